@@ -19,21 +19,68 @@ LOCAL_SRC_FILES := improsa.cpp \
 	$(SRC_PATH)/Filter.cpp \
 	$(SRC_PATH)/Bilateral.cpp \
 	$(SRC_PATH)/Blur.cpp \
+	$(SRC_PATH)/Canny.cpp \
+	$(SRC_PATH)/ColourConvert.cpp \
+	$(SRC_PATH)/Convolution.cpp \
 	$(SRC_PATH)/Copy.cpp \
+	$(SRC_PATH)/Equalize.cpp \
+	$(SRC_PATH)/IntegralImage.cpp \
+	$(SRC_PATH)/Median.cpp \
+	$(SRC_PATH)/Morphology.cpp \
+	$(SRC_PATH)/RecursiveGaussian.cpp \
 	$(SRC_PATH)/Sharpen.cpp \
-	$(SRC_PATH)/Sobel.cpp
+	$(SRC_PATH)/Sobel.cpp \
+	$(SRC_PATH)/UnsharpMask.cpp
 
 ifeq ($(HALIDE),1)
 LOCAL_CFLAGS    += -DENABLE_HALIDE=1
 LOCAL_SRC_FILES += \
 	halide/bilateral_cpu.s \
 	halide/bilateral_gpu.s \
+	halide/bilateral_cpu_planar.s \
+	halide/bilateral_gpu_planar.s \
+	halide/bilateral_cpu_u16.s \
+	halide/bilateral_gpu_u16.s \
+	halide/bilateral_cpu_f32.s \
+	halide/bilateral_gpu_f32.s \
+	halide/bilateral_cpu_half.s \
+	halide/bilateral_gpu_half.s \
 	halide/blur_cpu.s \
 	halide/blur_gpu.s \
+	halide/blur_cpu_planar.s \
+	halide/blur_gpu_planar.s \
+	halide/blur_cpu_u16.s \
+	halide/blur_gpu_u16.s \
+	halide/blur_cpu_f32.s \
+	halide/blur_gpu_f32.s \
+	halide/blur_cpu_half.s \
+	halide/blur_gpu_half.s \
 	halide/sharpen_cpu.s \
 	halide/sharpen_gpu.s \
+	halide/sharpen_cpu_planar.s \
+	halide/sharpen_gpu_planar.s \
+	halide/sharpen_cpu_u16.s \
+	halide/sharpen_gpu_u16.s \
+	halide/sharpen_cpu_f32.s \
+	halide/sharpen_gpu_f32.s \
+	halide/sharpen_cpu_half.s \
+	halide/sharpen_gpu_half.s \
 	halide/sobel_cpu.s \
-	halide/sobel_gpu.s
+	halide/sobel_gpu.s \
+	halide/sobel_cpu_planar.s \
+	halide/sobel_gpu_planar.s \
+	halide/sobel_cpu_u16.s \
+	halide/sobel_gpu_u16.s \
+	halide/sobel_cpu_f32.s \
+	halide/sobel_gpu_f32.s \
+	halide/unsharp_cpu.s \
+	halide/unsharp_gpu.s \
+	halide/unsharp_cpu_planar.s \
+	halide/unsharp_gpu_planar.s \
+	halide/unsharp_cpu_u16.s \
+	halide/unsharp_gpu_u16.s \
+	halide/unsharp_cpu_f32.s \
+	halide/unsharp_gpu_f32.s
 endif
 
 LOCAL_LDLIBS := -llog -ljnigraphics -lOpenCL
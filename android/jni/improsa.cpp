@@ -14,26 +14,47 @@
 
 #include "Bilateral.h"
 #include "Blur.h"
+#include "Canny.h"
+#include "ColourConvert.h"
+#include "Convolution.h"
 #include "Copy.h"
+#include "Equalize.h"
+#include "Median.h"
+#include "Morphology.h"
+#include "RecursiveGaussian.h"
 #include "Sharpen.h"
 #include "Sobel.h"
-
-#define METHOD_REFERENCE  (1<<1)
-#define METHOD_HALIDE_CPU (1<<2)
-#define METHOD_HALIDE_GPU (1<<3)
-#define METHOD_OPENCL     (1<<4)
+#include "UnsharpMask.h"
 
 using namespace improsa;
 
 extern "C"
 {
+  static Filter* createGaussian()
+  {
+    Convolution *gaussian = new Convolution("Gaussian");
+    gaussian->setGaussian(4, 1.5f);
+    return gaussian;
+  }
+
   static Filter *filters[] =
   {
     new Copy(),
     new Bilateral(),
     new Blur(),
+    createGaussian(),
+    new Median(),
+    new RecursiveGaussian(),
     new Sharpen(),
-    new Sobel()
+    new Sobel(),
+    new Canny(),
+    new UnsharpMask(),
+    new Morphology(MORPH_ERODE),
+    new Morphology(MORPH_DILATE),
+    new Morphology(MORPH_OPEN),
+    new Morphology(MORPH_CLOSE),
+    new Equalize(),
+    new ColourConvert(CONVERT_RGBA_TO_LAB)
   };
   static const int numFilters = sizeof(filters) / sizeof(Filter*);
 
@@ -146,6 +167,13 @@ extern "C"
     AndroidBitmap_lockPixels(env, bmpInput, (void**)&input.data);
     AndroidBitmap_lockPixels(env, bmpOutput, (void**)&output.data);
 
+    // Bitmap rows may be padded
+    AndroidBitmapInfo info;
+    AndroidBitmap_getInfo(env, bmpInput, &info);
+    input.stride = info.stride/4;
+    AndroidBitmap_getInfo(env, bmpOutput, &info);
+    output.stride = info.stride/4;
+
     // Force use of GPU for Halide pipelines
     setenv("HL_OCL_DEVICE", "gpu", 1);
 
@@ -156,7 +184,7 @@ extern "C"
     switch (filterMethod)
     {
       case METHOD_REFERENCE:
-        success = filter->runReference(input, output);
+        success = filter->runReference(input, output, params);
         break;
       case METHOD_HALIDE_CPU:
         success = filter->runHalideCPU(input, output, params);
@@ -12,17 +12,25 @@
 #include <cstring>
 #include <iostream>
 #include <map>
+#include <vector>
 
 #include "Bilateral.h"
 #include "Blur.h"
+#include "Canny.h"
+#include "ColourConvert.h"
+#include "Convolution.h"
 #include "Copy.h"
+#include "Equalize.h"
+#include "Median.h"
+#include "Morphology.h"
+#include "Pyramid.h"
+#include "RecursiveGaussian.h"
+#include "Resize.h"
 #include "Sharpen.h"
 #include "Sobel.h"
+#include "UnsharpMask.h"
 
-#define METHOD_REFERENCE  (1<<1)
-#define METHOD_HALIDE_CPU (1<<2)
-#define METHOD_HALIDE_GPU (1<<3)
-#define METHOD_OPENCL     (1<<4)
+#include "server.h"
 
 using namespace improsa;
 using namespace std;
@@ -31,15 +39,41 @@ struct _options_
 {
   map<string, Filter*> filters;
   map<string, unsigned int> methods;
+  Convolution *convolution, *gaussian;
+  int maskWidth, maskHeight;
+  vector<float> mask;
   _options_()
   {
+    convolution = new Convolution();
+    gaussian = new Convolution("Gaussian");
+    maskWidth = maskHeight = 0;
+
     filters["bilateral"] = new Bilateral();
     filters["blur"] = new Blur();
+    filters["canny"] = new Canny();
+    filters["close"] = new Morphology(MORPH_CLOSE);
+    filters["convolution"] = convolution;
     filters["copy"] = new Copy();
+    filters["dilate"] = new Morphology(MORPH_DILATE);
+    filters["equalize"] = new Equalize();
+    filters["erode"] = new Morphology(MORPH_ERODE);
+    filters["gaussian"] = gaussian;
+    filters["i420torgba"] = new ColourConvert(CONVERT_I420_TO_RGBA);
+    filters["median"] = new Median();
+    filters["nv12torgba"] = new ColourConvert(CONVERT_NV12_TO_RGBA);
+    filters["open"] = new Morphology(MORPH_OPEN);
+    filters["pyramid"] = new Pyramid();
+    filters["recursivegaussian"] = new RecursiveGaussian();
+    filters["resize"] = new Resize();
+    filters["rgbatoi420"] = new ColourConvert(CONVERT_RGBA_TO_I420);
+    filters["rgbatolab"] = new ColourConvert(CONVERT_RGBA_TO_LAB);
+    filters["rgbatonv12"] = new ColourConvert(CONVERT_RGBA_TO_NV12);
     filters["sharpen"] = new Sharpen();
     filters["sobel"] = new Sobel();
+    filters["unsharp"] = new UnsharpMask();
 
     methods["reference"] = METHOD_REFERENCE;
+    methods["cpu"] = METHOD_CPU;
     methods["opencl"] = METHOD_OPENCL;
 
 #if ENABLE_HALIDE
@@ -50,15 +84,22 @@ struct _options_
 } Options;
 
 void clinfo();
+void initImage(Image image);
+Filter* createFilter(const char *name, const Filter::Params& params);
 void printUsage();
 int updateStatus(const char *format, va_list args);
 
 int main(int argc, char *argv[])
 {
-  size_t size = 0;
+  size_t width = 0, height = 0;
+  size_t roi[4] = {0, 0, 0, 0};
   Filter *filter = NULL;
   unsigned int method = 0;
+  int layout = LAYOUT_INTERLEAVED;
+  int format = PIXEL_U8;
   Filter::Params params;
+  const char *serverPath = NULL;
+  unsigned int serverWorkers = 1;
 
   // Parse arguments
   for (int i = 1; i < argc; i++)
@@ -88,10 +129,342 @@ int main(int argc, char *argv[])
         exit(1);
       }
     }
+    else if (!strcmp(argv[i], "-batch"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Number of images required with -batch." << endl;
+        exit(1);
+      }
+
+      char *next;
+      params.batch = strtoul(argv[i], &next, 10);
+      if (strlen(next) || params.batch == 0)
+      {
+        cout << "Invalid number of images." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-gradient"))
+    {
+      params.sobelGradient = true;
+    }
+    else if (!strcmp(argv[i], "-half"))
+    {
+      params.halfPrecision = true;
+    }
     else if (!strcmp(argv[i], "-noverify"))
     {
       params.verify = false;
     }
+    else if (!strcmp(argv[i], "-format"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Pixel format required with -format." << endl;
+        exit(1);
+      }
+
+      if (!strcmp(argv[i], "u8"))
+      {
+        format = PIXEL_U8;
+      }
+      else if (!strcmp(argv[i], "u16"))
+      {
+        format = PIXEL_U16;
+      }
+      else if (!strcmp(argv[i], "f32"))
+      {
+        format = PIXEL_F32;
+      }
+      else
+      {
+        cout << "Invalid pixel format." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-planar"))
+    {
+      layout = LAYOUT_PLANAR;
+    }
+    else if (!strcmp(argv[i], "-verifysample"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Sample rate required with -verifysample." << endl;
+        exit(1);
+      }
+
+      char *next;
+      params.sampleRate = strtof(argv[i], &next);
+      if (strlen(next) || params.sampleRate <= 0.f || params.sampleRate > 1.f)
+      {
+        cout << "Invalid sample rate." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-threads"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Number of threads required with -threads." << endl;
+        exit(1);
+      }
+
+      char *next;
+      params.threads = strtoul(argv[i], &next, 10);
+      if (strlen(next))
+      {
+        cout << "Invalid number of threads." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-roi"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Region required with -roi." << endl;
+        exit(1);
+      }
+
+      char *next = argv[i];
+      for (int r = 0; r < 4; r++)
+      {
+        const char separator = r == 3 ? '\0' : r == 2 ? 'x' : ',';
+        roi[r] = strtoul(next, &next, 10);
+        if (next[0] != separator)
+        {
+          cout << "Invalid region." << endl;
+          exit(1);
+        }
+        next++;
+      }
+      if (roi[2] == 0 || roi[3] == 0)
+      {
+        cout << "Invalid region." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-sigma"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Sigma values required with -sigma." << endl;
+        exit(1);
+      }
+
+      char *next;
+      params.sigmaSpatial = strtof(argv[i], &next);
+      if (next[0] == ',')
+      {
+        params.sigmaRange = strtof(++next, &next);
+      }
+      if (strlen(next) || params.sigmaSpatial <= 0.f ||
+          params.sigmaRange <= 0.f)
+      {
+        cout << "Invalid sigma values." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-threshold"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Threshold values required with -threshold." << endl;
+        exit(1);
+      }
+
+      char *next;
+      params.lowThreshold = strtof(argv[i], &next);
+      if (next[0] == ',')
+      {
+        params.highThreshold = strtof(++next, &next);
+      }
+      if (strlen(next) || params.lowThreshold < 0.f ||
+          params.lowThreshold > params.highThreshold)
+      {
+        cout << "Invalid threshold values." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-unsharp"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Amount required with -unsharp." << endl;
+        exit(1);
+      }
+
+      char *next;
+      params.sharpenAmount = strtof(argv[i], &next);
+      if (next[0] == ',')
+      {
+        params.sharpenThreshold = strtof(++next, &next);
+      }
+      if (strlen(next) || params.sharpenAmount < 0.f ||
+          params.sharpenThreshold < 0.f || params.sharpenThreshold > 1.f)
+      {
+        cout << "Invalid unsharp mask values." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-radius"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Radius required with -radius." << endl;
+        exit(1);
+      }
+
+      char *next;
+      params.radius = strtoul(argv[i], &next, 10);
+      if (strlen(next) || params.radius <= 0)
+      {
+        cout << "Invalid radius." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-bilateralgrid"))
+    {
+      params.bilateralGrid = true;
+    }
+    else if (!strcmp(argv[i], "-hugepages"))
+    {
+      setHugePages(true);
+    }
+    else if (!strcmp(argv[i], "-integral"))
+    {
+      params.integralImage = true;
+    }
+    else if (!strcmp(argv[i], "-scale"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Scale factor required with -scale." << endl;
+        exit(1);
+      }
+
+      char *next;
+      params.scale = strtof(argv[i], &next);
+      if (strlen(next) || params.scale <= 0.f)
+      {
+        cout << "Invalid scale factor." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-resample"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Resampling kernel required with -resample." << endl;
+        exit(1);
+      }
+
+      if (!strcmp(argv[i], "box"))
+      {
+        params.resampling = RESAMPLE_BOX;
+      }
+      else if (!strcmp(argv[i], "bilinear"))
+      {
+        params.resampling = RESAMPLE_BILINEAR;
+      }
+      else if (!strcmp(argv[i], "lanczos"))
+      {
+        params.resampling = RESAMPLE_LANCZOS;
+      }
+      else
+      {
+        cout << "Invalid resampling kernel." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-levels"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Number of levels required with -levels." << endl;
+        exit(1);
+      }
+
+      char *next;
+      params.pyramidLevels = strtoul(argv[i], &next, 10);
+      if (strlen(next) || params.pyramidLevels == 0)
+      {
+        cout << "Invalid number of levels." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-laplacian"))
+    {
+      params.laplacian = true;
+    }
+    else if (!strcmp(argv[i], "-element"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Size required with -element." << endl;
+        exit(1);
+      }
+
+      char *next;
+      params.elementWidth = strtoul(argv[i], &next, 10);
+      params.elementHeight = params.elementWidth;
+      if (next[0] == 'x')
+      {
+        params.elementHeight = strtoul(++next, &next, 10);
+      }
+      if (strlen(next) || params.elementWidth == 0 ||
+          params.elementHeight == 0)
+      {
+        cout << "Invalid element size." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-mask"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Kernel required with -mask." << endl;
+        exit(1);
+      }
+
+      char *next;
+      int kernelWidth = strtol(argv[i], &next, 10);
+      int kernelHeight = 0;
+      if (next[0] == 'x')
+      {
+        kernelHeight = strtol(++next, &next, 10);
+      }
+      vector<float> values;
+      while (next[0] == (values.empty() ? ':' : ','))
+      {
+        values.push_back(strtof(++next, &next));
+      }
+      if (strlen(next) || kernelWidth*kernelHeight != values.size() ||
+          !Options.convolution->setKernel(kernelWidth, kernelHeight,
+                                          &values[0]))
+      {
+        cout << "Invalid convolution kernel." << endl;
+        exit(1);
+      }
+      Options.maskWidth = kernelWidth;
+      Options.maskHeight = kernelHeight;
+      Options.mask = values;
+    }
     else if (!strcmp(argv[i], "-clwgsize"))
     {
       ++i;
@@ -138,67 +511,238 @@ int main(int argc, char *argv[])
         exit(1);
       }
     }
+    else if (!strcmp(argv[i], "-clbuffer"))
+    {
+      params.buffers = true;
+    }
+    else if (!strcmp(argv[i], "-clcoarsen"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Pixels per work-item required with -clcoarsen." << endl;
+        exit(1);
+      }
+
+      char *next;
+      params.coarsening = strtoul(argv[i], &next, 10);
+      if (strlen(next) || params.coarsening == 0)
+      {
+        cout << "Invalid pixels per work-item." << endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-clcompare"))
+    {
+      params.compareBuffers = true;
+    }
+    else if (!strcmp(argv[i], "-cltune"))
+    {
+      params.tuneCoarsening = true;
+    }
+    else if (!strcmp(argv[i], "-clfixed"))
+    {
+      params.fixedPoint = true;
+    }
     else if (!strcmp(argv[i], "-clinfo"))
     {
       clinfo();
       exit(0);
     }
+    else if (!strcmp(argv[i], "-server"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Socket path required with -server." << endl;
+        exit(1);
+      }
+      serverPath = argv[i];
+    }
+    else if (!strcmp(argv[i], "-workers"))
+    {
+      ++i;
+      if (i >= argc)
+      {
+        cout << "Number of workers required with -workers." << endl;
+        exit(1);
+      }
+
+      char *next;
+      serverWorkers = strtoul(argv[i], &next, 10);
+      if (strlen(next) || serverWorkers == 0)
+      {
+        cout << "Invalid number of workers." << endl;
+        exit(1);
+      }
+    }
     else
     {
+      // Image size is either WIDTHxHEIGHT or a single size for both
       char *next;
-      size_t sz = strtoul(argv[i], &next, 10);
-      if (strlen(next) > 0 || size != 0 || sz == 0)
+      size_t w = strtoul(argv[i], &next, 10);
+      size_t h = w;
+      if (next[0] == 'x')
+      {
+        h = strtoul(++next, &next, 10);
+      }
+      if (strlen(next) > 0 || width != 0 || w == 0 || h == 0)
       {
         cout << "Invalid argument '" << argv[i] << "'" << endl;
         printUsage();
         exit(1);
       }
-      size = sz;
+      width = w;
+      height = h;
     }
   }
-  if (size == 0 || filter == NULL || method == 0)
+  if (serverPath)
+  {
+    // Each request carries a single image, which sessions are sized for
+    if (params.batch > 1)
+    {
+      cout << "Batches are not supported with -server." << endl;
+      exit(1);
+    }
+
+    // Filters and methods are chosen by each request
+    return runServer(serverPath, createFilter, params, serverWorkers) ? 0 : 1;
+  }
+  if (width == 0 || filter == NULL || method == 0)
   {
     printUsage();
     exit(1);
   }
 
-  // Allocate input/output images
-  Image input = {new unsigned char[size*size*4], size, size};
-  Image output = {new unsigned char[size*size*4], size, size};
+  // Gaussian kernel covers 3 sigma unless radius is given
+  int radius = params.radius ? params.radius : ceil(3*params.sigmaSpatial);
+  Options.gaussian->setGaussian(radius, params.sigmaSpatial);
+
+  // Batches and regions require the output to be the size of the input
+  size_t outputSize[2];
+  filter->getOutputSize(params, width, height, outputSize);
+  if ((params.batch > 1 || roi[2]) &&
+      (outputSize[0] != width || outputSize[1] != height))
+  {
+    cout << "Batches and regions are not supported when resizing." << endl;
+    exit(1);
+  }
+
+  // Conversion filters take or produce YUV images, which are 8-bit only
+  int inputLayout = filter->getInputLayout(layout);
+  int outputLayout = filter->getOutputLayout(inputLayout);
+  Image in = {NULL, width, height, inputLayout, format};
+  Image out = {NULL, width, height, outputLayout, format};
+  if ((isYUV(in) || isYUV(out)) && format != PIXEL_U8)
+  {
+    cout << "YUV images only support 8-bit pixels." << endl;
+    exit(1);
+  }
 
-  // Initialize input image with random data
-  for (int y = 0; y < size; y++)
+  // Filter a batch of separate images, comparing with the per-image path
+  if (params.batch > 1)
   {
-    for (int x = 0; x < size; x++)
+    if (inputLayout != LAYOUT_INTERLEAVED ||
+        outputLayout != LAYOUT_INTERLEAVED || roi[2])
     {
-      setPixel(input, x, y, 0, rand()/(float)RAND_MAX);
-      setPixel(input, x, y, 1, rand()/(float)RAND_MAX);
-      setPixel(input, x, y, 2, rand()/(float)RAND_MAX);
-      setPixel(input, x, y, 3, 255);
+      cout << "Batches only support interleaved images without -roi." << endl;
+      exit(1);
     }
+
+    vector<Image> inputs(params.batch), outputs(params.batch);
+    for (int n = 0; n < params.batch; n++)
+    {
+      Image image = {NULL, width, height, LAYOUT_INTERLEAVED, format};
+      inputs[n] = outputs[n] = image;
+      inputs[n].data = (unsigned char*)allocateBuffer(getImageSize(image));
+      outputs[n].data = (unsigned char*)allocateBuffer(getImageSize(image));
+      initImage(inputs[n]);
+    }
+
+    filter->setStatusCallback(updateStatus);
+    return filter->runBatch(method, &inputs[0], &outputs[0],
+                            params.batch, params) ? 0 : 1;
+  }
+
+  // Allocate input/output images, with planar inputs converted from an
+  // interleaved image below
+  Image input = {NULL, width, height, inputLayout, format};
+  Image output = {NULL, outputSize[0], outputSize[1], outputLayout, format};
+  if (inputLayout == LAYOUT_PLANAR)
+  {
+    input.layout = LAYOUT_INTERLEAVED;
+  }
+  input.data = (unsigned char*)allocateBuffer(getImageSize(input));
+  output.data = (unsigned char*)allocateBuffer(getImageSize(output));
+
+  initImage(input);
+
+  // Convert to planar layout if requested
+  if (inputLayout == LAYOUT_PLANAR)
+  {
+    Image planar = input;
+    planar.data = (unsigned char*)allocateBuffer(getImageSize(input));
+    planar.layout = LAYOUT_PLANAR;
+    double start = getCurrentTime();
+    convertLayout(input, planar);
+    double ms = (getCurrentTime()-start)*1e-3;
+    printf("Converted input to planar layout in %.2lf ms (%.1lf GB/s)\n",
+           ms, (2.0*getImageSize(input))/(ms*1e6));
+
+    releaseBuffer(input.data);
+    input = planar;
+  }
+
+  // Filter a region of the images in place, without copying
+  if (roi[2])
+  {
+    input = getRegion(input, roi[0], roi[1], roi[2], roi[3]);
+    output = getRegion(output, roi[0], roi[1], roi[2], roi[3]);
+    if (!input.data || !output.data)
+    {
+      cout << "Region must lie within an interleaved image." << endl;
+      exit(1);
+    }
+    printf("Processing %zux%zu region at (%zu,%zu)\n",
+           roi[2], roi[3], roi[0], roi[1]);
   }
 
-  // Run filter
+  // Run filter, counting peak memory from the images already allocated.
+  // The exit status is non-zero if the filter refused the input or failed
+  // verification.
+  resetPeakMemory();
   filter->setStatusCallback(updateStatus);
+  bool success = false;
   switch (method)
   {
     case METHOD_REFERENCE:
-      filter->runReference(input, output);
+    {
+      // Reference only runs once, so time it here to allow comparison
+      double start = getCurrentTime();
+      success = filter->runReference(input, output, params);
+      printf("Reference took %.1lf ms\n", (getCurrentTime()-start)*1e-3);
+      break;
+    }
+    case METHOD_CPU:
+      success = filter->runCPU(input, output, params);
       break;
     case METHOD_HALIDE_CPU:
-      filter->runHalideCPU(input, output, params);
+      success = filter->runHalideCPU(input, output, params);
       break;
     case METHOD_HALIDE_GPU:
-      filter->runHalideGPU(input, output, params);
+      success = filter->runHalideGPU(input, output, params);
       break;
     case METHOD_OPENCL:
-      filter->runOpenCL(input, output, params);
+      success = filter->runOpenCL(input, output, params);
       break;
     default:
       assert(false && "Invalid method.");
   }
 
-  return 0;
+  printf("Peak host memory %.1lf MB (%.1lf MB held by pool)\n",
+         getPeakMemory()/1048576.0, getReservedMemory()/1048576.0);
+
+  return success ? 0 : 1;
 }
 
 void clinfo()
@@ -251,9 +795,134 @@ void clinfo()
   cout << endl;
 }
 
+// Initialize an image with random data
+void initImage(Image image)
+{
+  for (int y = 0; y < image.height; y++)
+  {
+    for (int x = 0; x < image.width; x++)
+    {
+      setPixel(image, x, y, 0, rand()/(float)RAND_MAX);
+      setPixel(image, x, y, 1, rand()/(float)RAND_MAX);
+      setPixel(image, x, y, 2, rand()/(float)RAND_MAX);
+      setPixel(image, x, y, 3, 1.f);
+    }
+  }
+}
+
+// Create a new instance of a filter, configured from the command line
+Filter* createFilter(const char *name, const Filter::Params& params)
+{
+  string filter(name);
+  if (filter == "bilateral")
+  {
+    return new Bilateral();
+  }
+  else if (filter == "blur")
+  {
+    return new Blur();
+  }
+  else if (filter == "canny")
+  {
+    return new Canny();
+  }
+  else if (filter == "close")
+  {
+    return new Morphology(MORPH_CLOSE);
+  }
+  else if (filter == "convolution")
+  {
+    Convolution *convolution = new Convolution();
+    if (!Options.mask.empty())
+    {
+      convolution->setKernel(Options.maskWidth, Options.maskHeight,
+                             &Options.mask[0]);
+    }
+    return convolution;
+  }
+  else if (filter == "copy")
+  {
+    return new Copy();
+  }
+  else if (filter == "dilate")
+  {
+    return new Morphology(MORPH_DILATE);
+  }
+  else if (filter == "equalize")
+  {
+    return new Equalize();
+  }
+  else if (filter == "erode")
+  {
+    return new Morphology(MORPH_ERODE);
+  }
+  else if (filter == "gaussian")
+  {
+    Convolution *gaussian = new Convolution("Gaussian");
+    int radius = params.radius ? params.radius : ceil(3*params.sigmaSpatial);
+    gaussian->setGaussian(radius, params.sigmaSpatial);
+    return gaussian;
+  }
+  else if (filter == "i420torgba")
+  {
+    return new ColourConvert(CONVERT_I420_TO_RGBA);
+  }
+  else if (filter == "median")
+  {
+    return new Median();
+  }
+  else if (filter == "nv12torgba")
+  {
+    return new ColourConvert(CONVERT_NV12_TO_RGBA);
+  }
+  else if (filter == "open")
+  {
+    return new Morphology(MORPH_OPEN);
+  }
+  else if (filter == "pyramid")
+  {
+    return new Pyramid();
+  }
+  else if (filter == "recursivegaussian")
+  {
+    return new RecursiveGaussian();
+  }
+  else if (filter == "resize")
+  {
+    return new Resize();
+  }
+  else if (filter == "rgbatoi420")
+  {
+    return new ColourConvert(CONVERT_RGBA_TO_I420);
+  }
+  else if (filter == "rgbatolab")
+  {
+    return new ColourConvert(CONVERT_RGBA_TO_LAB);
+  }
+  else if (filter == "rgbatonv12")
+  {
+    return new ColourConvert(CONVERT_RGBA_TO_NV12);
+  }
+  else if (filter == "sharpen")
+  {
+    return new Sharpen();
+  }
+  else if (filter == "sobel")
+  {
+    return new Sobel();
+  }
+  else if (filter == "unsharp")
+  {
+    return new UnsharpMask();
+  }
+  return NULL;
+}
+
 void printUsage()
 {
   cout << endl << "Usage: improsa SIZE FILTER METHOD [OPTIONS]";
+  cout << endl << "       improsa WIDTHxHEIGHT FILTER METHOD [OPTIONS]";
+  cout << endl << "       improsa -server PATH [OPTIONS]";
   cout << endl << "       improsa -clinfo" << endl;
 
   cout << endl << "Where FILTER is one of:" << endl;
@@ -271,10 +940,40 @@ void printUsage()
   }
 
   cout << endl << "Where OPTIONS can be any of:" << endl;
+  cout << "\t-batch N         Filter N separate images as one batch" << endl;
+  cout << "\t-bilateralgrid   Use bilateral grid for bilateral filter" << endl;
+  cout << "\t-clbuffer        Use buffer OpenCL kernels, not images" << endl;
+  cout << "\t-clcoarsen K     Pixels per OpenCL work-item (coarsening)" << endl;
+  cout << "\t-clcompare       Compare image and buffer OpenCL kernels" << endl;
   cout << "\t-cldevice P:D    Select OpenCL platform/device" << endl;
+  cout << "\t-clfixed         Use fixed-point OpenCL kernels" << endl;
+  cout << "\t-cltune          Time a range of coarsening factors" << endl;
   cout << "\t-clwgsize X,Y    Specify work-group size" << endl;
+  cout << "\t-element W[xH]   Morphology structuring element size" << endl;
+  cout << "\t-format F        Pixel format (u8, u16 or f32)" << endl;
+  cout << "\t-gradient        Sobel magnitude and direction outputs" << endl;
+  cout << "\t-half            Half-precision arithmetic (where supported)"
+       << endl;
+  cout << "\t-hugepages       Back large buffers with huge pages" << endl;
   cout << "\t-i ITERATIONS    Number of runs to perform" << endl;
+  cout << "\t-integral        Use summed-area table for blur filter" << endl;
+  cout << "\t-laplacian       Build Laplacian rather than Gaussian pyramid"
+       << endl;
+  cout << "\t-levels N        Number of pyramid levels" << endl;
+  cout << "\t-mask WxH:V,...  Kernel for convolution filter" << endl;
   cout << "\t-noverify        Disable results verification" << endl;
+  cout << "\t-planar          Use planar image layout" << endl;
+  cout << "\t-radius N        Filter radius (where supported)" << endl;
+  cout << "\t-resample K      Resize kernel (box, bilinear or lanczos)"
+       << endl;
+  cout << "\t-roi X,Y,WxH     Only process a region of the images" << endl;
+  cout << "\t-scale S         Resize scale factor" << endl;
+  cout << "\t-sigma S[,R]     Spatial and range sigma values" << endl;
+  cout << "\t-threshold L[,H] Canny edge thresholds" << endl;
+  cout << "\t-threads N       Number of CPU threads (0 for all cores)" << endl;
+  cout << "\t-unsharp A[,T]   Unsharp mask amount and threshold" << endl;
+  cout << "\t-verifysample R  Verify a random fraction R of pixels" << endl;
+  cout << "\t-workers N       Number of CPU workers in server mode" << endl;
 
   cout << endl
     << "If specifying an OpenCL device with -cldevice, " << endl
@@ -282,6 +981,19 @@ void printUsage()
     << "indices reported by running with -clinfo."
     << endl;
 
+  cout << endl
+    << "With -verifysample, border pixels are always verified " << endl
+    << "and one pixel is checked in each interior tile, so that " << endl
+    << "very large images do not need a full reference pass."
+    << endl;
+
+  cout << endl
+    << "With -server, requests are received on a Unix domain " << endl
+    << "socket and images are passed in shared memory (see " << endl
+    << "server.h). Filter options apply to every request, " << endl
+    << "except -batch."
+    << endl;
+
   cout << endl;
 }
 
@@ -0,0 +1,575 @@
+// server.cpp (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <deque>
+#include <map>
+#include <string>
+
+#include "server.h"
+
+// Largest number of queued requests processed together on one session
+#define MAX_BATCH 32
+
+using namespace improsa;
+using namespace std;
+
+struct Job
+{
+  ServerRequest request;
+  double received;
+  bool done, success;
+  double latency;
+};
+
+struct Queue
+{
+  deque<Job*> jobs;
+  pthread_cond_t ready;
+};
+
+struct Worker
+{
+  pthread_t thread;
+  Queue *queue;
+  map<string, Filter*> filters;
+
+  // Filter holding the current session, with the request it was prepared
+  // for. Sessions are not supported for every method, in which case each
+  // request falls back to a one-shot run.
+  Filter *current;
+  string key;
+  bool prepared;
+};
+
+// State shared by all threads, protected by the lock
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  Queue cpu, device;
+  bool stopping;
+  int socket;
+
+  FilterFactory factory;
+  Filter::Params params;
+
+  double started;
+  uint64_t completed, failed, batches, bytes;
+  double totalLatency, maxLatency;
+} Server;
+
+static int logStatus(const char *format, va_list args)
+{
+  pthread_mutex_lock(&Server.lock);
+  vprintf(format, args);
+  printf("\n");
+  pthread_mutex_unlock(&Server.lock);
+  return 0;
+}
+
+static bool isDeviceMethod(int method)
+{
+  return method == METHOD_OPENCL || method == METHOD_HALIDE_GPU;
+}
+
+static Image getRequestImage(const ServerRequest& request)
+{
+  Image image = {NULL, request.width, request.height,
+                 (int)request.layout, (int)request.format, request.stride};
+  return image;
+}
+
+// Requests with the same key can share a session
+static string getKey(const ServerRequest& request)
+{
+  char key[SERVER_NAME_LENGTH+64];
+  snprintf(key, sizeof(key), "%.*s:%u:%ux%u:%u:%u",
+           SERVER_NAME_LENGTH, request.filter, request.method,
+           request.width, request.height, request.layout, request.format);
+  return key;
+}
+
+// The output takes its size and layout from the filter, as resizing and
+// conversion filters change them
+static bool getOutputImage(Filter *filter, const ServerRequest& request,
+                           Image& output)
+{
+  Image input = getRequestImage(request);
+  size_t size[2];
+  filter->getOutputSize(Server.params, input.width, input.height, size);
+  if ((request.outputWidth || request.outputHeight) &&
+      (request.outputWidth != size[0] || request.outputHeight != size[1]))
+  {
+    printf("Output must be %zux%zu for this filter and input\n",
+           size[0], size[1]);
+    return false;
+  }
+
+  output = input;
+  output.width = size[0];
+  output.height = size[1];
+  output.layout = filter->getOutputLayout(input.layout);
+  output.stride = request.outputStride;
+  return true;
+}
+
+// Map a shared memory object holding the data of the described image
+static bool mapImage(const char *name, bool writable, Image& image,
+                     size_t& size)
+{
+  if (image.width == 0 || image.height == 0 ||
+      (image.stride && image.stride < image.width) ||
+      (image.layout != LAYOUT_INTERLEAVED && image.layout != LAYOUT_PLANAR) ||
+      (image.format != PIXEL_U8 && image.format != PIXEL_U16 &&
+       image.format != PIXEL_F32))
+  {
+    printf("Invalid image description\n");
+    return false;
+  }
+
+  string shm(name, strnlen(name, SERVER_NAME_LENGTH));
+  int fd = shm_open(shm.c_str(), writable ? O_RDWR : O_RDONLY, 0);
+  if (fd < 0)
+  {
+    printf("Unable to open shared memory '%s' (%s)\n",
+           shm.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Planes are spaced by the image height
+  size_t required = getRowPitch(image)*image.height;
+  if (image.layout == LAYOUT_PLANAR)
+  {
+    required *= 4;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) || info.st_size < (off_t)required)
+  {
+    printf("Shared memory '%s' too small for image\n", shm.c_str());
+    close(fd);
+    return false;
+  }
+
+  size = info.st_size;
+  void *data = mmap(NULL, size, PROT_READ | (writable ? PROT_WRITE : 0),
+                    MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    printf("Unable to map shared memory '%s' (%s)\n",
+           shm.c_str(), strerror(errno));
+    return false;
+  }
+  image.data = (unsigned char*)data;
+  return true;
+}
+
+static Filter* getFilter(Worker *worker, const ServerRequest& request)
+{
+  string name(request.filter, strnlen(request.filter, SERVER_NAME_LENGTH));
+  map<string, Filter*>::iterator itr = worker->filters.find(name);
+  if (itr != worker->filters.end())
+  {
+    return itr->second;
+  }
+
+  Filter *filter = Server.factory(name.c_str(), Server.params);
+  if (filter)
+  {
+    filter->setStatusCallback(logStatus);
+    worker->filters[name] = filter;
+  }
+  else
+  {
+    printf("Unknown filter '%s'\n", name.c_str());
+  }
+  return filter;
+}
+
+// One-shot run for methods without session support, with a single timed
+// run after the warm-up run
+static bool runOnce(Filter *filter, int method, Image input, Image output)
+{
+  Filter::Params params = Server.params;
+  params.iterations = 1;
+  params.verify = false;
+  switch (method)
+  {
+    case METHOD_REFERENCE:
+      // Cached results belong to a previous input
+      filter->clearReferenceCache();
+      return filter->runReference(input, output, params);
+    case METHOD_CPU:
+      return filter->runCPU(input, output, params);
+    case METHOD_HALIDE_CPU:
+      return filter->runHalideCPU(input, output, params);
+    case METHOD_HALIDE_GPU:
+      return filter->runHalideGPU(input, output, params);
+    case METHOD_OPENCL:
+      return filter->runOpenCL(input, output, params);
+    default:
+      printf("Invalid method %d\n", method);
+      return false;
+  }
+}
+
+// Run one request, giving the size of its input and output images
+static bool runJob(Worker *worker, Filter *filter, const ServerRequest& request,
+                   size_t& bytes)
+{
+  Image input = getRequestImage(request), output;
+  size_t inputSize, outputSize;
+  if (!getOutputImage(filter, request, output))
+  {
+    return false;
+  }
+  if (!mapImage(request.input, false, input, inputSize))
+  {
+    return false;
+  }
+  if (!mapImage(request.output, true, output, outputSize))
+  {
+    munmap(input.data, inputSize);
+    return false;
+  }
+
+  bool success;
+  if (worker->prepared)
+  {
+    success = filter->process(input, output);
+  }
+  else
+  {
+    success = runOnce(filter, request.method, input, output);
+  }
+
+  bytes = getImageSize(input) + getImageSize(output);
+  munmap(input.data, inputSize);
+  munmap(output.data, outputSize);
+  return success;
+}
+
+// Run a batch of requests which share a key, preparing a session for the
+// first request unless the worker already holds one for the same key
+static void runBatch(Worker *worker, Job **batch, int count)
+{
+  const ServerRequest& request = batch[0]->request;
+  Filter *filter = getFilter(worker, request);
+  string key = getKey(request);
+  if (filter && (filter != worker->current || key != worker->key))
+  {
+    if (worker->current)
+    {
+      worker->current->release();
+    }
+    worker->current = filter;
+    worker->key = key;
+    worker->prepared = request.method != METHOD_REFERENCE &&
+      filter->prepare(request.method, getRequestImage(request),
+                      Server.params);
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    Job *job = batch[i];
+    size_t bytes = 0;
+    bool success = filter && runJob(worker, filter, job->request, bytes);
+
+    pthread_mutex_lock(&Server.lock);
+    job->success = success;
+    job->latency = (getCurrentTime()-job->received)*1e-3;
+    job->done = true;
+    if (success)
+    {
+      Server.completed++;
+      Server.bytes += bytes;
+    }
+    else
+    {
+      Server.failed++;
+    }
+    Server.totalLatency += job->latency;
+    if (job->latency > Server.maxLatency)
+    {
+      Server.maxLatency = job->latency;
+    }
+    pthread_cond_broadcast(&Server.finished);
+    pthread_mutex_unlock(&Server.lock);
+  }
+}
+
+static void* runWorker(void *data)
+{
+  Worker *worker = (Worker*)data;
+  Queue *queue = worker->queue;
+  Job *batch[MAX_BATCH];
+
+  pthread_mutex_lock(&Server.lock);
+  while (true)
+  {
+    while (queue->jobs.empty() && !Server.stopping)
+    {
+      pthread_cond_wait(&queue->ready, &Server.lock);
+    }
+    if (queue->jobs.empty())
+    {
+      break;
+    }
+
+    // Gather queued requests which can run on the same session as the
+    // oldest one, so that small images do not pay for a new session each
+    batch[0] = queue->jobs.front();
+    queue->jobs.pop_front();
+    int count = 1;
+    string key = getKey(batch[0]->request);
+    deque<Job*>::iterator itr = queue->jobs.begin();
+    while (itr != queue->jobs.end() && count < MAX_BATCH)
+    {
+      if (getKey((*itr)->request) == key)
+      {
+        batch[count++] = *itr;
+        itr = queue->jobs.erase(itr);
+      }
+      else
+      {
+        itr++;
+      }
+    }
+    Server.batches++;
+
+    pthread_mutex_unlock(&Server.lock);
+    runBatch(worker, batch, count);
+    pthread_mutex_lock(&Server.lock);
+  }
+  pthread_mutex_unlock(&Server.lock);
+
+  if (worker->current)
+  {
+    worker->current->release();
+  }
+  map<string, Filter*>::iterator itr;
+  for (itr = worker->filters.begin(); itr != worker->filters.end(); itr++)
+  {
+    delete itr->second;
+  }
+  return NULL;
+}
+
+// Caller must hold the lock
+static ServerStats getStats()
+{
+  ServerStats stats;
+  stats.completed = Server.completed;
+  stats.failed = Server.failed;
+  stats.batches = Server.batches;
+  stats.bytes = Server.bytes;
+  stats.uptime = (getCurrentTime()-Server.started)*1e-6;
+
+  uint64_t total = Server.completed + Server.failed;
+  stats.meanLatency = total ? Server.totalLatency/total : 0.0;
+  stats.maxLatency = Server.maxLatency;
+  stats.imagesPerSecond = Server.completed/stats.uptime;
+  stats.bandwidth = Server.bytes/(stats.uptime*1e9);
+  return stats;
+}
+
+static void printStats(const ServerStats& stats)
+{
+  printf("Completed %llu requests (%llu failed) in %llu batches\n",
+         (unsigned long long)stats.completed,
+         (unsigned long long)stats.failed,
+         (unsigned long long)stats.batches);
+  printf("Throughput %.1lf images/s (%.2lf GB/s)\n",
+         stats.imagesPerSecond, stats.bandwidth);
+  printf("Latency %.2lf ms mean, %.2lf ms max\n",
+         stats.meanLatency, stats.maxLatency);
+}
+
+static bool transfer(int fd, void *data, size_t size, bool sending)
+{
+  char *bytes = (char*)data;
+  while (size > 0)
+  {
+    ssize_t n = sending ? send(fd, bytes, size, 0) : recv(fd, bytes, size, 0);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return false;
+    }
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+static void* runConnection(void *data)
+{
+  int fd = (long)data;
+  ServerRequest request;
+  while (transfer(fd, &request, sizeof(request), false))
+  {
+    ServerResponse response;
+    memset(&response, 0, sizeof(response));
+
+    pthread_mutex_lock(&Server.lock);
+    if (request.command == SERVER_PROCESS && !Server.stopping)
+    {
+      Job job;
+      job.request = request;
+      job.received = getCurrentTime();
+      job.done = false;
+
+      Queue *queue = isDeviceMethod(request.method) ?
+        &Server.device : &Server.cpu;
+      queue->jobs.push_back(&job);
+      pthread_cond_signal(&queue->ready);
+      while (!job.done)
+      {
+        pthread_cond_wait(&Server.finished, &Server.lock);
+      }
+
+      response.success = job.success;
+      response.latency = job.latency;
+    }
+    else if (request.command == SERVER_STATS)
+    {
+      response.success = true;
+    }
+    else if (request.command == SERVER_SHUTDOWN)
+    {
+      // Stop accepting connections, letting the workers drain their queues
+      Server.stopping = true;
+      pthread_cond_broadcast(&Server.cpu.ready);
+      pthread_cond_broadcast(&Server.device.ready);
+      shutdown(Server.socket, SHUT_RDWR);
+      response.success = true;
+    }
+    response.stats = getStats();
+    pthread_mutex_unlock(&Server.lock);
+
+    if (!transfer(fd, &response, sizeof(response), true))
+    {
+      break;
+    }
+  }
+
+  close(fd);
+  return NULL;
+}
+
+bool runServer(const char *path, FilterFactory factory,
+               const Filter::Params& params, unsigned int cpuWorkers)
+{
+  struct sockaddr_un address;
+  if (strlen(path) >= sizeof(address.sun_path))
+  {
+    printf("Socket path too long\n");
+    return false;
+  }
+
+  Server.socket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Server.socket < 0)
+  {
+    printf("Unable to create socket (%s)\n", strerror(errno));
+    return false;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  unlink(path);
+  if (bind(Server.socket, (struct sockaddr*)&address, sizeof(address)) ||
+      listen(Server.socket, SOMAXCONN))
+  {
+    printf("Unable to listen on '%s' (%s)\n", path, strerror(errno));
+    close(Server.socket);
+    return false;
+  }
+
+  // Clients which disconnect early must not terminate the server
+  signal(SIGPIPE, SIG_IGN);
+
+  pthread_mutex_init(&Server.lock, NULL);
+  pthread_cond_init(&Server.finished, NULL);
+  pthread_cond_init(&Server.cpu.ready, NULL);
+  pthread_cond_init(&Server.device.ready, NULL);
+  Server.stopping = false;
+  Server.factory = factory;
+  Server.params = params;
+  Server.started = getCurrentTime();
+  Server.completed = Server.failed = Server.batches = Server.bytes = 0;
+  Server.totalLatency = Server.maxLatency = 0.0;
+
+  // Device worker comes last, after the CPU workers
+  unsigned int numWorkers = (cpuWorkers ? cpuWorkers : 1) + 1;
+  Worker *workers = new Worker[numWorkers];
+  for (unsigned int w = 0; w < numWorkers; w++)
+  {
+    workers[w].queue = w < numWorkers-1 ? &Server.cpu : &Server.device;
+    workers[w].current = NULL;
+    workers[w].prepared = false;
+    pthread_create(&workers[w].thread, NULL, runWorker, workers+w);
+  }
+
+  printf("Listening on '%s' with %u CPU workers and 1 device worker\n",
+         path, numWorkers-1);
+  fflush(stdout);
+
+  while (true)
+  {
+    int fd = accept(Server.socket, NULL, NULL);
+    if (fd < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      break;
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, runConnection, (void*)(long)fd);
+    pthread_detach(thread);
+  }
+
+  pthread_mutex_lock(&Server.lock);
+  Server.stopping = true;
+  pthread_cond_broadcast(&Server.cpu.ready);
+  pthread_cond_broadcast(&Server.device.ready);
+  pthread_mutex_unlock(&Server.lock);
+
+  for (unsigned int w = 0; w < numWorkers; w++)
+  {
+    pthread_join(workers[w].thread, NULL);
+  }
+  delete[] workers;
+  close(Server.socket);
+  unlink(path);
+
+  pthread_mutex_lock(&Server.lock);
+  printStats(getStats());
+  pthread_mutex_unlock(&Server.lock);
+
+  return true;
+}
@@ -0,0 +1,74 @@
+// server.h (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "Filter.h"
+
+// Clients connect to the server's Unix domain socket and send a sequence
+// of fixed-size requests, each answered by one response. Images are passed
+// as the names of POSIX shared memory objects (see shm_open), which the
+// client creates and fills before sending the request. The output object
+// must already be large enough to hold the output image, which has the
+// size given by the filter's getOutputSize for the input.
+
+#define SERVER_PROCESS  0
+#define SERVER_STATS    1
+#define SERVER_SHUTDOWN 2
+
+#define SERVER_NAME_LENGTH 64
+
+struct ServerRequest
+{
+  uint32_t command;
+  char filter[SERVER_NAME_LENGTH];
+  uint32_t method;
+  char input[SERVER_NAME_LENGTH];
+  char output[SERVER_NAME_LENGTH];
+
+  // Image description shared by input and output, as for improsa::Image
+  uint32_t width, height;
+  uint32_t layout, format;
+  uint32_t stride;
+
+  // Output dimensions, which are checked against the filter's output size
+  // unless both are zero, and the output row stride (zero if packed)
+  uint32_t outputWidth, outputHeight;
+  uint32_t outputStride;
+};
+
+struct ServerStats
+{
+  uint64_t completed, failed;
+  uint64_t batches;
+  uint64_t bytes;
+  double uptime;           // seconds
+  double meanLatency;      // ms, from receipt of request until completion
+  double maxLatency;       // ms
+  double imagesPerSecond;  // over the server's uptime
+  double bandwidth;        // GB/s of input and output over the uptime
+};
+
+struct ServerResponse
+{
+  uint32_t success;
+  double latency;          // ms
+  ServerStats stats;
+};
+
+typedef improsa::Filter* (*FilterFactory)(
+  const char *name, const improsa::Filter::Params& params);
+
+// Serve requests on the given socket path until a shutdown request is
+// received. Host methods (CPU, Halide CPU, reference) run on a pool of CPU
+// workers, while device methods (OpenCL, Halide GPU) run on a single device
+// worker. Each worker creates its own filters with the factory.
+bool runServer(const char *path, FilterFactory factory,
+               const improsa::Filter::Params& params, unsigned int cpuWorkers);
@@ -6,39 +6,350 @@
 // license terms please see the LICENSE file distributed with this
 // source code.
 
+#include <stdio.h>
 #include <string.h>
+#include <vector>
 
 #include "Bilateral.h"
 #include "opencl/bilateral.h"
 #if ENABLE_HALIDE
 #include "halide/bilateral_cpu.h"
 #include "halide/bilateral_gpu.h"
+#include "halide/bilateral_cpu_planar.h"
+#include "halide/bilateral_gpu_planar.h"
+#include "halide/bilateral_cpu_u16.h"
+#include "halide/bilateral_gpu_u16.h"
+#include "halide/bilateral_cpu_f32.h"
+#include "halide/bilateral_gpu_f32.h"
+#include "halide/bilateral_cpu_half.h"
+#include "halide/bilateral_gpu_half.h"
 #endif
 
 namespace improsa
 {
+  // Spatial weights for each tap in the window, and range weights indexed
+  // by the difference in a single 8-bit colour channel. The range kernel
+  // is separable across channels, since
+  //   exp(-(dr^2+dg^2+db^2)/2s^2) = exp(-dr^2/2s^2)*exp(-dg^2/2s^2)*...
+  // so a 256-entry table gives exact weights for 8-bit input.
+  static void computeWeights(const Filter::Params& params, int radius,
+                             float *spatial, float range[256])
+  {
+    int size = 2*radius + 1;
+    for (int j = -radius; j <= radius; j++)
+    {
+      for (int i = -radius; i <= radius; i++)
+      {
+        float norm = sqrt((float)(i*i) + (float)(j*j)) / params.sigmaSpatial;
+        spatial[(j+radius)*size + (i+radius)] = exp(-0.5f * (norm*norm));
+      }
+    }
+    for (int d = 0; d < 256; d++)
+    {
+      float norm = (d/255.f) / params.sigmaRange;
+      range[d] = exp(-0.5f * (norm*norm));
+    }
+  }
+
+  struct BilateralArgs
+  {
+    Image input, output;
+    int radius;
+    const float *spatial, *range;
+  };
+
+  static void bilateralRows(void *data, int begin, int end)
+  {
+    BilateralArgs *args = (BilateralArgs*)data;
+    Image input = args->input;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(args->output);
+    int width = input.width, height = input.height;
+    int radius = args->radius, size = 2*radius + 1;
+    for (int y = begin; y < end; y++)
+    {
+      for (int x = 0; x < width; x++)
+      {
+        const unsigned char *center = input.data + y*inPitch + x*4;
+
+        float coeff = 0.f;
+        float sum[3] = {0.f, 0.f, 0.f};
+        for (int j = -radius; j <= radius; j++)
+        {
+          int _y = y+j < 0 ? 0 : y+j >= height ? height-1 : y+j;
+          for (int i = -radius; i <= radius; i++)
+          {
+            int _x = x+i < 0 ? 0 : x+i >= width ? width-1 : x+i;
+            const unsigned char *pixel = input.data + _y*inPitch + _x*4;
+
+            float weight = args->spatial[(j+radius)*size + (i+radius)] *
+              args->range[abs(pixel[0] - center[0])] *
+              args->range[abs(pixel[1] - center[1])] *
+              args->range[abs(pixel[2] - center[2])];
+
+            coeff += weight;
+            sum[0] += weight * pixel[0];
+            sum[1] += weight * pixel[1];
+            sum[2] += weight * pixel[2];
+          }
+        }
+
+        unsigned char *out = args->output.data + y*outPitch + x*4;
+        out[0] = sum[0] / coeff;
+        out[1] = sum[1] / coeff;
+        out[2] = sum[2] / coeff;
+        out[3] = center[3];
+      }
+    }
+  }
+
+  // Bilateral grid (Chen, Paris and Durand, 2007). Pixels are splatted
+  // into a coarse 3D grid over (x, y, luminance) sampled at the spatial
+  // and range sigmas, the grid is blurred with a [1 4 6 4 1] kernel along
+  // each axis, and the result is sliced with trilinear interpolation. The
+  // cost is independent of the spatial radius.
+#define GRID_PAD 2
+
+  struct BilateralGrid
+  {
+    int width, height, depth;
+    float spatialStep, rangeStep;
+    float *data;
+  };
+
+  static BilateralGrid getGridSize(Image image, const Filter::Params& params)
+  {
+    BilateralGrid grid;
+    grid.spatialStep = params.sigmaSpatial;
+    grid.rangeStep = params.sigmaRange;
+    grid.width  = (int)((image.width-1)/grid.spatialStep + 0.5f);
+    grid.height = (int)((image.height-1)/grid.spatialStep + 0.5f);
+    grid.depth  = (int)(1.f/grid.rangeStep + 0.5f);
+    grid.width  += 1 + 2*GRID_PAD;
+    grid.height += 1 + 2*GRID_PAD;
+    grid.depth  += 1 + 2*GRID_PAD;
+    grid.data = NULL;
+    return grid;
+  }
+
+  static inline float luminance(const unsigned char *pixel)
+  {
+    return (pixel[0]*0.299f + pixel[1]*0.587f + pixel[2]*0.114f) / 255.f;
+  }
+
+  struct GridArgs
+  {
+    Image input, output;
+    BilateralGrid grid;
+    int axis;
+  };
+
+  // Each task owns a range of grid rows, so no two threads write to the
+  // same cell
+  static void gridSplatRows(void *data, int begin, int end)
+  {
+    GridArgs *args = (GridArgs*)data;
+    BilateralGrid grid = args->grid;
+    Image input = args->input;
+    size_t inPitch = getRowPitch(input);
+
+    for (int z = 0; z < grid.depth; z++)
+    {
+      memset(grid.data + (z*grid.height + begin)*grid.width*4, 0,
+             (end-begin)*grid.width*4*sizeof(float));
+    }
+
+    for (int y = 0; y < input.height; y++)
+    {
+      int gy = (int)(y/grid.spatialStep + 0.5f) + GRID_PAD;
+      if (gy < begin || gy >= end)
+      {
+        continue;
+      }
+      for (int x = 0; x < input.width; x++)
+      {
+        const unsigned char *pixel = input.data + y*inPitch + x*4;
+        int gx = (int)(x/grid.spatialStep + 0.5f) + GRID_PAD;
+        int gz = (int)(luminance(pixel)/grid.rangeStep + 0.5f) + GRID_PAD;
+
+        float *cell = grid.data + ((gz*grid.height + gy)*grid.width + gx)*4;
+        cell[0] += pixel[0];
+        cell[1] += pixel[1];
+        cell[2] += pixel[2];
+        cell[3] += 1.f;
+      }
+    }
+  }
+
+  static void gridBlurLines(void *data, int begin, int end)
+  {
+    GridArgs *args = (GridArgs*)data;
+    BilateralGrid grid = args->grid;
+
+    int size[3] = {grid.width, grid.height, grid.depth};
+    size_t stride[3] =
+    {
+      1, (size_t)grid.width, (size_t)grid.width*grid.height
+    };
+    int a = args->axis, u = (a+1)%3, v = (a+2)%3;
+    int n = size[a];
+    size_t step = stride[a]*4;
+
+    for (int line = begin; line < end; line++)
+    {
+      size_t start = (line%size[u])*stride[u] + (line/size[u])*stride[v];
+      float *values = grid.data + start*4;
+      for (int c = 0; c < 4; c++)
+      {
+        // Keep the two previous inputs, since blur is done in place
+        float prev2 = 0.f, prev1 = 0.f;
+        for (int i = 0; i < n; i++)
+        {
+          float current = values[i*step + c];
+          float next1 = i+1 < n ? values[(i+1)*step + c] : 0.f;
+          float next2 = i+2 < n ? values[(i+2)*step + c] : 0.f;
+          values[i*step + c] =
+            (prev2 + 4*prev1 + 6*current + 4*next1 + next2) * (1.f/16.f);
+          prev2 = prev1;
+          prev1 = current;
+        }
+      }
+    }
+  }
+
+  static void gridSliceRows(void *data, int begin, int end)
+  {
+    GridArgs *args = (GridArgs*)data;
+    BilateralGrid grid = args->grid;
+    Image input = args->input;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(args->output);
+    size_t plane = (size_t)grid.width*grid.height;
+
+    for (int y = begin; y < end; y++)
+    {
+      float fy = y/grid.spatialStep + GRID_PAD;
+      int iy = fy;
+      float ty = fy - iy;
+      for (int x = 0; x < input.width; x++)
+      {
+        const unsigned char *pixel = input.data + y*inPitch + x*4;
+        float fx = x/grid.spatialStep + GRID_PAD;
+        float fz = luminance(pixel)/grid.rangeStep + GRID_PAD;
+        int ix = fx, iz = fz;
+        float tx = fx - ix, tz = fz - iz;
+
+        float value[4] = {0.f, 0.f, 0.f, 0.f};
+        for (int k = 0; k < 8; k++)
+        {
+          int dx = k&1, dy = (k>>1)&1, dz = k>>2;
+          float weight = (dx ? tx : 1-tx) * (dy ? ty : 1-ty) * (dz ? tz : 1-tz);
+          const float *cell = grid.data +
+            ((iz+dz)*plane + (iy+dy)*grid.width + (ix+dx))*4;
+          for (int c = 0; c < 4; c++)
+          {
+            value[c] += weight * cell[c];
+          }
+        }
+
+        unsigned char *out = args->output.data + y*outPitch + x*4;
+        for (int c = 0; c < 3; c++)
+        {
+          float v = value[c] / value[3];
+          out[c] = v < 0.f ? 0 : v > 255.f ? 255 : v;
+        }
+        out[3] = pixel[3];
+      }
+    }
+  }
+
+  static void runGrid(GridArgs& args, unsigned int threads)
+  {
+    BilateralGrid& grid = args.grid;
+    parallelFor(grid.height, threads, gridSplatRows, &args);
+
+    args.axis = 0;
+    parallelFor(grid.height*grid.depth, threads, gridBlurLines, &args);
+    args.axis = 1;
+    parallelFor(grid.depth*grid.width, threads, gridBlurLines, &args);
+    args.axis = 2;
+    parallelFor(grid.width*grid.height, threads, gridBlurLines, &args);
+
+    parallelFor(args.output.height, threads, gridSliceRows, &args);
+  }
+
   Bilateral::Bilateral() : Filter()
   {
     m_name = "Bilateral";
+    m_radius = 2;
+    m_spatial = 0;
+    m_range = 0;
+    m_splatKernel = 0;
+    m_blurKernel = 0;
+    m_sliceKernel = 0;
+    m_deviceGrid[0] = m_deviceGrid[1] = 0;
+    m_grid = NULL;
+  }
+
+  Bilateral::~Bilateral()
+  {
+    release();
+  }
+
+  int Bilateral::getRadius(const Params& params) const
+  {
+    if (params.bilateralGrid)
+    {
+      // Support of the Gaussian approximated by the grid
+      return ceil(2*params.sigmaSpatial);
+    }
+    return params.radius ? params.radius : m_radius;
+  }
+
+  bool Bilateral::runCPU(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_CPU, input, output, params);
   }
 
   bool Bilateral::runHalideCPU(Image input, Image output, const Params& params)
   {
 #if ENABLE_HALIDE
+    if (params.sigmaSpatial != 3.f || params.sigmaRange != 0.2f ||
+        getRadius(params) != 2 || params.bilateralGrid)
+    {
+      reportStatus("Halide filter only supports radius 2 and sigma 3,0.2");
+      return false;
+    }
+
     // Create halide buffers
     buffer_t inputBuffer = createHalideBuffer(input);
     buffer_t outputBuffer = createHalideBuffer(output);
 
+    // Each layout and pixel format has a separate pipeline, and planar
+    // pipelines skip the alpha plane
+    HalideFunction pipeline = params.halfPrecision ?
+      selectHalfPipeline(input, halide_bilateral_cpu_half) :
+      selectHalidePipeline(
+        input, halide_bilateral_cpu, halide_bilateral_cpu_planar,
+        halide_bilateral_cpu_u16, halide_bilateral_cpu_f32);
+    if (!pipeline)
+    {
+      return false;
+    }
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      memset(output.data + getPixelOffset(output, 0, 0, 3), 255,
+             getRowPitch(output)*output.height);
+    }
+
     reportStatus("Running Halide CPU filter");
 
     // Warm-up run
-    halide_bilateral_cpu(&inputBuffer, &outputBuffer);
+    pipeline(&inputBuffer, &outputBuffer);
 
     // Timed runs
     startTiming();
     for (int i = 0; i < params.iterations; i++)
     {
-      halide_bilateral_cpu(&inputBuffer, &outputBuffer);
+      pipeline(&inputBuffer, &outputBuffer);
     }
     stopTiming();
 
@@ -54,22 +365,46 @@ namespace improsa
   bool Bilateral::runHalideGPU(Image input, Image output, const Params& params)
   {
 #if ENABLE_HALIDE
+    if (params.sigmaSpatial != 3.f || params.sigmaRange != 0.2f ||
+        getRadius(params) != 2 || params.bilateralGrid)
+    {
+      reportStatus("Halide filter only supports radius 2 and sigma 3,0.2");
+      return false;
+    }
+
     // Create halide buffers
     buffer_t inputBuffer = createHalideBuffer(input);
     buffer_t outputBuffer = createHalideBuffer(output);
 
+    // Each layout and pixel format has a separate pipeline, and planar
+    // pipelines skip the alpha plane
+    HalideFunction pipeline = params.halfPrecision ?
+      selectHalfPipeline(input, halide_bilateral_gpu_half) :
+      selectHalidePipeline(
+        input, halide_bilateral_gpu, halide_bilateral_gpu_planar,
+        halide_bilateral_gpu_u16, halide_bilateral_gpu_f32);
+    if (!pipeline)
+    {
+      return false;
+    }
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      memset(output.data + getPixelOffset(output, 0, 0, 3), 255,
+             getRowPitch(output)*output.height);
+    }
+
     reportStatus("Running Halide GPU filter");
 
     // Warm-up run
     inputBuffer.host_dirty = true;
-    halide_bilateral_gpu(&inputBuffer, &outputBuffer);
+    pipeline(&inputBuffer, &outputBuffer);
     halide_dev_sync(NULL);
 
     // Timed runs
     startTiming();
     for (int i = 0; i < params.iterations; i++)
     {
-      halide_bilateral_gpu(&inputBuffer, &outputBuffer);
+      pipeline(&inputBuffer, &outputBuffer);
     }
     halide_dev_sync(NULL);
     stopTiming();
@@ -84,91 +419,336 @@ namespace improsa
 #endif
   }
 
-  bool Bilateral::runOpenCL(Image input, Image output, const Params& params)
+  bool Bilateral::prepare(int method, Image image, const Params& params)
   {
-    if (!initCL(params, bilateral_kernel, "-cl-fast-relaxed-math"))
+    beginSession(method, image, params);
+    if (method != METHOD_CPU && method != METHOD_OPENCL)
+    {
+      return Filter::prepare(method, image, params);
+    }
+
+    if (!checkInterleaved(image, image) || !check8Bit(image, image))
     {
+      release();
       return false;
     }
 
-    cl_int err;
-    cl_kernel kernel;
-    cl_mem d_input, d_output;
-    cl_image_format format = {CL_RGBA, CL_UNORM_INT8};
+    if (method == METHOD_CPU)
+    {
+      unsigned int threads = getNumThreads(params.threads);
+      if (params.bilateralGrid)
+      {
+        BilateralGrid grid = getGridSize(image, params);
+        m_grid = (float*)allocateBuffer(
+          (size_t)grid.width*grid.height*grid.depth*4*sizeof(float));
+        reportStatus("Running CPU bilateral grid (%dx%dx%d) with %d threads",
+                     grid.width, grid.height, grid.depth, threads);
+        return true;
+      }
 
-    kernel = clCreateKernel(m_program, "bilateral", &err);
-    CHECK_ERROR_OCL(err, "creating kernel", return false);
+      int radius = getRadius(params);
+      m_spatialWeights.resize((2*radius+1)*(2*radius+1));
+      m_rangeWeights.resize(256);
+      computeWeights(params, radius, &m_spatialWeights[0],
+                     &m_rangeWeights[0]);
+      reportStatus("Running CPU filter with %d threads", threads);
+      return true;
+    }
 
-    d_input = clCreateImage2D(
-      m_context, CL_MEM_READ_ONLY, &format,
-      input.width, input.height, 0, NULL, &err);
-    CHECK_ERROR_OCL(err, "creating input image", return false);
+    if (params.fixedPoint && (params.bilateralGrid || !params.buffers))
+    {
+      reportStatus("Fixed-point kernel not implemented for this filter.");
+      release();
+      return false;
+    }
 
-    d_output = clCreateImage2D(
-      m_context, CL_MEM_WRITE_ONLY, &format,
-      input.width, input.height, 0, NULL, &err);
-    CHECK_ERROR_OCL(err, "creating output image", return false);
+    if (params.bilateralGrid)
+    {
+      return prepareGridOpenCL();
+    }
 
-    size_t origin[3] = {0, 0, 0};
-    size_t region[3] = {input.width, input.height, 1};
-    err = clEnqueueWriteImage(
-      m_queue, d_input, CL_TRUE,
-      origin, region, 0, 0, input.data, 0, NULL, NULL);
-    CHECK_ERROR_OCL(err, "writing image data", return false);
+    if (params.halfPrecision && !checkHalfKernel(params))
+    {
+      release();
+      return false;
+    }
 
-    err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_input);
-    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_output);
-    CHECK_ERROR_OCL(err, "setting kernel arguments", return false);
+    int radius = getRadius(params);
+    char options[128];
+    sprintf(options, "-cl-fast-relaxed-math -DRADIUS=%d -DGRID_DEPTH=1%s",
+            radius, params.halfPrecision ? " -DHALF" : "");
+    const char *name = "bilateral";
+    if (params.buffers)
+    {
+      name = "bilateral_buffer";
+    }
+    else if (params.coarsening > 1)
+    {
+      name = "bilateral_coarse";
+    }
+    else if (params.halfPrecision)
+    {
+      name = "bilateral_half";
+    }
+    cl_image_format format = {CL_RGBA, CL_UNSIGNED_INT8};
+    if (params.buffers ?
+        !prepareBufferKernel(bilateral_kernel, options, name) :
+        !prepareKernel(bilateral_kernel, options, name, format))
+    {
+      return false;
+    }
 
-    reportStatus("Running OpenCL kernel");
+    cl_int err;
+    size_t numWeights = (2*radius+1)*(2*radius+1);
+    cl_ulong maxConstant;
+    err = clGetDeviceInfo(m_device, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE,
+                          sizeof(cl_ulong), &maxConstant, NULL);
+    CHECK_ERROR_OCL(err, "getting max constant buffer size",
+                    release(); return false);
+    if ((numWeights + 256)*sizeof(float) > maxConstant)
+    {
+      reportStatus("Radius %d too large for constant memory, "
+                   "use -bilateralgrid", radius);
+      release();
+      return false;
+    }
 
-    const size_t global[2] = {output.width, output.height};
-    const size_t *local = NULL;
-    if (params.wgsize[0] && params.wgsize[1])
+    std::vector<float> spatial(numWeights);
+    float range[256];
+    computeWeights(params, radius, &spatial[0], range);
+
+    m_spatial = clCreateBuffer(
+      m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+      numWeights*sizeof(float), &spatial[0], &err);
+    CHECK_ERROR_OCL(err, "creating spatial weights buffer",
+                    release(); return false);
+
+    m_range = clCreateBuffer(
+      m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+      sizeof(range), range, &err);
+    CHECK_ERROR_OCL(err, "creating range weights buffer",
+                    release(); return false);
+
+    err  = clSetKernelArg(m_kernel, 2, sizeof(cl_mem), &m_spatial);
+    err |= clSetKernelArg(m_kernel, 3, sizeof(cl_mem), &m_range);
+    CHECK_ERROR_OCL(err, "setting kernel arguments", release(); return false);
+
+    reportStatus("Running OpenCL %s kernel", name);
+    return true;
+  }
+
+  void Bilateral::release()
+  {
+    if (m_spatial)
+    {
+      clReleaseMemObject(m_spatial);
+      m_spatial = 0;
+    }
+    if (m_range)
+    {
+      clReleaseMemObject(m_range);
+      m_range = 0;
+    }
+    if (m_splatKernel)
+    {
+      clReleaseKernel(m_splatKernel);
+      m_splatKernel = 0;
+    }
+    if (m_blurKernel)
     {
-      local = params.wgsize;
+      clReleaseKernel(m_blurKernel);
+      m_blurKernel = 0;
     }
+    if (m_sliceKernel)
+    {
+      clReleaseKernel(m_sliceKernel);
+      m_sliceKernel = 0;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+      if (m_deviceGrid[i])
+      {
+        clReleaseMemObject(m_deviceGrid[i]);
+        m_deviceGrid[i] = 0;
+      }
+    }
+    m_spatialWeights.clear();
+    m_rangeWeights.clear();
+    releaseBuffer(m_grid);
+    m_grid = NULL;
+    Filter::release();
+  }
 
-    // Timed runs
-    for (int i = 0; i < params.iterations + 1; i++)
+  bool Bilateral::execute()
+  {
+    if (m_sessionMethod == METHOD_OPENCL)
     {
-      err = clEnqueueNDRangeKernel(
-        m_queue, kernel, 2, NULL, global, local, 0, NULL, NULL);
-      CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+      if (m_sessionParams.bilateralGrid)
+      {
+        return executeGridOpenCL();
+      }
+      return Filter::execute();
+    }
+    if (m_sessionMethod != METHOD_CPU)
+    {
+      return Filter::execute();
+    }
 
-      // Start timing after warm-up run
-      if (i == 0)
+    unsigned int threads = getNumThreads(m_sessionParams.threads);
+    for (unsigned int b = 0; b < m_sessionParams.batch; b++)
+    {
+      Image input = getBatchImage(m_sessionInput, b);
+      Image output = getBatchImage(m_sessionOutput, b);
+      if (m_sessionParams.bilateralGrid)
+      {
+        GridArgs args;
+        args.input = input;
+        args.output = output;
+        args.grid = getGridSize(input, m_sessionParams);
+        args.grid.data = m_grid;
+        runGrid(args, threads);
+      }
+      else
       {
-        err = clFinish(m_queue);
-        CHECK_ERROR_OCL(err, "running kernel", return false);
-        startTiming();
+        BilateralArgs args =
+        {
+          input, output, getRadius(m_sessionParams),
+          &m_spatialWeights[0], &m_rangeWeights[0]
+        };
+        parallelFor(output.height, threads, bilateralRows, &args);
       }
     }
-    err = clFinish(m_queue);
-    CHECK_ERROR_OCL(err, "running kernel", return false);
-    stopTiming();
+    return true;
+  }
 
-    reportStatus("Finished OpenCL kernel");
+  bool Bilateral::runOpenCL(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_OPENCL, input, output, params);
+  }
 
-    err = clEnqueueReadImage(
-      m_queue, d_output, CL_TRUE,
-      origin, region, 0, 0, output.data, 0, NULL, NULL);
-    CHECK_ERROR_OCL(err, "reading image data", return false);
+  bool Bilateral::prepareGridOpenCL()
+  {
+    if (m_sessionParams.buffers || m_sessionParams.coarsening > 1)
+    {
+      reportStatus("Only the image kernels are implemented for the "
+                   "bilateral grid.");
+      release();
+      return false;
+    }
 
-    clReleaseMemObject(d_input);
-    clReleaseMemObject(d_output);
-    clReleaseKernel(kernel);
-    releaseCL();
+    // Each image of a batch would need a grid of its own
+    if (m_sessionParams.batch > 1)
+    {
+      reportStatus("Batches are not supported by the OpenCL grid.");
+      release();
+      return false;
+    }
 
-    return outputResults(input, output, params);
+    Image image = m_sessionImage;
+    BilateralGrid grid = getGridSize(image, m_sessionParams);
+
+    char options[128];
+    sprintf(options, "-cl-fast-relaxed-math -DRADIUS=0 -DGRID_DEPTH=%d",
+            grid.depth);
+    if (!initCL(m_sessionParams, bilateral_kernel, options))
+    {
+      release();
+      return false;
+    }
+
+    cl_int err;
+    cl_image_format format = {CL_RGBA, CL_UNSIGNED_INT8};
+    size_t gridSize = (size_t)grid.width*grid.height*grid.depth*4*sizeof(float);
+
+    m_splatKernel = clCreateKernel(m_program, "grid_splat", &err);
+    CHECK_ERROR_OCL(err, "creating splat kernel", release(); return false);
+    m_blurKernel = clCreateKernel(m_program, "grid_blur", &err);
+    CHECK_ERROR_OCL(err, "creating blur kernel", release(); return false);
+    m_sliceKernel = clCreateKernel(m_program, "grid_slice", &err);
+    CHECK_ERROR_OCL(err, "creating slice kernel", release(); return false);
+
+    m_deviceInput = clCreateImage2D(
+      m_context, CL_MEM_READ_ONLY, &format,
+      image.width, image.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating input image", release(); return false);
+
+    m_deviceOutput = clCreateImage2D(
+      m_context, CL_MEM_WRITE_ONLY, &format,
+      image.width, image.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating output image", release(); return false);
+
+    for (int i = 0; i < 2; i++)
+    {
+      m_deviceGrid[i] = clCreateBuffer(
+        m_context, CL_MEM_READ_WRITE, gridSize, NULL, &err);
+      CHECK_ERROR_OCL(err, "creating grid buffer", release(); return false);
+    }
+
+    err  = clSetKernelArg(m_splatKernel, 0, sizeof(cl_mem), &m_deviceInput);
+    err |= clSetKernelArg(m_splatKernel, 1, sizeof(cl_mem), m_deviceGrid+0);
+    err |= clSetKernelArg(m_splatKernel, 2, sizeof(float), &grid.spatialStep);
+    err |= clSetKernelArg(m_splatKernel, 3, sizeof(float), &grid.rangeStep);
+    err |= clSetKernelArg(m_sliceKernel, 0, sizeof(cl_mem), &m_deviceInput);
+    err |= clSetKernelArg(m_sliceKernel, 1, sizeof(cl_mem), &m_deviceOutput);
+    err |= clSetKernelArg(m_sliceKernel, 2, sizeof(cl_mem), m_deviceGrid+1);
+    err |= clSetKernelArg(m_sliceKernel, 3, sizeof(cl_int), &grid.width);
+    err |= clSetKernelArg(m_sliceKernel, 4, sizeof(cl_int), &grid.height);
+    err |= clSetKernelArg(m_sliceKernel, 5, sizeof(float), &grid.spatialStep);
+    err |= clSetKernelArg(m_sliceKernel, 6, sizeof(float), &grid.rangeStep);
+    CHECK_ERROR_OCL(err, "setting kernel arguments", release(); return false);
+
+    reportStatus("Running OpenCL bilateral grid (%dx%dx%d)",
+                 grid.width, grid.height, grid.depth);
+    return true;
   }
 
-  bool Bilateral::runReference(Image input, Image output)
+  bool Bilateral::executeGridOpenCL()
+  {
+    BilateralGrid grid = getGridSize(m_sessionImage, m_sessionParams);
+    const size_t splatGlobal[2] = {(size_t)grid.width, (size_t)grid.height};
+    const size_t blurGlobal[3] =
+    {
+      (size_t)grid.width, (size_t)grid.height, (size_t)grid.depth
+    };
+    const size_t global[2] = {m_sessionImage.width, m_sessionImage.height};
+    const size_t *local = NULL;
+    if (m_sessionParams.wgsize[0] && m_sessionParams.wgsize[1])
+    {
+      local = m_sessionParams.wgsize;
+    }
+
+    cl_int err = clEnqueueNDRangeKernel(
+      m_queue, m_splatKernel, 2, NULL, splatGlobal, NULL, 0, NULL, NULL);
+    CHECK_ERROR_OCL(err, "enqueuing splat kernel", return false);
+
+    // Blur along each axis, ping-ponging between the grid buffers
+    for (cl_int axis = 0; axis < 3; axis++)
+    {
+      err  = clSetKernelArg(m_blurKernel, 0, sizeof(cl_mem),
+                            m_deviceGrid + (axis&1));
+      err |= clSetKernelArg(m_blurKernel, 1, sizeof(cl_mem),
+                            m_deviceGrid + !(axis&1));
+      err |= clSetKernelArg(m_blurKernel, 2, sizeof(cl_int), &axis);
+      CHECK_ERROR_OCL(err, "setting kernel arguments", return false);
+
+      err = clEnqueueNDRangeKernel(
+        m_queue, m_blurKernel, 3, NULL, blurGlobal, NULL, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "enqueuing blur kernel", return false);
+    }
+
+    err = clEnqueueNDRangeKernel(
+      m_queue, m_sliceKernel, 2, NULL, global, local, 0, NULL, NULL);
+    CHECK_ERROR_OCL(err, "enqueuing slice kernel", return false);
+    return true;
+  }
+
+  bool Bilateral::runReference(Image input, Image output,
+                               const Params& params)
   {
     // Check for cached result
     if (m_reference.data)
     {
-      memcpy(output.data, m_reference.data, output.width*output.height*4);
+      copyImage(m_reference, output);
       reportStatus("Finished reference (cached)");
       return true;
     }
@@ -178,41 +758,9 @@ namespace improsa
     {
       for (int x = 0; x < output.width; x++)
       {
-        float cr = getPixel(input, x, y, 0);
-        float cg = getPixel(input, x, y, 1);
-        float cb = getPixel(input, x, y, 2);
-
-        float coeff = 0.f;
-        float sr = 0.f;
-        float sg = 0.f;
-        float sb = 0.f;
-
-        for (int j = -2; j <= 2; j++)
-        {
-          for (int i = -2; i <= 2; i++)
-          {
-            float r = getPixel(input, x+i, y+j, 0);
-            float g = getPixel(input, x+i, y+j, 1);
-            float b = getPixel(input, x+i, y+j, 2);
-
-            float weight, norm;
-
-            norm = sqrt((float)(i*i) + (float)(j*j)) * (1.f/3.f);
-            weight = exp(-0.5f * (norm*norm));
-
-            norm = sqrt(pow(r-cr,2) + pow(g-cg,2) + pow(b-cb,2)) * (1.f/0.2f);
-            weight *= exp(-0.5f * (norm*norm));
-
-            coeff += weight;
-            sr += weight * r;
-            sg += weight * g;
-            sb += weight * b;
-          }
-        }
-        setPixel(output, x, y, 0, sr/coeff);
-        setPixel(output, x, y, 1, sg/coeff);
-        setPixel(output, x, y, 2, sb/coeff);
-        setPixel(output, x, y, 3, getPixel(input, x, y, 3));
+        float pixel[4];
+        referencePixel(input, x, y, params, pixel);
+        setPixelRGBA(output, x, y, pixel);
       }
 #if SHOW_REFERENCE_PROGRESS == 1
       reportStatus("Completed %.1f%% of reference", (100.f*y)/(input.height-1));
@@ -221,11 +769,78 @@ namespace improsa
     reportStatus("Finished reference");
 
     // Cache result
-    m_reference.width = output.width;
-    m_reference.height = output.height;
-    m_reference.data = new unsigned char[output.width*output.height*4];
-    memcpy(m_reference.data, output.data, output.width*output.height*4);
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
+
+  bool Bilateral::verify(Image input, Image output, const Params& params,
+                         int tolerance)
+  {
+    if (params.bilateralGrid)
+    {
+      // The grid approximates the brute-force filter (with range measured
+      // on luminance) by sampling it at the sigmas. On random images, a
+      // correct grid measures 31-40 dB for sigmas 1-8 and ranges 0.05-0.4,
+      // while a grid which ignores the range axis or skips slicing measures
+      // 12-22 dB, so the overall error is checked against 30 dB.
+      return verifyApproximate(input, output, params, 30.0);
+    }
+    return Filter::verify(input, output, params, tolerance);
+  }
+
+  bool Bilateral::referencePixel(Image input, int x, int y,
+                                 const Params& params, float result[4])
+  {
+    float cr = getPixel(input, x, y, 0);
+    float cg = getPixel(input, x, y, 1);
+    float cb = getPixel(input, x, y, 2);
+    float cl = getPixelGrayscale(input, x, y);
+
+    float coeff = 0.f;
+    float sr = 0.f;
+    float sg = 0.f;
+    float sb = 0.f;
+
+    int radius = getRadius(params);
+    for (int j = -radius; j <= radius; j++)
+    {
+      for (int i = -radius; i <= radius; i++)
+      {
+        float r = getPixel(input, x+i, y+j, 0);
+        float g = getPixel(input, x+i, y+j, 1);
+        float b = getPixel(input, x+i, y+j, 2);
+
+        float weight, norm;
 
+        norm = sqrt((float)(i*i) + (float)(j*j)) / params.sigmaSpatial;
+        weight = exp(-0.5f * (norm*norm));
+
+        if (params.bilateralGrid)
+        {
+          // The grid measures range on luminance
+          norm = (getPixelGrayscale(input, x+i, y+j) - cl) / params.sigmaRange;
+        }
+        else
+        {
+          norm = sqrt(pow(r-cr,2) + pow(g-cg,2) + pow(b-cb,2)) /
+            params.sigmaRange;
+        }
+        weight *= exp(-0.5f * (norm*norm));
+
+        coeff += weight;
+        sr += weight * r;
+        sg += weight * g;
+        sb += weight * b;
+      }
+    }
+    result[0] = sr/coeff;
+    result[1] = sg/coeff;
+    result[2] = sb/coeff;
+    result[3] = getPixel(input, x, y, 3);
     return true;
   }
 }
@@ -6,6 +6,8 @@
 // license terms please see the LICENSE file distributed with this
 // source code.
 
+#include <vector>
+
 #include "Filter.h"
 
 namespace improsa
@@ -14,10 +16,37 @@ namespace improsa
   {
   public:
     Bilateral();
+    virtual ~Bilateral();
 
+    virtual bool runCPU(Image input, Image output, const Params& params);
     virtual bool runHalideCPU(Image input, Image output, const Params& params);
     virtual bool runHalideGPU(Image input, Image output, const Params& params);
     virtual bool runOpenCL(Image input, Image output, const Params& params);
-    virtual bool runReference(Image input, Image output);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+    virtual bool prepare(int method, Image image, const Params& params);
+    virtual void release();
+
+  protected:
+    virtual bool execute();
+    virtual int getRadius(const Params& params) const;
+    virtual bool verify(Image input, Image output, const Params& params,
+                        int tolerance=1);
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
+    bool prepareGridOpenCL();
+    bool executeGridOpenCL();
+
+    // Weights of the brute-force filter, and the grid of the bilateral
+    // grid, which the CPU reuses for each image of a batch
+    std::vector<float> m_spatialWeights, m_rangeWeights;
+    float *m_grid;
+    cl_mem m_spatial, m_range;
+
+    // Kernels of the OpenCL bilateral grid, which blurs the grid by
+    // ping-ponging between two buffers
+    cl_kernel m_splatKernel, m_blurKernel, m_sliceKernel;
+    cl_mem m_deviceGrid[2];
   };
 }
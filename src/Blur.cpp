@@ -6,39 +6,394 @@
 // license terms please see the LICENSE file distributed with this
 // source code.
 
+#include <stdio.h>
 #include <string.h>
 
 #include "Blur.h"
 #include "opencl/blur.h"
+#include "opencl/integral.h"
 #if ENABLE_HALIDE
 #include "halide/blur_cpu.h"
 #include "halide/blur_gpu.h"
+#include "halide/blur_cpu_planar.h"
+#include "halide/blur_gpu_planar.h"
+#include "halide/blur_cpu_u16.h"
+#include "halide/blur_gpu_u16.h"
+#include "halide/blur_cpu_f32.h"
+#include "halide/blur_gpu_f32.h"
+#include "halide/blur_cpu_half.h"
+#include "halide/blur_gpu_half.h"
 #endif
 
 namespace improsa
 {
+  struct BlurArgs
+  {
+    Image input, output;
+    int radius;
+    const IntegralImage *integral;
+  };
+
+  static void blurDirect(void *data, int begin, int end)
+  {
+    BlurArgs *args = (BlurArgs*)data;
+    Image input = args->input;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(args->output);
+    int w = input.width, h = input.height, r = args->radius;
+    int area = (2*r+1)*(2*r+1);
+    for (int y = begin; y < end; y++)
+    {
+      for (int x = 0; x < w; x++)
+      {
+        int sum[3] = {0, 0, 0};
+        for (int j = -r; j <= r; j++)
+        {
+          int _y = y+j < 0 ? 0 : y+j >= h ? h-1 : y+j;
+          for (int i = -r; i <= r; i++)
+          {
+            int _x = x+i < 0 ? 0 : x+i >= w ? w-1 : x+i;
+            const unsigned char *pixel = input.data + _y*inPitch + _x*4;
+            sum[0] += pixel[0];
+            sum[1] += pixel[1];
+            sum[2] += pixel[2];
+          }
+        }
+        unsigned char *out = args->output.data + y*outPitch + x*4;
+        out[0] = sum[0] / area;
+        out[1] = sum[1] / area;
+        out[2] = sum[2] / area;
+        out[3] = input.data[y*inPitch + x*4 + 3];
+      }
+    }
+  }
+
+  static void blurIntegral(void *data, int begin, int end)
+  {
+    BlurArgs *args = (BlurArgs*)data;
+    Image input = args->input;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(args->output);
+    int r = args->radius;
+    cl_uint area = (2*r+1)*(2*r+1);
+    for (int y = begin; y < end; y++)
+    {
+      for (int x = 0; x < input.width; x++)
+      {
+        cl_uint sum[4];
+        args->integral->boxSum(x, y, r, sum);
+        unsigned char *out = args->output.data + y*outPitch + x*4;
+        out[0] = sum[0] / area;
+        out[1] = sum[1] / area;
+        out[2] = sum[2] / area;
+        out[3] = input.data[y*inPitch + x*4 + 3];
+      }
+    }
+  }
+
   Blur::Blur() : Filter()
   {
     m_name = "Blur";
+    m_radius = 2;
+    m_integralRows = 0;
+    m_integralColumns = 0;
+    m_deviceTable = 0;
+  }
+
+  Blur::~Blur()
+  {
+    release();
+  }
+
+  int Blur::getRadius(const Params& params) const
+  {
+    return params.radius ? params.radius : m_radius;
+  }
+
+  bool Blur::prepare(int method, Image image, const Params& params)
+  {
+    beginSession(method, image, params);
+    int radius = getRadius(params);
+
+    if (method == METHOD_CPU)
+    {
+      if (!checkInterleaved(image, image) || !check8Bit(image, image))
+      {
+        release();
+        return false;
+      }
+
+      reportStatus("Running CPU %s blur (radius %d) with %d threads",
+                   params.integralImage ? "integral image" : "direct",
+                   radius, getNumThreads(params.threads));
+      return true;
+    }
+    else if (method == METHOD_OPENCL && params.integralImage)
+    {
+      if (!checkInterleaved(image, image) || !check8Bit(image, image))
+      {
+        release();
+        return false;
+      }
+
+      if (params.buffers || params.coarsening > 1)
+      {
+        reportStatus("Only the image kernels are implemented for the "
+                     "integral image.");
+        release();
+        return false;
+      }
+
+      // The column sums would run from one image of a batch into the next
+      if (params.batch > 1)
+      {
+        reportStatus("Batches are not supported by the integral image "
+                     "kernels.");
+        release();
+        return false;
+      }
+
+      if (!prepareIntegralOpenCL())
+      {
+        return false;
+      }
+
+      reportStatus("Running OpenCL integral image blur (radius %d)",
+                   radius);
+      return true;
+    }
+    else if (method == METHOD_OPENCL && image.layout == LAYOUT_INTERLEAVED)
+    {
+      if (params.halfPrecision && !checkHalfKernel(params))
+      {
+        release();
+        return false;
+      }
+
+      char options[64];
+      sprintf(options, "-cl-fast-relaxed-math -DRADIUS=%d%s", radius,
+              params.halfPrecision ? " -DHALF" : "");
+      if (params.buffers)
+      {
+        if (!prepareBufferKernel(blur_kernel, options, "blur_buffer"))
+        {
+          return false;
+        }
+
+        reportStatus("Running OpenCL blur_buffer kernel");
+        return true;
+      }
+
+      if (params.fixedPoint && !check8Bit(image, image))
+      {
+        release();
+        return false;
+      }
+
+      if (params.fixedPoint && radius != 2)
+      {
+        reportStatus("Fixed-point blur only supports radius 2");
+        release();
+        return false;
+      }
+
+      cl_image_format format = getImageFormat(image);
+      const char *name = "blur";
+      if (params.fixedPoint)
+      {
+        // Integer kernel operates directly on the 8-bit channel values
+        format.image_channel_data_type = CL_UNSIGNED_INT8;
+        name = "blur_fixed";
+      }
+      if (params.coarsening > 1)
+      {
+        if (params.fixedPoint)
+        {
+          reportStatus("Coarsening not supported for fixed-point kernels.");
+          release();
+          return false;
+        }
+        name = "blur_coarse";
+      }
+      if (params.halfPrecision)
+      {
+        name = "blur_half";
+      }
+      if (!prepareKernel(blur_kernel, options, name, format))
+      {
+        return false;
+      }
+
+      reportStatus("Running OpenCL %s kernel", name);
+      return true;
+    }
+
+    return Filter::prepare(method, image, params);
+  }
+
+  bool Blur::prepareIntegralOpenCL()
+  {
+    if (!initCL(m_sessionParams, integral_kernel, ""))
+    {
+      release();
+      return false;
+    }
+
+    cl_int err;
+    Image image = m_sessionImage;
+    cl_image_format format = {CL_RGBA, CL_UNSIGNED_INT8};
+    cl_int height = image.height;
+    cl_int radius = getRadius(m_sessionParams);
+
+    m_integralRows = clCreateKernel(m_program, "integral_rows", &err);
+    CHECK_ERROR_OCL(err, "creating row kernel", release(); return false);
+    m_integralColumns = clCreateKernel(m_program, "integral_columns", &err);
+    CHECK_ERROR_OCL(err, "creating column kernel", release(); return false);
+    m_kernel = clCreateKernel(m_program, "box_mean", &err);
+    CHECK_ERROR_OCL(err, "creating box mean kernel",
+                    release(); return false);
+
+    m_deviceInput = clCreateImage2D(
+      m_context, CL_MEM_READ_ONLY, &format,
+      image.width, image.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating input image", release(); return false);
+
+    m_deviceOutput = clCreateImage2D(
+      m_context, CL_MEM_WRITE_ONLY, &format,
+      image.width, image.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating output image", release(); return false);
+
+    m_deviceTable = clCreateBuffer(
+      m_context, CL_MEM_READ_WRITE,
+      (image.width+1)*(image.height+1)*4*sizeof(cl_uint), NULL, &err);
+    CHECK_ERROR_OCL(err, "creating summed-area table",
+                    release(); return false);
+
+    err  = clSetKernelArg(m_integralRows, 0, sizeof(cl_mem), &m_deviceInput);
+    err |= clSetKernelArg(m_integralRows, 1, sizeof(cl_mem), &m_deviceTable);
+    err |= clSetKernelArg(m_integralColumns, 0, sizeof(cl_mem),
+                          &m_deviceTable);
+    err |= clSetKernelArg(m_integralColumns, 1, sizeof(cl_int), &height);
+    err |= clSetKernelArg(m_kernel, 0, sizeof(cl_mem), &m_deviceTable);
+    err |= clSetKernelArg(m_kernel, 1, sizeof(cl_mem), &m_deviceOutput);
+    err |= clSetKernelArg(m_kernel, 2, sizeof(cl_int), &radius);
+    CHECK_ERROR_OCL(err, "setting kernel arguments", release(); return false);
+    return true;
+  }
+
+  void Blur::release()
+  {
+    if (m_integralRows)
+    {
+      clReleaseKernel(m_integralRows);
+      m_integralRows = 0;
+    }
+    if (m_integralColumns)
+    {
+      clReleaseKernel(m_integralColumns);
+      m_integralColumns = 0;
+    }
+    if (m_deviceTable)
+    {
+      clReleaseMemObject(m_deviceTable);
+      m_deviceTable = 0;
+    }
+    Filter::release();
+  }
+
+  // The table is rebuilt for each frame, before the mean of each box is
+  // taken with one work-item per output pixel
+  bool Blur::executeIntegralOpenCL()
+  {
+    const size_t rowsGlobal[1] = {m_sessionImage.height};
+    const size_t columnsGlobal[1] = {m_sessionImage.width+1};
+
+    cl_int err = clEnqueueNDRangeKernel(
+      m_queue, m_integralRows, 1, NULL, rowsGlobal, NULL, 0, NULL, NULL);
+    CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+    err = clEnqueueNDRangeKernel(
+      m_queue, m_integralColumns, 1, NULL, columnsGlobal, NULL,
+      0, NULL, NULL);
+    CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+    return Filter::execute();
+  }
+
+  bool Blur::execute()
+  {
+    if (m_sessionMethod == METHOD_OPENCL && m_deviceTable)
+    {
+      return executeIntegralOpenCL();
+    }
+    if (m_sessionMethod != METHOD_CPU)
+    {
+      return Filter::execute();
+    }
+
+    unsigned int threads = getNumThreads(m_sessionParams.threads);
+    for (unsigned int b = 0; b < m_sessionParams.batch; b++)
+    {
+      BlurArgs args =
+      {
+        getBatchImage(m_sessionInput, b), getBatchImage(m_sessionOutput, b),
+        getRadius(m_sessionParams), &m_integral
+      };
+
+      // The table is rebuilt for each frame
+      if (m_sessionParams.integralImage)
+      {
+        m_integral.build(args.input, threads);
+        parallelFor(args.input.height, threads, blurIntegral, &args);
+      }
+      else
+      {
+        parallelFor(args.input.height, threads, blurDirect, &args);
+      }
+    }
+    return true;
+  }
+
+  bool Blur::runCPU(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_CPU, input, output, params);
   }
 
   bool Blur::runHalideCPU(Image input, Image output, const Params& params)
   {
 #if ENABLE_HALIDE
+    if (getRadius(params) != 2 || params.integralImage)
+    {
+      reportStatus("Halide filter only supports direct blur with radius 2");
+      return false;
+    }
+
     // Create halide buffers
     buffer_t inputBuffer = createHalideBuffer(input);
     buffer_t outputBuffer = createHalideBuffer(output);
 
+    // Each layout and pixel format has a separate pipeline, and planar
+    // pipelines skip the alpha plane
+    HalideFunction pipeline = params.halfPrecision ?
+      selectHalfPipeline(input, halide_blur_cpu_half) :
+      selectHalidePipeline(
+        input, halide_blur_cpu, halide_blur_cpu_planar,
+        halide_blur_cpu_u16, halide_blur_cpu_f32);
+    if (!pipeline)
+    {
+      return false;
+    }
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      copyAlphaPlane(input, output);
+    }
+
     reportStatus("Running Halide CPU filter");
 
     // Warm-up run
-    halide_blur_cpu(&inputBuffer, &outputBuffer);
+    pipeline(&inputBuffer, &outputBuffer);
 
     // Timed runs
     startTiming();
     for (int i = 0; i < params.iterations; i++)
     {
-      halide_blur_cpu(&inputBuffer, &outputBuffer);
+      pipeline(&inputBuffer, &outputBuffer);
     }
     stopTiming();
 
@@ -54,22 +409,44 @@ namespace improsa
   bool Blur::runHalideGPU(Image input, Image output, const Params& params)
   {
 #if ENABLE_HALIDE
+    if (getRadius(params) != 2 || params.integralImage)
+    {
+      reportStatus("Halide filter only supports direct blur with radius 2");
+      return false;
+    }
+
     // Create halide buffers
     buffer_t inputBuffer = createHalideBuffer(input);
     buffer_t outputBuffer = createHalideBuffer(output);
 
+    // Each layout and pixel format has a separate pipeline, and planar
+    // pipelines skip the alpha plane
+    HalideFunction pipeline = params.halfPrecision ?
+      selectHalfPipeline(input, halide_blur_gpu_half) :
+      selectHalidePipeline(
+        input, halide_blur_gpu, halide_blur_gpu_planar,
+        halide_blur_gpu_u16, halide_blur_gpu_f32);
+    if (!pipeline)
+    {
+      return false;
+    }
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      copyAlphaPlane(input, output);
+    }
+
     reportStatus("Running Halide GPU filter");
 
     // Warm-up run
     inputBuffer.host_dirty = true;
-    halide_blur_gpu(&inputBuffer, &outputBuffer);
+    pipeline(&inputBuffer, &outputBuffer);
     halide_dev_sync(NULL);
 
     // Timed runs
     startTiming();
     for (int i = 0; i < params.iterations; i++)
     {
-      halide_blur_gpu(&inputBuffer, &outputBuffer);
+      pipeline(&inputBuffer, &outputBuffer);
     }
     halide_dev_sync(NULL);
     stopTiming();
@@ -86,89 +463,24 @@ namespace improsa
 
   bool Blur::runOpenCL(Image input, Image output, const Params& params)
   {
-    if (!initCL(params, blur_kernel, "-cl-fast-relaxed-math"))
+    if (input.layout == LAYOUT_PLANAR && !params.integralImage)
     {
-      return false;
+      char options[64];
+      sprintf(options, "-cl-fast-relaxed-math -DRADIUS=%d", getRadius(params));
+      return runPlanarOpenCL(input, output, params, blur_kernel, options,
+                             "blur_planar", false);
     }
 
-    cl_int err;
-    cl_kernel kernel;
-    cl_mem d_input, d_output;
-    cl_image_format format = {CL_RGBA, CL_UNORM_INT8};
-
-    kernel = clCreateKernel(m_program, "blur", &err);
-    CHECK_ERROR_OCL(err, "creating kernel", return false);
-
-    d_input = clCreateImage2D(
-      m_context, CL_MEM_READ_ONLY, &format,
-      input.width, input.height, 0, NULL, &err);
-    CHECK_ERROR_OCL(err, "creating input image", return false);
-
-    d_output = clCreateImage2D(
-      m_context, CL_MEM_WRITE_ONLY, &format,
-      input.width, input.height, 0, NULL, &err);
-    CHECK_ERROR_OCL(err, "creating output image", return false);
-
-    size_t origin[3] = {0, 0, 0};
-    size_t region[3] = {input.width, input.height, 1};
-    err = clEnqueueWriteImage(
-      m_queue, d_input, CL_TRUE,
-      origin, region, 0, 0, input.data, 0, NULL, NULL);
-    CHECK_ERROR_OCL(err, "writing image data", return false);
-
-    err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_input);
-    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_output);
-    CHECK_ERROR_OCL(err, "setting kernel arguments", return false);
-
-    reportStatus("Running OpenCL kernel");
-
-    const size_t global[2] = {output.width, output.height};
-    const size_t *local = NULL;
-    if (params.wgsize[0] && params.wgsize[1])
-    {
-      local = params.wgsize;
-    }
-
-    // Timed runs
-    for (int i = 0; i < params.iterations + 1; i++)
-    {
-      err = clEnqueueNDRangeKernel(
-        m_queue, kernel, 2, NULL, global, local, 0, NULL, NULL);
-      CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
-
-      // Start timing after warm-up run
-      if (i == 0)
-      {
-        err = clFinish(m_queue);
-        CHECK_ERROR_OCL(err, "running kernel", return false);
-        startTiming();
-      }
-    }
-    err = clFinish(m_queue);
-    CHECK_ERROR_OCL(err, "running kernel", return false);
-    stopTiming();
-
-    reportStatus("Finished OpenCL kernel");
-
-    err = clEnqueueReadImage(
-      m_queue, d_output, CL_TRUE,
-      origin, region, 0, 0, output.data, 0, NULL, NULL);
-    CHECK_ERROR_OCL(err, "reading image data", return false);
-
-    clReleaseMemObject(d_input);
-    clReleaseMemObject(d_output);
-    clReleaseKernel(kernel);
-    releaseCL();
-
-    return outputResults(input, output, params);
+    return benchmark(METHOD_OPENCL, input, output, params);
   }
 
-  bool Blur::runReference(Image input, Image output)
+  bool Blur::runReference(Image input, Image output,
+                          const Params& params)
   {
     // Check for cached result
     if (m_reference.data)
     {
-      memcpy(output.data, m_reference.data, output.width*output.height*4);
+      copyImage(m_reference, output);
       reportStatus("Finished reference (cached)");
       return true;
     }
@@ -178,22 +490,9 @@ namespace improsa
     {
       for (int x = 0; x < output.width; x++)
       {
-        float r = 0;
-        float g = 0;
-        float b = 0;
-        for (int j = -2; j <= 2; j++)
-        {
-          for (int i = -2; i <= 2; i++)
-          {
-            r += getPixel(input, x+i, y+j, 0);
-            g += getPixel(input, x+i, y+j, 1);
-            b += getPixel(input, x+i, y+j, 2);
-          }
-        }
-        setPixel(output, x, y, 0, r/25.f);
-        setPixel(output, x, y, 1, g/25.f);
-        setPixel(output, x, y, 2, b/25.f);
-        setPixel(output, x, y, 3, getPixel(input, x, y, 3));
+        float pixel[4];
+        referencePixel(input, x, y, params, pixel);
+        setPixelRGBA(output, x, y, pixel);
       }
 #if SHOW_REFERENCE_PROGRESS == 1
       reportStatus("Completed %.1f%% of reference", (100.f*y)/(input.height-1));
@@ -202,11 +501,35 @@ namespace improsa
     reportStatus("Finished reference");
 
     // Cache result
-    m_reference.width = output.width;
-    m_reference.height = output.height;
-    m_reference.data = new unsigned char[output.width*output.height*4];
-    memcpy(m_reference.data, output.data, output.width*output.height*4);
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
 
+  bool Blur::referencePixel(Image input, int x, int y,
+                            const Params& params, float result[4])
+  {
+    int radius = getRadius(params);
+    float area = (2*radius+1)*(2*radius+1);
+    float r = 0;
+    float g = 0;
+    float b = 0;
+    for (int j = -radius; j <= radius; j++)
+    {
+      for (int i = -radius; i <= radius; i++)
+      {
+        r += getPixel(input, x+i, y+j, 0);
+        g += getPixel(input, x+i, y+j, 1);
+        b += getPixel(input, x+i, y+j, 2);
+      }
+    }
+    result[0] = r/area;
+    result[1] = g/area;
+    result[2] = b/area;
+    result[3] = getPixel(input, x, y, 3);
     return true;
   }
 }
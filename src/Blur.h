@@ -7,6 +7,7 @@
 // source code.
 
 #include "Filter.h"
+#include "IntegralImage.h"
 
 namespace improsa
 {
@@ -14,10 +15,31 @@ namespace improsa
   {
   public:
     Blur();
+    virtual ~Blur();
 
+    virtual bool runCPU(Image input, Image output, const Params& params);
     virtual bool runHalideCPU(Image input, Image output, const Params& params);
     virtual bool runHalideGPU(Image input, Image output, const Params& params);
     virtual bool runOpenCL(Image input, Image output, const Params& params);
-    virtual bool runReference(Image input, Image output);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+    virtual bool prepare(int method, Image image, const Params& params);
+    virtual void release();
+
+  protected:
+    virtual bool execute();
+    virtual int getRadius(const Params& params) const;
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
+    bool prepareIntegralOpenCL();
+    bool executeIntegralOpenCL();
+
+    IntegralImage m_integral;
+
+    // The OpenCL integral image is built along the rows and then the
+    // columns of the table, after which the session kernel takes the mean
+    cl_kernel m_integralRows, m_integralColumns;
+    cl_mem m_deviceTable;
   };
 }
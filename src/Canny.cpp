@@ -0,0 +1,660 @@
+// Canny.cpp (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Canny.h"
+#include "opencl/canny.h"
+
+// Pixel labels after non-maximum suppression, as used by canny.cl
+#define LABEL_NONE 0
+#define LABEL_WEAK 1
+#define LABEL_EDGE 2
+
+namespace improsa
+{
+  struct SuppressArgs
+  {
+    const float *magnitude, *angle;
+    unsigned char *labels;
+    int width, height;
+    float low, high;
+  };
+
+  struct HysteresisArgs
+  {
+    unsigned char *labels;
+    int width, height;
+    int strips;
+    std::vector<int> *seeds;
+  };
+
+  struct EdgeArgs
+  {
+    const unsigned char *labels;
+    Image output;
+  };
+
+  static inline float gradientAt(const float *magnitude, int x, int y,
+                                 int width, int height)
+  {
+    if (x < 0 || x >= width || y < 0 || y >= height)
+    {
+      return 0.f;
+    }
+    return magnitude[x + y*width];
+  }
+
+  // Keep pixels whose magnitude is a maximum along the gradient direction,
+  // quantised to one of four neighbour pairs, and classify them with the
+  // thresholds. Ties go to the pixel further along the direction, so that
+  // plateaus give edges one pixel wide.
+  static inline unsigned char classifyPixel(const SuppressArgs *args,
+                                            int x, int y)
+  {
+    int w = args->width, h = args->height;
+    float a = args->angle[x + y*w];
+    a = a < 0.f ? a + (float)M_PI : a;
+    int dx = 1, dy = 0;
+    if (a >= M_PI/8 && a < 3*M_PI/8)
+    {
+      dy = 1;
+    }
+    else if (a >= 3*M_PI/8 && a < 5*M_PI/8)
+    {
+      dx = 0;
+      dy = 1;
+    }
+    else if (a >= 5*M_PI/8 && a < 7*M_PI/8)
+    {
+      dx = -1;
+      dy = 1;
+    }
+
+    float m = args->magnitude[x + y*w];
+    float m1 = gradientAt(args->magnitude, x+dx, y+dy, w, h);
+    float m2 = gradientAt(args->magnitude, x-dx, y-dy, w, h);
+    if (m > m1 && m >= m2 && m >= args->low)
+    {
+      return m >= args->high ? LABEL_EDGE : LABEL_WEAK;
+    }
+    return LABEL_NONE;
+  }
+
+  static void suppressRows(void *data, int begin, int end)
+  {
+    SuppressArgs *args = (SuppressArgs*)data;
+    for (int y = begin; y < end; y++)
+    {
+      for (int x = 0; x < args->width; x++)
+      {
+        args->labels[x + y*args->width] = classifyPixel(args, x, y);
+      }
+    }
+  }
+
+  static inline int stripBegin(const HysteresisArgs *args, int strip)
+  {
+    return (args->height * strip) / args->strips;
+  }
+
+  // Seed each strip of rows with its strong edges
+  static void seedStrips(void *data, int begin, int end)
+  {
+    HysteresisArgs *args = (HysteresisArgs*)data;
+    for (int s = begin; s < end; s++)
+    {
+      int first = stripBegin(args, s)*args->width;
+      int last = stripBegin(args, s+1)*args->width;
+      for (int p = first; p < last; p++)
+      {
+        if (args->labels[p] == LABEL_EDGE)
+        {
+          args->seeds[s].push_back(p);
+        }
+      }
+    }
+  }
+
+  // Flood fill from the seeds of each strip, promoting connected weak
+  // pixels to edges without leaving the strip
+  static void traceStrips(void *data, int begin, int end)
+  {
+    HysteresisArgs *args = (HysteresisArgs*)data;
+    int w = args->width;
+    for (int s = begin; s < end; s++)
+    {
+      int y0 = stripBegin(args, s), y1 = stripBegin(args, s+1);
+      std::vector<int>& stack = args->seeds[s];
+      while (!stack.empty())
+      {
+        int p = stack.back();
+        stack.pop_back();
+        args->labels[p] = LABEL_EDGE;
+
+        int x = p % w, y = p / w;
+        for (int j = -1; j <= 1; j++)
+        {
+          for (int i = -1; i <= 1; i++)
+          {
+            int _x = x+i, _y = y+j;
+            if (_x < 0 || _x >= w || _y < y0 || _y >= y1)
+            {
+              continue;
+            }
+            unsigned char *q = args->labels + _x + _y*w;
+            if (*q == LABEL_WEAK)
+            {
+              *q = LABEL_EDGE;
+              stack.push_back(_x + _y*w);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Seed weak pixels on the boundary rows of each strip which touch an
+  // edge in the neighbouring strip. Labels are only read here, so strips
+  // can be linked in parallel.
+  static void linkStrips(void *data, int begin, int end)
+  {
+    HysteresisArgs *args = (HysteresisArgs*)data;
+    int w = args->width;
+    for (int s = begin; s < end; s++)
+    {
+      // The first row touches the strip above, and the last the one below
+      int rows[2] = {stripBegin(args, s), stripBegin(args, s+1)-1};
+      int others[2] = {rows[0]-1, rows[1]+1};
+      for (int b = 0; b < 2; b++)
+      {
+        int y = rows[b], _y = others[b];
+        if (_y < 0 || _y >= args->height)
+        {
+          continue;
+        }
+        const unsigned char *row = args->labels + y*w;
+        const unsigned char *other = args->labels + _y*w;
+        for (int x = 0; x < w; x++)
+        {
+          if (row[x] != LABEL_WEAK)
+          {
+            continue;
+          }
+          for (int i = x > 0 ? x-1 : 0; i <= x+1 && i < w; i++)
+          {
+            if (other[i] == LABEL_EDGE)
+            {
+              args->seeds[s].push_back(x + y*w);
+              break;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  static void edgeRows(void *data, int begin, int end)
+  {
+    EdgeArgs *args = (EdgeArgs*)data;
+    Image output = args->output;
+    for (int y = begin; y < end; y++)
+    {
+      const unsigned char *labels = args->labels + y*output.width;
+      unsigned char *out = output.data + y*getRowPitch(output);
+      for (int x = 0; x < output.width; x++)
+      {
+        unsigned char value = labels[x] == LABEL_EDGE ? 255 : 0;
+        out[x*4 + 0] = value;
+        out[x*4 + 1] = value;
+        out[x*4 + 2] = value;
+        out[x*4 + 3] = 255;
+      }
+    }
+  }
+
+  // Hysteresis on the CPU splits the image into one strip of rows per
+  // thread. Strips are traced independently, and then weak pixels on strip
+  // boundaries which touch edges across them seed another round, until no
+  // edges cross a boundary.
+  static void traceEdges(unsigned char *labels, int width, int height,
+                         unsigned int threads)
+  {
+    int strips = threads < (unsigned int)height ? threads : height;
+    std::vector< std::vector<int> > seeds(strips);
+    HysteresisArgs args = {labels, width, height, strips, &seeds[0]};
+
+    parallelFor(strips, threads, seedStrips, &args);
+    bool linked;
+    do
+    {
+      parallelFor(strips, threads, traceStrips, &args);
+      parallelFor(strips, threads, linkStrips, &args);
+
+      linked = false;
+      for (int s = 0; s < strips; s++)
+      {
+        linked |= !seeds[s].empty();
+      }
+    } while (linked);
+  }
+
+  Canny::Canny() : Sobel()
+  {
+    m_name = "Canny";
+    m_labels = NULL;
+    m_suppressKernel = 0;
+    m_hysteresisKernel = 0;
+    m_outputKernel = 0;
+    m_deviceLabels = 0;
+    m_deviceChanged = 0;
+    m_passes = 0;
+  }
+
+  Canny::~Canny()
+  {
+    release();
+  }
+
+  bool Canny::checkThresholds(const Params& params) const
+  {
+    if (params.lowThreshold < 0.f ||
+        params.lowThreshold > params.highThreshold)
+    {
+      reportStatus("Invalid thresholds %g and %g",
+                   params.lowThreshold, params.highThreshold);
+      return false;
+    }
+    return true;
+  }
+
+  bool Canny::prepare(int method, Image image, const Params& params)
+  {
+    beginSession(method, image, params);
+    if (method != METHOD_CPU && method != METHOD_OPENCL)
+    {
+      return Filter::prepare(method, image, params);
+    }
+
+    if (!checkInterleaved(image, image) || !check8Bit(image, image) ||
+        !checkThresholds(params))
+    {
+      release();
+      return false;
+    }
+
+    if (method == METHOD_OPENCL)
+    {
+      if (params.buffers || params.coarsening > 1)
+      {
+        reportStatus("Only the image kernels are implemented for this "
+                     "filter.");
+        release();
+        return false;
+      }
+
+      // Suppression and hysteresis would cross the edges of the images
+      if (params.batch > 1)
+      {
+        reportStatus("Batches are not supported by the OpenCL kernels.");
+        release();
+        return false;
+      }
+
+      if (!prepareOpenCL())
+      {
+        return false;
+      }
+
+      reportStatus("Running OpenCL Canny kernels");
+      return true;
+    }
+
+    size_t pixels = image.width*image.height;
+    m_magnitude = (float*)allocateBuffer(pixels*sizeof(float));
+    m_angle = (float*)allocateBuffer(pixels*sizeof(float));
+    m_labels = (unsigned char*)allocateBuffer(pixels);
+
+    reportStatus("Running CPU filter with %d threads",
+                 getNumThreads(params.threads));
+    return true;
+  }
+
+  // The gradient kernel comes from the Sobel filter, and every stage
+  // stays on the device
+  bool Canny::prepareOpenCL()
+  {
+    getGradientTile(m_sessionParams, m_tile);
+    char options[128];
+    sprintf(options, "-cl-fast-relaxed-math -DTILE_X=%zu -DTILE_Y=%zu",
+            m_tile[0], m_tile[1]);
+    std::string source = std::string(getGradientSource()) + canny_kernel;
+    if (!initCL(m_sessionParams, source.c_str(), options))
+    {
+      release();
+      return false;
+    }
+
+    cl_int err;
+    m_kernel = clCreateKernel(m_program, "sobel_gradient", &err);
+    CHECK_ERROR_OCL(err, "creating gradient kernel",
+                    release(); return false);
+    m_suppressKernel = clCreateKernel(m_program, "canny_suppress", &err);
+    CHECK_ERROR_OCL(err, "creating suppression kernel",
+                    release(); return false);
+    m_hysteresisKernel = clCreateKernel(m_program, "canny_hysteresis", &err);
+    CHECK_ERROR_OCL(err, "creating hysteresis kernel",
+                    release(); return false);
+    m_outputKernel = clCreateKernel(m_program, "canny_output", &err);
+    CHECK_ERROR_OCL(err, "creating output kernel", release(); return false);
+
+    Image image = m_sessionImage;
+    cl_image_format format = getImageFormat(image);
+    m_deviceInput = clCreateImage2D(
+      m_context, CL_MEM_READ_ONLY, &format,
+      image.width, image.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating input image", release(); return false);
+
+    m_deviceOutput = clCreateImage2D(
+      m_context, CL_MEM_WRITE_ONLY, &format,
+      image.width, image.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating output image", release(); return false);
+
+    size_t pixels = image.width*image.height;
+    m_deviceMagnitude = clCreateBuffer(
+      m_context, CL_MEM_READ_WRITE, pixels*sizeof(cl_float), NULL, &err);
+    CHECK_ERROR_OCL(err, "creating magnitude buffer",
+                    release(); return false);
+
+    m_deviceAngle = clCreateBuffer(
+      m_context, CL_MEM_READ_WRITE, pixels*sizeof(cl_float), NULL, &err);
+    CHECK_ERROR_OCL(err, "creating angle buffer", release(); return false);
+
+    m_deviceLabels = clCreateBuffer(
+      m_context, CL_MEM_READ_WRITE, pixels, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating label buffer", release(); return false);
+
+    m_deviceChanged = clCreateBuffer(
+      m_context, CL_MEM_READ_WRITE, sizeof(cl_int), NULL, &err);
+    CHECK_ERROR_OCL(err, "creating flag buffer", release(); return false);
+
+    cl_int width = image.width, height = image.height;
+    cl_float low = m_sessionParams.lowThreshold;
+    cl_float high = m_sessionParams.highThreshold;
+    err  = clSetKernelArg(m_kernel, 0, sizeof(cl_mem), &m_deviceInput);
+    err |= clSetKernelArg(m_kernel, 1, sizeof(cl_mem), &m_deviceMagnitude);
+    err |= clSetKernelArg(m_kernel, 2, sizeof(cl_mem), &m_deviceAngle);
+    err |= clSetKernelArg(m_suppressKernel, 0, sizeof(cl_mem),
+                          &m_deviceMagnitude);
+    err |= clSetKernelArg(m_suppressKernel, 1, sizeof(cl_mem),
+                          &m_deviceAngle);
+    err |= clSetKernelArg(m_suppressKernel, 2, sizeof(cl_mem),
+                          &m_deviceLabels);
+    err |= clSetKernelArg(m_suppressKernel, 3, sizeof(cl_int), &width);
+    err |= clSetKernelArg(m_suppressKernel, 4, sizeof(cl_int), &height);
+    err |= clSetKernelArg(m_suppressKernel, 5, sizeof(cl_float), &low);
+    err |= clSetKernelArg(m_suppressKernel, 6, sizeof(cl_float), &high);
+    err |= clSetKernelArg(m_hysteresisKernel, 0, sizeof(cl_mem),
+                          &m_deviceLabels);
+    err |= clSetKernelArg(m_hysteresisKernel, 1, sizeof(cl_mem),
+                          &m_deviceChanged);
+    err |= clSetKernelArg(m_hysteresisKernel, 2, sizeof(cl_int), &width);
+    err |= clSetKernelArg(m_hysteresisKernel, 3, sizeof(cl_int), &height);
+    err |= clSetKernelArg(m_outputKernel, 0, sizeof(cl_mem),
+                          &m_deviceLabels);
+    err |= clSetKernelArg(m_outputKernel, 1, sizeof(cl_mem),
+                          &m_deviceOutput);
+    CHECK_ERROR_OCL(err, "setting kernel arguments",
+                    release(); return false);
+    return true;
+  }
+
+  void Canny::release()
+  {
+    releaseBuffer(m_labels);
+    m_labels = NULL;
+    if (m_suppressKernel)
+    {
+      clReleaseKernel(m_suppressKernel);
+      m_suppressKernel = 0;
+    }
+    if (m_hysteresisKernel)
+    {
+      clReleaseKernel(m_hysteresisKernel);
+      m_hysteresisKernel = 0;
+    }
+    if (m_outputKernel)
+    {
+      clReleaseKernel(m_outputKernel);
+      m_outputKernel = 0;
+    }
+    if (m_deviceLabels)
+    {
+      clReleaseMemObject(m_deviceLabels);
+      m_deviceLabels = 0;
+    }
+    if (m_deviceChanged)
+    {
+      clReleaseMemObject(m_deviceChanged);
+      m_deviceChanged = 0;
+    }
+    Sobel::release();
+  }
+
+  bool Canny::execute()
+  {
+    if (m_sessionMethod == METHOD_OPENCL)
+    {
+      return executeOpenCL();
+    }
+    if (m_sessionMethod != METHOD_CPU)
+    {
+      return Filter::execute();
+    }
+
+    unsigned int threads = getNumThreads(m_sessionParams.threads);
+    for (unsigned int b = 0; b < m_sessionParams.batch; b++)
+    {
+      Image input = getBatchImage(m_sessionInput, b);
+      Image output = getBatchImage(m_sessionOutput, b);
+      SuppressArgs suppressArgs =
+      {
+        m_magnitude, m_angle, m_labels,
+        (int)input.width, (int)input.height,
+        m_sessionParams.lowThreshold, m_sessionParams.highThreshold
+      };
+      EdgeArgs edgeArgs = {m_labels, output};
+
+      computeGradient(input, m_magnitude, m_angle, threads);
+      parallelFor(input.height, threads, suppressRows, &suppressArgs);
+      traceEdges(m_labels, input.width, input.height, threads);
+      parallelFor(output.height, threads, edgeRows, &edgeArgs);
+    }
+    return true;
+  }
+
+  bool Canny::executeOpenCL()
+  {
+    // Tiled kernels have their global size rounded up to whole tiles
+    const size_t global[2] = {m_sessionImage.width, m_sessionImage.height};
+    const size_t tiled[2] =
+    {
+      (global[0] + m_tile[0] - 1)/m_tile[0]*m_tile[0],
+      (global[1] + m_tile[1] - 1)/m_tile[1]*m_tile[1]
+    };
+
+    cl_int err = clEnqueueNDRangeKernel(
+      m_queue, m_kernel, 2, NULL, tiled, m_tile, 0, NULL, NULL);
+    err |= clEnqueueNDRangeKernel(
+      m_queue, m_suppressKernel, 2, NULL, global, NULL, 0, NULL, NULL);
+    CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+
+    // Hysteresis is repeated until no labels change, which is the only
+    // point at which the host waits for the device
+    const cl_int zero = 0;
+    cl_int changed;
+    m_passes = 0;
+    do
+    {
+      err = clEnqueueWriteBuffer(
+        m_queue, m_deviceChanged, CL_FALSE, 0, sizeof(cl_int), &zero,
+        0, NULL, NULL);
+      err |= clEnqueueNDRangeKernel(
+        m_queue, m_hysteresisKernel, 2, NULL, tiled, m_tile, 0, NULL, NULL);
+      err |= clEnqueueReadBuffer(
+        m_queue, m_deviceChanged, CL_TRUE, 0, sizeof(cl_int), &changed,
+        0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "running hysteresis", return false);
+      m_passes++;
+    } while (changed);
+
+    err = clEnqueueNDRangeKernel(
+      m_queue, m_outputKernel, 2, NULL, global, NULL, 0, NULL, NULL);
+    CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+    return true;
+  }
+
+  bool Canny::retrieve(bool blocking, cl_event *event)
+  {
+    if (m_sessionMethod == METHOD_OPENCL)
+    {
+      reportStatus("Finished OpenCL kernels (%d hysteresis passes)",
+                   m_passes);
+    }
+    return Filter::retrieve(blocking, event);
+  }
+
+  bool Canny::runCPU(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_CPU, input, output, params);
+  }
+
+  bool Canny::runHalideCPU(Image input, Image output, const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Canny::runHalideGPU(Image input, Image output, const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Canny::runOpenCL(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_OPENCL, input, output, params);
+  }
+
+  bool Canny::runReference(Image input, Image output, const Params& params)
+  {
+    // Check for cached result
+    if (m_reference.data)
+    {
+      copyImage(m_reference, output);
+      reportStatus("Finished reference (cached)");
+      return true;
+    }
+
+    reportStatus("Running reference");
+
+    int w = input.width, h = input.height;
+    float *magnitude = (float*)allocateBuffer(w*h*sizeof(float));
+    float *angle = (float*)allocateBuffer(w*h*sizeof(float));
+    for (int y = 0; y < h; y++)
+    {
+      for (int x = 0; x < w; x++)
+      {
+        float g_x, g_y;
+        referenceGradient(input, x, y, g_x, g_y);
+        magnitude[x + y*w] = sqrt(g_x*g_x + g_y*g_y);
+        angle[x + y*w] = atan2(g_y, g_x);
+      }
+    }
+
+    unsigned char *labels = (unsigned char*)allocateBuffer(w*h);
+    SuppressArgs args =
+    {
+      magnitude, angle, labels, w, h,
+      params.lowThreshold, params.highThreshold
+    };
+    std::vector<int> stack;
+    for (int y = 0; y < h; y++)
+    {
+      for (int x = 0; x < w; x++)
+      {
+        labels[x + y*w] = classifyPixel(&args, x, y);
+        if (labels[x + y*w] == LABEL_EDGE)
+        {
+          stack.push_back(x + y*w);
+        }
+      }
+    }
+
+    // Trace edges from strong pixels through connected weak pixels
+    while (!stack.empty())
+    {
+      int p = stack.back();
+      stack.pop_back();
+      for (int j = -1; j <= 1; j++)
+      {
+        for (int i = -1; i <= 1; i++)
+        {
+          int x = p%w + i, y = p/w + j;
+          if (x >= 0 && x < w && y >= 0 && y < h &&
+              labels[x + y*w] == LABEL_WEAK)
+          {
+            labels[x + y*w] = LABEL_EDGE;
+            stack.push_back(x + y*w);
+          }
+        }
+      }
+    }
+
+    for (int y = 0; y < output.height; y++)
+    {
+      for (int x = 0; x < output.width; x++)
+      {
+        float value = labels[x + y*w] == LABEL_EDGE ? 1.f : 0.f;
+        float pixel[4] = {value, value, value, 1.f};
+        setPixelRGBA(output, x, y, pixel);
+      }
+    }
+    releaseBuffer(magnitude);
+    releaseBuffer(angle);
+    releaseBuffer(labels);
+    reportStatus("Finished reference");
+
+    // Cache result
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
+
+  // Hysteresis depends on the whole image, so there is no per-pixel
+  // reference
+  bool Canny::referencePixel(Image input, int x, int y,
+                             const Params& params, float result[4])
+  {
+    return false;
+  }
+
+  // Rounding differences in the gradient can move a pixel across a
+  // threshold or a direction boundary, which may then add or remove a short
+  // run of edge pixels, so only the overall error is checked
+  bool Canny::verify(Image input, Image output, const Params& params,
+                     int tolerance)
+  {
+    return verifyApproximate(input, output, params, 30.0);
+  }
+}
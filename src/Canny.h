@@ -0,0 +1,52 @@
+// Canny.h (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "Sobel.h"
+
+namespace improsa
+{
+  // Edges are traced from the Sobel gradient by non-maximum suppression
+  // and hysteresis thresholding, giving white edges on black
+  class Canny : public Sobel
+  {
+  public:
+    Canny();
+    virtual ~Canny();
+
+    virtual bool runCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideGPU(Image input, Image output, const Params& params);
+    virtual bool runOpenCL(Image input, Image output, const Params& params);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+    virtual bool prepare(int method, Image image, const Params& params);
+    virtual void release();
+
+  protected:
+    virtual bool execute();
+    virtual bool retrieve(bool blocking, cl_event *event);
+    virtual bool verify(Image input, Image output, const Params& params,
+                        int tolerance=1);
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
+    bool checkThresholds(const Params& params) const;
+    bool prepareOpenCL();
+    bool executeOpenCL();
+
+    // Labels of one image, reused for each image of a batch with the
+    // gradient held by the Sobel filter
+    unsigned char *m_labels;
+
+    // The session kernel computes the gradient, which is then suppressed
+    // and traced on the device before the output kernel writes the edges
+    cl_kernel m_suppressKernel, m_hysteresisKernel, m_outputKernel;
+    cl_mem m_deviceLabels, m_deviceChanged;
+    int m_passes;
+  };
+}
@@ -0,0 +1,965 @@
+// ColourConvert.cpp (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ColourConvert.h"
+#include "opencl/colour_convert.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+// Segments of the Lab companding curve table, which is linearly
+// interpolated
+#define CURVE_SEGMENTS 1024
+
+namespace improsa
+{
+  static const char *CONVERSION_NAMES[] =
+  {
+    "NV12 to RGBA", "I420 to RGBA", "RGBA to NV12", "RGBA to I420",
+    "RGBA to Lab"
+  };
+
+  // sRGB primaries to XYZ, with the rows scaled by the D65 white point
+  static const float XYZ_MATRIX[3][3] =
+  {
+    {0.412453f/0.950456f, 0.357580f/0.950456f, 0.180423f/0.950456f},
+    {0.212671f,           0.715160f,           0.072169f},
+    {0.019334f/1.088754f, 0.119193f/1.088754f, 0.950227f/1.088754f},
+  };
+
+  // The planes of the YUV image, if any, and the input and output images
+  struct ConvertArgs
+  {
+    Image input, output;
+    YUVPlanes yuv;
+    const float *linear, *curve;
+  };
+
+  static inline unsigned char clampByte(int v)
+  {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+  }
+
+  /////////////////
+  // YUV -> RGBA //
+  /////////////////
+
+  static inline void yuvPixel(int y, int u, int v, unsigned char *out)
+  {
+    int c = 298*(y-16) + 128, d = u-128, e = v-128;
+    out[0] = clampByte((c + 409*e) >> 8);
+    out[1] = clampByte((c - 100*d - 208*e) >> 8);
+    out[2] = clampByte((c + 516*d) >> 8);
+    out[3] = 255;
+  }
+
+#if defined(__SSE2__)
+  // Pairs of 16-bit coefficients for _mm_madd_epi16
+  static inline __m128i coefficients(short a, short b)
+  {
+    return _mm_set1_epi32((unsigned short)a | ((int)b << 16));
+  }
+
+  // Four pixels, from (C,1) pairs of the luma terms and (D,E) pairs of the
+  // chroma terms, giving R, G and B as 32-bit values
+  static inline void yuvQuad(__m128i c1, __m128i de, __m128i rgb[3])
+  {
+    __m128i base = _mm_madd_epi16(c1, coefficients(298, 128));
+    rgb[0] = _mm_add_epi32(base, _mm_madd_epi16(de, coefficients(0, 409)));
+    rgb[1] = _mm_add_epi32(base,
+                           _mm_madd_epi16(de, coefficients(-100, -208)));
+    rgb[2] = _mm_add_epi32(base, _mm_madd_epi16(de, coefficients(516, 0)));
+    for (int c = 0; c < 3; c++)
+    {
+      rgb[c] = _mm_srai_epi32(rgb[c], 8);
+    }
+  }
+#elif defined(__ARM_NEON__)
+  static inline uint8x8_t narrowChannel(int32x4_t lo, int32x4_t hi)
+  {
+    return vqmovun_s16(vcombine_s16(vshrn_n_s32(lo, 8), vshrn_n_s32(hi, 8)));
+  }
+#endif
+
+  static void yuvToRGBARows(void *data, int begin, int end)
+  {
+    ConvertArgs *args = (ConvertArgs*)data;
+    Image rgba = args->output;
+    YUVPlanes yuv = args->yuv;
+    size_t pitch = getRowPitch(rgba);
+    int w = rgba.width, step = yuv.uvStep;
+    for (int y = begin; y < end; y++)
+    {
+      const unsigned char *lum = yuv.y + y*yuv.yPitch;
+      const unsigned char *u = yuv.u + (y/2)*yuv.uvPitch;
+      const unsigned char *v = yuv.v + (y/2)*yuv.uvPitch;
+      unsigned char *out = rgba.data + y*pitch;
+
+      int x = 0;
+#if defined(__SSE2__)
+      // Eight pixels at a time, sharing four chroma samples. The chroma
+      // samples are arranged as (U,V) pairs, each duplicated for the two
+      // pixels which share it.
+      __m128i zero = _mm_setzero_si128();
+      __m128i alpha = _mm_set1_epi8((char)255);
+      for (; x + 8 <= w; x += 8)
+      {
+        __m128i uv;
+        if (step == 2)
+        {
+          uv = _mm_loadl_epi64((const __m128i*)(u + x));
+        }
+        else
+        {
+          int us, vs;
+          memcpy(&us, u + x/2, 4);
+          memcpy(&vs, v + x/2, 4);
+          uv = _mm_unpacklo_epi8(_mm_cvtsi32_si128(us),
+                                 _mm_cvtsi32_si128(vs));
+        }
+        __m128i de = _mm_sub_epi16(_mm_unpacklo_epi8(uv, zero),
+                                   _mm_set1_epi16(128));
+        __m128i c = _mm_sub_epi16(
+          _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(lum + x)), zero),
+          _mm_set1_epi16(16));
+        __m128i one = _mm_set1_epi16(1);
+
+        __m128i lo[3], hi[3];
+        yuvQuad(_mm_unpacklo_epi16(c, one), _mm_unpacklo_epi32(de, de), lo);
+        yuvQuad(_mm_unpackhi_epi16(c, one), _mm_unpackhi_epi32(de, de), hi);
+        __m128i r = _mm_packs_epi32(lo[0], hi[0]);
+        __m128i g = _mm_packs_epi32(lo[1], hi[1]);
+        __m128i b = _mm_packs_epi32(lo[2], hi[2]);
+        __m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r),
+                                       _mm_packus_epi16(g, g));
+        __m128i ba = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), alpha);
+        _mm_storeu_si128((__m128i*)(out + x*4), _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i*)(out + x*4 + 16),
+                         _mm_unpackhi_epi16(rg, ba));
+      }
+#elif defined(__ARM_NEON__)
+      for (; x + 8 <= w; x += 8)
+      {
+        unsigned char us[8], vs[8];
+        for (int k = 0; k < 8; k++)
+        {
+          us[k] = u[(x+k)/2*step];
+          vs[k] = v[(x+k)/2*step];
+        }
+        int16x8_t c = vreinterpretq_s16_u16(
+          vsubl_u8(vld1_u8(lum + x), vdup_n_u8(16)));
+        int16x8_t d = vreinterpretq_s16_u16(
+          vsubl_u8(vld1_u8(us), vdup_n_u8(128)));
+        int16x8_t e = vreinterpretq_s16_u16(
+          vsubl_u8(vld1_u8(vs), vdup_n_u8(128)));
+
+        int32x4_t round = vdupq_n_s32(128);
+        int32x4_t baseLo = vmlal_n_s16(round, vget_low_s16(c), 298);
+        int32x4_t baseHi = vmlal_n_s16(round, vget_high_s16(c), 298);
+        uint8x8x4_t px;
+        px.val[0] = narrowChannel(
+          vmlal_n_s16(baseLo, vget_low_s16(e), 409),
+          vmlal_n_s16(baseHi, vget_high_s16(e), 409));
+        px.val[1] = narrowChannel(
+          vmlsl_n_s16(vmlsl_n_s16(baseLo, vget_low_s16(d), 100),
+                      vget_low_s16(e), 208),
+          vmlsl_n_s16(vmlsl_n_s16(baseHi, vget_high_s16(d), 100),
+                      vget_high_s16(e), 208));
+        px.val[2] = narrowChannel(
+          vmlal_n_s16(baseLo, vget_low_s16(d), 516),
+          vmlal_n_s16(baseHi, vget_high_s16(d), 516));
+        px.val[3] = vdup_n_u8(255);
+        vst4_u8(out + x*4, px);
+      }
+#endif
+      for (; x < w; x++)
+      {
+        yuvPixel(lum[x], u[x/2*step], v[x/2*step], out + x*4);
+      }
+    }
+  }
+
+  /////////////////
+  // RGBA -> YUV //
+  /////////////////
+
+  static inline unsigned char lumaPixel(const unsigned char *in)
+  {
+    return ((66*in[0] + 129*in[1] + 25*in[2] + 128) >> 8) + 16;
+  }
+
+  // Chroma of a 2x2 block, from the sums of its channel values
+  static inline unsigned char chromaU(int r, int g, int b)
+  {
+    return ((-38*r - 74*g + 112*b + 512) >> 10) + 128;
+  }
+
+  static inline unsigned char chromaV(int r, int g, int b)
+  {
+    return ((112*r - 94*g - 18*b + 512) >> 10) + 128;
+  }
+
+#if defined(__SSE2__)
+  // Eight interleaved pixels to R, G and B as 16-bit values
+  static inline void loadRGB(const unsigned char *in, __m128i rgb[3])
+  {
+    __m128i p0 = _mm_loadu_si128((const __m128i*)in);
+    __m128i p1 = _mm_loadu_si128((const __m128i*)(in + 16));
+    __m128i t0 = _mm_unpacklo_epi8(p0, p1);
+    __m128i t1 = _mm_unpackhi_epi8(p0, p1);
+    __m128i u0 = _mm_unpacklo_epi8(t0, t1);
+    __m128i u1 = _mm_unpackhi_epi8(t0, t1);
+    __m128i rg = _mm_unpacklo_epi8(u0, u1);
+    __m128i ba = _mm_unpackhi_epi8(u0, u1);
+    __m128i zero = _mm_setzero_si128();
+    rgb[0] = _mm_unpacklo_epi8(rg, zero);
+    rgb[1] = _mm_unpackhi_epi8(rg, zero);
+    rgb[2] = _mm_unpacklo_epi8(ba, zero);
+  }
+
+  // Luma of eight pixels, where the weighted sum fits in 16 unsigned bits
+  static inline __m128i lumaEight(const __m128i rgb[3])
+  {
+    __m128i sum = _mm_mullo_epi16(rgb[0], _mm_set1_epi16(66));
+    sum = _mm_add_epi16(sum, _mm_mullo_epi16(rgb[1], _mm_set1_epi16(129)));
+    sum = _mm_add_epi16(sum, _mm_mullo_epi16(rgb[2], _mm_set1_epi16(25)));
+    sum = _mm_add_epi16(sum, _mm_set1_epi16(128));
+    sum = _mm_add_epi16(_mm_srli_epi16(sum, 8), _mm_set1_epi16(16));
+    return _mm_packus_epi16(sum, sum);
+  }
+
+  // Chroma of four blocks from the sums of their two rows, where
+  // _mm_madd_epi16 adds each horizontal pair of pixels
+  static inline __m128i chromaFour(const __m128i sum[3], int r, int g, int b)
+  {
+    __m128i v = _mm_madd_epi16(sum[0], _mm_set1_epi16(r));
+    v = _mm_add_epi32(v, _mm_madd_epi16(sum[1], _mm_set1_epi16(g)));
+    v = _mm_add_epi32(v, _mm_madd_epi16(sum[2], _mm_set1_epi16(b)));
+    v = _mm_srai_epi32(_mm_add_epi32(v, _mm_set1_epi32(512)), 10);
+    return _mm_add_epi32(v, _mm_set1_epi32(128));
+  }
+#elif defined(__ARM_NEON__)
+  static inline uint8x8_t lumaEight(uint8x8x4_t px)
+  {
+    uint16x8_t sum = vmull_u8(px.val[0], vdup_n_u8(66));
+    sum = vmlal_u8(sum, px.val[1], vdup_n_u8(129));
+    sum = vmlal_u8(sum, px.val[2], vdup_n_u8(25));
+    sum = vaddq_u16(sum, vdupq_n_u16(128));
+    return vadd_u8(vshrn_n_u16(sum, 8), vdup_n_u8(16));
+  }
+
+  static inline int16x4_t chromaFour(const int32x4_t sum[3],
+                                     int r, int g, int b)
+  {
+    int32x4_t v = vmlaq_n_s32(vdupq_n_s32(512), sum[0], r);
+    v = vmlaq_n_s32(v, sum[1], g);
+    v = vmlaq_n_s32(v, sum[2], b);
+    v = vaddq_s32(vshrq_n_s32(v, 10), vdupq_n_s32(128));
+    return vmovn_s32(v);
+  }
+#endif
+
+  // Each step produces two rows of luma and one row of chroma. For odd
+  // dimensions, the last row and column are repeated in the chroma sums
+  // of the final blocks, matching the clamped reads of the reference.
+  static void rgbaToYUVRows(void *data, int begin, int end)
+  {
+    ConvertArgs *args = (ConvertArgs*)data;
+    Image rgba = args->input;
+    YUVPlanes yuv = args->yuv;
+    size_t pitch = getRowPitch(rgba);
+    int w = rgba.width, step = yuv.uvStep;
+    for (int j = begin; j < end; j++)
+    {
+      // A repeated row writes the same luma twice
+      int last = 2*j+1 < rgba.height ? 2*j+1 : 2*j;
+      const unsigned char *in[2] =
+      {
+        rgba.data + 2*j*pitch, rgba.data + last*pitch
+      };
+      unsigned char *lum[2] =
+      {
+        yuv.y + 2*j*yuv.yPitch, yuv.y + last*yuv.yPitch
+      };
+      unsigned char *u = yuv.u + j*yuv.uvPitch;
+      unsigned char *v = yuv.v + j*yuv.uvPitch;
+
+      int x = 0;
+#if defined(__SSE2__)
+      for (; x + 8 <= w; x += 8)
+      {
+        __m128i rgb[2][3], sum[3];
+        for (int r = 0; r < 2; r++)
+        {
+          loadRGB(in[r] + x*4, rgb[r]);
+          _mm_storel_epi64((__m128i*)(lum[r] + x), lumaEight(rgb[r]));
+        }
+        for (int c = 0; c < 3; c++)
+        {
+          sum[c] = _mm_add_epi16(rgb[0][c], rgb[1][c]);
+        }
+        __m128i cu = chromaFour(sum, -38, -74, 112);
+        __m128i cv = chromaFour(sum, 112, -94, -18);
+        if (step == 2)
+        {
+          __m128i uv = _mm_packs_epi32(_mm_unpacklo_epi32(cu, cv),
+                                       _mm_unpackhi_epi32(cu, cv));
+          _mm_storel_epi64((__m128i*)(u + x), _mm_packus_epi16(uv, uv));
+        }
+        else
+        {
+          __m128i uv = _mm_packs_epi32(cu, cv);
+          uv = _mm_packus_epi16(uv, uv);
+          int us = _mm_cvtsi128_si32(uv);
+          int vs = _mm_cvtsi128_si32(_mm_srli_si128(uv, 4));
+          memcpy(u + x/2, &us, 4);
+          memcpy(v + x/2, &vs, 4);
+        }
+      }
+#elif defined(__ARM_NEON__)
+      for (; x + 8 <= w; x += 8)
+      {
+        uint8x8x4_t px[2];
+        for (int r = 0; r < 2; r++)
+        {
+          px[r] = vld4_u8(in[r] + x*4);
+          vst1_u8(lum[r] + x, lumaEight(px[r]));
+        }
+        int32x4_t sum[3];
+        for (int c = 0; c < 3; c++)
+        {
+          sum[c] = vreinterpretq_s32_u32(
+            vpaddlq_u16(vaddl_u8(px[0].val[c], px[1].val[c])));
+        }
+        int16x4_t cu = chromaFour(sum, -38, -74, 112);
+        int16x4_t cv = chromaFour(sum, 112, -94, -18);
+        if (step == 2)
+        {
+          int16x4x2_t uv = vzip_s16(cu, cv);
+          vst1_u8(u + x, vqmovun_s16(vcombine_s16(uv.val[0], uv.val[1])));
+        }
+        else
+        {
+          unsigned char uv[8];
+          vst1_u8(uv, vqmovun_s16(vcombine_s16(cu, cv)));
+          memcpy(u + x/2, uv, 4);
+          memcpy(v + x/2, uv + 4, 4);
+        }
+      }
+#endif
+      for (; x < w; x += 2)
+      {
+        int next = x+1 < w ? 4 : 0;
+        int sum[3] = {0, 0, 0};
+        for (int r = 0; r < 2; r++)
+        {
+          const unsigned char *p = in[r] + x*4;
+          lum[r][x] = lumaPixel(p);
+          if (next)
+          {
+            lum[r][x+1] = lumaPixel(p + next);
+          }
+          for (int c = 0; c < 3; c++)
+          {
+            sum[c] += p[c] + p[c+next];
+          }
+        }
+        u[x/2*step] = chromaU(sum[0], sum[1], sum[2]);
+        v[x/2*step] = chromaV(sum[0], sum[1], sum[2]);
+      }
+    }
+  }
+
+  ////////////////
+  // RGB -> Lab //
+  ////////////////
+
+  // The curve table has a repeated final sample, so that t = 1 needs no
+  // special case
+  static inline float labCurve(const float *curve, float t)
+  {
+    t = t < 0.f ? 0.f : t > 1.f ? 1.f : t;
+    float position = t*CURVE_SEGMENTS;
+    int i = (int)position;
+    float f = position - i;
+    return curve[i] + f*(curve[i+1] - curve[i]);
+  }
+
+  static inline void labPixel(const ConvertArgs *args,
+                              const unsigned char *in, unsigned char *out)
+  {
+    float rgb[3], f[3];
+    for (int c = 0; c < 3; c++)
+    {
+      rgb[c] = args->linear[in[c]];
+    }
+    for (int i = 0; i < 3; i++)
+    {
+      f[i] = labCurve(args->curve, XYZ_MATRIX[i][0]*rgb[0] +
+                                   XYZ_MATRIX[i][1]*rgb[1] +
+                                   XYZ_MATRIX[i][2]*rgb[2]);
+    }
+    out[0] = clampByte((116.f*f[1] - 16.f)*2.55f + 0.5f);
+    out[1] = clampByte(500.f*(f[0] - f[1]) + 128.5f);
+    out[2] = clampByte(200.f*(f[1] - f[2]) + 128.5f);
+    out[3] = in[3];
+  }
+
+#if defined(__SSE2__)
+  // Four lookups, with the table samples gathered into registers directly
+  // (storing them to memory to reload as a vector stalls store forwarding)
+  static inline __m128 gather(const float *table, const int i[4], int offset)
+  {
+    return _mm_set_ps(table[i[3] + offset], table[i[2] + offset],
+                      table[i[1] + offset], table[i[0] + offset]);
+  }
+
+  static inline __m128 labCurve4(const float *curve, __m128 t)
+  {
+    t = _mm_min_ps(_mm_max_ps(t, _mm_setzero_ps()), _mm_set1_ps(1.f));
+    t = _mm_mul_ps(t, _mm_set1_ps(CURVE_SEGMENTS));
+    __m128i position = _mm_cvttps_epi32(t);
+    __m128 f = _mm_sub_ps(t, _mm_cvtepi32_ps(position));
+    int i[4];
+    _mm_storeu_si128((__m128i*)i, position);
+    __m128 lo = gather(curve, i, 0);
+    return _mm_add_ps(lo, _mm_mul_ps(f, _mm_sub_ps(gather(curve, i, 1), lo)));
+  }
+
+  // Four pixels, as (L,a,b,alpha) bytes
+  static inline void labQuad(const ConvertArgs *args,
+                             const unsigned char *in, unsigned char *out)
+  {
+    const float *linear = args->linear;
+    __m128 rgb[3], f[3];
+    for (int c = 0; c < 3; c++)
+    {
+      rgb[c] = _mm_set_ps(linear[in[12+c]], linear[in[8+c]],
+                          linear[in[4+c]], linear[in[c]]);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+      __m128 v = _mm_mul_ps(rgb[0], _mm_set1_ps(XYZ_MATRIX[i][0]));
+      v = _mm_add_ps(v, _mm_mul_ps(rgb[1], _mm_set1_ps(XYZ_MATRIX[i][1])));
+      v = _mm_add_ps(v, _mm_mul_ps(rgb[2], _mm_set1_ps(XYZ_MATRIX[i][2])));
+      f[i] = labCurve4(args->curve, v);
+    }
+
+    __m128i l = _mm_cvttps_epi32(
+      _mm_sub_ps(_mm_mul_ps(f[1], _mm_set1_ps(116.f*2.55f)),
+                 _mm_set1_ps(16.f*2.55f - 0.5f)));
+    __m128i a = _mm_cvttps_epi32(
+      _mm_add_ps(_mm_mul_ps(_mm_sub_ps(f[0], f[1]), _mm_set1_ps(500.f)),
+                 _mm_set1_ps(128.5f)));
+    __m128i b = _mm_cvttps_epi32(
+      _mm_add_ps(_mm_mul_ps(_mm_sub_ps(f[1], f[2]), _mm_set1_ps(200.f)),
+                 _mm_set1_ps(128.5f)));
+    __m128i alpha = _mm_set_epi32(in[15], in[11], in[7], in[3]);
+
+    // Pack to (L,b) and (a,alpha) bytes, then interleave into pixels
+    __m128i zero = _mm_setzero_si128();
+    __m128i lb = _mm_packus_epi16(_mm_packs_epi32(l, b), zero);
+    __m128i aa = _mm_packus_epi16(_mm_packs_epi32(a, alpha), zero);
+    __m128i pairs = _mm_unpacklo_epi8(lb, aa);
+    _mm_storeu_si128((__m128i*)out,
+                     _mm_unpacklo_epi16(pairs, _mm_srli_si128(pairs, 8)));
+  }
+#elif defined(__ARM_NEON__)
+  static inline float32x4_t gather(const float *table, const int i[4],
+                                    int offset)
+  {
+    float32x4_t v = vdupq_n_f32(table[i[0] + offset]);
+    v = vsetq_lane_f32(table[i[1] + offset], v, 1);
+    v = vsetq_lane_f32(table[i[2] + offset], v, 2);
+    return vsetq_lane_f32(table[i[3] + offset], v, 3);
+  }
+
+  static inline float32x4_t labCurve4(const float *curve, float32x4_t t)
+  {
+    t = vminq_f32(vmaxq_f32(t, vdupq_n_f32(0.f)), vdupq_n_f32(1.f));
+    t = vmulq_n_f32(t, CURVE_SEGMENTS);
+    int32x4_t position = vcvtq_s32_f32(t);
+    float32x4_t f = vsubq_f32(t, vcvtq_f32_s32(position));
+    int i[4];
+    vst1q_s32(i, position);
+    float32x4_t lo = gather(curve, i, 0);
+    return vmlaq_f32(lo, f, vsubq_f32(gather(curve, i, 1), lo));
+  }
+
+  static inline void labQuad(const ConvertArgs *args,
+                             const unsigned char *in, unsigned char *out)
+  {
+    const float *linear = args->linear;
+    float32x4_t rgb[3], f[3];
+    for (int c = 0; c < 3; c++)
+    {
+      int v[4] = {in[c], in[4+c], in[8+c], in[12+c]};
+      rgb[c] = gather(linear, v, 0);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+      float32x4_t v = vmulq_n_f32(rgb[0], XYZ_MATRIX[i][0]);
+      v = vmlaq_n_f32(v, rgb[1], XYZ_MATRIX[i][1]);
+      v = vmlaq_n_f32(v, rgb[2], XYZ_MATRIX[i][2]);
+      f[i] = labCurve4(args->curve, v);
+    }
+
+    int32x4_t l = vcvtq_s32_f32(
+      vsubq_f32(vmulq_n_f32(f[1], 116.f*2.55f),
+                vdupq_n_f32(16.f*2.55f - 0.5f)));
+    int32x4_t a = vcvtq_s32_f32(
+      vmlaq_n_f32(vdupq_n_f32(128.5f), vsubq_f32(f[0], f[1]), 500.f));
+    int32x4_t b = vcvtq_s32_f32(
+      vmlaq_n_f32(vdupq_n_f32(128.5f), vsubq_f32(f[1], f[2]), 200.f));
+    int32x4_t alpha = {in[3], in[7], in[11], in[15]};
+
+    // Pack to (L,a) and (b,alpha) bytes, then interleave into pixels
+    uint8x8_t la = vqmovun_s16(vcombine_s16(vqmovn_s32(l), vqmovn_s32(a)));
+    uint8x8_t ba = vqmovun_s16(vcombine_s16(vqmovn_s32(b),
+                                            vqmovn_s32(alpha)));
+    uint8x8x2_t zipped = vzip_u8(la, ba);
+    uint8x8x2_t pixels = vzip_u8(zipped.val[0], zipped.val[1]);
+    vst1_u8(out, pixels.val[0]);
+    vst1_u8(out + 8, pixels.val[1]);
+  }
+#endif
+
+  static void labRows(void *data, int begin, int end)
+  {
+    ConvertArgs *args = (ConvertArgs*)data;
+    Image input = args->input, output = args->output;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(output);
+    int w = input.width;
+    for (int y = begin; y < end; y++)
+    {
+      const unsigned char *in = input.data + y*inPitch;
+      unsigned char *out = output.data + y*outPitch;
+
+      int x = 0;
+#if defined(__SSE2__) || defined(__ARM_NEON__)
+      for (; x + 4 <= w; x += 4)
+      {
+        labQuad(args, in + x*4, out + x*4);
+      }
+#endif
+      for (; x < w; x++)
+      {
+        labPixel(args, in + x*4, out + x*4);
+      }
+    }
+  }
+
+  // sRGB companding, for values in [0,1]
+  static inline float linearize(float v)
+  {
+    return v <= 0.04045f ? v/12.92f : powf((v + 0.055f)/1.055f, 2.4f);
+  }
+
+  static inline float labFunction(float t)
+  {
+    return t > 0.008856f ? cbrtf(t) : 7.787f*t + 16.f/116.f;
+  }
+
+  ColourConvert::ColourConvert(int conversion) : Filter()
+  {
+    m_name = CONVERSION_NAMES[conversion];
+    m_conversion = conversion;
+
+    if (conversion == CONVERT_RGBA_TO_LAB)
+    {
+      m_linear.resize(256);
+      for (int v = 0; v < 256; v++)
+      {
+        m_linear[v] = linearize(v/255.f);
+      }
+      m_curve.resize(CURVE_SEGMENTS+2);
+      for (int i = 0; i <= CURVE_SEGMENTS; i++)
+      {
+        m_curve[i] = labFunction(i/(float)CURVE_SEGMENTS);
+      }
+      m_curve[CURVE_SEGMENTS+1] = m_curve[CURVE_SEGMENTS];
+    }
+  }
+
+  ColourConvert::~ColourConvert()
+  {
+    release();
+  }
+
+  int ColourConvert::getInputLayout(int layout) const
+  {
+    switch (m_conversion)
+    {
+      case CONVERT_NV12_TO_RGBA:
+        return LAYOUT_NV12;
+      case CONVERT_I420_TO_RGBA:
+        return LAYOUT_I420;
+      default:
+        return layout;
+    }
+  }
+
+  int ColourConvert::getOutputLayout(int layout) const
+  {
+    switch (m_conversion)
+    {
+      case CONVERT_NV12_TO_RGBA:
+      case CONVERT_I420_TO_RGBA:
+        return LAYOUT_INTERLEAVED;
+      case CONVERT_RGBA_TO_NV12:
+        return LAYOUT_NV12;
+      case CONVERT_RGBA_TO_I420:
+        return LAYOUT_I420;
+      default:
+        return layout;
+    }
+  }
+
+  bool ColourConvert::prepare(int method, Image image, const Params& params)
+  {
+    beginSession(method, image, params);
+    if (method != METHOD_CPU && method != METHOD_OPENCL)
+    {
+      return Filter::prepare(method, image, params);
+    }
+
+    // The RGBA side of the conversion must be interleaved
+    Image output = image;
+    output.layout = getOutputLayout(image.layout);
+    Image rgba = isYUV(image) ? output : image;
+    if (image.layout != getInputLayout(image.layout))
+    {
+      reportStatus("Input must be a %s image.",
+                   m_conversion == CONVERT_NV12_TO_RGBA ? "NV12" : "I420");
+      release();
+      return false;
+    }
+    if (!checkInterleaved(rgba, rgba) || !check8Bit(image, image))
+    {
+      release();
+      return false;
+    }
+
+    if (m_conversion != CONVERT_RGBA_TO_LAB && params.batch > 1)
+    {
+      reportStatus("Batches not supported for YUV images.");
+      release();
+      return false;
+    }
+
+    if (method == METHOD_OPENCL)
+    {
+      if (params.buffers || params.coarsening > 1)
+      {
+        reportStatus("Only the image kernel is implemented for this filter.");
+        release();
+        return false;
+      }
+
+      if (!prepareOpenCL(image))
+      {
+        return false;
+      }
+
+      reportStatus("Running OpenCL %s conversion", m_name);
+      return true;
+    }
+
+    reportStatus("Running CPU %s conversion with %d threads",
+                 m_name, getNumThreads(params.threads));
+    return true;
+  }
+
+  // The YUV side of the conversion is held in a tightly packed buffer, and
+  // the RGBA side in an image
+  bool ColourConvert::prepareOpenCL(Image image)
+  {
+    if (m_conversion == CONVERT_RGBA_TO_LAB)
+    {
+      cl_image_format format = {CL_RGBA, CL_UNORM_INT8};
+      return prepareKernel(colour_convert_kernel, "", "rgba_to_lab", format);
+    }
+
+    if (!initCL(m_sessionParams, colour_convert_kernel, ""))
+    {
+      release();
+      return false;
+    }
+
+    bool toRGBA = isYUV(image);
+    cl_int err;
+    m_kernel = clCreateKernel(m_program,
+                              toRGBA ? "yuv_to_rgba" : "rgba_to_yuv", &err);
+    CHECK_ERROR_OCL(err, "creating kernel", release(); return false);
+
+    Image yuv = image;
+    yuv.layout = toRGBA ? image.layout : getOutputLayout(image.layout);
+    yuv.stride = 0;
+    cl_mem *buffer = toRGBA ? &m_deviceInput : &m_deviceOutput;
+    *buffer = clCreateBuffer(
+      m_context, toRGBA ? CL_MEM_READ_ONLY : CL_MEM_WRITE_ONLY,
+      getImageSize(yuv), NULL, &err);
+    CHECK_ERROR_OCL(err, "creating YUV buffer", release(); return false);
+
+    cl_image_format format = {CL_RGBA, CL_UNSIGNED_INT8};
+    cl_mem *rgba = toRGBA ? &m_deviceOutput : &m_deviceInput;
+    *rgba = clCreateImage2D(
+      m_context, toRGBA ? CL_MEM_WRITE_ONLY : CL_MEM_READ_ONLY, &format,
+      image.width, image.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating RGBA image", release(); return false);
+
+    cl_int uvStep = yuv.layout == LAYOUT_NV12 ? 2 : 1;
+    err  = clSetKernelArg(m_kernel, 0, sizeof(cl_mem), &m_deviceInput);
+    err |= clSetKernelArg(m_kernel, 1, sizeof(cl_mem), &m_deviceOutput);
+    err |= clSetKernelArg(m_kernel, 2, sizeof(cl_int), &uvStep);
+    CHECK_ERROR_OCL(err, "setting kernel arguments", release(); return false);
+    return true;
+  }
+
+  // Each plane of a YUV image is transferred separately, since the host
+  // planes may be padded. The device planes are located by byte offset,
+  // since with odd dimensions a plane's offset need not be a multiple of
+  // its pitch.
+  bool ColourConvert::transferPlanes(Image image, cl_mem buffer, bool write,
+                                     bool blocking, cl_event *event)
+  {
+    YUVPlanes planes = getYUVPlanes(image);
+    size_t w = image.width, h = image.height;
+    size_t cw = (w+1)/2, ch = (h+1)/2;
+    unsigned char *host[3] = {planes.y, planes.u, planes.v};
+    size_t hostPitch[3] = {planes.yPitch, planes.uvPitch, planes.uvPitch};
+    size_t offset[3] = {0, w*h, w*h + cw*ch};
+    size_t pitch[3] = {w, cw*planes.uvStep, cw};
+    size_t rows[3] = {h, ch, ch};
+    int numPlanes = planes.uvStep == 2 ? 2 : 3;
+
+    for (int p = 0; p < numPlanes; p++)
+    {
+      cl_int err;
+      size_t hostOrigin[3] = {0, 0, 0};
+      size_t bufferOrigin[3] = {offset[p], 0, 0};
+      size_t region[3] = {pitch[p], rows[p], 1};
+      cl_bool block = blocking ? CL_TRUE : CL_FALSE;
+      if (write)
+      {
+        err = clEnqueueWriteBufferRect(
+          m_queue, buffer, block, bufferOrigin, hostOrigin, region,
+          pitch[p], 0, hostPitch[p], 0, host[p], 0, NULL, NULL);
+        CHECK_ERROR_OCL(err, "writing YUV data", return false);
+      }
+      else
+      {
+        err = clEnqueueReadBufferRect(
+          m_queue, buffer, block, bufferOrigin, hostOrigin, region,
+          pitch[p], 0, hostPitch[p], 0, host[p], 0, NULL,
+          p == numPlanes-1 ? event : NULL);
+        CHECK_ERROR_OCL(err, "reading YUV data", return false);
+      }
+    }
+    return true;
+  }
+
+  bool ColourConvert::bind(Image input, Image output, bool blocking)
+  {
+    if (m_sessionMethod != METHOD_OPENCL || !isYUV(input))
+    {
+      return Filter::bind(input, output, blocking);
+    }
+    m_sessionInput = input;
+    m_sessionOutput = output;
+    return transferPlanes(input, m_deviceInput, true, blocking, NULL);
+  }
+
+  bool ColourConvert::retrieve(bool blocking, cl_event *event)
+  {
+    if (m_sessionMethod != METHOD_OPENCL || !isYUV(m_sessionOutput))
+    {
+      return Filter::retrieve(blocking, event);
+    }
+    return transferPlanes(m_sessionOutput, m_deviceOutput, false,
+                          blocking, event);
+  }
+
+  bool ColourConvert::execute()
+  {
+    if (m_sessionMethod == METHOD_OPENCL &&
+        m_conversion != CONVERT_RGBA_TO_LAB)
+    {
+      // One work-item per 2x2 block, sharing a chroma sample
+      size_t global[2] =
+      {
+        (m_sessionImage.width+1)/2, (m_sessionImage.height+1)/2
+      };
+      const size_t *local = NULL;
+      if (m_sessionParams.wgsize[0] && m_sessionParams.wgsize[1])
+      {
+        local = m_sessionParams.wgsize;
+      }
+      cl_int err = clEnqueueNDRangeKernel(
+        m_queue, m_kernel, 2, NULL, global, local, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+      return true;
+    }
+    if (m_sessionMethod != METHOD_CPU)
+    {
+      return Filter::execute();
+    }
+
+    // Lab pixels are converted independently, so the images of a batch are
+    // processed as one
+    unsigned int threads = getNumThreads(m_sessionParams.threads);
+    ConvertArgs args;
+    args.input = m_sessionInput;
+    args.output = m_sessionOutput;
+    args.linear = args.curve = NULL;
+    if (m_conversion == CONVERT_RGBA_TO_LAB)
+    {
+      args.linear = &m_linear[0];
+      args.curve = &m_curve[0];
+      parallelFor(args.input.height, threads, labRows, &args);
+    }
+    else if (isYUV(args.input))
+    {
+      args.yuv = getYUVPlanes(args.input);
+      parallelFor(args.output.height, threads, yuvToRGBARows, &args);
+    }
+    else
+    {
+      args.yuv = getYUVPlanes(args.output);
+      parallelFor((args.input.height+1)/2, threads, rgbaToYUVRows, &args);
+    }
+    return true;
+  }
+
+  bool ColourConvert::runCPU(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_CPU, input, output, params);
+  }
+
+  bool ColourConvert::runHalideCPU(Image input, Image output,
+                                   const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool ColourConvert::runHalideGPU(Image input, Image output,
+                                   const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool ColourConvert::runOpenCL(Image input, Image output,
+                                const Params& params)
+  {
+    return benchmark(METHOD_OPENCL, input, output, params);
+  }
+
+  bool ColourConvert::runReference(Image input, Image output,
+                                   const Params& params)
+  {
+    // Check for cached result
+    if (m_reference.data)
+    {
+      copyImage(m_reference, output);
+      reportStatus("Finished reference (cached)");
+      return true;
+    }
+
+    reportStatus("Running reference");
+    for (int y = 0; y < output.height; y++)
+    {
+      for (int x = 0; x < output.width; x++)
+      {
+        float pixel[4];
+        referencePixel(input, x, y, params, pixel);
+        setPixelRGBA(output, x, y, pixel);
+      }
+    }
+    reportStatus("Finished reference");
+
+    // Cache result
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
+
+  // The YUV conversions use the same coefficients as the fixed-point
+  // kernels, in floating point, with chroma averaged over each 2x2 block.
+  // Values are rounded here, since pixel writes truncate.
+  bool ColourConvert::referencePixel(Image input, int x, int y,
+                                     const Params& params, float result[4])
+  {
+    float v[4];
+    for (int c = 0; c < 4; c++)
+    {
+      v[c] = getPixel(input, x, y, c)*255.f;
+    }
+
+    if (m_conversion == CONVERT_NV12_TO_RGBA ||
+        m_conversion == CONVERT_I420_TO_RGBA)
+    {
+      float c = 298.f*(v[0] - 16.f), d = v[1] - 128.f, e = v[2] - 128.f;
+      v[0] = (c + 409.f*e)/256.f;
+      v[1] = (c - 100.f*d - 208.f*e)/256.f;
+      v[2] = (c + 516.f*d)/256.f;
+    }
+    else if (m_conversion == CONVERT_RGBA_TO_LAB)
+    {
+      float rgb[3], f[3];
+      for (int c = 0; c < 3; c++)
+      {
+        rgb[c] = linearize(v[c]/255.f);
+      }
+      for (int i = 0; i < 3; i++)
+      {
+        f[i] = labFunction(XYZ_MATRIX[i][0]*rgb[0] +
+                           XYZ_MATRIX[i][1]*rgb[1] +
+                           XYZ_MATRIX[i][2]*rgb[2]);
+      }
+      v[0] = (116.f*f[1] - 16.f)*2.55f;
+      v[1] = 500.f*(f[0] - f[1]) + 128.f;
+      v[2] = 200.f*(f[1] - f[2]) + 128.f;
+    }
+    else
+    {
+      float sum[3] = {0, 0, 0};
+      for (int j = 0; j < 2; j++)
+      {
+        for (int i = 0; i < 2; i++)
+        {
+          for (int c = 0; c < 3; c++)
+          {
+            sum[c] += getPixel(input, (x&~1) + i, (y&~1) + j, c)*255.f;
+          }
+        }
+      }
+      v[0] = (66.f*v[0] + 129.f*v[1] + 25.f*v[2])/256.f + 16.f;
+      v[1] = (-38.f*sum[0] - 74.f*sum[1] + 112.f*sum[2])/1024.f + 128.f;
+      v[2] = (112.f*sum[0] - 94.f*sum[1] - 18.f*sum[2])/1024.f + 128.f;
+      v[3] = 255.f;
+    }
+
+    for (int c = 0; c < 3; c++)
+    {
+      result[c] = (v[c] + 0.5f)/255.f;
+    }
+    result[3] = v[3]/255.f;
+    return true;
+  }
+}
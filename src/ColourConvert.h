@@ -0,0 +1,67 @@
+// ColourConvert.h (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <vector>
+
+#include "Filter.h"
+
+namespace improsa
+{
+  enum
+  {
+    CONVERT_NV12_TO_RGBA = 0,
+    CONVERT_I420_TO_RGBA = 1,
+    CONVERT_RGBA_TO_NV12 = 2,
+    CONVERT_RGBA_TO_I420 = 3,
+    CONVERT_RGBA_TO_LAB  = 4,
+  };
+
+  // Conversions between RGBA images and YUV 4:2:0 camera frames, using
+  // BT.601 studio-swing coefficients in 8-bit fixed point, and from sRGB
+  // to CIE L*a*b* (D65 white point). Lab values are stored as L/100,
+  // (a+128)/255 and (b+128)/255 of the channel range, with alpha copied.
+  //
+  // The YUV conversions read or write the frame in the layout of the
+  // camera, replacing a separate conversion before or after filtering.
+  // They run as standalone filters, not fused into another filter's
+  // kernels. Each chroma sample is shared by a 2x2 block of pixels, with
+  // the blocks on the edges of odd-sized images holding fewer pixels.
+  class ColourConvert : public Filter
+  {
+  public:
+    ColourConvert(int conversion);
+    virtual ~ColourConvert();
+
+    virtual bool runCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideGPU(Image input, Image output, const Params& params);
+    virtual bool runOpenCL(Image input, Image output, const Params& params);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+    virtual int getInputLayout(int layout) const;
+    virtual int getOutputLayout(int layout) const;
+    virtual bool prepare(int method, Image image, const Params& params);
+
+  protected:
+    virtual bool bind(Image input, Image output, bool blocking);
+    virtual bool execute();
+    virtual bool retrieve(bool blocking, cl_event *event);
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
+    bool prepareOpenCL(Image image);
+    bool transferPlanes(Image image, cl_mem buffer, bool write,
+                        bool blocking, cl_event *event);
+
+    int m_conversion;
+
+    // Tables for Lab conversion of 8-bit pixels: linear values of each
+    // sRGB value, and samples of the Lab companding curve over [0,1]
+    std::vector<float> m_linear, m_curve;
+  };
+}
@@ -0,0 +1,603 @@
+// Convolution.cpp (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Convolution.h"
+#include "opencl/convolution.h"
+
+namespace improsa
+{
+  // Use a one-sided Jacobi SVD to determine whether the kernel has rank 1,
+  // and if so split it into row and column vectors
+  static bool separate(int width, int height, const float *kernel,
+                       float *row, float *column)
+  {
+    // Orthogonalise the columns of U=A, accumulating rotations in V
+    std::vector<double> U(kernel, kernel + width*height);
+    std::vector<double> V(width*width, 0.0);
+    for (int i = 0; i < width; i++)
+    {
+      V[i*width + i] = 1.0;
+    }
+
+    for (int sweep = 0; sweep < 32; sweep++)
+    {
+      bool converged = true;
+      for (int p = 0; p < width; p++)
+      {
+        for (int q = p+1; q < width; q++)
+        {
+          double alpha = 0, beta = 0, gamma = 0;
+          for (int y = 0; y < height; y++)
+          {
+            double up = U[y*width + p], uq = U[y*width + q];
+            alpha += up*up;
+            beta  += uq*uq;
+            gamma += up*uq;
+          }
+          if (fabs(gamma) <= 1e-12*sqrt(alpha*beta) || gamma == 0)
+          {
+            continue;
+          }
+          converged = false;
+
+          double zeta = (beta - alpha) / (2*gamma);
+          double t = (zeta >= 0 ? 1 : -1) / (fabs(zeta) + sqrt(1 + zeta*zeta));
+          double c = 1 / sqrt(1 + t*t);
+          double s = c*t;
+          for (int y = 0; y < height; y++)
+          {
+            double up = U[y*width + p], uq = U[y*width + q];
+            U[y*width + p] = c*up - s*uq;
+            U[y*width + q] = s*up + c*uq;
+          }
+          for (int x = 0; x < width; x++)
+          {
+            double vp = V[x*width + p], vq = V[x*width + q];
+            V[x*width + p] = c*vp - s*vq;
+            V[x*width + q] = s*vp + c*vq;
+          }
+        }
+      }
+      if (converged)
+      {
+        break;
+      }
+    }
+
+    // Singular values are the column norms of U
+    int first = -1;
+    double sigma[2] = {0, 0};
+    for (int k = 0; k < width; k++)
+    {
+      double norm = 0;
+      for (int y = 0; y < height; y++)
+      {
+        norm += U[y*width + k]*U[y*width + k];
+      }
+      norm = sqrt(norm);
+      if (norm > sigma[0])
+      {
+        sigma[1] = sigma[0];
+        sigma[0] = norm;
+        first = k;
+      }
+      else if (norm > sigma[1])
+      {
+        sigma[1] = norm;
+      }
+    }
+    if (first < 0 || sigma[1] > 1e-6*sigma[0])
+    {
+      return false;
+    }
+
+    // A = sigma*u*v^T, with sigma split evenly between the two vectors
+    double scale = sqrt(sigma[0]);
+    for (int y = 0; y < height; y++)
+    {
+      column[y] = U[y*width + first] / sigma[0] * scale;
+    }
+    for (int x = 0; x < width; x++)
+    {
+      row[x] = V[x*width + first] * scale;
+    }
+    return true;
+  }
+
+  struct ConvolutionArgs
+  {
+    Image input, output;
+    float *temp;
+    int width, height;
+    const float *kernel, *row, *column;
+  };
+
+  static inline int clampIndex(int i, int n)
+  {
+    return i < 0 ? 0 : i >= n ? n-1 : i;
+  }
+
+  static inline unsigned char toByte(float value)
+  {
+    return value < 0.f ? 0 : value > 255.f ? 255 : value;
+  }
+
+  static void convolve2D(void *data, int begin, int end)
+  {
+    ConvolutionArgs *args = (ConvolutionArgs*)data;
+    Image input = args->input;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(args->output);
+    int rx = args->width/2, ry = args->height/2;
+    for (int y = begin; y < end; y++)
+    {
+      for (int x = 0; x < input.width; x++)
+      {
+        float sum[3] = {0.f, 0.f, 0.f};
+        for (int j = 0; j < args->height; j++)
+        {
+          int _y = clampIndex(y+j-ry, input.height);
+          for (int i = 0; i < args->width; i++)
+          {
+            int _x = clampIndex(x+i-rx, input.width);
+            const unsigned char *pixel = input.data + _y*inPitch + _x*4;
+            float weight = args->kernel[j*args->width + i];
+            sum[0] += weight * pixel[0];
+            sum[1] += weight * pixel[1];
+            sum[2] += weight * pixel[2];
+          }
+        }
+        unsigned char *out = args->output.data + y*outPitch + x*4;
+        out[0] = toByte(sum[0]);
+        out[1] = toByte(sum[1]);
+        out[2] = toByte(sum[2]);
+        out[3] = input.data[y*inPitch + x*4 + 3];
+      }
+    }
+  }
+
+  static void convolveRows(void *data, int begin, int end)
+  {
+    ConvolutionArgs *args = (ConvolutionArgs*)data;
+    Image input = args->input;
+    size_t inPitch = getRowPitch(input);
+    int rx = args->width/2;
+    for (int y = begin; y < end; y++)
+    {
+      for (int x = 0; x < input.width; x++)
+      {
+        float *sum = args->temp + (x + y*input.width)*4;
+        sum[0] = sum[1] = sum[2] = 0.f;
+        for (int i = 0; i < args->width; i++)
+        {
+          int _x = clampIndex(x+i-rx, input.width);
+          const unsigned char *pixel = input.data + y*inPitch + _x*4;
+          sum[0] += args->row[i] * pixel[0];
+          sum[1] += args->row[i] * pixel[1];
+          sum[2] += args->row[i] * pixel[2];
+        }
+      }
+    }
+  }
+
+  static void convolveColumns(void *data, int begin, int end)
+  {
+    ConvolutionArgs *args = (ConvolutionArgs*)data;
+    Image input = args->input;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(args->output);
+    int ry = args->height/2;
+    for (int y = begin; y < end; y++)
+    {
+      for (int x = 0; x < input.width; x++)
+      {
+        float sum[3] = {0.f, 0.f, 0.f};
+        for (int j = 0; j < args->height; j++)
+        {
+          int _y = clampIndex(y+j-ry, input.height);
+          const float *pixel = args->temp + (x + _y*input.width)*4;
+          sum[0] += args->column[j] * pixel[0];
+          sum[1] += args->column[j] * pixel[1];
+          sum[2] += args->column[j] * pixel[2];
+        }
+        unsigned char *out = args->output.data + y*outPitch + x*4;
+        out[0] = toByte(sum[0]);
+        out[1] = toByte(sum[1]);
+        out[2] = toByte(sum[2]);
+        out[3] = input.data[y*inPitch + x*4 + 3];
+      }
+    }
+  }
+
+  static void convolve(ConvolutionArgs& args, unsigned int threads,
+                       bool separable)
+  {
+    int height = args.output.height;
+    if (separable)
+    {
+      parallelFor(height, threads, convolveRows, &args);
+      parallelFor(height, threads, convolveColumns, &args);
+    }
+    else
+    {
+      parallelFor(height, threads, convolve2D, &args);
+    }
+  }
+
+  Convolution::Convolution(const char *name) : Filter()
+  {
+    m_name = name;
+    m_weights = NULL;
+    m_row = NULL;
+    m_column = NULL;
+    m_temp = NULL;
+    m_columnKernel = 0;
+    m_deviceWeights = 0;
+    m_deviceColumn = 0;
+    m_deviceTemp = 0;
+
+    // Default to a 3x3 sharpening kernel, which is not separable and so
+    // measures the general 2D path
+    const float sharpen[9] =
+    {
+      -1, -1, -1,
+      -1,  9, -1,
+      -1, -1, -1,
+    };
+    setKernel(3, 3, sharpen);
+  }
+
+  Convolution::~Convolution()
+  {
+    release();
+    delete[] m_weights;
+    delete[] m_row;
+    delete[] m_column;
+  }
+
+  bool Convolution::setKernel(int width, int height, const float *values)
+  {
+    if (width <= 0 || height <= 0 || !(width & 1) || !(height & 1))
+    {
+      reportStatus("Convolution kernel dimensions must be odd");
+      return false;
+    }
+
+    delete[] m_weights;
+    delete[] m_row;
+    delete[] m_column;
+
+    m_width = width;
+    m_height = height;
+    m_weights = new float[width*height];
+    memcpy(m_weights, values, width*height*sizeof(float));
+    m_row = new float[width];
+    m_column = new float[height];
+    m_separable = separate(width, height, values, m_row, m_column);
+    m_radius = (width > height ? width : height) / 2;
+
+    clearReferenceCache();
+    return true;
+  }
+
+  bool Convolution::setGaussian(int radius, float sigma)
+  {
+    int size = 2*radius + 1;
+    std::vector<float> values(size*size);
+    float total = 0.f;
+    for (int j = -radius; j <= radius; j++)
+    {
+      for (int i = -radius; i <= radius; i++)
+      {
+        float weight = exp(-(i*i + j*j) / (2*sigma*sigma));
+        values[(j+radius)*size + (i+radius)] = weight;
+        total += weight;
+      }
+    }
+    for (int i = 0; i < size*size; i++)
+    {
+      values[i] /= total;
+    }
+    return setKernel(size, size, &values[0]);
+  }
+
+  bool Convolution::prepare(int method, Image image, const Params& params)
+  {
+    beginSession(method, image, params);
+    if (method != METHOD_CPU && method != METHOD_OPENCL)
+    {
+      return Filter::prepare(method, image, params);
+    }
+
+    if (!checkInterleaved(image, image))
+    {
+      release();
+      return false;
+    }
+
+    const char *type = m_separable ? "separable" : "non-separable";
+    if (method == METHOD_CPU)
+    {
+      if (!check8Bit(image, image))
+      {
+        release();
+        return false;
+      }
+
+      if (m_separable)
+      {
+        m_temp = (float*)allocateBuffer(
+          image.width*image.height*4*sizeof(float));
+      }
+
+      reportStatus("Running CPU %dx%d %s convolution with %d threads",
+                   m_width, m_height, type, getNumThreads(params.threads));
+      return true;
+    }
+
+    if (params.buffers || params.coarsening > 1)
+    {
+      reportStatus("Only the image kernels are implemented for this filter.");
+      release();
+      return false;
+    }
+
+    // Loop bounds are specialised for the kernel size
+    char options[128];
+    sprintf(options,
+            "-cl-fast-relaxed-math -DKERNEL_WIDTH=%d -DKERNEL_HEIGHT=%d",
+            m_width, m_height);
+    if (m_separable)
+    {
+      if (!prepareSeparableOpenCL(options))
+      {
+        return false;
+      }
+    }
+    else
+    {
+      if (!prepareKernel(convolution_kernel, options, "convolve",
+                         getImageFormat(image)))
+      {
+        return false;
+      }
+
+      cl_int err;
+      m_deviceWeights = clCreateBuffer(
+        m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        m_width*m_height*sizeof(float), m_weights, &err);
+      CHECK_ERROR_OCL(err, "creating weights buffer",
+                      release(); return false);
+
+      err = clSetKernelArg(Filter::m_kernel, 2, sizeof(cl_mem),
+                           &m_deviceWeights);
+      CHECK_ERROR_OCL(err, "setting kernel arguments",
+                      release(); return false);
+    }
+
+    reportStatus("Running OpenCL %dx%d %s convolution",
+                 m_width, m_height, type);
+    return true;
+  }
+
+  // The row kernel writes to a buffer rather than an image, so the
+  // session objects are created here instead of by prepareKernel()
+  bool Convolution::prepareSeparableOpenCL(const char *options)
+  {
+    // Kernels clamp reads to the rows of each image in a batch
+    char batchOptions[256];
+    if (m_sessionParams.batch > 1)
+    {
+      sprintf(batchOptions, "%s -DBATCH_HEIGHT=%zu", options,
+              m_sessionImage.height/m_sessionParams.batch);
+      options = batchOptions;
+    }
+    if (!initCL(m_sessionParams, convolution_kernel, options))
+    {
+      release();
+      return false;
+    }
+
+    cl_int err;
+    Image image = m_sessionImage;
+    cl_image_format format = getImageFormat(image);
+
+    Filter::m_kernel = clCreateKernel(m_program, "convolve_rows", &err);
+    CHECK_ERROR_OCL(err, "creating row kernel", release(); return false);
+    m_columnKernel = clCreateKernel(m_program, "convolve_columns", &err);
+    CHECK_ERROR_OCL(err, "creating column kernel", release(); return false);
+
+    m_deviceInput = clCreateImage2D(
+      m_context, CL_MEM_READ_ONLY, &format,
+      image.width, image.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating input image", release(); return false);
+
+    m_deviceOutput = clCreateImage2D(
+      m_context, CL_MEM_WRITE_ONLY, &format,
+      image.width, image.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating output image", release(); return false);
+
+    m_deviceTemp = clCreateBuffer(
+      m_context, CL_MEM_READ_WRITE,
+      image.width*image.height*4*sizeof(float), NULL, &err);
+    CHECK_ERROR_OCL(err, "creating temporary buffer",
+                    release(); return false);
+
+    m_deviceWeights = clCreateBuffer(
+      m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+      m_width*sizeof(float), m_row, &err);
+    CHECK_ERROR_OCL(err, "creating row weights buffer",
+                    release(); return false);
+
+    m_deviceColumn = clCreateBuffer(
+      m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+      m_height*sizeof(float), m_column, &err);
+    CHECK_ERROR_OCL(err, "creating column weights buffer",
+                    release(); return false);
+
+    cl_kernel rows = Filter::m_kernel;
+    err  = clSetKernelArg(rows, 0, sizeof(cl_mem), &m_deviceInput);
+    err |= clSetKernelArg(rows, 1, sizeof(cl_mem), &m_deviceTemp);
+    err |= clSetKernelArg(rows, 2, sizeof(cl_mem), &m_deviceWeights);
+    err |= clSetKernelArg(m_columnKernel, 0, sizeof(cl_mem), &m_deviceTemp);
+    err |= clSetKernelArg(m_columnKernel, 1, sizeof(cl_mem), &m_deviceOutput);
+    err |= clSetKernelArg(m_columnKernel, 2, sizeof(cl_mem), &m_deviceColumn);
+    CHECK_ERROR_OCL(err, "setting kernel arguments", release(); return false);
+    return true;
+  }
+
+  void Convolution::release()
+  {
+    releaseBuffer(m_temp);
+    m_temp = NULL;
+    if (m_columnKernel)
+    {
+      clReleaseKernel(m_columnKernel);
+      m_columnKernel = 0;
+    }
+    if (m_deviceWeights)
+    {
+      clReleaseMemObject(m_deviceWeights);
+      m_deviceWeights = 0;
+    }
+    if (m_deviceColumn)
+    {
+      clReleaseMemObject(m_deviceColumn);
+      m_deviceColumn = 0;
+    }
+    if (m_deviceTemp)
+    {
+      clReleaseMemObject(m_deviceTemp);
+      m_deviceTemp = 0;
+    }
+    Filter::release();
+  }
+
+  bool Convolution::execute()
+  {
+    if (m_sessionMethod == METHOD_OPENCL && m_columnKernel)
+    {
+      // Both passes have one work-item per pixel
+      const size_t global[2] = {m_sessionImage.width, m_sessionImage.height};
+      const size_t *local = NULL;
+      if (m_sessionParams.wgsize[0] && m_sessionParams.wgsize[1])
+      {
+        local = m_sessionParams.wgsize;
+      }
+
+      cl_int err = clEnqueueNDRangeKernel(
+        m_queue, Filter::m_kernel, 2, NULL, global, local, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+      err = clEnqueueNDRangeKernel(
+        m_queue, m_columnKernel, 2, NULL, global, local, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+      return true;
+    }
+    if (m_sessionMethod != METHOD_CPU)
+    {
+      return Filter::execute();
+    }
+
+    unsigned int threads = getNumThreads(m_sessionParams.threads);
+    for (unsigned int b = 0; b < m_sessionParams.batch; b++)
+    {
+      ConvolutionArgs args =
+      {
+        getBatchImage(m_sessionInput, b), getBatchImage(m_sessionOutput, b),
+        m_temp,
+        m_width, m_height, m_weights, m_row, m_column
+      };
+      convolve(args, threads, m_separable);
+    }
+    return true;
+  }
+
+  bool Convolution::runCPU(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_CPU, input, output, params);
+  }
+
+  bool Convolution::runHalideCPU(Image input, Image output,
+                                 const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Convolution::runHalideGPU(Image input, Image output,
+                                 const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Convolution::runOpenCL(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_OPENCL, input, output, params);
+  }
+
+  bool Convolution::runReference(Image input, Image output,
+                                 const Params& params)
+  {
+    // Check for cached result
+    if (m_reference.data)
+    {
+      copyImage(m_reference, output);
+      reportStatus("Finished reference (cached)");
+      return true;
+    }
+
+    reportStatus("Running reference");
+    for (int y = 0; y < output.height; y++)
+    {
+      for (int x = 0; x < output.width; x++)
+      {
+        float pixel[4];
+        referencePixel(input, x, y, params, pixel);
+        setPixelRGBA(output, x, y, pixel);
+      }
+#if SHOW_REFERENCE_PROGRESS == 1
+      reportStatus("Completed %.1f%% of reference", (100.f*y)/(input.height-1));
+#endif
+    }
+    reportStatus("Finished reference");
+
+    // Cache result
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
+
+  bool Convolution::referencePixel(Image input, int x, int y,
+                                   const Params& params, float result[4])
+  {
+    int rx = m_width/2, ry = m_height/2;
+    float r = 0;
+    float g = 0;
+    float b = 0;
+    for (int j = 0; j < m_height; j++)
+    {
+      for (int i = 0; i < m_width; i++)
+      {
+        float weight = m_weights[j*m_width + i];
+        r += getPixel(input, x+i-rx, y+j-ry, 0) * weight;
+        g += getPixel(input, x+i-rx, y+j-ry, 1) * weight;
+        b += getPixel(input, x+i-rx, y+j-ry, 2) * weight;
+      }
+    }
+    result[0] = r;
+    result[1] = g;
+    result[2] = b;
+    result[3] = getPixel(input, x, y, 3);
+    return true;
+  }
+}
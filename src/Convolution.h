@@ -0,0 +1,55 @@
+// Convolution.h (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "Filter.h"
+
+namespace improsa
+{
+  class Convolution : public Filter
+  {
+  public:
+    Convolution(const char *name="Convolution");
+    virtual ~Convolution();
+
+    // Kernel dimensions must be odd, with values stored in row-major order
+    bool setKernel(int width, int height, const float *values);
+    bool setGaussian(int radius, float sigma);
+
+    virtual bool runCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideGPU(Image input, Image output, const Params& params);
+    virtual bool runOpenCL(Image input, Image output, const Params& params);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+    // The convolution kernel is captured when the session is prepared
+    virtual bool prepare(int method, Image image, const Params& params);
+    virtual void release();
+
+  protected:
+    virtual bool execute();
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
+    bool prepareSeparableOpenCL(const char *options);
+
+    int m_width, m_height;
+    float *m_weights;
+
+    // Rank-1 decomposition (kernel[y][x] = column[y]*row[x])
+    bool m_separable;
+    float *m_row, *m_column;
+
+    // Rows filtered by the separable CPU path, for one image of a batch
+    float *m_temp;
+
+    // The separable OpenCL path runs the session kernel along the rows
+    // into a temporary buffer, and a second kernel along the columns
+    cl_kernel m_columnKernel;
+    cl_mem m_deviceWeights, m_deviceColumn, m_deviceTemp;
+  };
+}
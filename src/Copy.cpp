@@ -35,9 +35,12 @@ namespace improsa
   {
     cl_int err;
 
-    char options[64];
-    sprintf(options, "-cl-fast-relaxed-math -DWIDTH=%zu -DHEIGHT=%zu",
-            input.width, input.height);
+    // Buffer kernel moves whole pixels of the requested format
+    const char *pixelTypes[] = {"uchar4", "ushort4", "float4"};
+    char options[128];
+    sprintf(options,
+            "-cl-fast-relaxed-math -DWIDTH=%zu -DHEIGHT=%zu -DPIXEL=%s",
+            input.width, input.height, pixelTypes[input.format]);
     if (!initCL(params, copy_kernel, options))
     {
       return false;
@@ -50,6 +53,12 @@ namespace improsa
       "image_int",
     };
     size_t numKernels = sizeof(kernels)/sizeof(const char*);
+    if (input.format == PIXEL_F32)
+    {
+      // Float channels have no integer image equivalent
+      numKernels--;
+    }
+    size_t imageSize = getImageSize(input);
 
     // Get maximum memory allocation size
     cl_ulong maxAlloc;
@@ -59,7 +68,7 @@ namespace improsa
 
     // Compute maximum number of images we can allocate
     int numImages = params.iterations + 1;
-    size_t maxImages = floor((maxAlloc / (double)(input.width*input.height*4)));
+    size_t maxImages = floor((maxAlloc / (double)imageSize));
     if (params.iterations+1 > maxImages)
     {
       numImages = maxImages;
@@ -75,17 +84,22 @@ namespace improsa
       bool images = !strncmp(kernels[k], "image", 5);
       size_t origin[3] = {0, 0, 0};
       size_t region[3] = {input.width, input.height, 1};
+      size_t rowRegion[3] =
+      {
+        input.width*4*getChannelSize(input), input.height, 1
+      };
 
       kernel = clCreateKernel(m_program, kernels[k], &err);
       CHECK_ERROR_OCL(err, "creating kernel", return false);
 
       if (images)
       {
-        cl_image_format format =
+        cl_image_format format = getImageFormat(input);
+        if (k == 2)
         {
-          CL_RGBA,
-          k==1 ? CL_UNORM_INT8 : CL_UNSIGNED_INT8
-        };
+          format.image_channel_data_type =
+            input.format == PIXEL_U16 ? CL_UNSIGNED_INT16 : CL_UNSIGNED_INT8;
+        }
 
         d_input = clCreateImage3D(
           m_context, CL_MEM_READ_ONLY, &format,
@@ -102,7 +116,7 @@ namespace improsa
           origin[2] = i;
           err = clEnqueueWriteImage(
             m_queue, d_input, CL_TRUE,
-            origin, region, 0, 0, input.data, 0, NULL, NULL);
+            origin, region, getRowPitch(input), 0, input.data, 0, NULL, NULL);
           CHECK_ERROR_OCL(err, "writing image data", return false);
         }
         origin[2] = 0;
@@ -111,19 +125,21 @@ namespace improsa
       {
         d_input = clCreateBuffer(
           m_context, CL_MEM_READ_ONLY,
-          input.width*input.height*4*numImages, NULL, &err);
+          imageSize*numImages, NULL, &err);
         CHECK_ERROR_OCL(err, "creating input buffer", return false)
 
         d_output = clCreateBuffer(
           m_context, CL_MEM_WRITE_ONLY,
-          output.width*output.height*4, NULL, &err);
+          imageSize, NULL, &err);
         CHECK_ERROR_OCL(err, "creating output buffer", return false)
 
+        // Device buffers are tightly packed, while host rows may be padded
         for (int i = 0; i < numImages; i++)
         {
-          size_t offset = i*input.width*input.height*4;
-          err = clEnqueueWriteBuffer(
-            m_queue, d_input, CL_TRUE, offset, input.width*input.height*4,
+          size_t bufferOrigin[3] = {0, 0, (size_t)i};
+          err = clEnqueueWriteBufferRect(
+            m_queue, d_input, CL_TRUE, bufferOrigin, origin, rowRegion,
+            rowRegion[0], imageSize, getRowPitch(input), 0,
             input.data, 0, NULL, NULL);
           CHECK_ERROR_OCL(err, "writing buffer data", return false);
         }
@@ -147,7 +163,7 @@ namespace improsa
       cl_event *events = new cl_event[params.iterations+1];
       for (int i = 0; i < params.iterations + 1; i++)
       {
-        size_t offset[3] = {0, 0, i % numImages};
+        size_t offset[3] = {0, 0, (size_t)(i % numImages)};
         err = clEnqueueNDRangeKernel(
           m_queue, kernel, 3, offset, global, local, 0, NULL, events+i);
         CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
@@ -168,25 +184,26 @@ namespace improsa
       {
         err = clEnqueueReadImage(
           m_queue, d_output, CL_TRUE,
-          origin, region, 0, 0, output.data, 0, NULL, NULL);
+          origin, region, getRowPitch(output), 0, output.data, 0, NULL, NULL);
         CHECK_ERROR_OCL(err, "reading image data", return false);
       }
       else
       {
-        err = clEnqueueReadBuffer(
-          m_queue, d_output, CL_TRUE, 0, output.width*output.height*4,
+        err = clEnqueueReadBufferRect(
+          m_queue, d_output, CL_TRUE, origin, origin, rowRegion,
+          rowRegion[0], imageSize, getRowPitch(output), 0,
           output.data, 0, NULL, NULL);
         CHECK_ERROR_OCL(err, "writing buffer data", return false);
       }
 
       // Compute average bandwidth
-      double totalBytes = input.width*input.height*4*2*params.iterations;
+      double totalBytes = imageSize*2.0*params.iterations;
       double seconds = (m_endTime-m_startTime)*1e-6;
       double meanBandwidth = (totalBytes/seconds)*1e-9;
 
       // Compute max bandwidth
       cl_ulong start, end;
-      double bytes = input.width*input.height*4*2;
+      double bytes = imageSize*2.0;
       double maxBandwidth = meanBandwidth;
       for (int i = 0; i < params.iterations+1; i++)
       {
@@ -209,7 +226,7 @@ namespace improsa
 
       reportStatus("%12s: max %.1lf GB/s (%s, average %.1lf GB/s)",
                    kernels[k], maxBandwidth,
-                   verify(input, output) ? "passed" : "failed",
+                   verify(input, output, params) ? "passed" : "failed",
                    meanBandwidth);
 
       if (maxBandwidth > peakBandwidth)
@@ -224,17 +241,28 @@ namespace improsa
       delete[] local;
     }
 
-    reportStatus("Peak bandwidth was %.1lf GB/s with %s kernel",
-                 peakBandwidth, peakKernel);
+    reportStatus("Peak bandwidth was %.1lf GB/s with %s kernel (%s pixels)",
+                 peakBandwidth, peakKernel, getFormatName(input.format));
 
     releaseCL();
 
     return true;
   }
 
-  bool Copy::runReference(Image input, Image output)
+  bool Copy::runReference(Image input, Image output,
+                          const Params& params)
+  {
+    copyImage(input, output);
+    return true;
+  }
+
+  bool Copy::referencePixel(Image input, int x, int y,
+                            const Params& params, float result[4])
   {
-    memcpy(output.data, input.data, output.width*output.height*4);
+    for (int c = 0; c < 4; c++)
+    {
+      result[c] = getPixel(input, x, y, c);
+    }
     return true;
   }
 }
@@ -18,6 +18,11 @@ namespace improsa
     virtual bool runHalideCPU(Image input, Image output, const Params& params);
     virtual bool runHalideGPU(Image input, Image output, const Params& params);
     virtual bool runOpenCL(Image input, Image output, const Params& params);
-    virtual bool runReference(Image input, Image output);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+  protected:
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
   };
 }
@@ -0,0 +1,461 @@
+// Equalize.cpp (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Equalize.h"
+#include "opencl/equalize.h"
+
+// Bins in the histogram of each colour channel
+#define BINS 256
+
+// Work-groups building private histograms in the OpenCL kernel, which must
+// be a power of two for the reduction
+#define CL_GROUPS 64
+
+// Work-group size of the OpenCL histogram kernel, unless one is given
+#define CL_GROUP_SIZE 256
+
+namespace improsa
+{
+  struct EqualizeArgs
+  {
+    Image input, output;
+    unsigned int *histograms;
+    int chunks, stride;
+    const unsigned char *lut;
+  };
+
+  // Each chunk of rows is counted into the private histogram of its thread
+  static void histogramChunks(void *data, int begin, int end)
+  {
+    EqualizeArgs *args = (EqualizeArgs*)data;
+    Image input = args->input;
+    size_t pitch = getRowPitch(input);
+    int w = input.width, h = input.height;
+    for (int chunk = begin; chunk < end; chunk++)
+    {
+      unsigned int *hist = args->histograms + chunk*3*BINS;
+      memset(hist, 0, 3*BINS*sizeof(unsigned int));
+      int first = (h * (size_t)chunk) / args->chunks;
+      int last = (h * (size_t)(chunk+1)) / args->chunks;
+      for (int y = first; y < last; y++)
+      {
+        const unsigned char *in = input.data + y*pitch;
+        for (int x = 0; x < w; x++)
+        {
+          hist[in[x*4 + 0]]++;
+          hist[in[x*4 + 1] + BINS]++;
+          hist[in[x*4 + 2] + 2*BINS]++;
+        }
+      }
+    }
+  }
+
+  // One level of the tree reduction, adding each histogram stride places
+  // along into the one at the start of its pair
+  static void reduceHistograms(void *data, int begin, int end)
+  {
+    EqualizeArgs *args = (EqualizeArgs*)data;
+    for (int pair = begin; pair < end; pair++)
+    {
+      int a = pair*2*args->stride, b = a + args->stride;
+      if (b >= args->chunks)
+      {
+        continue;
+      }
+      unsigned int *dst = args->histograms + a*3*BINS;
+      const unsigned int *src = args->histograms + b*3*BINS;
+      for (int i = 0; i < 3*BINS; i++)
+      {
+        dst[i] += src[i];
+      }
+    }
+  }
+
+  static void equalizeRows(void *data, int begin, int end)
+  {
+    EqualizeArgs *args = (EqualizeArgs*)data;
+    Image input = args->input, output = args->output;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(output);
+    const unsigned char *lut = args->lut;
+    for (int y = begin; y < end; y++)
+    {
+      const unsigned char *in = input.data + y*inPitch;
+      unsigned char *out = output.data + y*outPitch;
+      for (int x = 0; x < input.width; x++)
+      {
+        out[x*4 + 0] = lut[in[x*4 + 0]];
+        out[x*4 + 1] = lut[in[x*4 + 1] + BINS];
+        out[x*4 + 2] = lut[in[x*4 + 2] + 2*BINS];
+        out[x*4 + 3] = in[x*4 + 3];
+      }
+    }
+  }
+
+  // The lowest occupied value maps to zero and the highest to 255. Images
+  // with a single value in a channel are left unchanged.
+  static void buildLUT(const unsigned int *hist, unsigned char *lut)
+  {
+    size_t total = 0, lowest = 0;
+    for (int v = 0; v < BINS; v++)
+    {
+      if (!total)
+      {
+        lowest = hist[v];
+      }
+      total += hist[v];
+    }
+
+    size_t cdf = 0, range = total - lowest;
+    for (int v = 0; v < BINS; v++)
+    {
+      cdf += hist[v];
+      if (!range)
+      {
+        lut[v] = v;
+      }
+      else
+      {
+        size_t above = cdf > lowest ? cdf - lowest : 0;
+        lut[v] = (above*(BINS-1) + range/2) / range;
+      }
+    }
+  }
+
+  Equalize::Equalize() : Filter()
+  {
+    m_name = "Equalize";
+    m_chunks = 0;
+    m_histogramKernel = 0;
+    m_reduceKernel = 0;
+    m_lutKernel = 0;
+    m_deviceHistograms = 0;
+    m_deviceLUT = 0;
+  }
+
+  Equalize::~Equalize()
+  {
+    release();
+  }
+
+  bool Equalize::prepare(int method, Image image, const Params& params)
+  {
+    beginSession(method, image, params);
+    if (method != METHOD_CPU && method != METHOD_OPENCL)
+    {
+      return Filter::prepare(method, image, params);
+    }
+
+    if (!checkInterleaved(image, image) || !check8Bit(image, image))
+    {
+      release();
+      return false;
+    }
+
+    if (method == METHOD_OPENCL)
+    {
+      if (params.buffers || params.coarsening > 1)
+      {
+        reportStatus("Only the image kernel is implemented for this filter.");
+        release();
+        return false;
+      }
+
+      if (!prepareOpenCL())
+      {
+        return false;
+      }
+
+      reportStatus("Running OpenCL histogram equalization with %d "
+                   "work-group histograms", CL_GROUPS);
+      return true;
+    }
+
+    // One chunk of rows per thread
+    unsigned int threads = getNumThreads(params.threads);
+    m_chunks = threads < image.height ? threads : image.height;
+    m_histograms.assign(m_chunks*3*BINS, 0);
+
+    reportStatus("Running CPU histogram equalization with %d threads",
+                 threads);
+    return true;
+  }
+
+  bool Equalize::prepareOpenCL()
+  {
+    cl_image_format format = {CL_RGBA, CL_UNSIGNED_INT8};
+    if (!prepareKernel(equalize_kernel, "", "equalize", format))
+    {
+      return false;
+    }
+
+    cl_int err;
+    m_histogramKernel = clCreateKernel(m_program, "histogram", &err);
+    CHECK_ERROR_OCL(err, "creating histogram kernel",
+                    release(); return false);
+    m_reduceKernel = clCreateKernel(m_program, "histogram_reduce", &err);
+    CHECK_ERROR_OCL(err, "creating reduce kernel", release(); return false);
+    m_lutKernel = clCreateKernel(m_program, "histogram_lut", &err);
+    CHECK_ERROR_OCL(err, "creating lookup kernel", release(); return false);
+
+    m_deviceHistograms = clCreateBuffer(
+      m_context, CL_MEM_READ_WRITE, CL_GROUPS*3*BINS*sizeof(cl_uint),
+      NULL, &err);
+    CHECK_ERROR_OCL(err, "creating histogram buffer",
+                    release(); return false);
+    m_deviceLUT = clCreateBuffer(
+      m_context, CL_MEM_READ_WRITE, 3*BINS, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating lookup buffer", release(); return false);
+
+    m_groupSize = CL_GROUP_SIZE;
+    if (m_sessionParams.wgsize[0] && m_sessionParams.wgsize[1])
+    {
+      m_groupSize = m_sessionParams.wgsize[0]*m_sessionParams.wgsize[1];
+    }
+
+    cl_int groups = CL_GROUPS;
+    err  = clSetKernelArg(m_histogramKernel, 0, sizeof(cl_mem),
+                          &m_deviceInput);
+    err |= clSetKernelArg(m_histogramKernel, 1, sizeof(cl_mem),
+                          &m_deviceHistograms);
+    err |= clSetKernelArg(m_reduceKernel, 0, sizeof(cl_mem),
+                          &m_deviceHistograms);
+    err |= clSetKernelArg(m_reduceKernel, 2, sizeof(cl_int), &groups);
+    err |= clSetKernelArg(m_lutKernel, 0, sizeof(cl_mem),
+                          &m_deviceHistograms);
+    err |= clSetKernelArg(m_lutKernel, 1, sizeof(cl_mem), &m_deviceLUT);
+    err |= clSetKernelArg(m_kernel, 2, sizeof(cl_mem), &m_deviceLUT);
+    CHECK_ERROR_OCL(err, "setting kernel arguments",
+                    release(); return false);
+    return true;
+  }
+
+  void Equalize::release()
+  {
+    m_histograms.clear();
+    m_chunks = 0;
+    if (m_histogramKernel)
+    {
+      clReleaseKernel(m_histogramKernel);
+      m_histogramKernel = 0;
+    }
+    if (m_reduceKernel)
+    {
+      clReleaseKernel(m_reduceKernel);
+      m_reduceKernel = 0;
+    }
+    if (m_lutKernel)
+    {
+      clReleaseKernel(m_lutKernel);
+      m_lutKernel = 0;
+    }
+    if (m_deviceHistograms)
+    {
+      clReleaseMemObject(m_deviceHistograms);
+      m_deviceHistograms = 0;
+    }
+    if (m_deviceLUT)
+    {
+      clReleaseMemObject(m_deviceLUT);
+      m_deviceLUT = 0;
+    }
+    Filter::release();
+  }
+
+  bool Equalize::getHistogram(unsigned int histogram[3][256])
+  {
+    if (m_sessionMethod == METHOD_OPENCL && m_deviceHistograms)
+    {
+      cl_int err = clEnqueueReadBuffer(
+        m_queue, m_deviceHistograms, CL_TRUE, 0, 3*BINS*sizeof(cl_uint),
+        histogram, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "reading histogram", return false);
+      return true;
+    }
+    if (m_histograms.empty())
+    {
+      return false;
+    }
+    memcpy(histogram, &m_histograms[0], 3*BINS*sizeof(unsigned int));
+    return true;
+  }
+
+  // Each image of a batch is equalized with its own histogram. The
+  // private histograms are merged by a tree reduction, with the pairs at
+  // each level added in parallel.
+  bool Equalize::execute()
+  {
+    if (m_sessionMethod == METHOD_OPENCL)
+    {
+      return executeOpenCL();
+    }
+    if (m_sessionMethod != METHOD_CPU)
+    {
+      return Filter::execute();
+    }
+
+    unsigned int threads = getNumThreads(m_sessionParams.threads);
+    unsigned char lut[3*BINS];
+    for (unsigned int b = 0; b < m_sessionParams.batch; b++)
+    {
+      EqualizeArgs args =
+      {
+        getBatchImage(m_sessionInput, b), getBatchImage(m_sessionOutput, b),
+        &m_histograms[0], (int)m_chunks, 0, lut
+      };
+      parallelFor(m_chunks, threads, histogramChunks, &args);
+      for (args.stride = 1; args.stride < m_chunks; args.stride *= 2)
+      {
+        int pairs = (m_chunks + 2*args.stride-1) / (2*args.stride);
+        parallelFor(pairs, threads, reduceHistograms, &args);
+      }
+
+      for (int c = 0; c < 3; c++)
+      {
+        buildLUT(&m_histograms[c*BINS], lut + c*BINS);
+      }
+      parallelFor(args.input.height, threads, equalizeRows, &args);
+    }
+    return true;
+  }
+
+  bool Equalize::executeOpenCL()
+  {
+    cl_int err;
+    size_t height = m_sessionImage.height/m_sessionParams.batch;
+    const size_t *local = NULL;
+    if (m_sessionParams.wgsize[0] && m_sessionParams.wgsize[1])
+    {
+      local = m_sessionParams.wgsize;
+    }
+
+    for (unsigned int b = 0; b < m_sessionParams.batch; b++)
+    {
+      cl_int y0 = b*height, rows = height;
+      err  = clSetKernelArg(m_histogramKernel, 2, sizeof(cl_int), &y0);
+      err |= clSetKernelArg(m_histogramKernel, 3, sizeof(cl_int), &rows);
+      CHECK_ERROR_OCL(err, "setting histogram arguments", return false);
+
+      size_t global = CL_GROUPS*m_groupSize;
+      err = clEnqueueNDRangeKernel(
+        m_queue, m_histogramKernel, 1, NULL, &global, &m_groupSize,
+        0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "enqueuing histogram kernel", return false);
+
+      for (cl_int stride = 1; stride < CL_GROUPS; stride *= 2)
+      {
+        err = clSetKernelArg(m_reduceKernel, 1, sizeof(cl_int), &stride);
+        CHECK_ERROR_OCL(err, "setting reduce arguments", return false);
+
+        size_t pairs = (CL_GROUPS + 2*stride-1) / (2*stride);
+        global = pairs*3*BINS;
+        err = clEnqueueNDRangeKernel(
+          m_queue, m_reduceKernel, 1, NULL, &global, NULL, 0, NULL, NULL);
+        CHECK_ERROR_OCL(err, "enqueuing reduce kernel", return false);
+      }
+
+      global = 3*BINS;
+      err = clEnqueueNDRangeKernel(
+        m_queue, m_lutKernel, 1, NULL, &global, NULL, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "enqueuing lookup kernel", return false);
+
+      size_t offset[2] = {0, b*height};
+      size_t size[2] = {m_sessionImage.width, height};
+      err = clEnqueueNDRangeKernel(
+        m_queue, m_kernel, 2, offset, size, local, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+    }
+    return true;
+  }
+
+  bool Equalize::runCPU(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_CPU, input, output, params);
+  }
+
+  bool Equalize::runHalideCPU(Image input, Image output,
+                              const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Equalize::runHalideGPU(Image input, Image output,
+                              const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Equalize::runOpenCL(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_OPENCL, input, output, params);
+  }
+
+  // Values are quantised to the histogram bins, so the reference has no
+  // per-pixel form and is always computed for the whole image
+  bool Equalize::runReference(Image input, Image output,
+                              const Params& params)
+  {
+    // Check for cached result
+    if (m_reference.data)
+    {
+      copyImage(m_reference, output);
+      reportStatus("Finished reference (cached)");
+      return true;
+    }
+
+    reportStatus("Running reference");
+    unsigned int hist[3*BINS] = {0};
+    for (int y = 0; y < input.height; y++)
+    {
+      for (int x = 0; x < input.width; x++)
+      {
+        for (int c = 0; c < 3; c++)
+        {
+          int v = getPixel(input, x, y, c)*(BINS-1) + 0.5f;
+          v = v < 0 ? 0 : v >= BINS ? BINS-1 : v;
+          hist[c*BINS + v]++;
+        }
+      }
+    }
+
+    unsigned char lut[3*BINS];
+    for (int c = 0; c < 3; c++)
+    {
+      buildLUT(hist + c*BINS, lut + c*BINS);
+    }
+
+    for (int y = 0; y < output.height; y++)
+    {
+      for (int x = 0; x < output.width; x++)
+      {
+        float pixel[4];
+        for (int c = 0; c < 3; c++)
+        {
+          int v = getPixel(input, x, y, c)*(BINS-1) + 0.5f;
+          v = v < 0 ? 0 : v >= BINS ? BINS-1 : v;
+          pixel[c] = lut[c*BINS + v] / (float)(BINS-1);
+        }
+        pixel[3] = getPixel(input, x, y, 3);
+        setPixelRGBA(output, x, y, pixel);
+      }
+    }
+    reportStatus("Finished reference");
+
+    // Cache result
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
+}
@@ -0,0 +1,53 @@
+// Equalize.h (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <vector>
+
+#include "Filter.h"
+
+namespace improsa
+{
+  // Histogram equalization of each colour channel, which maps values
+  // through the normalised cumulative histogram of the image so that they
+  // are spread evenly over the range. Alpha is copied.
+  class Equalize : public Filter
+  {
+  public:
+    Equalize();
+    virtual ~Equalize();
+
+    virtual bool runCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideGPU(Image input, Image output, const Params& params);
+    virtual bool runOpenCL(Image input, Image output, const Params& params);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+    virtual bool prepare(int method, Image image, const Params& params);
+    virtual void release();
+
+    // Histogram of the last image processed by the current session
+    bool getHistogram(unsigned int histogram[3][256]);
+
+  protected:
+    virtual bool execute();
+    bool prepareOpenCL();
+    bool executeOpenCL();
+
+    // Private histograms of each CPU thread, of which the first holds the
+    // merged histogram once they are reduced
+    std::vector<unsigned int> m_histograms;
+    unsigned int m_chunks;
+
+    // Private histograms of each work-group, and the lookup tables built
+    // from the merged histogram
+    cl_kernel m_histogramKernel, m_reduceKernel, m_lutKernel;
+    cl_mem m_deviceHistograms, m_deviceLUT;
+    size_t m_groupSize;
+  };
+}
@@ -9,23 +9,48 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <map>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "Filter.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+// Default pixels produced by each work-item of a buffer kernel
+#define BUFFER_PIXELS 4
+
+// Coarsening factors timed with Params::tuneCoarsening
+static const unsigned int COARSENING[] = {1, 2, 4, 8, 16};
+
 namespace improsa
 {
   Filter::Filter()
   {
     m_statusCallback = NULL;
+    m_radius = 0;
     m_context = 0;
     m_queue = 0;
     m_program = 0;
     m_reference.data = NULL;
+    m_sessionMethod = 0;
+    m_kernel = 0;
+    m_deviceInput = 0;
+    m_deviceOutput = 0;
+    m_deviceBuffers = false;
+    m_itemPixels[0] = m_itemPixels[1] = 1;
   }
 
   Filter::~Filter()
   {
+    release();
     clearReferenceCache();
   }
 
@@ -33,22 +58,46 @@ namespace improsa
   {
     if (m_reference.data)
     {
-      delete[] m_reference.data;
+      releaseBuffer(m_reference.data);
       m_reference.data = NULL;
     }
   }
 
+  bool Filter::runCPU(Image input, Image output, const Params& params)
+  {
+    reportStatus("CPU implementation not available for this filter.");
+    return false;
+  }
+
   const char* Filter::getName() const
   {
     return m_name;
   }
 
-  bool Filter::initCL(const Params& params,
-                      const char *source, const char *options)
+  int Filter::getRadius(const Params& params) const
   {
-    // Ensure no existing context
-    releaseCL();
+    return m_radius;
+  }
+
+  void Filter::getOutputSize(const Params& params, size_t width,
+                             size_t height, size_t size[2]) const
+  {
+    size[0] = width;
+    size[1] = height;
+  }
+
+  int Filter::getInputLayout(int layout) const
+  {
+    return layout;
+  }
+
+  int Filter::getOutputLayout(int layout) const
+  {
+    return layout;
+  }
 
+  bool Filter::selectDevice(const Params& params, cl_device_id *device)
+  {
     cl_int err;
     cl_uint numPlatforms, numDevices;
 
@@ -73,7 +122,69 @@ namespace improsa
         params.deviceIndex, numDevices);
       return false;
     }
-    m_device = devices[params.deviceIndex];
+    *device = devices[params.deviceIndex];
+    return true;
+  }
+
+  bool Filter::checkDeviceExtension(const Params& params,
+                                    const char *extension)
+  {
+    cl_device_id device;
+    if (!selectDevice(params, &device))
+    {
+      return false;
+    }
+
+    size_t size;
+    cl_int err = clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, NULL, &size);
+    CHECK_ERROR_OCL(err, "getting device extensions", return false);
+    std::vector<char> extensions(size+1, 0);
+    clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, size, &extensions[0], NULL);
+
+    // Extension names are separated by spaces
+    std::string list = std::string(" ") + &extensions[0] + " ";
+    if (list.find(std::string(" ") + extension + " ") == std::string::npos)
+    {
+      reportStatus("Device does not support %s", extension);
+      return false;
+    }
+    return true;
+  }
+
+  // Half-precision kernels are only written for images, and need a device
+  // with the cl_khr_fp16 extension
+  bool Filter::checkHalfKernel(const Params& params)
+  {
+    if (params.fixedPoint || params.buffers || params.coarsening > 1)
+    {
+      reportStatus("Half precision is only implemented for image kernels.");
+      return false;
+    }
+    return checkDeviceExtension(params, "cl_khr_fp16");
+  }
+
+  // 64-bit FNV-1a hash
+  static unsigned long long hashString(const char *str)
+  {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (; *str; str++)
+    {
+      hash = (hash ^ (unsigned char)*str) * 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  bool Filter::initCL(const Params& params,
+                      const char *source, const char *options)
+  {
+    // Ensure no existing context
+    releaseCL();
+
+    cl_int err;
+    if (!selectDevice(params, &m_device))
+    {
+      return false;
+    }
 
     char name[64];
     clGetDeviceInfo(m_device, CL_DEVICE_NAME, 64, name, NULL);
@@ -86,8 +197,28 @@ namespace improsa
                                    CL_QUEUE_PROFILING_ENABLE, &err);
     CHECK_ERROR_OCL(err, "creating command queue", return false);
 
-    m_program = clCreateProgramWithSource(m_context, 1, &source, NULL, &err);
-    CHECK_ERROR_OCL(err, "creating program", return false);
+    // Programs specialised with build options are only compiled once per
+    // device, after which the binary is reused. Filters build several
+    // programs with the same options, so the source is part of the key.
+    char sourceHash[32];
+    sprintf(sourceHash, "%016llx", hashString(source));
+    std::string key = std::string(name) + "|" + sourceHash + "|" +
+                      (options ? options : "");
+    bool cached = m_programCache.count(key);
+    if (cached)
+    {
+      std::vector<unsigned char>& binary = m_programCache[key];
+      const unsigned char *data = &binary[0];
+      size_t size = binary.size();
+      m_program = clCreateProgramWithBinary(
+        m_context, 1, &m_device, &size, &data, NULL, &err);
+      CHECK_ERROR_OCL(err, "creating program from binary", return false);
+    }
+    else
+    {
+      m_program = clCreateProgramWithSource(m_context, 1, &source, NULL, &err);
+      CHECK_ERROR_OCL(err, "creating program", return false);
+    }
 
     err = clBuildProgram(m_program, 1, &m_device, options, NULL, NULL);
     if (err == CL_BUILD_PROGRAM_FAILURE)
@@ -103,6 +234,24 @@ namespace improsa
     }
     CHECK_ERROR_OCL(err, "building program", return false);
 
+    if (!cached)
+    {
+      size_t size;
+      err = clGetProgramInfo(m_program, CL_PROGRAM_BINARY_SIZES,
+                             sizeof(size_t), &size, NULL);
+      if (err == CL_SUCCESS && size > 0)
+      {
+        std::vector<unsigned char> binary(size);
+        unsigned char *data = &binary[0];
+        err = clGetProgramInfo(m_program, CL_PROGRAM_BINARIES,
+                               sizeof(unsigned char*), &data, NULL);
+        if (err == CL_SUCCESS)
+        {
+          m_programCache[key] = binary;
+        }
+      }
+    }
+
     reportStatus("OpenCL context initialised.");
     return true;
   }
@@ -114,7 +263,7 @@ namespace improsa
     const char *verifyStr = "";
     if (params.verify)
     {
-      success = verify(input, output);
+      success = verify(input, output, params);
       if (success)
       {
         verifyStr = "(verification passed)";
@@ -136,158 +285,1646 @@ namespace improsa
     sprintf(fmt, "Finished in %%.%dlf ms %%s", dp<0 ? 0 : dp);
     reportStatus(fmt, runtime, verifyStr);
 
+    // Effective bandwidth, counting one read of the input and one write of
+    // the output per iteration
+    double bytes = getImageSize(input) + getImageSize(output);
+    reportStatus("Effective bandwidth %.2lf GB/s (%s pixels)",
+                 bytes/(runtime*1e6), getFormatName(input.format));
+
     return success;
   }
 
-  void Filter::releaseCL()
+  bool Filter::prepare(int method, Image image, const Params& params)
   {
-    if (m_program)
-    {
-      clReleaseProgram(m_program);
-      m_program = 0;
-    }
-    if (m_queue)
-    {
-      clReleaseCommandQueue(m_queue);
-      m_queue = 0;
-    }
-    if (m_context)
+    release();
+    reportStatus("Sessions not supported for this method.");
+    return false;
+  }
+
+  bool Filter::process(Image input, Image output)
+  {
+    if (!checkSession(input, output))
     {
-      clReleaseContext(m_context);
-      m_context = 0;
+      return false;
     }
+    return bind(input, output, true) && execute() && retrieve(true, NULL);
   }
 
-  void Filter::reportStatus(const char *format, ...) const
+  bool Filter::submit(Image input, Image output, cl_event *event)
   {
-    if (m_statusCallback)
+    *event = NULL;
+    if (!checkSession(input, output))
     {
-      va_list args;
-      va_start(args, format);
-      m_statusCallback(format, args);
-      va_end(args);
+      return false;
     }
+    return bind(input, output, false) && execute() && retrieve(false, event);
   }
 
-  void Filter::setStatusCallback(int (*callback)(const char*, va_list args))
+  void Filter::release()
   {
-    m_statusCallback = callback;
+    if (m_kernel)
+    {
+      clReleaseKernel(m_kernel);
+      m_kernel = 0;
+    }
+    if (m_deviceInput)
+    {
+      clReleaseMemObject(m_deviceInput);
+      m_deviceInput = 0;
+    }
+    if (m_deviceOutput)
+    {
+      clReleaseMemObject(m_deviceOutput);
+      m_deviceOutput = 0;
+    }
+    m_deviceBuffers = false;
+    m_itemPixels[0] = m_itemPixels[1] = 1;
+    releaseCL();
+    m_sessionMethod = 0;
   }
 
-  void Filter::startTiming()
+  void Filter::beginSession(int method, Image image, const Params& params)
   {
-    m_startTime = getCurrentTime();
+    release();
+    m_sessionMethod = method;
+    m_sessionParams = params;
+    m_sessionImage = image;
+    m_sessionImage.height *= params.batch;
   }
 
-  void Filter::stopTiming()
+  bool Filter::prepareKernel(const char *source, const char *options,
+                             const char *name, cl_image_format format)
   {
-    m_endTime = getCurrentTime();
+    // Kernels clamp reads to the rows of each image in a batch
+    size_t height = m_sessionImage.height/m_sessionParams.batch;
+    char batchOptions[256];
+    if (m_sessionParams.batch > 1)
+    {
+      sprintf(batchOptions, "%s -DBATCH_HEIGHT=%zu", options, height);
+      options = batchOptions;
+    }
+
+    // Coarsened image kernels produce a vertical strip of pixels
+    char stripOptions[256];
+    if (m_sessionParams.coarsening > 1)
+    {
+      sprintf(stripOptions, "%s -DSTRIP=%u -DIMAGE_HEIGHT=%zu", options,
+              m_sessionParams.coarsening, height);
+      options = stripOptions;
+      m_itemPixels[1] = m_sessionParams.coarsening;
+    }
+
+    // Any failure ends the session
+    if (!initCL(m_sessionParams, source, options))
+    {
+      release();
+      return false;
+    }
+
+    cl_int err;
+    m_kernel = clCreateKernel(m_program, name, &err);
+    CHECK_ERROR_OCL(err, "creating kernel", release(); return false);
+
+    m_deviceInput = clCreateImage2D(
+      m_context, CL_MEM_READ_ONLY, &format,
+      m_sessionImage.width, m_sessionImage.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating input image", release(); return false);
+
+    size_t outputSize[2];
+    getSessionOutputSize(outputSize);
+    m_deviceOutput = clCreateImage2D(
+      m_context, CL_MEM_WRITE_ONLY, &format,
+      outputSize[0], outputSize[1], 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating output image", release(); return false);
+
+    err  = clSetKernelArg(m_kernel, 0, sizeof(cl_mem), &m_deviceInput);
+    err |= clSetKernelArg(m_kernel, 1, sizeof(cl_mem), &m_deviceOutput);
+    CHECK_ERROR_OCL(err, "setting kernel arguments", release(); return false);
+
+    reportStatus("Prepared OpenCL %s kernel", name);
+    return true;
   }
 
-  bool Filter::verify(Image input, Image output, int tolerance)
+  // Buffer kernels take tightly packed uchar4 pixels, with the image size
+  // given by WIDTH and HEIGHT (per image of a batch) and ROWS (in total).
+  // Each work-item produces BUFFER_PIXELS horizontally adjacent pixels.
+  bool Filter::prepareBufferKernel(const char *source, const char *options,
+                                   const char *name)
   {
-    // Compute reference image
-    Image ref =
+    if (m_sessionImage.format != PIXEL_U8)
     {
-      (unsigned char*)malloc(output.width*output.height*4),
-      output.width,
-      output.height
-    };
-    runReference(input, ref);
+      reportStatus("Buffer kernels only support 8-bit pixels.");
+      release();
+      return false;
+    }
 
-    // Compare pixels
-    int errors = 0;
-    const int maxErrors = 16;
-    for (int y = 0; y < output.height; y++)
+    m_itemPixels[0] = m_sessionParams.coarsening ?
+      m_sessionParams.coarsening : BUFFER_PIXELS;
+    char bufferOptions[256];
+    sprintf(bufferOptions,
+            "%s -DWIDTH=%zu -DHEIGHT=%zu -DROWS=%zu -DPIXELS=%zu", options,
+            m_sessionImage.width, m_sessionImage.height/m_sessionParams.batch,
+            m_sessionImage.height, m_itemPixels[0]);
+    if (!initCL(m_sessionParams, source, bufferOptions))
     {
-      for (int x = 0; x < output.width; x++)
-      {
-        for (int c = 0; c < 4; c++)
-        {
-          int r = getPixel(ref, x, y, c)*255;
-          int o = getPixel(output, x, y, c)*255;
-          int diff = abs(r - o);
-          if (diff > tolerance)
-          {
-            // Only report first few errors
-            if (errors < maxErrors)
-            {
-              reportStatus("Mismatch at (%d,%d,%d): %d vs %d", x, y, c, r, o);
-            }
-            if (++errors == maxErrors)
-            {
-              reportStatus("Supressing further errors");
-            }
-          }
-        }
-      }
+      release();
+      return false;
     }
 
-    free(ref.data);
+    cl_int err;
+    m_kernel = clCreateKernel(m_program, name, &err);
+    CHECK_ERROR_OCL(err, "creating kernel", release(); return false);
+
+    size_t size = getImageSize(m_sessionImage);
+    m_deviceInput = clCreateBuffer(
+      m_context, CL_MEM_READ_ONLY, size, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating input buffer", release(); return false);
 
-    return errors == 0;
+    m_deviceOutput = clCreateBuffer(
+      m_context, CL_MEM_WRITE_ONLY, size, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating output buffer", release(); return false);
+    m_deviceBuffers = true;
+
+    err  = clSetKernelArg(m_kernel, 0, sizeof(cl_mem), &m_deviceInput);
+    err |= clSetKernelArg(m_kernel, 1, sizeof(cl_mem), &m_deviceOutput);
+    CHECK_ERROR_OCL(err, "setting kernel arguments", release(); return false);
+
+    reportStatus("Prepared OpenCL %s kernel", name);
+    return true;
   }
 
-  /////////////////
-  // Image utils //
-  /////////////////
+  bool Filter::checkSession(Image input, Image output) const
+  {
+    if (!m_sessionMethod)
+    {
+      reportStatus("No session prepared.");
+      return false;
+    }
 
-  inline int clamp(int x, int min, int max)
+    const Image& image = m_sessionImage;
+    size_t outputSize[2];
+    getSessionOutputSize(outputSize);
+    if (input.width != image.width || input.height != image.height ||
+        output.width != outputSize[0] || output.height != outputSize[1] ||
+        input.layout != image.layout ||
+        output.layout != getOutputLayout(image.layout) ||
+        input.format != image.format || output.format != image.format)
+    {
+      reportStatus("Images do not match the prepared session.");
+      return false;
+    }
+    return true;
+  }
+
+  // Size of the session's output, with the images of a batch stacked
+  void Filter::getSessionOutputSize(size_t size[2]) const
   {
-    return x < min ? min : x > max ? max : x;
+    unsigned int batch = m_sessionParams.batch;
+    getOutputSize(m_sessionParams, m_sessionImage.width,
+                  m_sessionImage.height/batch, size);
+    size[1] *= batch;
   }
 
-  inline float clamp(float x, float min, float max)
+  // Region of a session image holding one image of a batch
+  Image Filter::getBatchImage(Image image, unsigned int index) const
   {
-    return x < min ? min : x > max ? max : x;
+    size_t height = m_sessionImage.height/m_sessionParams.batch;
+    return getRegion(image, 0, index*height, image.width, height);
   }
 
-  buffer_t createHalideBuffer(Image image)
+  bool Filter::bind(Image input, Image output, bool blocking)
   {
-    buffer_t buffer = {0};
-    buffer.host = image.data;
-    buffer.extent[0] = image.width;
-    buffer.extent[1] = image.height;
-    buffer.extent[2] = 4;
-    buffer.stride[0] = 4;
-    buffer.stride[1] = image.width*4;
-    buffer.stride[2] = 1;
-    buffer.elem_size = 1;
-    return buffer;
+    m_sessionInput = input;
+    m_sessionOutput = output;
+    if (!m_deviceInput)
+    {
+      return true;
+    }
+
+    cl_int err;
+    size_t origin[3] = {0, 0, 0};
+    if (m_deviceBuffers)
+    {
+      // Device buffers are tightly packed, while host rows may be padded
+      size_t region[3] = {input.width*4, input.height, 1};
+      err = clEnqueueWriteBufferRect(
+        m_queue, m_deviceInput, blocking ? CL_TRUE : CL_FALSE,
+        origin, origin, region, region[0], 0, getRowPitch(input), 0,
+        input.data, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "writing buffer data", return false);
+      return true;
+    }
+
+    size_t region[3] = {input.width, input.height, 1};
+    err = clEnqueueWriteImage(
+      m_queue, m_deviceInput, blocking ? CL_TRUE : CL_FALSE,
+      origin, region, getRowPitch(input), 0, input.data, 0, NULL, NULL);
+    CHECK_ERROR_OCL(err, "writing image data", return false);
+    return true;
   }
 
-  float getPixel(Image image, int x, int y, int c)
+  bool Filter::execute()
   {
-    int _x = clamp(x, 0, image.width-1);
-    int _y = clamp(y, 0, image.height-1);
-    return image.data[(_x + _y*image.width)*4 + c]/255.f;
+    if (!m_kernel)
+    {
+      return false;
+    }
+
+    // One work-item per output pixel
+    size_t global[2];
+    getSessionOutputSize(global);
+    const size_t *local = NULL;
+    if (m_sessionParams.wgsize[0] && m_sessionParams.wgsize[1])
+    {
+      local = m_sessionParams.wgsize;
+    }
+
+    // Buffer and coarsened kernels check bounds, so the range is rounded
+    // up to whole work-groups. Strips are counted per image of a batch.
+    if (m_deviceBuffers || m_itemPixels[1] > 1)
+    {
+      size_t height = global[1]/m_sessionParams.batch;
+      global[0] = (global[0] + m_itemPixels[0]-1)/m_itemPixels[0];
+      global[1] = ((height + m_itemPixels[1]-1)/m_itemPixels[1]) *
+        m_sessionParams.batch;
+      for (int d = 0; local && d < 2; d++)
+      {
+        global[d] = ((global[d] + local[d]-1)/local[d])*local[d];
+      }
+    }
+
+    cl_int err = clEnqueueNDRangeKernel(
+      m_queue, m_kernel, 2, NULL, global, local, 0, NULL, NULL);
+    CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+    return true;
   }
 
-  float getPixelGrayscale(Image image, int x, int y)
+  bool Filter::retrieve(bool blocking, cl_event *event)
   {
-    int _x = clamp(x, 0, image.width-1);
-    int _y = clamp(y, 0, image.height-1);
-    float r = image.data[(_x + _y*image.width)*4 + 0]/255.f * 0.299f;
-    float g = image.data[(_x + _y*image.width)*4 + 1]/255.f * 0.587f;
-    float b = image.data[(_x + _y*image.width)*4 + 2]/255.f * 0.114f;
-    return (r + g + b);
+    if (!m_deviceOutput)
+    {
+      return true;
+    }
+
+    cl_int err;
+    Image output = m_sessionOutput;
+    size_t origin[3] = {0, 0, 0};
+    if (m_deviceBuffers)
+    {
+      size_t region[3] = {output.width*4, output.height, 1};
+      err = clEnqueueReadBufferRect(
+        m_queue, m_deviceOutput, blocking ? CL_TRUE : CL_FALSE,
+        origin, origin, region, region[0], 0, getRowPitch(output), 0,
+        output.data, 0, NULL, event);
+      CHECK_ERROR_OCL(err, "reading buffer data", return false);
+      return true;
+    }
+
+    size_t region[3] = {output.width, output.height, 1};
+    err = clEnqueueReadImage(
+      m_queue, m_deviceOutput, blocking ? CL_TRUE : CL_FALSE,
+      origin, region, getRowPitch(output), 0, output.data, 0, NULL, event);
+    CHECK_ERROR_OCL(err, "reading image data", return false);
+    return true;
   }
 
-  void setPixel(Image image, int x, int y, int c, float value)
+  bool Filter::finishSession()
   {
-    int _x = clamp(x, 0, image.width-1);
-    int _y = clamp(y, 0, image.height-1);
-    image.data[(_x + _y*image.width)*4 + c] = clamp(value, 0.f, 1.f)*255.f;
+    if (m_queue)
+    {
+      cl_int err = clFinish(m_queue);
+      CHECK_ERROR_OCL(err, "running kernel", return false);
+    }
+    return true;
   }
 
-  void setPixelGrayscale(Image image, int x, int y, float value)
+  bool Filter::benchmark(int method, Image input, Image output,
+                         const Params& params)
   {
-    int _x = clamp(x, 0, image.width-1);
-    int _y = clamp(y, 0, image.height-1);
-    image.data[(_x + _y*image.width)*4 + 0] = clamp(value, 0.f, 1.f)*255;
-    image.data[(_x + _y*image.width)*4 + 1] = clamp(value, 0.f, 1.f)*255;
-    image.data[(_x + _y*image.width)*4 + 2] = clamp(value, 0.f, 1.f)*255;
-    image.data[(_x + _y*image.width)*4 + 3] = 255;
+    if (method != METHOD_OPENCL ||
+        (!params.compareBuffers && !params.tuneCoarsening))
+    {
+      return timeSession(method, input, output, params) &&
+             outputResults(input, output, params);
+    }
+
+    // Time each kernel variant side by side
+    int numMemories = params.compareBuffers ? 2 : 1;
+    int numFactors = params.tuneCoarsening ?
+      sizeof(COARSENING)/sizeof(unsigned int) : 1;
+    double bestRuntime = 0;
+    char bestName[32] = "";
+    bool success = true;
+    for (int m = 0; m < numMemories; m++)
+    {
+      for (int f = 0; f < numFactors; f++)
+      {
+        Params variant = params;
+        if (params.compareBuffers)
+        {
+          variant.buffers = m == 1;
+        }
+        if (params.tuneCoarsening)
+        {
+          variant.coarsening = COARSENING[f];
+        }
+
+        char name[32];
+        sprintf(name, "%s", variant.buffers ? "buffer" : "image");
+        if (params.tuneCoarsening)
+        {
+          sprintf(name + strlen(name), " x%u", variant.coarsening);
+        }
+
+        // Variants which cannot be prepared are skipped
+        if (!timeSession(method, input, output, variant))
+        {
+          reportStatus("%12s: not available", name);
+          continue;
+        }
+
+        const char *verifyStr = "unverified";
+        if (params.verify)
+        {
+          bool passed = verify(input, output, params);
+          verifyStr = passed ? "passed" : "failed";
+          success = success && passed;
+        }
+
+        double runtime = ((m_endTime-m_startTime)*1e-3)/params.iterations;
+        double bytes = getImageSize(input) + getImageSize(output);
+        reportStatus("%12s: %.3lf ms, %.2lf GB/s (%s)", name, runtime,
+                     bytes/(runtime*1e6), verifyStr);
+
+        if (!bestName[0] || runtime < bestRuntime)
+        {
+          bestRuntime = runtime;
+          strcpy(bestName, name);
+        }
+      }
+    }
+
+    if (!bestName[0])
+    {
+      return false;
+    }
+    reportStatus("Fastest was %s kernel (%.3lf ms)", bestName, bestRuntime);
+    return success;
+  }
+
+  bool Filter::timeSession(int method, Image input, Image output,
+                           const Params& params)
+  {
+    if (!prepare(method, input, params))
+    {
+      return false;
+    }
+
+    // Warm-up run
+    if (!bind(input, output, true) || !execute() || !finishSession())
+    {
+      release();
+      return false;
+    }
+
+    // Timed runs
+    startTiming();
+    for (int i = 0; i < params.iterations; i++)
+    {
+      if (!execute())
+      {
+        release();
+        return false;
+      }
+    }
+    if (!finishSession())
+    {
+      release();
+      return false;
+    }
+    stopTiming();
+
+    bool success = retrieve(true, NULL);
+    release();
+    return success;
+  }
+
+  bool Filter::runBatch(int method, const Image *inputs, const Image *outputs,
+                        unsigned int count, const Params& params)
+  {
+    Image image = inputs[0];
+    for (unsigned int n = 0; n < count; n++)
+    {
+      if (inputs[n].width != image.width || inputs[n].height != image.height ||
+          inputs[n].layout != image.layout || inputs[n].format != image.format)
+      {
+        reportStatus("Batched images must have the same size and format.");
+        return false;
+      }
+    }
+
+    reportStatus("Running batch of %u %zux%zu images", count,
+                 image.width, image.height);
+
+    // Per-image path, with one run of the session for each image
+    Params single = params;
+    single.batch = 1;
+    if (!prepare(method, image, single))
+    {
+      return false;
+    }
+    bool success = process(inputs[0], outputs[0]);
+    double start = getCurrentTime();
+    for (int i = 0; i < params.iterations && success; i++)
+    {
+      for (unsigned int n = 0; n < count && success; n++)
+      {
+        success = process(inputs[n], outputs[n]);
+      }
+    }
+    double perImage = getCurrentTime()-start;
+    release();
+    if (!success)
+    {
+      return false;
+    }
+
+    // Batched path, packing the images into one image and unpacking the
+    // results, so that the copies are included in the timing
+    Params batched = params;
+    batched.batch = count;
+    if (!prepare(method, image, batched))
+    {
+      return false;
+    }
+    Image input = image;
+    input.height *= count;
+    input.stride = 0;
+    input.data = (unsigned char*)allocateBuffer(getImageSize(input));
+    Image output = input;
+    output.data = (unsigned char*)allocateBuffer(getImageSize(output));
+
+    // Timed runs (after warm-up run)
+    for (int i = 0; i < params.iterations + 1 && success; i++)
+    {
+      if (i == 1)
+      {
+        start = getCurrentTime();
+      }
+
+      for (unsigned int n = 0; n < count; n++)
+      {
+        copyImage(inputs[n], getBatchImage(input, n));
+      }
+      success = process(input, output);
+      for (unsigned int n = 0; n < count; n++)
+      {
+        copyImage(getBatchImage(output, n), outputs[n]);
+      }
+    }
+    double whole = getCurrentTime()-start;
+    release();
+    releaseBuffer(input.data);
+    releaseBuffer(output.data);
+    if (!success)
+    {
+      return false;
+    }
+
+    double images = (double)count*params.iterations;
+    reportStatus("Per-image path: %.1lf images/s", images/(perImage*1e-6));
+    reportStatus("Batched path:   %.1lf images/s (%.2lfx)",
+                 images/(whole*1e-6), perImage/whole);
+
+    // Each image has its own reference
+    if (params.verify)
+    {
+      for (unsigned int n = 0; n < count && success; n++)
+      {
+        clearReferenceCache();
+        success = verify(inputs[n], outputs[n], params);
+      }
+      clearReferenceCache();
+      reportStatus(success ? "Verification passed" : "Verification failed");
+    }
+    return success;
+  }
+
+  bool Filter::referencePixel(Image input, int x, int y,
+                              const Params& params, float result[4])
+  {
+    // Filters without per-pixel reference math only support full verification
+    return false;
+  }
+
+  void Filter::releaseCL()
+  {
+    if (m_program)
+    {
+      clReleaseProgram(m_program);
+      m_program = 0;
+    }
+    if (m_queue)
+    {
+      clReleaseCommandQueue(m_queue);
+      m_queue = 0;
+    }
+    if (m_context)
+    {
+      clReleaseContext(m_context);
+      m_context = 0;
+    }
+  }
+
+  bool Filter::runPlanarOpenCL(Image input, Image output,
+                               const Params& params,
+                               const char *source, const char *options,
+                               const char *name, bool opaque)
+  {
+    if (!check8Bit(input, output))
+    {
+      return false;
+    }
+
+    if (!initCL(params, source, options))
+    {
+      return false;
+    }
+
+    cl_int err;
+    cl_kernel kernel;
+    cl_mem d_input, d_output;
+    cl_int width = input.width, height = input.height;
+    size_t planes = input.width*input.height*3;
+
+    // The colour planes are transferred as 3*height rows, which are tightly
+    // packed on the device
+    size_t origin[3] = {0, 0, 0};
+    size_t region[3] = {input.width, input.height*3, 1};
+
+    kernel = clCreateKernel(m_program, name, &err);
+    CHECK_ERROR_OCL(err, "creating kernel", return false);
+
+    d_input = clCreateBuffer(
+      m_context, CL_MEM_READ_ONLY, planes, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating input buffer", return false);
+
+    d_output = clCreateBuffer(
+      m_context, CL_MEM_WRITE_ONLY, planes, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating output buffer", return false);
+
+    err = clEnqueueWriteBufferRect(
+      m_queue, d_input, CL_TRUE, origin, origin, region,
+      input.width, 0, getRowPitch(input), 0, input.data, 0, NULL, NULL);
+    CHECK_ERROR_OCL(err, "writing buffer data", return false);
+
+    err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_input);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_output);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_int), &width);
+    err |= clSetKernelArg(kernel, 3, sizeof(cl_int), &height);
+    CHECK_ERROR_OCL(err, "setting kernel arguments", return false);
+
+    reportStatus("Running OpenCL %s kernel", name);
+
+    const size_t global[2] = {output.width, output.height};
+    const size_t *local = NULL;
+    if (params.wgsize[0] && params.wgsize[1])
+    {
+      local = params.wgsize;
+    }
+
+    // Timed runs
+    for (int i = 0; i < params.iterations + 1; i++)
+    {
+      err = clEnqueueNDRangeKernel(
+        m_queue, kernel, 2, NULL, global, local, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+
+      // Start timing after warm-up run
+      if (i == 0)
+      {
+        err = clFinish(m_queue);
+        CHECK_ERROR_OCL(err, "running kernel", return false);
+        startTiming();
+      }
+    }
+    err = clFinish(m_queue);
+    CHECK_ERROR_OCL(err, "running kernel", return false);
+    stopTiming();
+
+    reportStatus("Finished OpenCL kernel");
+
+    err = clEnqueueReadBufferRect(
+      m_queue, d_output, CL_TRUE, origin, origin, region,
+      output.width, 0, getRowPitch(output), 0, output.data, 0, NULL, NULL);
+    CHECK_ERROR_OCL(err, "reading buffer data", return false);
+
+    if (opaque)
+    {
+      memset(output.data + getPixelOffset(output, 0, 0, 3), 255,
+             getRowPitch(output)*output.height);
+    }
+    else
+    {
+      copyAlphaPlane(input, output);
+    }
+
+    clReleaseMemObject(d_input);
+    clReleaseMemObject(d_output);
+    clReleaseKernel(kernel);
+    releaseCL();
+
+    return outputResults(input, output, params);
+  }
+
+  void Filter::reportStatus(const char *format, ...) const
+  {
+    if (m_statusCallback)
+    {
+      va_list args;
+      va_start(args, format);
+      m_statusCallback(format, args);
+      va_end(args);
+    }
+  }
+
+  void Filter::setStatusCallback(int (*callback)(const char*, va_list args))
+  {
+    m_statusCallback = callback;
+  }
+
+  void Filter::startTiming()
+  {
+    m_startTime = getCurrentTime();
+  }
+
+  void Filter::stopTiming()
+  {
+    m_endTime = getCurrentTime();
+  }
+
+  bool Filter::verify(Image input, Image output, const Params& params,
+                      int tolerance)
+  {
+    if (params.sampleRate < 1.f)
+    {
+      return verifySampled(input, output, params, tolerance);
+    }
+
+    // Compute reference image
+    Image ref =
+    {
+      (unsigned char*)allocateBuffer(getImageSize(output)),
+      output.width,
+      output.height,
+      output.layout,
+      output.format
+    };
+    runReference(input, ref, params);
+
+    // Compare pixels
+    int errors = 0;
+    const int maxErrors = 16;
+    for (int y = 0; y < output.height; y++)
+    {
+      for (int x = 0; x < output.width; x++)
+      {
+        for (int c = 0; c < 4; c++)
+        {
+          int r = getPixel(ref, x, y, c)*255;
+          int o = getPixel(output, x, y, c)*255;
+          int diff = abs(r - o);
+          if (diff > tolerance)
+          {
+            // Only report first few errors
+            if (errors < maxErrors)
+            {
+              reportStatus("Mismatch at (%d,%d,%d): %d vs %d", x, y, c, r, o);
+            }
+            if (++errors == maxErrors)
+            {
+              reportStatus("Supressing further errors");
+            }
+          }
+        }
+      }
+    }
+
+    releaseBuffer(ref.data);
+
+    return errors == 0;
+  }
+
+  bool Filter::verifySampled(Image input, Image output,
+                             const Params& params, int tolerance)
+  {
+    float pixel[4];
+    if (!referencePixel(input, 0, 0, params, pixel))
+    {
+      reportStatus("Sampled verification not supported, verifying all pixels");
+      Params full = params;
+      full.sampleRate = 1.f;
+      return verify(input, output, full, tolerance);
+    }
+
+    // Border pixels (where clamping applies) are always checked, and the
+    // interior is split into tiles with one randomly chosen pixel from each
+    int border = getRadius(params);
+    int x0 = border, x1 = output.width - border;
+    int y0 = border, y1 = output.height - border;
+    if (x1 < x0) x1 = x0;
+    if (y1 < y0) y1 = y0;
+    int tile = (int)(1.f/sqrt(params.sampleRate) + 0.5f);
+    if (tile < 1) tile = 1;
+
+    int errors = 0;
+    const int maxErrors = 16;
+    size_t borderPixels = 0, borderFailed = 0;
+    size_t samples = 0, samplesFailed = 0;
+    for (int y = 0; y < output.height; y++)
+    {
+      bool borderRow = y < y0 || y >= y1;
+      for (int x = 0; x < output.width; x++)
+      {
+        bool isBorder = borderRow || x < x0 || x >= x1;
+        if (!isBorder)
+        {
+          // Only visit the top-left corner of each interior tile
+          if ((y-y0) % tile || (x-x0) % tile)
+          {
+            continue;
+          }
+        }
+
+        int px = x, py = y;
+        if (!isBorder)
+        {
+          int tw = x1-x < tile ? x1-x : tile;
+          int th = y1-y < tile ? y1-y : tile;
+          px += rand() % tw;
+          py += rand() % th;
+        }
+
+        referencePixel(input, px, py, params, pixel);
+
+        bool failed = false;
+        for (int c = 0; c < 4; c++)
+        {
+          int r = quantize(output, pixel[c])*255;
+          int o = getPixel(output, px, py, c)*255;
+          int diff = abs(r - o);
+          if (diff > tolerance)
+          {
+            failed = true;
+            if (errors < maxErrors)
+            {
+              reportStatus("Mismatch at (%d,%d,%d): %d vs %d",
+                           px, py, c, r, o);
+            }
+            if (++errors == maxErrors)
+            {
+              reportStatus("Supressing further errors");
+            }
+          }
+        }
+
+        if (isBorder)
+        {
+          borderPixels++;
+          borderFailed += failed;
+        }
+        else
+        {
+          samples++;
+          samplesFailed += failed;
+        }
+      }
+    }
+
+    // Wilson score interval for the interior mismatch rate
+    size_t interior = (size_t)(x1-x0) * (y1-y0);
+    double rate = 0, upper = 0;
+    if (samples)
+    {
+      const double z = 1.96;
+      double n = samples;
+      rate = samplesFailed / n;
+      upper = (rate + z*z/(2*n) +
+               z*sqrt(rate*(1-rate)/n + z*z/(4*n*n))) / (1 + z*z/n);
+    }
+    reportStatus("Sampled %zu of %zu interior pixels and all %zu border pixels",
+                 samples, interior, borderPixels);
+    reportStatus("Border mismatches: %zu, interior mismatch rate %.4f%% "
+                 "(95%% confidence upper bound %.4f%%, ~%.0lf pixels)",
+                 borderFailed, rate*100, upper*100, upper*interior);
+
+    return errors == 0;
+  }
+
+  bool Filter::verifyApproximate(Image input, Image output,
+                                 const Params& params, double minPSNR)
+  {
+    // Use per-pixel reference at sampled locations where possible,
+    // otherwise compute full reference image
+    float pixel[4];
+    Image ref =
+    {
+      NULL, output.width, output.height, output.layout, output.format
+    };
+    bool sampled = params.sampleRate < 1.f &&
+                   referencePixel(input, 0, 0, params, pixel);
+    int tile = 1;
+    if (sampled)
+    {
+      tile = (int)(1.f/sqrt(params.sampleRate) + 0.5f);
+      if (tile < 1) tile = 1;
+    }
+    else
+    {
+      ref.data = (unsigned char*)allocateBuffer(getImageSize(output));
+      runReference(input, ref, params);
+    }
+
+    double absError = 0, sqError = 0;
+    int maxError = 0;
+    size_t count = 0;
+    for (int y = 0; y < output.height; y += tile)
+    {
+      for (int x = 0; x < output.width; x += tile)
+      {
+        int px = x, py = y;
+        if (sampled)
+        {
+          px += rand() % (output.width-x < tile ? output.width-x : tile);
+          py += rand() % (output.height-y < tile ? output.height-y : tile);
+          referencePixel(input, px, py, params, pixel);
+        }
+        for (int c = 0; c < 4; c++)
+        {
+          int r;
+          if (sampled)
+          {
+            r = quantize(output, pixel[c])*255;
+          }
+          else
+          {
+            r = getPixel(ref, px, py, c)*255;
+          }
+          int diff = abs(r - (int)(getPixel(output, px, py, c)*255));
+          absError += diff;
+          sqError += diff*diff;
+          if (diff > maxError)
+          {
+            maxError = diff;
+          }
+          count++;
+        }
+      }
+    }
+    releaseBuffer(ref.data);
+
+    double psnr = sqError ? 10*log10(255.0*255.0*count/sqError) : INFINITY;
+    reportStatus("Mean absolute error %.2lf, max %d, PSNR %.1lf dB "
+                 "(threshold %.1lf dB)",
+                 absError/count, maxError, psnr, minPSNR);
+
+    return psnr >= minPSNR;
+  }
+
+  bool Filter::checkInterleaved(Image input, Image output) const
+  {
+    if (input.layout != LAYOUT_INTERLEAVED ||
+        output.layout != LAYOUT_INTERLEAVED)
+    {
+      reportStatus("Planar layout not supported by this implementation.");
+      return false;
+    }
+    return true;
+  }
+
+  bool Filter::check8Bit(Image input, Image output) const
+  {
+    if (input.format != PIXEL_U8 || output.format != PIXEL_U8)
+    {
+      reportStatus("%s pixels not supported by this implementation.",
+                   getFormatName(input.format != PIXEL_U8 ?
+                                 input.format : output.format));
+      return false;
+    }
+    return true;
+  }
+
+  HalideFunction Filter::selectHalidePipeline(Image input,
+                                              HalideFunction interleaved,
+                                              HalideFunction planar,
+                                              HalideFunction u16,
+                                              HalideFunction f32) const
+  {
+    // Planar pipelines are only generated for 8-bit pixels
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      if (input.format != PIXEL_U8)
+      {
+        reportStatus("Planar %s pixels not supported by Halide pipelines.",
+                     getFormatName(input.format));
+        return NULL;
+      }
+      return planar;
+    }
+    switch (input.format)
+    {
+      case PIXEL_U16:
+        return u16;
+      case PIXEL_F32:
+        return f32;
+      default:
+        return interleaved;
+    }
+  }
+
+  // Half-precision pipelines are only generated for interleaved 8-bit
+  // pixels, whose values are represented exactly in half precision
+  HalideFunction Filter::selectHalfPipeline(Image input,
+                                            HalideFunction half) const
+  {
+    if (input.layout != LAYOUT_INTERLEAVED || input.format != PIXEL_U8)
+    {
+      reportStatus("Half-precision Halide pipelines only support "
+                   "interleaved 8-bit pixels.");
+      return NULL;
+    }
+    return half;
+  }
+
+  /////////////////
+  // Image utils //
+  /////////////////
+
+  inline int clamp(int x, int min, int max)
+  {
+    return x < min ? min : x > max ? max : x;
+  }
+
+  inline float clamp(float x, float min, float max)
+  {
+    return x < min ? min : x > max ? max : x;
+  }
+
+  buffer_t createHalideBuffer(Image image)
+  {
+    buffer_t buffer = {0};
+    buffer.host = image.data;
+    buffer.extent[0] = image.width;
+    buffer.extent[1] = image.height;
+    buffer.elem_size = getChannelSize(image);
+    // Regions of interest are addressed by their data pointer, so the
+    // buffer minimum stays at the origin
+    size_t stride = getRowPitch(image)/buffer.elem_size;
+    if (image.layout == LAYOUT_PLANAR)
+    {
+      // Only the colour planes are exposed, so pipelines skip alpha
+      buffer.extent[2] = 3;
+      buffer.stride[0] = 1;
+      buffer.stride[1] = stride;
+      buffer.stride[2] = stride*image.height;
+    }
+    else
+    {
+      buffer.extent[2] = 4;
+      buffer.stride[0] = 4;
+      buffer.stride[1] = stride;
+      buffer.stride[2] = 1;
+    }
+    return buffer;
+  }
+
+  cl_image_format getImageFormat(Image image)
+  {
+    cl_image_format format = {CL_RGBA, CL_UNORM_INT8};
+    if (image.format == PIXEL_U16)
+    {
+      format.image_channel_data_type = CL_UNORM_INT16;
+    }
+    else if (image.format == PIXEL_F32)
+    {
+      format.image_channel_data_type = CL_FLOAT;
+    }
+    return format;
+  }
+
+  const char* getFormatName(int format)
+  {
+    switch (format)
+    {
+      case PIXEL_U16:
+        return "u16";
+      case PIXEL_F32:
+        return "f32";
+      default:
+        return "u8";
+    }
+  }
+
+  size_t getChannelSize(Image image)
+  {
+    switch (image.format)
+    {
+      case PIXEL_U16:
+        return sizeof(unsigned short);
+      case PIXEL_F32:
+        return sizeof(float);
+      default:
+        return sizeof(unsigned char);
+    }
+  }
+
+  // Size of a tightly packed copy of an image, in bytes
+  size_t getImageSize(Image image)
+  {
+    if (isYUV(image))
+    {
+      return image.width*image.height +
+        2*((image.width+1)/2)*((image.height+1)/2);
+    }
+    return image.width*image.height*4*getChannelSize(image);
+  }
+
+  static inline size_t getStride(Image image)
+  {
+    return image.stride ? image.stride : image.width;
+  }
+
+  // Distance between the starts of consecutive rows (within a plane for
+  // planar images, and within the Y plane for YUV images), in bytes
+  size_t getRowPitch(Image image)
+  {
+    size_t values = getStride(image);
+    if (image.layout == LAYOUT_INTERLEAVED)
+    {
+      values *= 4;
+    }
+    return values*getChannelSize(image);
+  }
+
+  bool isYUV(Image image)
+  {
+    return image.layout == LAYOUT_NV12 || image.layout == LAYOUT_I420;
+  }
+
+  // Chroma planes follow the Y plane, and have rows half its pitch (for
+  // each of U and V) rounded up
+  YUVPlanes getYUVPlanes(Image image)
+  {
+    YUVPlanes planes;
+    size_t stride = getStride(image);
+    size_t chromaPitch = (stride+1)/2;
+    planes.y = image.data;
+    planes.yPitch = stride;
+    planes.u = image.data + stride*image.height;
+    if (image.layout == LAYOUT_NV12)
+    {
+      planes.v = planes.u + 1;
+      planes.uvPitch = 2*chromaPitch;
+      planes.uvStep = 2;
+    }
+    else
+    {
+      planes.v = planes.u + chromaPitch*((image.height+1)/2);
+      planes.uvPitch = chromaPitch;
+      planes.uvStep = 1;
+    }
+    return planes;
+  }
+
+  // Planes are spaced by the image height, so regions are only supported
+  // for interleaved images (an empty image is returned otherwise)
+  Image getRegion(Image image, int x, int y, size_t width, size_t height)
+  {
+    Image region = image;
+    region.width = width;
+    region.height = height;
+    region.stride = getStride(image);
+    if (image.layout != LAYOUT_INTERLEAVED ||
+        x < 0 || y < 0 || x+width > image.width || y+height > image.height)
+    {
+      region.data = NULL;
+      return region;
+    }
+    region.data = image.data + y*getRowPitch(image) +
+                  x*4*getChannelSize(image);
+    return region;
+  }
+
+  static void copyPlane(const unsigned char *input, size_t inPitch,
+                        unsigned char *output, size_t outPitch,
+                        size_t bytes, size_t rows)
+  {
+    for (size_t y = 0; y < rows; y++)
+    {
+      memcpy(output + y*outPitch, input + y*inPitch, bytes);
+    }
+  }
+
+  // Copy between images of the same size, layout and format, whose strides
+  // may differ
+  void copyImage(Image input, Image output)
+  {
+    if (isYUV(input))
+    {
+      YUVPlanes in = getYUVPlanes(input), out = getYUVPlanes(output);
+      size_t chromaWidth = (input.width+1)/2;
+      size_t chromaHeight = (input.height+1)/2;
+      copyPlane(in.y, in.yPitch, out.y, out.yPitch,
+                input.width, input.height);
+      copyPlane(in.u, in.uvPitch, out.u, out.uvPitch,
+                chromaWidth*in.uvStep, chromaHeight);
+      if (input.layout == LAYOUT_I420)
+      {
+        copyPlane(in.v, in.uvPitch, out.v, out.uvPitch,
+                  chromaWidth, chromaHeight);
+      }
+      return;
+    }
+
+    size_t rows = input.height;
+    size_t bytes = input.width*getChannelSize(input);
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      rows *= 4;
+    }
+    else
+    {
+      bytes *= 4;
+    }
+
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(output);
+    if (inPitch == bytes && outPitch == bytes)
+    {
+      memcpy(output.data, input.data, rows*bytes);
+      return;
+    }
+    copyPlane(input.data, inPitch, output.data, outPitch, bytes, rows);
+  }
+
+  // Offset of a channel value, in units of the channel size. The alpha
+  // channel of YUV images is not stored.
+  size_t getPixelOffset(Image image, int x, int y, int c)
+  {
+    if (isYUV(image))
+    {
+      YUVPlanes planes = getYUVPlanes(image);
+      if (c == 0)
+      {
+        return x + y*planes.yPitch;
+      }
+      const unsigned char *plane = c == 1 ? planes.u : planes.v;
+      return (plane - image.data) + (y/2)*planes.uvPitch +
+             (x/2)*planes.uvStep;
+    }
+
+    size_t stride = getStride(image);
+    if (image.layout == LAYOUT_PLANAR)
+    {
+      return x + (y + c*image.height)*stride;
+    }
+    return (x + y*stride)*4 + c;
+  }
+
+  static void deinterleave(const unsigned char *in, unsigned char *out,
+                           size_t count, size_t plane)
+  {
+    unsigned char *r = out, *g = r + plane, *b = g + plane, *a = b + plane;
+    size_t i = 0;
+#if defined(__SSE2__)
+    // Transpose 16 pixels at a time with byte, word and quadword unpacks
+    for (; i + 16 <= count; i += 16)
+    {
+      __m128i p0 = _mm_loadu_si128((const __m128i*)(in + i*4));
+      __m128i p1 = _mm_loadu_si128((const __m128i*)(in + i*4 + 16));
+      __m128i p2 = _mm_loadu_si128((const __m128i*)(in + i*4 + 32));
+      __m128i p3 = _mm_loadu_si128((const __m128i*)(in + i*4 + 48));
+
+      __m128i t0 = _mm_unpacklo_epi8(p0, p1);
+      __m128i t1 = _mm_unpackhi_epi8(p0, p1);
+      __m128i t2 = _mm_unpacklo_epi8(p2, p3);
+      __m128i t3 = _mm_unpackhi_epi8(p2, p3);
+
+      __m128i u0 = _mm_unpacklo_epi8(t0, t1);
+      __m128i u1 = _mm_unpackhi_epi8(t0, t1);
+      __m128i u2 = _mm_unpacklo_epi8(t2, t3);
+      __m128i u3 = _mm_unpackhi_epi8(t2, t3);
+
+      __m128i v0 = _mm_unpacklo_epi8(u0, u1);
+      __m128i v1 = _mm_unpackhi_epi8(u0, u1);
+      __m128i v2 = _mm_unpacklo_epi8(u2, u3);
+      __m128i v3 = _mm_unpackhi_epi8(u2, u3);
+
+      _mm_storeu_si128((__m128i*)(r + i), _mm_unpacklo_epi64(v0, v2));
+      _mm_storeu_si128((__m128i*)(g + i), _mm_unpackhi_epi64(v0, v2));
+      _mm_storeu_si128((__m128i*)(b + i), _mm_unpacklo_epi64(v1, v3));
+      _mm_storeu_si128((__m128i*)(a + i), _mm_unpackhi_epi64(v1, v3));
+    }
+#elif defined(__ARM_NEON__)
+    for (; i + 16 <= count; i += 16)
+    {
+      uint8x16x4_t v = vld4q_u8(in + i*4);
+      vst1q_u8(r + i, v.val[0]);
+      vst1q_u8(g + i, v.val[1]);
+      vst1q_u8(b + i, v.val[2]);
+      vst1q_u8(a + i, v.val[3]);
+    }
+#endif
+    for (; i < count; i++)
+    {
+      r[i] = in[i*4 + 0];
+      g[i] = in[i*4 + 1];
+      b[i] = in[i*4 + 2];
+      a[i] = in[i*4 + 3];
+    }
+  }
+
+  static void interleave(const unsigned char *in, unsigned char *out,
+                         size_t count, size_t plane)
+  {
+    const unsigned char *r = in, *g = r + plane, *b = g + plane, *a = b + plane;
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= count; i += 16)
+    {
+      __m128i vr = _mm_loadu_si128((const __m128i*)(r + i));
+      __m128i vg = _mm_loadu_si128((const __m128i*)(g + i));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+
+      __m128i rg0 = _mm_unpacklo_epi8(vr, vg);
+      __m128i rg1 = _mm_unpackhi_epi8(vr, vg);
+      __m128i ba0 = _mm_unpacklo_epi8(vb, va);
+      __m128i ba1 = _mm_unpackhi_epi8(vb, va);
+
+      __m128i *o = (__m128i*)(out + i*4);
+      _mm_storeu_si128(o + 0, _mm_unpacklo_epi16(rg0, ba0));
+      _mm_storeu_si128(o + 1, _mm_unpackhi_epi16(rg0, ba0));
+      _mm_storeu_si128(o + 2, _mm_unpacklo_epi16(rg1, ba1));
+      _mm_storeu_si128(o + 3, _mm_unpackhi_epi16(rg1, ba1));
+    }
+#elif defined(__ARM_NEON__)
+    for (; i + 16 <= count; i += 16)
+    {
+      uint8x16x4_t v;
+      v.val[0] = vld1q_u8(r + i);
+      v.val[1] = vld1q_u8(g + i);
+      v.val[2] = vld1q_u8(b + i);
+      v.val[3] = vld1q_u8(a + i);
+      vst4q_u8(out + i*4, v);
+    }
+#endif
+    for (; i < count; i++)
+    {
+      out[i*4 + 0] = r[i];
+      out[i*4 + 1] = g[i];
+      out[i*4 + 2] = b[i];
+      out[i*4 + 3] = a[i];
+    }
+  }
+
+  void convertLayout(Image input, Image output)
+  {
+    size_t bytes = getChannelSize(input);
+    if (input.layout == output.layout)
+    {
+      copyImage(input, output);
+    }
+    else if (bytes > 1)
+    {
+      // Wider channels are moved one value at a time
+      for (int y = 0; y < input.height; y++)
+      {
+        for (int x = 0; x < input.width; x++)
+        {
+          for (int c = 0; c < 4; c++)
+          {
+            memcpy(output.data + getPixelOffset(output, x, y, c)*bytes,
+                   input.data + getPixelOffset(input, x, y, c)*bytes, bytes);
+          }
+        }
+      }
+    }
+    else if (input.layout == LAYOUT_INTERLEAVED)
+    {
+      size_t plane = getRowPitch(output)*output.height;
+      for (int y = 0; y < input.height; y++)
+      {
+        deinterleave(input.data + y*getRowPitch(input),
+                     output.data + y*getRowPitch(output), input.width, plane);
+      }
+    }
+    else
+    {
+      size_t plane = getRowPitch(input)*input.height;
+      for (int y = 0; y < input.height; y++)
+      {
+        interleave(input.data + y*getRowPitch(input),
+                   output.data + y*getRowPitch(output), input.width, plane);
+      }
+    }
+  }
+
+  void copyAlphaPlane(Image input, Image output)
+  {
+    size_t size = getChannelSize(input);
+    for (int y = 0; y < input.height; y++)
+    {
+      memcpy(output.data + getPixelOffset(output, 0, y, 3)*size,
+             input.data + getPixelOffset(input, 0, y, 3)*size,
+             input.width*size);
+    }
+  }
+
+  // Channel values are read as normalised floats, while writes clamp and
+  // scale to the range of integer formats. Float images are left unclamped.
+  template <typename T>
+  static inline float loadChannel(const unsigned char *data, size_t offset,
+                                  float scale)
+  {
+    return ((const T*)data)[offset] / scale;
+  }
+
+  template <typename T>
+  static inline void storeChannel(unsigned char *data, size_t offset,
+                                  float scale, float value)
+  {
+    ((T*)data)[offset] = clamp(value, 0.f, 1.f)*scale;
+  }
+
+  static inline float readChannel(Image image, size_t offset)
+  {
+    switch (image.format)
+    {
+      case PIXEL_U16:
+        return loadChannel<unsigned short>(image.data, offset, 65535.f);
+      case PIXEL_F32:
+        return loadChannel<float>(image.data, offset, 1.f);
+      default:
+        return loadChannel<unsigned char>(image.data, offset, 255.f);
+    }
+  }
+
+  static inline void writeChannel(Image image, size_t offset, float value)
+  {
+    switch (image.format)
+    {
+      case PIXEL_U16:
+        storeChannel<unsigned short>(image.data, offset, 65535.f, value);
+        break;
+      case PIXEL_F32:
+        ((float*)image.data)[offset] = value;
+        break;
+      default:
+        storeChannel<unsigned char>(image.data, offset, 255.f, value);
+        break;
+    }
+  }
+
+  float quantize(Image image, float value)
+  {
+    unsigned char data[sizeof(float)];
+    Image pixel = {data, 1, 1, LAYOUT_INTERLEAVED, image.format};
+    writeChannel(pixel, 0, value);
+    return readChannel(pixel, 0);
+  }
+
+  float getPixel(Image image, int x, int y, int c)
+  {
+    if (c == 3 && isYUV(image))
+    {
+      return 1.f;
+    }
+    int _x = clamp(x, 0, image.width-1);
+    int _y = clamp(y, 0, image.height-1);
+    return readChannel(image, getPixelOffset(image, _x, _y, c));
+  }
+
+  float getPixelGrayscale(Image image, int x, int y)
+  {
+    int _x = clamp(x, 0, image.width-1);
+    int _y = clamp(y, 0, image.height-1);
+    float r = readChannel(image, getPixelOffset(image, _x, _y, 0)) * 0.299f;
+    float g = readChannel(image, getPixelOffset(image, _x, _y, 1)) * 0.587f;
+    float b = readChannel(image, getPixelOffset(image, _x, _y, 2)) * 0.114f;
+    return (r + g + b);
+  }
+
+  void setPixel(Image image, int x, int y, int c, float value)
+  {
+    if (c == 3 && isYUV(image))
+    {
+      return;
+    }
+    int _x = clamp(x, 0, image.width-1);
+    int _y = clamp(y, 0, image.height-1);
+    writeChannel(image, getPixelOffset(image, _x, _y, c), value);
+  }
+
+  void setPixelGrayscale(Image image, int x, int y, float value)
+  {
+    int _x = clamp(x, 0, image.width-1);
+    int _y = clamp(y, 0, image.height-1);
+    for (int c = 0; c < 3; c++)
+    {
+      writeChannel(image, getPixelOffset(image, _x, _y, c), value);
+    }
+    setPixel(image, _x, _y, 3, 1.f);
+  }
+
+  void setPixelRGBA(Image image, int x, int y, const float value[4])
+  {
+    for (int c = 0; c < 4; c++)
+    {
+      setPixel(image, x, y, c, value[c]);
+    }
+  }
+
+  //////////////////
+  // Memory utils //
+  //////////////////
+
+  #define CACHE_LINE_SIZE 64
+  #define HUGE_PAGE_SIZE  (2<<20)
+
+  static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+  static std::multimap<size_t, void*> poolFree;
+  static std::map<void*, size_t> poolSizes;
+  static size_t poolInUse = 0, poolPeak = 0, poolReserved = 0;
+  static bool poolHugePages = false;
+
+  void* allocateBuffer(size_t size)
+  {
+    size_t align = CACHE_LINE_SIZE;
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (poolHugePages && size >= HUGE_PAGE_SIZE)
+    {
+      align = HUGE_PAGE_SIZE;
+    }
+    else if (size >= page)
+    {
+      align = page;
+    }
+    size = (size + align-1) / align * align;
+
+    pthread_mutex_lock(&poolLock);
+
+    // Reuse a released block of the same size if possible
+    void *buffer = NULL;
+    std::multimap<size_t, void*>::iterator itr = poolFree.find(size);
+    if (itr != poolFree.end())
+    {
+      buffer = itr->second;
+      poolFree.erase(itr);
+    }
+    else
+    {
+      if (posix_memalign(&buffer, align, size))
+      {
+        pthread_mutex_unlock(&poolLock);
+        return NULL;
+      }
+#ifdef MADV_HUGEPAGE
+      if (align == HUGE_PAGE_SIZE)
+      {
+        madvise(buffer, size, MADV_HUGEPAGE);
+      }
+#endif
+      poolSizes[buffer] = size;
+      poolReserved += size;
+    }
+
+    poolInUse += size;
+    if (poolInUse > poolPeak)
+    {
+      poolPeak = poolInUse;
+    }
+
+    pthread_mutex_unlock(&poolLock);
+    return buffer;
+  }
+
+  void releaseBuffer(void *buffer)
+  {
+    if (!buffer)
+    {
+      return;
+    }
+
+    pthread_mutex_lock(&poolLock);
+    size_t size = poolSizes[buffer];
+    poolInUse -= size;
+    poolFree.insert(std::make_pair(size, buffer));
+    pthread_mutex_unlock(&poolLock);
+  }
+
+  void setHugePages(bool enable)
+  {
+    poolHugePages = enable;
+  }
+
+  // Return all pooled blocks that are not in use to the system
+  void trimMemoryPool()
+  {
+    pthread_mutex_lock(&poolLock);
+    std::multimap<size_t, void*>::iterator itr;
+    for (itr = poolFree.begin(); itr != poolFree.end(); itr++)
+    {
+      poolSizes.erase(itr->second);
+      poolReserved -= itr->first;
+      free(itr->second);
+    }
+    poolFree.clear();
+    pthread_mutex_unlock(&poolLock);
+  }
+
+  // Largest number of bytes in use at once since the last reset
+  size_t getPeakMemory()
+  {
+    return poolPeak;
+  }
+
+  // Bytes held by the pool, whether in use or not
+  size_t getReservedMemory()
+  {
+    return poolReserved;
+  }
+
+  void resetPeakMemory()
+  {
+    pthread_mutex_lock(&poolLock);
+    poolPeak = poolInUse;
+    pthread_mutex_unlock(&poolLock);
+  }
+
+  /////////////////////
+  // Threading utils //
+  /////////////////////
+
+  unsigned int getNumThreads(unsigned int requested)
+  {
+    if (requested)
+    {
+      return requested;
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? cores : 1;
+  }
+
+  struct RangeTask
+  {
+    RangeFunction func;
+    void *data;
+    int begin, end;
+  };
+
+  static void* runRangeTask(void *arg)
+  {
+    RangeTask *task = (RangeTask*)arg;
+    task->func(task->data, task->begin, task->end);
+    return NULL;
+  }
+
+  void parallelFor(int count, unsigned int threads,
+                   RangeFunction func, void *data)
+  {
+    threads = getNumThreads(threads);
+    if (threads > count)
+    {
+      threads = count > 0 ? count : 1;
+    }
+    if (threads == 1)
+    {
+      func(data, 0, count);
+      return;
+    }
+
+    // Split range into contiguous chunks, with the calling thread
+    // processing the final chunk itself
+    RangeTask *tasks = new RangeTask[threads];
+    pthread_t *handles = new pthread_t[threads];
+    for (unsigned int t = 0; t < threads; t++)
+    {
+      tasks[t].func = func;
+      tasks[t].data = data;
+      tasks[t].begin = (count * (size_t)t) / threads;
+      tasks[t].end = (count * (size_t)(t+1)) / threads;
+      if (t < threads-1)
+      {
+        pthread_create(handles+t, NULL, runRangeTask, tasks+t);
+      }
+    }
+    runRangeTask(tasks+threads-1);
+    for (unsigned int t = 0; t < threads-1; t++)
+    {
+      pthread_join(handles[t], NULL);
+    }
+    delete[] tasks;
+    delete[] handles;
   }
 
   //////////////////
@@ -9,8 +9,11 @@
 #pragma once
 
 #include <CL/cl.h>
+#include <map>
 #include <math.h>
 #include <stdarg.h>
+#include <string>
+#include <vector>
 
 #define CHECK_ERROR_OCL(err, op, action)                       \
   if (err != CL_SUCCESS)                                       \
@@ -37,15 +40,69 @@ extern "C" void halide_dev_sync(void *user_context);
 extern "C" void halide_copy_to_dev(void *user_context, buffer_t *buf);
 extern "C" void halide_copy_to_host(void *user_context, buffer_t *buf);
 extern "C" void halide_release(void *user_context);
+typedef int (*HalideFunction)(buffer_t *input, buffer_t *output);
+
+#define METHOD_REFERENCE  (1<<1)
+#define METHOD_HALIDE_CPU (1<<2)
+#define METHOD_HALIDE_GPU (1<<3)
+#define METHOD_OPENCL     (1<<4)
+#define METHOD_CPU        (1<<5)
 
 namespace improsa
 {
+  // Interleaved images store RGBA pixels contiguously, while planar images
+  // store four separate planes (R, G, B then A) of width*height bytes.
+  //
+  // YUV 4:2:0 images (8-bit only) store a plane of Y values followed by
+  // chroma planes subsampled by two in each direction, with U and V values
+  // interleaved (NV12) or in separate planes (I420). Their channels are
+  // read as Y, U, V and an implicit opaque alpha.
+  enum
+  {
+    LAYOUT_INTERLEAVED = 0,
+    LAYOUT_PLANAR      = 1,
+    LAYOUT_NV12        = 2,
+    LAYOUT_I420        = 3,
+  };
+
+  // Channel values are stored as normalised unsigned integers (8 or 16
+  // bits) or as unclamped 32-bit floats, for high dynamic range images
+  enum
+  {
+    PIXEL_U8  = 0,
+    PIXEL_U16 = 1,
+    PIXEL_F32 = 2,
+  };
+
+  // Kernels used to resample images to a different size
+  enum
+  {
+    RESAMPLE_BOX      = 0,
+    RESAMPLE_BILINEAR = 1,
+    RESAMPLE_LANCZOS  = 2,
+  };
+
+  // Rows are stride pixels apart, or width pixels when stride is zero. A
+  // stride wider than the image allows padded rows, or a region of interest
+  // within a larger image (see getRegion).
   typedef struct
   {
     unsigned char *data;
     size_t width, height;
+    int layout;
+    int format;
+    size_t stride;
   } Image;
 
+  // Planes of a YUV 4:2:0 image, with pitches in bytes. Chroma values are
+  // uvStep bytes apart along a row (2 for NV12, where v is u+1).
+  typedef struct
+  {
+    unsigned char *y, *u, *v;
+    size_t yPitch, uvPitch;
+    int uvStep;
+  } YUVPlanes;
+
   class Filter
   {
   public:
@@ -53,22 +110,95 @@ namespace improsa
     {
       // General parameters
       bool verify;
+      float sampleRate;
       unsigned int iterations;
 
+      // Number of images stacked vertically in each session image (at
+      // least 1)
+      unsigned int batch;
+
+      // Half-precision arithmetic in the OpenCL and Halide pipelines which
+      // support it
+      bool halfPrecision;
+
+      // CPU parameters
+      unsigned int threads;
+
       // OpenCL parameters
       cl_device_type type;
       cl_uint platformIndex, deviceIndex;
       size_t wgsize[2];
+      bool fixedPoint;
+      bool buffers;
+      bool compareBuffers;
+
+      // Pixels produced by each work-item of a coarsened kernel (0 for the
+      // kernel's default), optionally chosen by timing several values
+      unsigned int coarsening;
+      bool tuneCoarsening;
+
+      // Filter parameters
+      int radius;
+      float sigmaSpatial, sigmaRange;
+      bool bilateralGrid;
+      bool integralImage;
+      bool sobelGradient;
+
+      // Canny thresholds on the gradient magnitude of the luminance, which
+      // is four times the contrast of a step edge
+      float lowThreshold, highThreshold;
+
+      // Unsharp mask strength, and the smallest difference from the blurred
+      // image (as a fraction of the channel range) which is sharpened
+      float sharpenAmount, sharpenThreshold;
+
+      // Scale factor and kernel for resizing, and the number of levels in
+      // an image pyramid (including the input), which holds Laplacian
+      // (band-pass) levels rather than Gaussian levels when laplacian is set
+      float scale;
+      int resampling;
+      unsigned int pyramidLevels;
+      bool laplacian;
+
+      // Rectangular structuring element of the morphology filters (zero
+      // for a square element covering the filter radius)
+      unsigned int elementWidth, elementHeight;
 
       _Params_()
       {
         verify = true;
+        sampleRate = 1.f;
         iterations = 8;
+        batch = 1;
+        halfPrecision = false;
+
+        threads = 0;
 
         type = CL_DEVICE_TYPE_ALL;
         platformIndex = 0;
         deviceIndex = 0;
         wgsize[0] = wgsize[1] = 0;
+        fixedPoint = false;
+        buffers = false;
+        compareBuffers = false;
+        coarsening = 0;
+        tuneCoarsening = false;
+
+        radius = 0;
+        sigmaSpatial = 3.f;
+        sigmaRange = 0.2f;
+        bilateralGrid = false;
+        integralImage = false;
+        sobelGradient = false;
+        lowThreshold = 0.2f;
+        highThreshold = 0.6f;
+        sharpenAmount = 1.f;
+        sharpenThreshold = 0.f;
+        scale = 0.5f;
+        resampling = RESAMPLE_BOX;
+        pyramidLevels = 4;
+        laplacian = false;
+        elementWidth = elementHeight = 0;
       }
     } Params;
 
@@ -79,22 +209,79 @@ namespace improsa
     virtual void clearReferenceCache();
     virtual const char* getName() const;
 
+    virtual bool runCPU(Image input, Image output, const Params& params);
     virtual bool runHalideCPU(Image input, Image output,
                               const Params& params) = 0;
     virtual bool runHalideGPU(Image input, Image output,
                               const Params& params) = 0;
     virtual bool runOpenCL(Image input, Image output,
                            const Params& params) = 0;
-    virtual bool runReference(Image input, Image output) = 0;
+    virtual bool runReference(Image input, Image output,
+                              const Params& params) = 0;
 
     virtual void setStatusCallback(int (*callback)(const char*, va_list args));
 
+    // Size of the output produced for an input of the given size, which is
+    // the same as the input unless the filter resizes the image
+    virtual void getOutputSize(const Params& params, size_t width,
+                               size_t height, size_t size[2]) const;
+
+    // Layouts of the input and output images, given the layout requested
+    // for the input, which are the same unless the filter converts layouts
+    virtual int getInputLayout(int layout) const;
+    virtual int getOutputLayout(int layout) const;
+
+    // Sessions allow a filter to be used as a library. prepare() creates
+    // the resources for one method and image shape (taken from the given
+    // image), after which process() performs only the filtering. submit()
+    // enqueues the same work without waiting, returning an event which
+    // completes once the output has been written, or NULL if the work has
+    // already completed. The input must remain valid until then.
+    //
+    // With params.batch > 1, the images passed to process() and submit()
+    // hold that many images of the prepared shape stacked vertically, each
+    // of which is filtered independently in a single run.
+    //
+    // The CPU and OpenCL methods of each filter are sessions, and are
+    // benchmarked through them, apart from these which still run one-shot:
+    // Halide pipelines, which manage their own buffers and device copies;
+    // the Copy filter, which measures the transfers that sessions avoid;
+    // and kernels for planar images, as sessions only take interleaved
+    // images.
+    virtual bool prepare(int method, Image image, const Params& params);
+    bool process(Image input, Image output);
+    bool submit(Image input, Image output, cl_event *event);
+    virtual void release();
+
+    // Compare the throughput of filtering a set of equally sized images one
+    // at a time against packing them into a single batch
+    bool runBatch(int method, const Image *inputs, const Image *outputs,
+                  unsigned int count, const Params& params);
+
   protected:
     const char *m_name;
+    int m_radius;
     Image m_reference;
     int (*m_statusCallback)(const char*, va_list args);
     void reportStatus(const char *format, ...) const;
-    virtual bool verify(Image input, Image output, int tolerance=1);
+    virtual int getRadius(const Params& params) const;
+    virtual bool verify(Image input, Image output, const Params& params,
+                        int tolerance=1);
+    virtual bool verifySampled(Image input, Image output,
+                               const Params& params, int tolerance=1);
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
+    bool verifyApproximate(Image input, Image output, const Params& params,
+                           double minPSNR);
+    bool checkInterleaved(Image input, Image output) const;
+    bool check8Bit(Image input, Image output) const;
+    HalideFunction selectHalidePipeline(Image input,
+                                        HalideFunction interleaved,
+                                        HalideFunction planar,
+                                        HalideFunction u16,
+                                        HalideFunction f32) const;
+    HalideFunction selectHalfPipeline(Image input,
+                                      HalideFunction half) const;
 
     double m_startTime, m_endTime;
     bool outputResults(Image input, Image output, const Params& params);
@@ -105,16 +292,94 @@ namespace improsa
     cl_context m_context;
     cl_command_queue m_queue;
     cl_program m_program;
+    std::map< std::string, std::vector<unsigned char> > m_programCache;
+    bool selectDevice(const Params& params, cl_device_id *device);
+    bool checkDeviceExtension(const Params& params,
+                              const char *extension);
+    bool checkHalfKernel(const Params& params);
     bool initCL(const Params& params, const char *source, const char *options);
     void releaseCL();
+
+    // Session steps. bind() transfers the input to the device (if any) and
+    // records both images, execute() runs the filter on the bound images,
+    // and retrieve() transfers the output back to the host. The default
+    // steps run the kernel created by prepareKernel().
+    virtual bool bind(Image input, Image output, bool blocking);
+    virtual bool execute();
+    virtual bool retrieve(bool blocking, cl_event *event);
+    void beginSession(int method, Image image, const Params& params);
+    bool prepareKernel(const char *source, const char *options,
+                       const char *name, cl_image_format format);
+    bool prepareBufferKernel(const char *source, const char *options,
+                             const char *name);
+    bool checkSession(Image input, Image output) const;
+    void getSessionOutputSize(size_t size[2]) const;
+    Image getBatchImage(Image image, unsigned int index) const;
+    bool finishSession();
+
+    // Benchmark a method using a session, with the input transferred once
+    // so that only execute() is timed. With params.compareBuffers or
+    // params.tuneCoarsening, each variant of an OpenCL session's kernel is
+    // timed in turn.
+    bool benchmark(int method, Image input, Image output,
+                   const Params& params);
+    bool timeSession(int method, Image input, Image output,
+                     const Params& params);
+
+    int m_sessionMethod;
+    Params m_sessionParams;
+    Image m_sessionImage, m_sessionInput, m_sessionOutput;
+    cl_kernel m_kernel;
+    cl_mem m_deviceInput, m_deviceOutput;
+    bool m_deviceBuffers;
+    size_t m_itemPixels[2];
+
+    // Run a buffer kernel over the colour planes of planar images, taking
+    // (input, output, width, height). The alpha plane is either copied from
+    // the input or set to opaque.
+    bool runPlanarOpenCL(Image input, Image output, const Params& params,
+                         const char *source, const char *options,
+                         const char *name, bool opaque);
   };
 
   // Image utils
   buffer_t createHalideBuffer(Image image);
+  cl_image_format getImageFormat(Image image);
+  const char* getFormatName(int format);
+  size_t getChannelSize(Image image);
+  size_t getImageSize(Image image);
+  size_t getRowPitch(Image image);
+  Image getRegion(Image image, int x, int y, size_t width, size_t height);
+  void copyImage(Image input, Image output);
+  size_t getPixelOffset(Image image, int x, int y, int c);
+  bool isYUV(Image image);
+  YUVPlanes getYUVPlanes(Image image);
+  void convertLayout(Image input, Image output);
+  void copyAlphaPlane(Image input, Image output);
   float getPixel(Image image, int x, int y, int c);
   float getPixelGrayscale(Image image, int x, int y);
+  float quantize(Image image, float value);
   void setPixel(Image image, int x, int y, int c, float value);
   void setPixelGrayscale(Image image, int x, int y, float value);
+  void setPixelRGBA(Image image, int x, int y, const float value[4]);
+
+  // Memory utils. Buffers are cache-line aligned (page aligned when larger
+  // than a page) and returned to a pool on release, so that repeated runs
+  // with the same image sizes reuse allocations. Large buffers can
+  // optionally be backed by transparent huge pages.
+  void* allocateBuffer(size_t size);
+  void releaseBuffer(void *buffer);
+  void setHugePages(bool enable);
+  void trimMemoryPool();
+  size_t getPeakMemory();
+  size_t getReservedMemory();
+  void resetPeakMemory();
+
+  // Threading utils
+  typedef void (*RangeFunction)(void *data, int begin, int end);
+  unsigned int getNumThreads(unsigned int requested);
+  void parallelFor(int count, unsigned int threads,
+                   RangeFunction func, void *data);
 
   // Timing utils
   double getCurrentTime();
@@ -0,0 +1,191 @@
+// IntegralImage.cpp (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <string.h>
+
+#include "IntegralImage.h"
+
+namespace improsa
+{
+  struct IntegralArgs
+  {
+    Image image;
+    cl_uint *table;
+  };
+
+  // Prefix sum along each row of the image
+  static void integralRows(void *data, int begin, int end)
+  {
+    IntegralArgs *args = (IntegralArgs*)data;
+    Image image = args->image;
+    size_t stride = (image.width+1)*4;
+    for (int y = begin; y < end; y++)
+    {
+      const unsigned char *in = image.data + y*getRowPitch(image);
+      cl_uint *row = args->table + (y+1)*stride;
+      cl_uint sum[4] = {0, 0, 0, 0};
+      row[0] = row[1] = row[2] = row[3] = 0;
+      for (int x = 0; x < image.width; x++)
+      {
+        for (int c = 0; c < 4; c++)
+        {
+          sum[c] += in[x*4 + c];
+          row[(x+1)*4 + c] = sum[c];
+        }
+      }
+    }
+  }
+
+  // Accumulate rows downwards, for a range of columns at a time so that
+  // each step accesses contiguous memory
+  static void integralColumns(void *data, int begin, int end)
+  {
+    IntegralArgs *args = (IntegralArgs*)data;
+    Image image = args->image;
+    size_t stride = (image.width+1)*4;
+    for (int y = 1; y < image.height; y++)
+    {
+      const cl_uint *above = args->table + (y*stride) + begin*4;
+      cl_uint *row = args->table + ((y+1)*stride) + begin*4;
+      for (int i = 0; i < (end-begin)*4; i++)
+      {
+        row[i] += above[i];
+      }
+    }
+  }
+
+  IntegralImage::IntegralImage()
+  {
+    m_data = NULL;
+    m_width = 0;
+    m_height = 0;
+  }
+
+  IntegralImage::~IntegralImage()
+  {
+    releaseBuffer(m_data);
+  }
+
+  void IntegralImage::build(Image image, unsigned int threads)
+  {
+    if (image.width != m_width || image.height != m_height)
+    {
+      releaseBuffer(m_data);
+      m_width = image.width;
+      m_height = image.height;
+      m_data = (cl_uint*)allocateBuffer(
+        (m_width+1)*(m_height+1)*4*sizeof(cl_uint));
+      memset(m_data, 0, (m_width+1)*4*sizeof(cl_uint));
+    }
+
+    IntegralArgs args = {image, m_data};
+    parallelFor(image.height, threads, integralRows, &args);
+    parallelFor(image.width+1, threads, integralColumns, &args);
+  }
+
+  void IntegralImage::rectSum(int x0, int y0, int x1, int y1,
+                              cl_uint sum[4]) const
+  {
+    size_t stride = (m_width+1)*4;
+    const cl_uint *a = m_data + y0*stride + x0*4;
+    const cl_uint *b = m_data + y0*stride + (x1+1)*4;
+    const cl_uint *c = m_data + (y1+1)*stride + x0*4;
+    const cl_uint *d = m_data + (y1+1)*stride + (x1+1)*4;
+    for (int i = 0; i < 4; i++)
+    {
+      sum[i] = d[i] - b[i] - c[i] + a[i];
+    }
+  }
+
+  void IntegralImage::boxSum(int x, int y, int radius, cl_uint sum[4]) const
+  {
+    int w = m_width, h = m_height;
+    int x0 = x-radius < 0 ? 0 : x-radius;
+    int y0 = y-radius < 0 ? 0 : y-radius;
+    int x1 = x+radius >= w ? w-1 : x+radius;
+    int y1 = y+radius >= h ? h-1 : y+radius;
+    rectSum(x0, y0, x1, y1, sum);
+
+    // Number of taps that fall off each edge of the image
+    cl_uint left   = x0 - (x-radius);
+    cl_uint right  = (x+radius) - x1;
+    cl_uint top    = y0 - (y-radius);
+    cl_uint bottom = (y+radius) - y1;
+    if (!(left | right | top | bottom))
+    {
+      return;
+    }
+
+    // Clamped taps repeat the edge rows, edge columns and corners
+    cl_uint edge[4];
+    if (left)
+    {
+      rectSum(0, y0, 0, y1, edge);
+      for (int i = 0; i < 4; i++)
+      {
+        sum[i] += left*edge[i];
+      }
+    }
+    if (right)
+    {
+      rectSum(w-1, y0, w-1, y1, edge);
+      for (int i = 0; i < 4; i++)
+      {
+        sum[i] += right*edge[i];
+      }
+    }
+    if (top)
+    {
+      rectSum(x0, 0, x1, 0, edge);
+      for (int i = 0; i < 4; i++)
+      {
+        sum[i] += top*edge[i];
+      }
+    }
+    if (bottom)
+    {
+      rectSum(x0, h-1, x1, h-1, edge);
+      for (int i = 0; i < 4; i++)
+      {
+        sum[i] += bottom*edge[i];
+      }
+    }
+
+    const int cx[2] = {0, w-1}, cy[2] = {0, h-1};
+    const cl_uint nx[2] = {left, right}, ny[2] = {top, bottom};
+    for (int j = 0; j < 2; j++)
+    {
+      for (int k = 0; k < 2; k++)
+      {
+        if (nx[k] && ny[j])
+        {
+          rectSum(cx[k], cy[j], cx[k], cy[j], edge);
+          for (int i = 0; i < 4; i++)
+          {
+            sum[i] += nx[k]*ny[j]*edge[i];
+          }
+        }
+      }
+    }
+  }
+
+  const cl_uint* IntegralImage::getData() const
+  {
+    return m_data;
+  }
+
+  size_t IntegralImage::getWidth() const
+  {
+    return m_width;
+  }
+
+  size_t IntegralImage::getHeight() const
+  {
+    return m_height;
+  }
+}
@@ -0,0 +1,46 @@
+// IntegralImage.h (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#pragma once
+
+#include "Filter.h"
+
+namespace improsa
+{
+  // Summed-area table of an RGBA image, answering rectangle sums in O(1).
+  // The table has an extra leading row and column of zeros, and each entry
+  // holds the per-channel sum of all pixels above and to the left of it.
+  //
+  // Entries are 32-bit and may wrap around for large images. Differences
+  // are taken modulo 2^32 as well, so rectangle sums remain exact as long
+  // as the true sum fits in 32 bits (rectangles of up to 2^24 pixels).
+  class IntegralImage
+  {
+  public:
+    IntegralImage();
+    ~IntegralImage();
+
+    // Build the table for an image, using the given number of CPU threads
+    void build(Image image, unsigned int threads);
+
+    // Per-channel sum over [x0,x1]x[y0,y1], all coordinates inside the image
+    void rectSum(int x0, int y0, int x1, int y1, cl_uint sum[4]) const;
+
+    // Per-channel sum over the (2*radius+1)^2 window centred on (x,y),
+    // with clamp-to-edge addressing for pixels outside the image
+    void boxSum(int x, int y, int radius, cl_uint sum[4]) const;
+
+    const cl_uint* getData() const;
+    size_t getWidth() const;
+    size_t getHeight() const;
+
+  private:
+    cl_uint *m_data;
+    size_t m_width, m_height;
+  };
+}
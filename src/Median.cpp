@@ -0,0 +1,336 @@
+// Median.cpp (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+#include "Median.h"
+#include "opencl/median.h"
+
+// Largest radius handled by the OpenCL sorting network
+#define MAX_CL_RADIUS 2
+
+// Largest radius whose window size fits in 16-bit histogram counts
+#define MAX_CPU_RADIUS 127
+
+namespace improsa
+{
+  struct MedianArgs
+  {
+    Image input, output;
+    int radius;
+  };
+
+  // Each channel has a fine histogram of 256 bins and a coarse histogram
+  // of 16 bins, used to locate the median quickly
+  struct Histogram
+  {
+    unsigned short fine[3][256];
+    unsigned short coarse[3][16];
+  };
+
+  static inline int clampIndex(int i, int n)
+  {
+    return i < 0 ? 0 : i >= n ? n-1 : i;
+  }
+
+  static inline void addPixel(Histogram& hist, const unsigned char *pixel)
+  {
+    for (int c = 0; c < 3; c++)
+    {
+      hist.fine[c][pixel[c]]++;
+      hist.coarse[c][pixel[c]>>4]++;
+    }
+  }
+
+  static inline void removePixel(Histogram& hist, const unsigned char *pixel)
+  {
+    for (int c = 0; c < 3; c++)
+    {
+      hist.fine[c][pixel[c]]--;
+      hist.coarse[c][pixel[c]>>4]--;
+    }
+  }
+
+  static inline void addHistogram(Histogram& dst, const Histogram& src)
+  {
+    unsigned short *d = &dst.fine[0][0];
+    const unsigned short *s = &src.fine[0][0];
+    for (int i = 0; i < sizeof(Histogram)/sizeof(unsigned short); i++)
+    {
+      d[i] += s[i];
+    }
+  }
+
+  static inline void subHistogram(Histogram& dst, const Histogram& src)
+  {
+    unsigned short *d = &dst.fine[0][0];
+    const unsigned short *s = &src.fine[0][0];
+    for (int i = 0; i < sizeof(Histogram)/sizeof(unsigned short); i++)
+    {
+      d[i] -= s[i];
+    }
+  }
+
+  // Find the value with rank 'target' (counting from zero)
+  static inline unsigned char findRank(const Histogram& hist, int c,
+                                       int target)
+  {
+    int sum = 0, k = 0;
+    while (sum + hist.coarse[c][k] <= target)
+    {
+      sum += hist.coarse[c][k++];
+    }
+    int v = k*16;
+    while (sum + hist.fine[c][v] <= target)
+    {
+      sum += hist.fine[c][v++];
+    }
+    return v;
+  }
+
+  // Perreault and Hebert, "Median Filtering in Constant Time", IEEE TIP 16
+  // (2007). A histogram is kept for each column of the window height. Each
+  // step down a row updates every column histogram with one add and one
+  // remove. Each step along a row adds one column histogram to the kernel
+  // histogram and removes another, so the cost per pixel is independent of
+  // the radius. Each thread processes a contiguous strip of rows.
+  static void medianRows(void *data, int begin, int end)
+  {
+    MedianArgs *args = (MedianArgs*)data;
+    Image input = args->input;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(args->output);
+    int w = input.width, h = input.height, r = args->radius;
+    int target = (2*r+1)*(2*r+1)/2;
+
+    Histogram *columns = (Histogram*)allocateBuffer(w*sizeof(Histogram));
+    Histogram kernel;
+    memset(columns, 0, w*sizeof(Histogram));
+
+    for (int x = 0; x < w; x++)
+    {
+      for (int j = -r; j <= r; j++)
+      {
+        int _y = clampIndex(begin+j, h);
+        addPixel(columns[x], input.data + _y*inPitch + x*4);
+      }
+    }
+
+    for (int y = begin; y < end; y++)
+    {
+      if (y > begin)
+      {
+        int oldRow = clampIndex(y-r-1, h);
+        int newRow = clampIndex(y+r, h);
+        for (int x = 0; x < w; x++)
+        {
+          removePixel(columns[x], input.data + oldRow*inPitch + x*4);
+          addPixel(columns[x], input.data + newRow*inPitch + x*4);
+        }
+      }
+
+      memset(&kernel, 0, sizeof(Histogram));
+      for (int i = -r; i <= r; i++)
+      {
+        addHistogram(kernel, columns[clampIndex(i, w)]);
+      }
+
+      for (int x = 0; x < w; x++)
+      {
+        if (x > 0)
+        {
+          addHistogram(kernel, columns[clampIndex(x+r, w)]);
+          subHistogram(kernel, columns[clampIndex(x-r-1, w)]);
+        }
+
+        unsigned char *out = args->output.data + y*outPitch + x*4;
+        out[0] = findRank(kernel, 0, target);
+        out[1] = findRank(kernel, 1, target);
+        out[2] = findRank(kernel, 2, target);
+        out[3] = input.data[y*inPitch + x*4 + 3];
+      }
+    }
+
+    releaseBuffer(columns);
+  }
+
+  Median::Median() : Filter()
+  {
+    m_name = "Median";
+    m_radius = 1;
+  }
+
+  int Median::getRadius(const Params& params) const
+  {
+    return params.radius ? params.radius : m_radius;
+  }
+
+  bool Median::prepare(int method, Image image, const Params& params)
+  {
+    beginSession(method, image, params);
+    int radius = getRadius(params);
+
+    if (method == METHOD_CPU)
+    {
+      if (!checkInterleaved(image, image) || !check8Bit(image, image))
+      {
+        release();
+        return false;
+      }
+
+      if (radius > MAX_CPU_RADIUS)
+      {
+        reportStatus("CPU median filter supports radius up to %d",
+                     MAX_CPU_RADIUS);
+        release();
+        return false;
+      }
+
+      reportStatus("Running CPU constant-time median (radius %d) "
+                   "with %d threads", radius, getNumThreads(params.threads));
+      return true;
+    }
+    else if (method == METHOD_OPENCL)
+    {
+      if (!checkInterleaved(image, image) || !check8Bit(image, image))
+      {
+        release();
+        return false;
+      }
+
+      if (radius > MAX_CL_RADIUS)
+      {
+        reportStatus("OpenCL median filter supports radius up to %d",
+                     MAX_CL_RADIUS);
+        release();
+        return false;
+      }
+
+      if (params.buffers || params.coarsening > 1)
+      {
+        reportStatus("Only the image kernel is implemented for this filter.");
+        release();
+        return false;
+      }
+
+      char options[64];
+      sprintf(options, "-DRADIUS=%d", radius);
+      cl_image_format format = {CL_RGBA, CL_UNSIGNED_INT8};
+      if (!prepareKernel(median_kernel, options, "median", format))
+      {
+        return false;
+      }
+
+      reportStatus("Running OpenCL sorting network median (radius %d)",
+                   radius);
+      return true;
+    }
+
+    return Filter::prepare(method, image, params);
+  }
+
+  bool Median::execute()
+  {
+    if (m_sessionMethod != METHOD_CPU)
+    {
+      return Filter::execute();
+    }
+
+    unsigned int threads = getNumThreads(m_sessionParams.threads);
+    for (unsigned int b = 0; b < m_sessionParams.batch; b++)
+    {
+      MedianArgs args =
+      {
+        getBatchImage(m_sessionInput, b), getBatchImage(m_sessionOutput, b),
+        getRadius(m_sessionParams)
+      };
+      parallelFor(args.input.height, threads, medianRows, &args);
+    }
+    return true;
+  }
+
+  bool Median::runCPU(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_CPU, input, output, params);
+  }
+
+  bool Median::runHalideCPU(Image input, Image output, const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Median::runHalideGPU(Image input, Image output, const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Median::runOpenCL(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_OPENCL, input, output, params);
+  }
+
+  bool Median::runReference(Image input, Image output, const Params& params)
+  {
+    // Check for cached result
+    if (m_reference.data)
+    {
+      copyImage(m_reference, output);
+      reportStatus("Finished reference (cached)");
+      return true;
+    }
+
+    reportStatus("Running reference");
+    for (int y = 0; y < output.height; y++)
+    {
+      for (int x = 0; x < output.width; x++)
+      {
+        float pixel[4];
+        referencePixel(input, x, y, params, pixel);
+        setPixelRGBA(output, x, y, pixel);
+      }
+#if SHOW_REFERENCE_PROGRESS == 1
+      reportStatus("Completed %.1f%% of reference", (100.f*y)/(input.height-1));
+#endif
+    }
+    reportStatus("Finished reference");
+
+    // Cache result
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
+
+  // Naive median: gather and sort the window for each channel
+  bool Median::referencePixel(Image input, int x, int y,
+                              const Params& params, float result[4])
+  {
+    int radius = getRadius(params);
+    std::vector<float> values;
+    for (int c = 0; c < 3; c++)
+    {
+      values.clear();
+      for (int j = -radius; j <= radius; j++)
+      {
+        for (int i = -radius; i <= radius; i++)
+        {
+          values.push_back(getPixel(input, x+i, y+j, c));
+        }
+      }
+      std::sort(values.begin(), values.end());
+      result[c] = values[values.size()/2];
+    }
+    result[3] = getPixel(input, x, y, 3);
+    return true;
+  }
+}
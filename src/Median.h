@@ -0,0 +1,33 @@
+// Median.h (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "Filter.h"
+
+namespace improsa
+{
+  class Median : public Filter
+  {
+  public:
+    Median();
+
+    virtual bool runCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideGPU(Image input, Image output, const Params& params);
+    virtual bool runOpenCL(Image input, Image output, const Params& params);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+    virtual bool prepare(int method, Image image, const Params& params);
+
+  protected:
+    virtual bool execute();
+    virtual int getRadius(const Params& params) const;
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
+  };
+}
@@ -0,0 +1,541 @@
+// Morphology.cpp (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Morphology.h"
+#include "opencl/morphology.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+// Largest element dimension held in private memory by the OpenCL kernel
+#define MAX_CL_ELEMENT 63
+
+namespace improsa
+{
+  struct MorphologyArgs
+  {
+    Image input, output;
+    int size;
+  };
+
+  struct Erode
+  {
+    static inline unsigned char apply(unsigned char a, unsigned char b)
+    {
+      return a < b ? a : b;
+    }
+#if defined(__SSE2__)
+    static inline __m128i apply(__m128i a, __m128i b)
+    {
+      return _mm_min_epu8(a, b);
+    }
+#elif defined(__ARM_NEON__)
+    static inline uint8x16_t apply(uint8x16_t a, uint8x16_t b)
+    {
+      return vminq_u8(a, b);
+    }
+#endif
+  };
+
+  struct Dilate
+  {
+    static inline unsigned char apply(unsigned char a, unsigned char b)
+    {
+      return a > b ? a : b;
+    }
+#if defined(__SSE2__)
+    static inline __m128i apply(__m128i a, __m128i b)
+    {
+      return _mm_max_epu8(a, b);
+    }
+#elif defined(__ARM_NEON__)
+    static inline uint8x16_t apply(uint8x16_t a, uint8x16_t b)
+    {
+      return vmaxq_u8(a, b);
+    }
+#endif
+  };
+
+  static inline int clampIndex(int i, int n)
+  {
+    return i < 0 ? 0 : i >= n ? n-1 : i;
+  }
+
+  template <class Op>
+  static inline void combine(const unsigned char *a, const unsigned char *b,
+                             unsigned char *result, size_t n)
+  {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16)
+    {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+      _mm_storeu_si128((__m128i*)(result + i), Op::apply(va, vb));
+    }
+#elif defined(__ARM_NEON__)
+    for (; i + 16 <= n; i += 16)
+    {
+      vst1q_u8(result + i, Op::apply(vld1q_u8(a + i), vld1q_u8(b + i)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+      result[i] = Op::apply(a[i], b[i]);
+    }
+  }
+
+  // van Herk, "A fast algorithm for local minimum and maximum filters on
+  // rectangular and octagonal kernels", Pattern Recognition Letters 13
+  // (1992), and Gil and Werman, IEEE PAMI 15 (1993). The line is split
+  // into segments as long as the window, so every window spans the end of
+  // one segment and the start of the next. Suffix results of the first and
+  // running prefix results of the second are combined, which takes three
+  // operations per element whatever the window size.
+  //
+  // Elements [begin, end) of a line with length elements, each bytes wide
+  // and stride bytes apart, are written to out (outStride bytes apart).
+  // Reads beyond the line are clamped to its ends. The buffer holds
+  // size+1 elements.
+  template <class Op>
+  static void vanHerk(const unsigned char *line, size_t stride, int length,
+                      unsigned char *out, size_t outStride,
+                      int begin, int end, int size, size_t bytes,
+                      unsigned char *buffer)
+  {
+    unsigned char *suffix = buffer;
+    unsigned char *prefix = buffer + size*bytes;
+    int first = begin - size/2;
+    for (int base = 0; base < end-begin; base += size)
+    {
+      for (int t = size-1; t >= 0; t--)
+      {
+        const unsigned char *value =
+          line + clampIndex(first+base+t, length)*stride;
+        if (t == size-1)
+        {
+          memcpy(suffix + t*bytes, value, bytes);
+        }
+        else
+        {
+          combine<Op>(suffix + (t+1)*bytes, value, suffix + t*bytes, bytes);
+        }
+      }
+
+      for (int t = 0; t < size && base+t < end-begin; t++)
+      {
+        unsigned char *result = out + (begin+base+t)*outStride;
+        if (t == 0)
+        {
+          // The window is exactly the first segment
+          memcpy(result, suffix, bytes);
+          continue;
+        }
+
+        const unsigned char *value =
+          line + clampIndex(first+base+size+t-1, length)*stride;
+        if (t == 1)
+        {
+          memcpy(prefix, value, bytes);
+        }
+        else
+        {
+          combine<Op>(prefix, value, prefix, bytes);
+        }
+        combine<Op>(suffix + t*bytes, prefix, result, bytes);
+      }
+    }
+  }
+
+  // Windows along each row, one pixel per element. Alpha is copied.
+  template <class Op>
+  static void morphRows(void *data, int begin, int end)
+  {
+    MorphologyArgs *args = (MorphologyArgs*)data;
+    Image input = args->input, output = args->output;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(output);
+    int w = input.width;
+
+    unsigned char *buffer =
+      (unsigned char*)allocateBuffer((args->size+1)*4);
+    for (int y = begin; y < end; y++)
+    {
+      const unsigned char *in = input.data + y*inPitch;
+      unsigned char *out = output.data + y*outPitch;
+      vanHerk<Op>(in, 4, w, out, 4, 0, w, args->size, 4, buffer);
+      for (int x = 0; x < w; x++)
+      {
+        out[x*4 + 3] = in[x*4 + 3];
+      }
+    }
+    releaseBuffer(buffer);
+  }
+
+  // Windows down each column, with whole rows as elements so that the
+  // operations run across the full width of the image
+  template <class Op>
+  static void morphColumns(void *data, int begin, int end)
+  {
+    MorphologyArgs *args = (MorphologyArgs*)data;
+    Image input = args->input, output = args->output;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(output);
+    int w = input.width;
+
+    unsigned char *buffer =
+      (unsigned char*)allocateBuffer((args->size+1)*w*4);
+    vanHerk<Op>(input.data, inPitch, input.height, output.data, outPitch,
+                begin, end, args->size, w*4, buffer);
+    for (int y = begin; y < end; y++)
+    {
+      const unsigned char *in = input.data + y*inPitch;
+      unsigned char *out = output.data + y*outPitch;
+      for (int x = 0; x < w; x++)
+      {
+        out[x*4 + 3] = in[x*4 + 3];
+      }
+    }
+    releaseBuffer(buffer);
+  }
+
+  // Direct minimum or maximum over the element
+  static void referenceWindow(Image input, int x, int y, const int size[2],
+                              bool dilate, float result[4])
+  {
+    for (int c = 0; c < 3; c++)
+    {
+      result[c] = getPixel(input, x-size[0]/2, y-size[1]/2, c);
+      for (int j = 0; j < size[1]; j++)
+      {
+        for (int i = 0; i < size[0]; i++)
+        {
+          float value = getPixel(input, x+i-size[0]/2, y+j-size[1]/2, c);
+          result[c] = dilate ? fmaxf(result[c], value) :
+                               fminf(result[c], value);
+        }
+      }
+    }
+    result[3] = getPixel(input, x, y, 3);
+  }
+
+  static void referenceImage(Image input, Image output, const int size[2],
+                             bool dilate)
+  {
+    for (int y = 0; y < output.height; y++)
+    {
+      for (int x = 0; x < output.width; x++)
+      {
+        float pixel[4];
+        referenceWindow(input, x, y, size, dilate, pixel);
+        setPixelRGBA(output, x, y, pixel);
+      }
+    }
+  }
+
+  static const char *operationNames[] = {"Erode", "Dilate", "Open", "Close"};
+
+  Morphology::Morphology(int operation) : Filter()
+  {
+    m_name = operationNames[operation];
+    m_operation = operation;
+    m_radius = 1;
+    m_buffer.data = NULL;
+    m_deviceBuffers[0] = m_deviceBuffers[1] = 0;
+  }
+
+  Morphology::~Morphology()
+  {
+    release();
+  }
+
+  void Morphology::getElement(const Params& params, int size[2]) const
+  {
+    int radius = params.radius ? params.radius : m_radius;
+    size[0] = params.elementWidth ? params.elementWidth : 2*radius+1;
+    size[1] = params.elementHeight ? params.elementHeight : 2*radius+1;
+  }
+
+  // Opening and closing reach twice as far as a single operation
+  int Morphology::getRadius(const Params& params) const
+  {
+    int size[2];
+    getElement(params, size);
+    int radius = (size[0] > size[1] ? size[0] : size[1])/2;
+    return m_operation >= MORPH_OPEN ? 2*radius : radius;
+  }
+
+  bool Morphology::prepare(int method, Image image, const Params& params)
+  {
+    beginSession(method, image, params);
+    if (method != METHOD_CPU && method != METHOD_OPENCL)
+    {
+      return Filter::prepare(method, image, params);
+    }
+
+    if (!checkInterleaved(image, image) || !check8Bit(image, image))
+    {
+      release();
+      return false;
+    }
+
+    int size[2];
+    getElement(params, size);
+    if (method == METHOD_CPU)
+    {
+      m_buffer = m_sessionImage;
+      m_buffer.stride = 0;
+      m_buffer.data = (unsigned char*)allocateBuffer(getImageSize(m_buffer));
+
+      reportStatus("Running CPU van Herk/Gil-Werman %s (%dx%d) "
+                   "with %d threads", m_name, size[0], size[1],
+                   getNumThreads(params.threads));
+      return true;
+    }
+
+    if (params.buffers || params.coarsening > 1)
+    {
+      reportStatus("Only the image kernel is implemented for this filter.");
+      release();
+      return false;
+    }
+
+    if (size[0] > MAX_CL_ELEMENT || size[1] > MAX_CL_ELEMENT)
+    {
+      reportStatus("OpenCL morphology supports elements up to %dx%d",
+                   MAX_CL_ELEMENT, MAX_CL_ELEMENT);
+      release();
+      return false;
+    }
+
+    char options[64];
+    sprintf(options, "-DMAX_SIZE=%d -DIMAGE_HEIGHT=%zu",
+            size[0] > size[1] ? size[0] : size[1], image.height);
+    cl_image_format format = {CL_RGBA, CL_UNSIGNED_INT8};
+    if (!prepareKernel(morphology_kernel, options, "morph", format))
+    {
+      return false;
+    }
+
+    // Opening and closing need a second intermediate image, as the output
+    // image cannot be read by the kernel
+    cl_int err;
+    int buffers = m_operation >= MORPH_OPEN ? 2 : 1;
+    for (int i = 0; i < buffers; i++)
+    {
+      m_deviceBuffers[i] = clCreateImage2D(
+        m_context, CL_MEM_READ_WRITE, &format,
+        m_sessionImage.width, m_sessionImage.height, 0, NULL, &err);
+      CHECK_ERROR_OCL(err, "creating intermediate image",
+                      release(); return false);
+    }
+
+    reportStatus("Running OpenCL van Herk/Gil-Werman %s (%dx%d)",
+                 m_name, size[0], size[1]);
+    return true;
+  }
+
+  void Morphology::release()
+  {
+    releaseBuffer(m_buffer.data);
+    m_buffer.data = NULL;
+    for (int i = 0; i < 2; i++)
+    {
+      if (m_deviceBuffers[i])
+      {
+        clReleaseMemObject(m_deviceBuffers[i]);
+        m_deviceBuffers[i] = 0;
+      }
+    }
+    Filter::release();
+  }
+
+  bool Morphology::execute()
+  {
+    if (m_sessionMethod != METHOD_CPU && m_sessionMethod != METHOD_OPENCL)
+    {
+      return Filter::execute();
+    }
+
+    // Opening and closing apply a second operation to the output of the
+    // first, which is the intermediate image for OpenCL
+    bool dilate[2] =
+    {
+      m_operation == MORPH_DILATE || m_operation == MORPH_CLOSE,
+      m_operation == MORPH_OPEN
+    };
+    int operations = m_operation >= MORPH_OPEN ? 2 : 1;
+
+    if (m_sessionMethod == METHOD_OPENCL)
+    {
+      cl_mem input = m_deviceInput;
+      for (int k = 0; k < operations; k++)
+      {
+        cl_mem output = k+1 < operations ? m_deviceBuffers[1] : m_deviceOutput;
+        if (!enqueuePass(input, m_deviceBuffers[0], false, dilate[k]) ||
+            !enqueuePass(m_deviceBuffers[0], output, true, dilate[k]))
+        {
+          return false;
+        }
+        input = output;
+      }
+      return true;
+    }
+
+    int size[2];
+    getElement(m_sessionParams, size);
+    unsigned int threads = getNumThreads(m_sessionParams.threads);
+    for (unsigned int b = 0; b < m_sessionParams.batch; b++)
+    {
+      Image input = getBatchImage(m_sessionInput, b);
+      Image buffer = getBatchImage(m_buffer, b);
+      Image output = getBatchImage(m_sessionOutput, b);
+      for (int k = 0; k < operations; k++)
+      {
+        MorphologyArgs rowArgs = {k ? output : input, buffer, size[0]};
+        MorphologyArgs columnArgs = {buffer, output, size[1]};
+        parallelFor(input.height, threads,
+                    dilate[k] ? morphRows<Dilate> : morphRows<Erode>,
+                    &rowArgs);
+        parallelFor(input.height, threads,
+                    dilate[k] ? morphColumns<Dilate> : morphColumns<Erode>,
+                    &columnArgs);
+      }
+    }
+    return true;
+  }
+
+  // Each work-item produces a segment as long as the element, along a row
+  // or down a column of one image in the batch
+  bool Morphology::enqueuePass(cl_mem input, cl_mem output, bool columns,
+                               bool dilate)
+  {
+    int element[2];
+    getElement(m_sessionParams, element);
+    cl_int size = element[columns ? 1 : 0];
+    cl_int columnPass = columns, dilatePass = dilate;
+
+    cl_int err;
+    err  = clSetKernelArg(m_kernel, 0, sizeof(cl_mem), &input);
+    err |= clSetKernelArg(m_kernel, 1, sizeof(cl_mem), &output);
+    err |= clSetKernelArg(m_kernel, 2, sizeof(cl_int), &size);
+    err |= clSetKernelArg(m_kernel, 3, sizeof(cl_int), &columnPass);
+    err |= clSetKernelArg(m_kernel, 4, sizeof(cl_int), &dilatePass);
+    CHECK_ERROR_OCL(err, "setting kernel arguments", return false);
+
+    size_t width = m_sessionImage.width;
+    size_t height = m_sessionImage.height/m_sessionParams.batch;
+    size_t global[2] = {width, m_sessionImage.height};
+    if (columns)
+    {
+      global[1] = ((height + size-1)/size)*m_sessionParams.batch;
+    }
+    else
+    {
+      global[0] = (width + size-1)/size;
+    }
+
+    // The kernel checks bounds, so the range is rounded up to whole
+    // work-groups
+    const size_t *local = NULL;
+    if (m_sessionParams.wgsize[0] && m_sessionParams.wgsize[1])
+    {
+      local = m_sessionParams.wgsize;
+      for (int d = 0; d < 2; d++)
+      {
+        global[d] = ((global[d] + local[d]-1)/local[d])*local[d];
+      }
+    }
+
+    err = clEnqueueNDRangeKernel(
+      m_queue, m_kernel, 2, NULL, global, local, 0, NULL, NULL);
+    CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+    return true;
+  }
+
+  bool Morphology::runCPU(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_CPU, input, output, params);
+  }
+
+  bool Morphology::runHalideCPU(Image input, Image output,
+                                const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Morphology::runHalideGPU(Image input, Image output,
+                                const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Morphology::runOpenCL(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_OPENCL, input, output, params);
+  }
+
+  bool Morphology::runReference(Image input, Image output,
+                                const Params& params)
+  {
+    // Check for cached result
+    if (m_reference.data)
+    {
+      copyImage(m_reference, output);
+      reportStatus("Finished reference (cached)");
+      return true;
+    }
+
+    reportStatus("Running reference");
+    int size[2];
+    getElement(params, size);
+    if (m_operation < MORPH_OPEN)
+    {
+      referenceImage(input, output, size, m_operation == MORPH_DILATE);
+    }
+    else
+    {
+      Image buffer = output;
+      buffer.stride = 0;
+      buffer.data = (unsigned char*)allocateBuffer(getImageSize(buffer));
+      referenceImage(input, buffer, size, m_operation == MORPH_CLOSE);
+      referenceImage(buffer, output, size, m_operation == MORPH_OPEN);
+      releaseBuffer(buffer.data);
+    }
+    reportStatus("Finished reference");
+
+    // Cache result
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
+
+  // Opening and closing are only verified against the full reference
+  bool Morphology::referencePixel(Image input, int x, int y,
+                                  const Params& params, float result[4])
+  {
+    if (m_operation >= MORPH_OPEN)
+    {
+      return false;
+    }
+
+    int size[2];
+    getElement(params, size);
+    referenceWindow(input, x, y, size, m_operation == MORPH_DILATE, result);
+    return true;
+  }
+}
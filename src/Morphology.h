@@ -0,0 +1,55 @@
+// Morphology.h (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "Filter.h"
+
+namespace improsa
+{
+  enum
+  {
+    MORPH_ERODE  = 0,
+    MORPH_DILATE = 1,
+    MORPH_OPEN   = 2,
+    MORPH_CLOSE  = 3,
+  };
+
+  // Erosion (minimum) and dilation (maximum) over a rectangular structuring
+  // element, and the opening (erosion then dilation) and closing (dilation
+  // then erosion) built from them. The element is separable, so each
+  // operation is a pass along rows followed by a pass along columns.
+  class Morphology : public Filter
+  {
+  public:
+    Morphology(int operation);
+    virtual ~Morphology();
+
+    virtual bool runCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideGPU(Image input, Image output, const Params& params);
+    virtual bool runOpenCL(Image input, Image output, const Params& params);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+    virtual bool prepare(int method, Image image, const Params& params);
+    virtual void release();
+
+  protected:
+    virtual bool execute();
+    virtual int getRadius(const Params& params) const;
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
+    void getElement(const Params& params, int size[2]) const;
+    bool enqueuePass(cl_mem input, cl_mem output, bool columns, bool dilate);
+
+    int m_operation;
+
+    // Intermediate image between the row and column passes
+    Image m_buffer;
+    cl_mem m_deviceBuffers[2];
+  };
+}
@@ -0,0 +1,671 @@
+// Pyramid.cpp (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Pyramid.h"
+#include "opencl/pyramid.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace improsa
+{
+  // The reduce kernel is the outer product of these weights, which sum to
+  // 16 in each direction
+  static const int BINOMIAL[5] = {1, 4, 6, 4, 1};
+
+  static inline int clampIndex(int i, int n)
+  {
+    return i < 0 ? 0 : i >= n ? n-1 : i;
+  }
+
+  // Each level is half the size of the previous level (rounding up), and
+  // all but the first are stacked down the right of the output
+  static void getLevels(const Filter::Params& params, size_t width,
+                        size_t height, std::vector<PyramidLevel>& levels)
+  {
+    PyramidLevel level = {0, 0, width, height};
+    levels.assign(1, level);
+    for (unsigned int k = 1; k < params.pyramidLevels; k++)
+    {
+      level.x = width;
+      level.y = k > 1 ? level.y + level.height : 0;
+      level.width = (level.width+1)/2;
+      level.height = (level.height+1)/2;
+      levels.push_back(level);
+    }
+  }
+
+  static Image getLevelRegion(Image output, const PyramidLevel& level)
+  {
+    return getRegion(output, level.x, level.y, level.width, level.height);
+  }
+
+  // Taps of the expand kernel for coordinate i of the finer level. Even
+  // coordinates lie on a coarse sample, taking weights 1,6,1 from it and
+  // its neighbours, while odd coordinates lie between two coarse samples.
+  // The weights sum to 8 in both cases.
+  static inline int expandTaps(int i, int n, int index[3], int weight[3])
+  {
+    int m = i >> 1;
+    if (i & 1)
+    {
+      index[0] = clampIndex(m, n);
+      index[1] = clampIndex(m+1, n);
+      weight[0] = weight[1] = 4;
+      return 2;
+    }
+    index[0] = clampIndex(m-1, n);
+    index[1] = clampIndex(m, n);
+    index[2] = clampIndex(m+1, n);
+    weight[0] = weight[2] = 1;
+    weight[1] = 6;
+    return 3;
+  }
+
+  struct PyramidArgs
+  {
+    Image fine, coarse, output;
+  };
+
+  // Smooths and subsamples in one pass, only evaluating the kernel at the
+  // retained pixels. The vertical pass produces one row of 16-bit column
+  // sums (at most 255*16) for the horizontal pass, so each thread only
+  // needs a single row of intermediate storage.
+  static void reduceRows(void *data, int begin, int end)
+  {
+    PyramidArgs *args = (PyramidArgs*)data;
+    Image fine = args->fine, coarse = args->coarse;
+    size_t finePitch = getRowPitch(fine), coarsePitch = getRowPitch(coarse);
+    int w = fine.width, h = fine.height;
+
+    unsigned short *column =
+      (unsigned short*)allocateBuffer(w*4*sizeof(unsigned short));
+    for (int y = begin; y < end; y++)
+    {
+      const unsigned char *rows[5];
+      for (int j = 0; j < 5; j++)
+      {
+        rows[j] = fine.data + clampIndex(2*y+j-2, h)*finePitch;
+      }
+
+      int i = 0;
+#if defined(__SSE2__)
+      // Sixteen channel values at a time, widened to two registers
+      __m128i zero = _mm_setzero_si128();
+      __m128i six = _mm_set1_epi16(6);
+      for (; i + 16 <= w*4; i += 16)
+      {
+        __m128i v[5];
+        for (int j = 0; j < 5; j++)
+        {
+          v[j] = _mm_loadu_si128((const __m128i*)(rows[j] + i));
+        }
+        for (int k = 0; k < 2; k++)
+        {
+          __m128i u[5];
+          for (int j = 0; j < 5; j++)
+          {
+            u[j] = k ? _mm_unpackhi_epi8(v[j], zero) :
+                       _mm_unpacklo_epi8(v[j], zero);
+          }
+          __m128i sum = _mm_add_epi16(u[0], u[4]);
+          sum = _mm_add_epi16(
+            sum, _mm_slli_epi16(_mm_add_epi16(u[1], u[3]), 2));
+          sum = _mm_add_epi16(sum, _mm_mullo_epi16(u[2], six));
+          _mm_storeu_si128((__m128i*)(column + i + k*8), sum);
+        }
+      }
+#elif defined(__ARM_NEON__)
+      uint8x8_t six = vdup_n_u8(6);
+      for (; i + 8 <= w*4; i += 8)
+      {
+        uint8x8_t v[5];
+        for (int j = 0; j < 5; j++)
+        {
+          v[j] = vld1_u8(rows[j] + i);
+        }
+        uint16x8_t sum = vaddl_u8(v[0], v[4]);
+        sum = vaddq_u16(sum, vshlq_n_u16(vaddl_u8(v[1], v[3]), 2));
+        sum = vmlal_u8(sum, v[2], six);
+        vst1q_u16(column + i, sum);
+      }
+#endif
+      for (; i < w*4; i++)
+      {
+        column[i] = 0;
+        for (int j = 0; j < 5; j++)
+        {
+          column[i] += BINOMIAL[j]*rows[j][i];
+        }
+      }
+
+      unsigned char *out = coarse.data + y*coarsePitch;
+      for (int x = 0; x < coarse.width; x++)
+      {
+        int index[5];
+        for (int t = 0; t < 5; t++)
+        {
+          index[t] = clampIndex(2*x+t-2, w)*4;
+        }
+        for (int c = 0; c < 4; c++)
+        {
+          int sum = 128;
+          for (int t = 0; t < 5; t++)
+          {
+            sum += BINOMIAL[t]*column[index[t] + c];
+          }
+          out[x*4 + c] = sum >> 8;
+        }
+      }
+    }
+    releaseBuffer(column);
+  }
+
+  // Expands the coarse level to the size of the fine level and stores the
+  // difference, offset by 128, with the alpha of the fine level
+  static void laplacianRows(void *data, int begin, int end)
+  {
+    PyramidArgs *args = (PyramidArgs*)data;
+    Image fine = args->fine, coarse = args->coarse, output = args->output;
+    size_t finePitch = getRowPitch(fine), coarsePitch = getRowPitch(coarse);
+    size_t outPitch = getRowPitch(output);
+    int cw = coarse.width, ch = coarse.height;
+
+    unsigned short *column =
+      (unsigned short*)allocateBuffer(cw*4*sizeof(unsigned short));
+    for (int y = begin; y < end; y++)
+    {
+      int index[3], weight[3];
+      int taps = expandTaps(y, ch, index, weight);
+      for (int i = 0; i < cw*4; i++)
+      {
+        column[i] = 0;
+        for (int t = 0; t < taps; t++)
+        {
+          column[i] += weight[t]*coarse.data[index[t]*coarsePitch + i];
+        }
+      }
+
+      const unsigned char *in = fine.data + y*finePitch;
+      unsigned char *out = output.data + y*outPitch;
+      for (int x = 0; x < fine.width; x++)
+      {
+        taps = expandTaps(x, cw, index, weight);
+        for (int c = 0; c < 3; c++)
+        {
+          int sum = 32;
+          for (int t = 0; t < taps; t++)
+          {
+            sum += weight[t]*column[index[t]*4 + c];
+          }
+          int value = in[x*4 + c] - (sum >> 6) + 128;
+          out[x*4 + c] = value < 0 ? 0 : value > 255 ? 255 : value;
+        }
+        out[x*4 + 3] = in[x*4 + 3];
+      }
+    }
+    releaseBuffer(column);
+  }
+
+  // Zero the parts of the output which are not covered by a level
+  static void clearUnused(Image output,
+                          const std::vector<PyramidLevel>& levels)
+  {
+    size_t pitch = getRowPitch(output);
+    size_t left = levels[0].width;
+    for (size_t y = 0; y < output.height; y++)
+    {
+      unsigned char *row = output.data + y*pitch;
+      if (y >= levels[0].height)
+      {
+        memset(row, 0, left*4);
+      }
+
+      size_t covered = 0;
+      for (size_t k = 1; k < levels.size(); k++)
+      {
+        if (y >= levels[k].y && y < levels[k].y + levels[k].height)
+        {
+          covered = levels[k].width;
+        }
+      }
+      memset(row + (left+covered)*4, 0, (output.width-left-covered)*4);
+    }
+  }
+
+  Pyramid::Pyramid() : Filter()
+  {
+    m_name = "Pyramid";
+    m_radius = 2;
+    m_laplacianKernel = 0;
+  }
+
+  Pyramid::~Pyramid()
+  {
+    release();
+  }
+
+  void Pyramid::getOutputSize(const Params& params, size_t width,
+                              size_t height, size_t size[2]) const
+  {
+    std::vector<PyramidLevel> levels;
+    getLevels(params, width, height, levels);
+    const PyramidLevel& last = levels.back();
+    size[0] = width + (levels.size() > 1 ? levels[1].width : 0);
+    size[1] = last.y + last.height > height ? last.y + last.height : height;
+  }
+
+  bool Pyramid::prepare(int method, Image image, const Params& params)
+  {
+    beginSession(method, image, params);
+    if (method != METHOD_CPU && method != METHOD_OPENCL)
+    {
+      return Filter::prepare(method, image, params);
+    }
+
+    if (params.batch > 1)
+    {
+      reportStatus("Batches not supported for this filter.");
+      release();
+      return false;
+    }
+    if (!checkInterleaved(image, image) || !check8Bit(image, image))
+    {
+      release();
+      return false;
+    }
+
+    getLevels(params, image.width, image.height, m_levels);
+    const char *type = params.laplacian ? "Laplacian" : "Gaussian";
+
+    if (method == METHOD_OPENCL)
+    {
+      if (params.buffers || params.fixedPoint || params.halfPrecision ||
+          params.coarsening > 1)
+      {
+        reportStatus("Only the image kernel is implemented for this filter.");
+        release();
+        return false;
+      }
+      if (!prepareOpenCL())
+      {
+        return false;
+      }
+
+      reportStatus("Running OpenCL %s pyramid with %zu levels",
+                   type, m_levels.size());
+      return true;
+    }
+
+    // Intermediate Gaussian levels of a Laplacian pyramid are kept in
+    // buffers, while the others are written straight to the output
+    m_buffers.assign(m_levels.size(), Image());
+    for (size_t k = 1; params.laplacian && k+1 < m_levels.size(); k++)
+    {
+      Image buffer = {NULL, m_levels[k].width, m_levels[k].height,
+                      LAYOUT_INTERLEAVED, PIXEL_U8};
+      buffer.data = (unsigned char*)allocateBuffer(getImageSize(buffer));
+      m_buffers[k] = buffer;
+    }
+
+    reportStatus("Running CPU %s pyramid with %zu levels and %d threads",
+                 type, m_levels.size(), getNumThreads(params.threads));
+    return true;
+  }
+
+  bool Pyramid::prepareOpenCL()
+  {
+    if (!initCL(m_sessionParams, pyramid_kernel, ""))
+    {
+      release();
+      return false;
+    }
+
+    cl_int err;
+    m_kernel = clCreateKernel(m_program, "pyramid_reduce", &err);
+    CHECK_ERROR_OCL(err, "creating reduce kernel", release(); return false);
+    m_laplacianKernel = clCreateKernel(m_program, "pyramid_laplacian", &err);
+    CHECK_ERROR_OCL(err, "creating Laplacian kernel",
+                    release(); return false);
+
+    cl_image_format format = {CL_RGBA, CL_UNORM_INT8};
+    m_deviceInput = clCreateImage2D(
+      m_context, CL_MEM_READ_ONLY, &format,
+      m_sessionImage.width, m_sessionImage.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating input image", release(); return false);
+
+    size_t size[2];
+    getSessionOutputSize(size);
+    m_deviceOutput = clCreateImage2D(
+      m_context, CL_MEM_WRITE_ONLY, &format, size[0], size[1], 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating output image", release(); return false);
+
+    // Parts of the output not covered by a level are cleared once
+    unsigned char *zero = (unsigned char*)allocateBuffer(size[0]*size[1]*4);
+    memset(zero, 0, size[0]*size[1]*4);
+    size_t origin[3] = {0, 0, 0};
+    size_t region[3] = {size[0], size[1], 1};
+    err = clEnqueueWriteImage(
+      m_queue, m_deviceOutput, CL_TRUE,
+      origin, region, 0, 0, zero, 0, NULL, NULL);
+    releaseBuffer(zero);
+    CHECK_ERROR_OCL(err, "clearing output image", release(); return false);
+
+    m_levelImages.assign(m_levels.size(), (cl_mem)0);
+    for (size_t k = 1; k < m_levels.size(); k++)
+    {
+      m_levelImages[k] = clCreateImage2D(
+        m_context, CL_MEM_READ_WRITE, &format,
+        m_levels[k].width, m_levels[k].height, 0, NULL, &err);
+      CHECK_ERROR_OCL(err, "creating level image", release(); return false);
+    }
+    return true;
+  }
+
+  void Pyramid::release()
+  {
+    for (size_t k = 0; k < m_buffers.size(); k++)
+    {
+      releaseBuffer(m_buffers[k].data);
+    }
+    m_buffers.clear();
+    for (size_t k = 0; k < m_levelImages.size(); k++)
+    {
+      if (m_levelImages[k])
+      {
+        clReleaseMemObject(m_levelImages[k]);
+      }
+    }
+    m_levelImages.clear();
+    if (m_laplacianKernel)
+    {
+      clReleaseKernel(m_laplacianKernel);
+      m_laplacianKernel = 0;
+    }
+    Filter::release();
+  }
+
+  bool Pyramid::execute()
+  {
+    if (m_sessionMethod == METHOD_OPENCL)
+    {
+      return executeOpenCL();
+    }
+    if (m_sessionMethod != METHOD_CPU)
+    {
+      return Filter::execute();
+    }
+
+    Image output = m_sessionOutput;
+    unsigned int threads = getNumThreads(m_sessionParams.threads);
+    bool laplacian = m_sessionParams.laplacian && m_levels.size() > 1;
+    std::vector<Image> gaussian(m_levels.size());
+    gaussian[0] = m_sessionInput;
+    for (size_t k = 1; k < m_levels.size(); k++)
+    {
+      gaussian[k] = m_buffers[k].data ?
+        m_buffers[k] : getLevelRegion(output, m_levels[k]);
+    }
+
+    if (!laplacian)
+    {
+      copyImage(m_sessionInput, getLevelRegion(output, m_levels[0]));
+    }
+    for (size_t k = 1; k < m_levels.size(); k++)
+    {
+      PyramidArgs args = {gaussian[k-1], gaussian[k], output};
+      parallelFor(gaussian[k].height, threads, reduceRows, &args);
+    }
+    for (size_t k = 0; laplacian && k+1 < m_levels.size(); k++)
+    {
+      PyramidArgs args =
+      {
+        gaussian[k], gaussian[k+1], getLevelRegion(output, m_levels[k])
+      };
+      parallelFor(gaussian[k].height, threads, laplacianRows, &args);
+    }
+    clearUnused(output, m_levels);
+    return true;
+  }
+
+  // Levels are built in order, each from the image of the previous level.
+  // The reduce kernel also writes each level to the output, where the
+  // Laplacian kernel replaces all but the last.
+  bool Pyramid::executeOpenCL()
+  {
+    cl_int err;
+    bool laplacian = m_sessionParams.laplacian && m_levels.size() > 1;
+    if (!laplacian)
+    {
+      size_t origin[3] = {0, 0, 0};
+      size_t region[3] = {m_levels[0].width, m_levels[0].height, 1};
+      err = clEnqueueCopyImage(
+        m_queue, m_deviceInput, m_deviceOutput,
+        origin, origin, region, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "copying first level", return false);
+    }
+
+    for (size_t k = 1; k < m_levels.size(); k++)
+    {
+      cl_mem fine = k > 1 ? m_levelImages[k-1] : m_deviceInput;
+      cl_int x = m_levels[k].x, y = m_levels[k].y;
+      err  = clSetKernelArg(m_kernel, 0, sizeof(cl_mem), &fine);
+      err |= clSetKernelArg(m_kernel, 1, sizeof(cl_mem), &m_levelImages[k]);
+      err |= clSetKernelArg(m_kernel, 2, sizeof(cl_mem), &m_deviceOutput);
+      err |= clSetKernelArg(m_kernel, 3, sizeof(cl_int), &x);
+      err |= clSetKernelArg(m_kernel, 4, sizeof(cl_int), &y);
+      CHECK_ERROR_OCL(err, "setting reduce arguments", return false);
+
+      size_t global[2] = {m_levels[k].width, m_levels[k].height};
+      err = clEnqueueNDRangeKernel(
+        m_queue, m_kernel, 2, NULL, global, NULL, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "enqueuing reduce kernel", return false);
+    }
+
+    for (size_t k = 0; laplacian && k+1 < m_levels.size(); k++)
+    {
+      cl_mem fine = k > 0 ? m_levelImages[k] : m_deviceInput;
+      cl_int x = m_levels[k].x, y = m_levels[k].y;
+      err  = clSetKernelArg(m_laplacianKernel, 0, sizeof(cl_mem), &fine);
+      err |= clSetKernelArg(m_laplacianKernel, 1, sizeof(cl_mem),
+                            &m_levelImages[k+1]);
+      err |= clSetKernelArg(m_laplacianKernel, 2, sizeof(cl_mem),
+                            &m_deviceOutput);
+      err |= clSetKernelArg(m_laplacianKernel, 3, sizeof(cl_int), &x);
+      err |= clSetKernelArg(m_laplacianKernel, 4, sizeof(cl_int), &y);
+      CHECK_ERROR_OCL(err, "setting Laplacian arguments", return false);
+
+      size_t global[2] = {m_levels[k].width, m_levels[k].height};
+      err = clEnqueueNDRangeKernel(
+        m_queue, m_laplacianKernel, 2, NULL, global, NULL, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "enqueuing Laplacian kernel", return false);
+    }
+    return true;
+  }
+
+  bool Pyramid::runCPU(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_CPU, input, output, params);
+  }
+
+  bool Pyramid::runHalideCPU(Image input, Image output, const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Pyramid::runHalideGPU(Image input, Image output, const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Pyramid::runOpenCL(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_OPENCL, input, output, params);
+  }
+
+  // Straightforward version which smooths each whole level before
+  // subsampling it, and evaluates the expand kernel from its definition.
+  // Levels are held as floats in units of 8-bit channel values, and are
+  // rounded as the integer implementations round them.
+  bool Pyramid::runReference(Image input, Image output, const Params& params)
+  {
+    // Check for cached result
+    if (m_reference.data)
+    {
+      copyImage(m_reference, output);
+      reportStatus("Finished reference (cached)");
+      return true;
+    }
+
+    reportStatus("Running reference");
+    std::vector<PyramidLevel> levels;
+    getLevels(params, input.width, input.height, levels);
+    size_t numLevels = levels.size();
+    std::vector<float*> gaussian(numLevels);
+
+    gaussian[0] =
+      (float*)allocateBuffer(input.width*input.height*4*sizeof(float));
+    for (int y = 0; y < input.height; y++)
+    {
+      for (int x = 0; x < input.width; x++)
+      {
+        for (int c = 0; c < 4; c++)
+        {
+          gaussian[0][(x + y*input.width)*4 + c] =
+            floor(getPixel(input, x, y, c)*255 + 0.5f);
+        }
+      }
+    }
+
+    for (size_t k = 1; k < numLevels; k++)
+    {
+      int w = levels[k-1].width, h = levels[k-1].height;
+      const float *fine = gaussian[k-1];
+      float *smoothed = (float*)allocateBuffer(w*h*4*sizeof(float));
+      for (int y = 0; y < h; y++)
+      {
+        for (int x = 0; x < w; x++)
+        {
+          for (int c = 0; c < 4; c++)
+          {
+            float sum = 0.f;
+            for (int j = -2; j <= 2; j++)
+            {
+              for (int i = -2; i <= 2; i++)
+              {
+                int _x = clampIndex(x+i, w), _y = clampIndex(y+j, h);
+                sum += BINOMIAL[i+2]*BINOMIAL[j+2]*fine[(_x + _y*w)*4 + c];
+              }
+            }
+            smoothed[(x + y*w)*4 + c] = sum;
+          }
+        }
+      }
+
+      int cw = levels[k].width, ch = levels[k].height;
+      gaussian[k] = (float*)allocateBuffer(cw*ch*4*sizeof(float));
+      for (int y = 0; y < ch; y++)
+      {
+        for (int x = 0; x < cw; x++)
+        {
+          for (int c = 0; c < 4; c++)
+          {
+            float sum = smoothed[(2*x + 2*y*w)*4 + c];
+            gaussian[k][(x + y*cw)*4 + c] = floor((sum + 128)/256);
+          }
+        }
+      }
+      releaseBuffer(smoothed);
+#if SHOW_REFERENCE_PROGRESS == 1
+      reportStatus("Completed %.1f%% of reference", (100.f*k)/numLevels);
+#endif
+    }
+
+    float zero[4] = {0.f, 0.f, 0.f, 0.f};
+    for (int y = 0; y < output.height; y++)
+    {
+      for (int x = 0; x < output.width; x++)
+      {
+        setPixelRGBA(output, x, y, zero);
+      }
+    }
+
+    for (size_t k = 0; k < numLevels; k++)
+    {
+      const PyramidLevel& level = levels[k];
+      bool bandpass = params.laplacian && k+1 < numLevels;
+      for (int y = 0; y < level.height; y++)
+      {
+        for (int x = 0; x < level.width; x++)
+        {
+          const float *value = &gaussian[k][(x + y*level.width)*4];
+          float pixel[4] = {value[0], value[1], value[2], value[3]};
+          if (bandpass)
+          {
+            // Expand the next level, where only the kernel taps which
+            // land on samples of the coarser level contribute
+            int cw = levels[k+1].width, ch = levels[k+1].height;
+            for (int c = 0; c < 3; c++)
+            {
+              float sum = 0.f;
+              for (int j = -2; j <= 2; j++)
+              {
+                for (int i = -2; i <= 2; i++)
+                {
+                  if ((x-i) % 2 || (y-j) % 2)
+                  {
+                    continue;
+                  }
+                  int _x = clampIndex((x-i)/2, cw);
+                  int _y = clampIndex((y-j)/2, ch);
+                  sum += BINOMIAL[i+2]*BINOMIAL[j+2]*
+                         gaussian[k+1][(_x + _y*cw)*4 + c];
+                }
+              }
+              float v = value[c] - floor((sum + 32)/64) + 128;
+              pixel[c] = v < 0.f ? 0.f : v > 255.f ? 255.f : v;
+            }
+          }
+          for (int c = 0; c < 4; c++)
+          {
+            pixel[c] /= 255.f;
+          }
+          setPixelRGBA(output, level.x + x, level.y + y, pixel);
+        }
+      }
+    }
+    for (size_t k = 0; k < numLevels; k++)
+    {
+      releaseBuffer(gaussian[k]);
+    }
+    reportStatus("Finished reference");
+
+    // Cache result
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
+
+  // Levels depend on whole images, so there is no per-pixel reference
+  bool Pyramid::referencePixel(Image input, int x, int y,
+                               const Params& params, float result[4])
+  {
+    return false;
+  }
+}
@@ -0,0 +1,61 @@
+// Pyramid.h (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <vector>
+
+#include "Filter.h"
+
+namespace improsa
+{
+  // Position and size of a pyramid level within the output
+  typedef struct
+  {
+    size_t x, y;
+    size_t width, height;
+  } PyramidLevel;
+
+  // Builds a Gaussian pyramid, where each level is the previous level
+  // smoothed with a 5x5 binomial kernel and subsampled by two, or the
+  // corresponding Laplacian pyramid, where each level is the difference
+  // between a Gaussian level and the next level expanded back to its size
+  // (offset by half the range), apart from the last. The output is a
+  // mosaic with the first level on the left and the others stacked to its
+  // right.
+  class Pyramid : public Filter
+  {
+  public:
+    Pyramid();
+    virtual ~Pyramid();
+
+    virtual bool runCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideGPU(Image input, Image output, const Params& params);
+    virtual bool runOpenCL(Image input, Image output, const Params& params);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+    virtual void getOutputSize(const Params& params, size_t width,
+                               size_t height, size_t size[2]) const;
+    virtual bool prepare(int method, Image image, const Params& params);
+    virtual void release();
+
+  protected:
+    virtual bool execute();
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
+    bool prepareOpenCL();
+    bool executeOpenCL();
+
+    // Levels of the current session. Gaussian levels which do not appear
+    // in the output are held in buffers which are reused for every image.
+    std::vector<PyramidLevel> m_levels;
+    std::vector<Image> m_buffers;
+    std::vector<cl_mem> m_levelImages;
+    cl_kernel m_laplacianKernel;
+  };
+}
@@ -0,0 +1,674 @@
+// RecursiveGaussian.cpp (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "RecursiveGaussian.h"
+#include "opencl/recursive_gaussian.h"
+
+namespace improsa
+{
+  // Young and van Vliet, "Recursive implementation of the Gaussian filter",
+  // Signal Processing 44 (1995). Each pass is a third-order causal filter
+  // followed by the same filter run anti-causally:
+  //   w[n] = B*x[n] + c1*w[n-1] + c2*w[n-2] + c3*w[n-3]
+  // Coefficients are stored as {B, c1, c2, c3, M[0..8]}, where M gives the
+  // initial anti-causal state from the last three causal outputs (see
+  // Triggs and Sdika, "Boundary conditions for Young-van Vliet recursive
+  // filtering", IEEE TSP 54 (2006)).
+  static bool getCoefficients(float sigma, float coeffs[16])
+  {
+    if (sigma < 0.5f)
+    {
+      return false;
+    }
+
+    double q;
+    if (sigma >= 2.5f)
+    {
+      q = 0.98711*sigma - 0.96330;
+    }
+    else
+    {
+      q = 3.97156 - 4.14554*sqrt(1.0 - 0.26891*sigma);
+    }
+
+    double q2 = q*q, q3 = q2*q;
+    double b0 = 1.57825 + 2.44413*q + 1.4281*q2 + 0.422205*q3;
+    double b1 = 2.44413*q + 2.85619*q2 + 1.26661*q3;
+    double b2 = -(1.4281*q2 + 1.26661*q3);
+    double b3 = 0.422205*q3;
+    double B = 1.0 - (b1 + b2 + b3)/b0;
+    double c[3] = {b1/b0, b2/b0, b3/b0};
+    coeffs[0] = B;
+    coeffs[1] = c[0];
+    coeffs[2] = c[1];
+    coeffs[3] = c[2];
+
+    // The filter is linear, so rather than using the closed form for M we
+    // extend the signal beyond the edge with a constant and measure the
+    // response to each of the three causal outputs numerically
+    int length = 20*ceil(sigma) + 64;
+    std::vector<double> u(length + 3), v(length + 3);
+    for (int k = 0; k < 3; k++)
+    {
+      // u[2-k] is the k'th from last causal output, relative to the edge
+      u[0] = u[1] = u[2] = 0.0;
+      u[2-k] = 1.0;
+      for (int n = 3; n < length + 3; n++)
+      {
+        u[n] = c[0]*u[n-1] + c[1]*u[n-2] + c[2]*u[n-3];
+      }
+      v[length] = v[length+1] = v[length+2] = 0.0;
+      for (int n = length-1; n >= 3; n--)
+      {
+        v[n] = B*u[n] + c[0]*v[n+1] + c[1]*v[n+2] + c[2]*v[n+3];
+      }
+      for (int j = 0; j < 3; j++)
+      {
+        coeffs[4 + j*3 + k] = v[3+j];
+      }
+    }
+    coeffs[13] = coeffs[14] = coeffs[15] = 0.f;
+    return true;
+  }
+
+  // Given the last three causal outputs and the edge value, compute the
+  // anti-causal outputs for the three samples beyond the edge
+  static inline void getBoundary(const float coeffs[16], float edge,
+                                 float& w1, float& w2, float& w3)
+  {
+    const float *M = coeffs + 4;
+    float u1 = w1 - edge, u2 = w2 - edge, u3 = w3 - edge;
+    w1 = edge + M[0]*u1 + M[1]*u2 + M[2]*u3;
+    w2 = edge + M[3]*u1 + M[4]*u2 + M[5]*u3;
+    w3 = edge + M[6]*u1 + M[7]*u2 + M[8]*u3;
+  }
+
+  // Below this sigma the third-order recursion departs from the Gaussian
+  // by several levels (up to 16 at sigma 1), so these short kernels are
+  // applied directly instead
+  static const float MIN_RECURSIVE_SIGMA = 2.f;
+
+  // Normalised 1D Gaussian weights, as used by the reference
+  static std::vector<float> getWeights(float sigma, int radius)
+  {
+    std::vector<float> weights(2*radius + 1);
+    float total = 0.f;
+    for (int i = -radius; i <= radius; i++)
+    {
+      weights[i+radius] = exp(-(i*i) / (2*sigma*sigma));
+      total += weights[i+radius];
+    }
+    for (int i = 0; i < 2*radius + 1; i++)
+    {
+      weights[i] /= total;
+    }
+    return weights;
+  }
+
+  struct IIRArgs
+  {
+    Image input, output;
+    float *temp;
+    float coeffs[16];
+
+    // Direct convolution weights, used instead when radius > 0
+    const float *weights;
+    int radius;
+  };
+
+  static inline int clampIndex(int i, int n)
+  {
+    return i < 0 ? 0 : i >= n ? n-1 : i;
+  }
+
+  static inline unsigned char toByte(float value)
+  {
+    return value < 0.f ? 0 : value > 255.f ? 255 : value;
+  }
+
+  // Filter each row of the input into the temporary buffer. The causal
+  // pass starts from the steady-state response to the first pixel, and the
+  // anti-causal pass from the response to the last pixel repeated, which
+  // matches clamp-to-edge addressing.
+  static void iirRows(void *data, int begin, int end)
+  {
+    IIRArgs *args = (IIRArgs*)data;
+    Image input = args->input;
+    int width = input.width;
+    float B = args->coeffs[0];
+    float c1 = args->coeffs[1], c2 = args->coeffs[2], c3 = args->coeffs[3];
+    for (int y = begin; y < end; y++)
+    {
+      const unsigned char *in = input.data + y*getRowPitch(input);
+      float *row = args->temp + y*width*4;
+      for (int c = 0; c < 3; c++)
+      {
+        float w1, w2, w3;
+        w1 = w2 = w3 = in[c];
+        for (int x = 0; x < width; x++)
+        {
+          float w = B*in[x*4 + c] + c1*w1 + c2*w2 + c3*w3;
+          row[x*4 + c] = w;
+          w3 = w2;
+          w2 = w1;
+          w1 = w;
+        }
+
+        getBoundary(args->coeffs, in[(width-1)*4 + c], w1, w2, w3);
+        for (int x = width-1; x >= 0; x--)
+        {
+          float w = B*row[x*4 + c] + c1*w1 + c2*w2 + c3*w3;
+          row[x*4 + c] = w;
+          w3 = w2;
+          w2 = w1;
+          w1 = w;
+        }
+      }
+    }
+  }
+
+  // Filter a range of columns of the temporary buffer into the output.
+  // The recursion runs down all columns in the range together, so that
+  // each step accesses contiguous memory.
+  static void iirColumns(void *data, int begin, int end)
+  {
+    IIRArgs *args = (IIRArgs*)data;
+    Image input = args->input;
+    int width = input.width, height = input.height;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(args->output);
+    float B = args->coeffs[0];
+    float c1 = args->coeffs[1], c2 = args->coeffs[2], c3 = args->coeffs[3];
+
+    int n = (end - begin)*4;
+    float *state = (float*)allocateBuffer(n*4*sizeof(float));
+    float *w1 = state, *w2 = w1 + n, *w3 = w2 + n, *edge = w3 + n;
+
+    float *first = args->temp + begin*4;
+    float *last = args->temp + (begin + (height-1)*width)*4;
+    for (int i = 0; i < n; i++)
+    {
+      w1[i] = w2[i] = w3[i] = first[i];
+      edge[i] = last[i];
+    }
+    for (int y = 0; y < height; y++)
+    {
+      float *row = args->temp + (begin + y*width)*4;
+      for (int i = 0; i < n; i++)
+      {
+        float w = B*row[i] + c1*w1[i] + c2*w2[i] + c3*w3[i];
+        row[i] = w;
+        w3[i] = w2[i];
+        w2[i] = w1[i];
+        w1[i] = w;
+      }
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+      getBoundary(args->coeffs, edge[i], w1[i], w2[i], w3[i]);
+    }
+    for (int y = height-1; y >= 0; y--)
+    {
+      const float *row = args->temp + (begin + y*width)*4;
+      const unsigned char *in = input.data + y*inPitch + begin*4;
+      unsigned char *out = args->output.data + y*outPitch + begin*4;
+      for (int i = 0; i < n; i++)
+      {
+        float w = B*row[i] + c1*w1[i] + c2*w2[i] + c3*w3[i];
+        w3[i] = w2[i];
+        w2[i] = w1[i];
+        w1[i] = w;
+        out[i] = (i & 3) == 3 ? in[i] : toByte(w);
+      }
+    }
+
+    releaseBuffer(state);
+  }
+
+  // Convolve each row of the input into the temporary buffer
+  static void firRows(void *data, int begin, int end)
+  {
+    IIRArgs *args = (IIRArgs*)data;
+    Image input = args->input;
+    int width = input.width, radius = args->radius;
+    const float *weights = args->weights + radius;
+    for (int y = begin; y < end; y++)
+    {
+      const unsigned char *in = input.data + y*getRowPitch(input);
+      float *row = args->temp + y*width*4;
+      for (int x = 0; x < width; x++)
+      {
+        float sum[3] = {0.f, 0.f, 0.f};
+        for (int i = -radius; i <= radius; i++)
+        {
+          const unsigned char *p = in + clampIndex(x+i, width)*4;
+          sum[0] += p[0]*weights[i];
+          sum[1] += p[1]*weights[i];
+          sum[2] += p[2]*weights[i];
+        }
+        row[x*4 + 0] = sum[0];
+        row[x*4 + 1] = sum[1];
+        row[x*4 + 2] = sum[2];
+      }
+    }
+  }
+
+  // Convolve a range of columns of the temporary buffer into the output
+  static void firColumns(void *data, int begin, int end)
+  {
+    IIRArgs *args = (IIRArgs*)data;
+    Image input = args->input;
+    int width = input.width, height = input.height, radius = args->radius;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(args->output);
+    const float *weights = args->weights + radius;
+    for (int y = 0; y < height; y++)
+    {
+      const unsigned char *in = input.data + y*inPitch;
+      unsigned char *out = args->output.data + y*outPitch;
+      for (int i = begin*4; i < end*4; i++)
+      {
+        if ((i & 3) == 3)
+        {
+          out[i] = in[i];
+          continue;
+        }
+        float sum = 0.f;
+        for (int j = -radius; j <= radius; j++)
+        {
+          sum += args->temp[clampIndex(y+j, height)*width*4 + i]*weights[j];
+        }
+        out[i] = toByte(sum);
+      }
+    }
+  }
+
+  static void iirFilter(IIRArgs& args, unsigned int threads)
+  {
+    if (args.radius > 0)
+    {
+      parallelFor(args.input.height, threads, firRows, &args);
+      parallelFor(args.input.width, threads, firColumns, &args);
+      return;
+    }
+    parallelFor(args.input.height, threads, iirRows, &args);
+    parallelFor(args.input.width, threads, iirColumns, &args);
+  }
+
+  RecursiveGaussian::RecursiveGaussian() : Filter()
+  {
+    m_name = "RecursiveGaussian";
+    m_directRadius = 0;
+    m_temp = NULL;
+    m_columnKernel = 0;
+    m_deviceTemp = 0;
+    m_deviceWeights = 0;
+  }
+
+  RecursiveGaussian::~RecursiveGaussian()
+  {
+    release();
+  }
+
+  bool RecursiveGaussian::prepare(int method, Image image,
+                                  const Params& params)
+  {
+    beginSession(method, image, params);
+    if (method != METHOD_CPU && method != METHOD_OPENCL)
+    {
+      return Filter::prepare(method, image, params);
+    }
+
+    if (!checkInterleaved(image, image))
+    {
+      release();
+      return false;
+    }
+
+    if (!getCoefficients(params.sigmaSpatial, m_coeffs))
+    {
+      reportStatus("Recursive Gaussian requires sigma >= 0.5");
+      release();
+      return false;
+    }
+    m_directRadius = 0;
+    if (params.sigmaSpatial < MIN_RECURSIVE_SIGMA)
+    {
+      m_directRadius = getRadius(params);
+      m_weights = getWeights(params.sigmaSpatial, m_directRadius);
+    }
+    const char *type = m_directRadius ? "direct" : "recursive";
+
+    if (method == METHOD_CPU)
+    {
+      if (!check8Bit(image, image))
+      {
+        release();
+        return false;
+      }
+
+      m_temp = (float*)allocateBuffer(
+        image.width*image.height*4*sizeof(float));
+      reportStatus("Running CPU %s Gaussian (sigma=%.2f) with %d threads",
+                   type, params.sigmaSpatial, getNumThreads(params.threads));
+      return true;
+    }
+
+    if (params.buffers || params.coarsening > 1)
+    {
+      reportStatus("Only the image kernels are implemented for this filter.");
+      release();
+      return false;
+    }
+
+    // The recursion would run from one image of a batch into the next
+    if (params.batch > 1)
+    {
+      reportStatus("Batches are not supported by the OpenCL kernels.");
+      release();
+      return false;
+    }
+
+    if (!prepareOpenCL())
+    {
+      return false;
+    }
+
+    reportStatus("Running OpenCL %s Gaussian (sigma=%.2f)",
+                 type, params.sigmaSpatial);
+    return true;
+  }
+
+  bool RecursiveGaussian::prepareOpenCL()
+  {
+    if (!initCL(m_sessionParams, recursive_gaussian_kernel,
+                "-cl-fast-relaxed-math"))
+    {
+      release();
+      return false;
+    }
+
+    cl_int err;
+    Image image = m_sessionImage;
+    cl_image_format format = getImageFormat(image);
+    bool direct = m_directRadius > 0;
+
+    m_kernel = clCreateKernel(
+      m_program, direct ? "fir_rows" : "iir_rows", &err);
+    CHECK_ERROR_OCL(err, "creating row kernel", release(); return false);
+    m_columnKernel = clCreateKernel(
+      m_program, direct ? "fir_columns" : "iir_columns", &err);
+    CHECK_ERROR_OCL(err, "creating column kernel", release(); return false);
+
+    m_deviceInput = clCreateImage2D(
+      m_context, CL_MEM_READ_ONLY, &format,
+      image.width, image.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating input image", release(); return false);
+
+    m_deviceOutput = clCreateImage2D(
+      m_context, CL_MEM_WRITE_ONLY, &format,
+      image.width, image.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating output image", release(); return false);
+
+    m_deviceTemp = clCreateBuffer(
+      m_context, CL_MEM_READ_WRITE,
+      image.width*image.height*4*sizeof(float), NULL, &err);
+    CHECK_ERROR_OCL(err, "creating temporary buffer",
+                    release(); return false);
+
+    if (direct)
+    {
+      m_deviceWeights = clCreateBuffer(
+        m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        m_weights.size()*sizeof(float), &m_weights[0], &err);
+      CHECK_ERROR_OCL(err, "creating weights buffer",
+                      release(); return false);
+
+      cl_int radius = m_directRadius;
+      err  = clSetKernelArg(m_kernel, 0, sizeof(cl_mem), &m_deviceInput);
+      err |= clSetKernelArg(m_kernel, 1, sizeof(cl_mem), &m_deviceTemp);
+      err |= clSetKernelArg(m_kernel, 2, sizeof(cl_mem), &m_deviceWeights);
+      err |= clSetKernelArg(m_kernel, 3, sizeof(cl_int), &radius);
+      err |= clSetKernelArg(m_columnKernel, 0, sizeof(cl_mem), &m_deviceTemp);
+      err |= clSetKernelArg(m_columnKernel, 1, sizeof(cl_mem),
+                            &m_deviceInput);
+      err |= clSetKernelArg(m_columnKernel, 2, sizeof(cl_mem),
+                            &m_deviceOutput);
+      err |= clSetKernelArg(m_columnKernel, 3, sizeof(cl_mem),
+                            &m_deviceWeights);
+      err |= clSetKernelArg(m_columnKernel, 4, sizeof(cl_int), &radius);
+    }
+    else
+    {
+      cl_float16 coeffs;
+      memcpy(coeffs.s, m_coeffs, sizeof(m_coeffs));
+      err  = clSetKernelArg(m_kernel, 0, sizeof(cl_mem), &m_deviceInput);
+      err |= clSetKernelArg(m_kernel, 1, sizeof(cl_mem), &m_deviceTemp);
+      err |= clSetKernelArg(m_kernel, 2, sizeof(cl_float16), &coeffs);
+      err |= clSetKernelArg(m_columnKernel, 0, sizeof(cl_mem), &m_deviceTemp);
+      err |= clSetKernelArg(m_columnKernel, 1, sizeof(cl_mem),
+                            &m_deviceInput);
+      err |= clSetKernelArg(m_columnKernel, 2, sizeof(cl_mem),
+                            &m_deviceOutput);
+      err |= clSetKernelArg(m_columnKernel, 3, sizeof(cl_float16), &coeffs);
+    }
+    CHECK_ERROR_OCL(err, "setting kernel arguments", release(); return false);
+    return true;
+  }
+
+  void RecursiveGaussian::release()
+  {
+    m_weights.clear();
+    releaseBuffer(m_temp);
+    m_temp = NULL;
+    if (m_columnKernel)
+    {
+      clReleaseKernel(m_columnKernel);
+      m_columnKernel = 0;
+    }
+    if (m_deviceTemp)
+    {
+      clReleaseMemObject(m_deviceTemp);
+      m_deviceTemp = 0;
+    }
+    if (m_deviceWeights)
+    {
+      clReleaseMemObject(m_deviceWeights);
+      m_deviceWeights = 0;
+    }
+    Filter::release();
+  }
+
+  bool RecursiveGaussian::execute()
+  {
+    if (m_sessionMethod == METHOD_OPENCL)
+    {
+      // The recursion uses one work-item per row, then one per column,
+      // while direct convolution uses one per pixel for each pass
+      bool direct = m_directRadius > 0;
+      cl_uint dims = direct ? 2 : 1;
+      const size_t imageGlobal[2] =
+      {
+        m_sessionImage.width, m_sessionImage.height
+      };
+      const size_t rowsGlobal[1] = {m_sessionImage.height};
+      const size_t *rowsSize = direct ? imageGlobal : rowsGlobal;
+
+      cl_int err = clEnqueueNDRangeKernel(
+        m_queue, m_kernel, dims, NULL, rowsSize, NULL, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+      err = clEnqueueNDRangeKernel(
+        m_queue, m_columnKernel, dims, NULL, imageGlobal, NULL,
+        0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+      return true;
+    }
+    if (m_sessionMethod != METHOD_CPU)
+    {
+      return Filter::execute();
+    }
+
+    unsigned int threads = getNumThreads(m_sessionParams.threads);
+    for (unsigned int b = 0; b < m_sessionParams.batch; b++)
+    {
+      IIRArgs args;
+      args.input = getBatchImage(m_sessionInput, b);
+      args.output = getBatchImage(m_sessionOutput, b);
+      args.temp = m_temp;
+      memcpy(args.coeffs, m_coeffs, sizeof(m_coeffs));
+      args.radius = m_directRadius;
+      args.weights = m_directRadius ? &m_weights[0] : NULL;
+      iirFilter(args, threads);
+    }
+    return true;
+  }
+
+  bool RecursiveGaussian::runCPU(Image input, Image output,
+                                 const Params& params)
+  {
+    return benchmark(METHOD_CPU, input, output, params);
+  }
+
+  bool RecursiveGaussian::runHalideCPU(Image input, Image output,
+                                       const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool RecursiveGaussian::runHalideGPU(Image input, Image output,
+                                       const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool RecursiveGaussian::runOpenCL(Image input, Image output,
+                                    const Params& params)
+  {
+    return benchmark(METHOD_OPENCL, input, output, params);
+  }
+
+  // Direct separable convolution with a truncated Gaussian kernel
+  bool RecursiveGaussian::runReference(Image input, Image output,
+                                       const Params& params)
+  {
+    // Check for cached result
+    if (m_reference.data)
+    {
+      copyImage(m_reference, output);
+      reportStatus("Finished reference (cached)");
+      return true;
+    }
+
+    reportStatus("Running reference");
+
+    int radius = getRadius(params);
+    std::vector<float> weights = getWeights(params.sigmaSpatial, radius);
+
+    float *temp = (float*)allocateBuffer(
+      output.width*output.height*3*sizeof(float));
+    for (int y = 0; y < output.height; y++)
+    {
+      for (int x = 0; x < output.width; x++)
+      {
+        for (int c = 0; c < 3; c++)
+        {
+          float sum = 0.f;
+          for (int i = -radius; i <= radius; i++)
+          {
+            sum += getPixel(input, x+i, y, c) * weights[i+radius];
+          }
+          temp[(x + y*output.width)*3 + c] = sum;
+        }
+      }
+    }
+    for (int y = 0; y < output.height; y++)
+    {
+      for (int x = 0; x < output.width; x++)
+      {
+        float pixel[4];
+        for (int c = 0; c < 3; c++)
+        {
+          float sum = 0.f;
+          for (int j = -radius; j <= radius; j++)
+          {
+            int _y = clampIndex(y+j, output.height);
+            sum += temp[(x + _y*output.width)*3 + c] * weights[j+radius];
+          }
+          pixel[c] = sum;
+        }
+        pixel[3] = getPixel(input, x, y, 3);
+        setPixelRGBA(output, x, y, pixel);
+      }
+#if SHOW_REFERENCE_PROGRESS == 1
+      reportStatus("Completed %.1f%% of reference", (100.f*y)/(input.height-1));
+#endif
+    }
+    releaseBuffer(temp);
+    reportStatus("Finished reference");
+
+    // Cache result
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
+
+  int RecursiveGaussian::getRadius(const Params& params) const
+  {
+    return ceil(4*params.sigmaSpatial);
+  }
+
+  bool RecursiveGaussian::verify(Image input, Image output,
+                                 const Params& params, int tolerance)
+  {
+    // Small sigma uses direct convolution, which should match exactly
+    if (params.sigmaSpatial < MIN_RECURSIVE_SIGMA)
+    {
+      return Filter::verify(input, output, params, tolerance);
+    }
+
+    // Otherwise the recursive filter only approximates the Gaussian. On
+    // random images it scores 49 dB (max error 5) at sigma 2, improving
+    // with sigma.
+    return verifyApproximate(input, output, params, 45.0);
+  }
+
+  bool RecursiveGaussian::referencePixel(Image input, int x, int y,
+                                         const Params& params,
+                                         float result[4])
+  {
+    int radius = getRadius(params);
+    float sigma = params.sigmaSpatial;
+    float total = 0.f;
+    float r = 0;
+    float g = 0;
+    float b = 0;
+    for (int j = -radius; j <= radius; j++)
+    {
+      for (int i = -radius; i <= radius; i++)
+      {
+        float weight = exp(-(i*i + j*j) / (2*sigma*sigma));
+        r += getPixel(input, x+i, y+j, 0) * weight;
+        g += getPixel(input, x+i, y+j, 1) * weight;
+        b += getPixel(input, x+i, y+j, 2) * weight;
+        total += weight;
+      }
+    }
+    result[0] = r / total;
+    result[1] = g / total;
+    result[2] = b / total;
+    result[3] = getPixel(input, x, y, 3);
+    return true;
+  }
+}
@@ -0,0 +1,53 @@
+// RecursiveGaussian.h (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <vector>
+
+#include "Filter.h"
+
+namespace improsa
+{
+  class RecursiveGaussian : public Filter
+  {
+  public:
+    RecursiveGaussian();
+    virtual ~RecursiveGaussian();
+
+    virtual bool runCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideGPU(Image input, Image output, const Params& params);
+    virtual bool runOpenCL(Image input, Image output, const Params& params);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+    virtual bool prepare(int method, Image image, const Params& params);
+    virtual void release();
+
+  protected:
+    virtual bool execute();
+    virtual int getRadius(const Params& params) const;
+    virtual bool verify(Image input, Image output, const Params& params,
+                        int tolerance=1);
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
+    bool prepareOpenCL();
+
+    // Recursion coefficients, or the weights of the direct convolution
+    // used for small sigma (when m_directRadius > 0), and the rows
+    // filtered by the CPU for one image of a batch
+    float m_coeffs[16];
+    std::vector<float> m_weights;
+    float *m_temp;
+    int m_directRadius;
+
+    // The session kernel filters the rows into a temporary buffer, and a
+    // second kernel filters its columns into the output
+    cl_kernel m_columnKernel;
+    cl_mem m_deviceTemp, m_deviceWeights;
+  };
+}
@@ -0,0 +1,434 @@
+// Resize.cpp (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <math.h>
+#include <stdio.h>
+
+#include "Resize.h"
+#include "opencl/resize.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+// Lobes of the Lanczos kernel either side of the centre
+#define LANCZOS_A 3
+
+namespace improsa
+{
+  static const char *RESAMPLING_NAMES[] = {"box", "bilinear", "lanczos"};
+
+  static inline int clampIndex(int i, int n)
+  {
+    return i < 0 ? 0 : i >= n ? n-1 : i;
+  }
+
+  static float lanczos(float x)
+  {
+    if (x == 0.f)
+    {
+      return 1.f;
+    }
+    if (fabs(x) >= LANCZOS_A)
+    {
+      return 0.f;
+    }
+    float px = M_PI*x;
+    return LANCZOS_A*sin(px)*sin(px/LANCZOS_A)/(px*px);
+  }
+
+  // Taps per output pixel when resampling from in to out pixels
+  static int getTaps(int resampling, size_t in, size_t out)
+  {
+    if (resampling != RESAMPLE_LANCZOS)
+    {
+      return 2;
+    }
+    float scale = in/(float)out;
+    float support = LANCZOS_A*(scale > 1.f ? scale : 1.f);
+    return (int)ceil(2*support) + 1;
+  }
+
+  // Weights for output pixel i, returning the first input pixel. Pixel
+  // centres are at half-integer coordinates in both images.
+  static int getWeights(int resampling, size_t in, size_t out, int i,
+                        float *weights)
+  {
+    float scale = in/(float)out;
+    if (resampling == RESAMPLE_BOX)
+    {
+      weights[0] = weights[1] = 0.5f;
+      return 2*i;
+    }
+    else if (resampling == RESAMPLE_BILINEAR)
+    {
+      float src = (i+0.5f)*scale - 0.5f;
+      int first = floor(src);
+      weights[1] = src - first;
+      weights[0] = 1.f - weights[1];
+      return first;
+    }
+
+    float filterScale = scale > 1.f ? scale : 1.f;
+    float center = (i+0.5f)*scale;
+    int first = floor(center - LANCZOS_A*filterScale);
+    int taps = getTaps(resampling, in, out);
+    float sum = 0.f;
+    for (int t = 0; t < taps; t++)
+    {
+      weights[t] = lanczos((first+t+0.5f-center)/filterScale);
+      sum += weights[t];
+    }
+    for (int t = 0; t < taps; t++)
+    {
+      weights[t] /= sum;
+    }
+    return first;
+  }
+
+  static void computeTable(int resampling, size_t in, size_t out,
+                           ResampleTable& table)
+  {
+    table.taps = getTaps(resampling, in, out);
+    table.first.resize(out);
+    table.weights.resize(out*table.taps);
+    for (int i = 0; i < out; i++)
+    {
+      table.first[i] = getWeights(resampling, in, out, i,
+                                  &table.weights[i*table.taps]);
+    }
+  }
+
+  struct ResizeArgs
+  {
+    Image input, output;
+    const ResampleTable *x, *y;
+  };
+
+  // The vertical pass combines whole input rows into one row of floats,
+  // which the horizontal pass then resamples, so each thread only needs a
+  // single row of intermediate storage
+  static void resizeRows(void *data, int begin, int end)
+  {
+    ResizeArgs *args = (ResizeArgs*)data;
+    Image input = args->input, output = args->output;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(output);
+    int w = input.width, h = input.height;
+    const ResampleTable& tableX = *args->x;
+    const ResampleTable& tableY = *args->y;
+
+    float *row = (float*)allocateBuffer(w*4*sizeof(float));
+    for (int y = begin; y < end; y++)
+    {
+      const float *weights = &tableY.weights[y*tableY.taps];
+      for (int i = 0; i < w*4; i++)
+      {
+        row[i] = 0.f;
+      }
+      for (int t = 0; t < tableY.taps; t++)
+      {
+        if (weights[t] == 0.f)
+        {
+          continue;
+        }
+        const unsigned char *in =
+          input.data + clampIndex(tableY.first[y]+t, h)*inPitch;
+        for (int i = 0; i < w*4; i++)
+        {
+          row[i] += weights[t]*in[i];
+        }
+      }
+
+      unsigned char *out = output.data + y*outPitch;
+      for (int x = 0; x < output.width; x++)
+      {
+        weights = &tableX.weights[x*tableX.taps];
+        float sum[4] = {0.f, 0.f, 0.f, 0.f};
+        for (int t = 0; t < tableX.taps; t++)
+        {
+          const float *pixel = row + clampIndex(tableX.first[x]+t, w)*4;
+          sum[0] += weights[t]*pixel[0];
+          sum[1] += weights[t]*pixel[1];
+          sum[2] += weights[t]*pixel[2];
+          sum[3] += weights[t]*pixel[3];
+        }
+        for (int c = 0; c < 4; c++)
+        {
+          float value = sum[c] + 0.5f;
+          out[x*4 + c] = value < 0.f ? 0 : value > 255.f ? 255 : value;
+        }
+      }
+    }
+    releaseBuffer(row);
+  }
+
+  // Each output pixel is the rounded mean of a 2x2 block of input pixels
+  static void boxRows(void *data, int begin, int end)
+  {
+    ResizeArgs *args = (ResizeArgs*)data;
+    Image input = args->input, output = args->output;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(output);
+    int w = input.width, h = input.height;
+    for (int y = begin; y < end; y++)
+    {
+      const unsigned char *in0 = input.data + clampIndex(2*y, h)*inPitch;
+      const unsigned char *in1 = input.data + clampIndex(2*y+1, h)*inPitch;
+      unsigned char *out = output.data + y*outPitch;
+      int x = 0;
+#if defined(__SSE2__)
+      // Four output pixels from eight pixels of each input row. Channels
+      // are widened to 16 bits, so each register holds two pixels.
+      __m128i zero = _mm_setzero_si128();
+      __m128i two = _mm_set1_epi16(2);
+      for (; (x+4)*2 <= w; x += 4)
+      {
+        __m128i sum[2];
+        for (int k = 0; k < 2; k++)
+        {
+          __m128i a = _mm_loadu_si128((const __m128i*)(in0 + x*8 + k*16));
+          __m128i b = _mm_loadu_si128((const __m128i*)(in1 + x*8 + k*16));
+          __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+                                     _mm_unpacklo_epi8(b, zero));
+          __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+                                     _mm_unpackhi_epi8(b, zero));
+
+          // Add horizontally adjacent pixels
+          sum[k] = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi),
+                                 _mm_unpackhi_epi64(lo, hi));
+          sum[k] = _mm_srli_epi16(_mm_add_epi16(sum[k], two), 2);
+        }
+        _mm_storeu_si128((__m128i*)(out + x*4),
+                         _mm_packus_epi16(sum[0], sum[1]));
+      }
+#elif defined(__ARM_NEON__)
+      // Even and odd pixels are loaded into separate registers
+      for (; (x+4)*2 <= w; x += 4)
+      {
+        uint32x4x2_t a = vld2q_u32((const uint32_t*)(in0 + x*8));
+        uint32x4x2_t b = vld2q_u32((const uint32_t*)(in1 + x*8));
+        uint8x16_t a0 = vreinterpretq_u8_u32(a.val[0]);
+        uint8x16_t a1 = vreinterpretq_u8_u32(a.val[1]);
+        uint8x16_t b0 = vreinterpretq_u8_u32(b.val[0]);
+        uint8x16_t b1 = vreinterpretq_u8_u32(b.val[1]);
+        uint16x8_t lo = vaddq_u16(
+          vaddl_u8(vget_low_u8(a0), vget_low_u8(a1)),
+          vaddl_u8(vget_low_u8(b0), vget_low_u8(b1)));
+        uint16x8_t hi = vaddq_u16(
+          vaddl_u8(vget_high_u8(a0), vget_high_u8(a1)),
+          vaddl_u8(vget_high_u8(b0), vget_high_u8(b1)));
+        vst1q_u8(out + x*4,
+                 vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+      }
+#endif
+      for (; x < output.width; x++)
+      {
+        int x0 = clampIndex(2*x, w)*4, x1 = clampIndex(2*x+1, w)*4;
+        for (int c = 0; c < 4; c++)
+        {
+          out[x*4 + c] =
+            (in0[x0+c] + in0[x1+c] + in1[x0+c] + in1[x1+c] + 2) >> 2;
+        }
+      }
+    }
+  }
+
+  Resize::Resize() : Filter()
+  {
+    m_name = "Resize";
+    m_radius = 1;
+  }
+
+  void Resize::getOutputSize(const Params& params, size_t width,
+                             size_t height, size_t size[2]) const
+  {
+    size[0] = width*params.scale + 0.5f;
+    size[1] = height*params.scale + 0.5f;
+    size[0] = size[0] ? size[0] : 1;
+    size[1] = size[1] ? size[1] : 1;
+  }
+
+  bool Resize::checkResampling(Image image, const Params& params) const
+  {
+    if (params.batch > 1)
+    {
+      reportStatus("Batches not supported for this filter.");
+      return false;
+    }
+    if (params.resampling == RESAMPLE_BOX && params.scale != 0.5f)
+    {
+      reportStatus("Box resampling only supports a scale of 0.5");
+      return false;
+    }
+    return true;
+  }
+
+  bool Resize::prepare(int method, Image image, const Params& params)
+  {
+    beginSession(method, image, params);
+    if (!checkResampling(image, params))
+    {
+      release();
+      return false;
+    }
+
+    size_t size[2];
+    getOutputSize(params, image.width, image.height, size);
+    const char *name = RESAMPLING_NAMES[params.resampling];
+
+    if (method == METHOD_CPU)
+    {
+      if (!checkInterleaved(image, image) || !check8Bit(image, image))
+      {
+        release();
+        return false;
+      }
+
+      computeTable(params.resampling, image.width, size[0], m_tableX);
+      computeTable(params.resampling, image.height, size[1], m_tableY);
+
+      reportStatus("Running CPU %s resize to %zux%zu with %d threads",
+                   name, size[0], size[1], getNumThreads(params.threads));
+      return true;
+    }
+    else if (method == METHOD_OPENCL && image.layout == LAYOUT_INTERLEAVED)
+    {
+      if (params.buffers || params.fixedPoint || params.halfPrecision ||
+          params.coarsening > 1)
+      {
+        reportStatus("Only the image kernel is implemented for this filter.");
+        release();
+        return false;
+      }
+
+      // The Lanczos kernel loops over a fixed number of taps in each
+      // direction
+      char options[128], kernel[32];
+      sprintf(options, "-DTAPS_X=%d -DTAPS_Y=%d",
+              getTaps(params.resampling, image.width, size[0]),
+              getTaps(params.resampling, image.height, size[1]));
+      sprintf(kernel, "resize_%s", name);
+      if (!prepareKernel(resize_kernel, options, kernel,
+                         getImageFormat(image)))
+      {
+        return false;
+      }
+
+      reportStatus("Running OpenCL %s kernel to %zux%zu",
+                   kernel, size[0], size[1]);
+      return true;
+    }
+
+    return Filter::prepare(method, image, params);
+  }
+
+  bool Resize::execute()
+  {
+    if (m_sessionMethod != METHOD_CPU)
+    {
+      return Filter::execute();
+    }
+
+    ResizeArgs args =
+    {
+      m_sessionInput, m_sessionOutput, &m_tableX, &m_tableY
+    };
+    parallelFor(args.output.height, getNumThreads(m_sessionParams.threads),
+                m_sessionParams.resampling == RESAMPLE_BOX ?
+                  boxRows : resizeRows,
+                &args);
+    return true;
+  }
+
+  bool Resize::runCPU(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_CPU, input, output, params);
+  }
+
+  bool Resize::runHalideCPU(Image input, Image output, const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Resize::runHalideGPU(Image input, Image output, const Params& params)
+  {
+    reportStatus("Halide not implemented for this filter.");
+    return false;
+  }
+
+  bool Resize::runOpenCL(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_OPENCL, input, output, params);
+  }
+
+  bool Resize::runReference(Image input, Image output, const Params& params)
+  {
+    // Check for cached result
+    if (m_reference.data)
+    {
+      copyImage(m_reference, output);
+      reportStatus("Finished reference (cached)");
+      return true;
+    }
+
+    reportStatus("Running reference");
+    for (int y = 0; y < output.height; y++)
+    {
+      for (int x = 0; x < output.width; x++)
+      {
+        float pixel[4];
+        referencePixel(input, x, y, params, pixel);
+        setPixelRGBA(output, x, y, pixel);
+      }
+#if SHOW_REFERENCE_PROGRESS == 1
+      reportStatus("Completed %.1f%% of reference",
+                   (100.f*y)/(output.height-1));
+#endif
+    }
+    reportStatus("Finished reference");
+
+    // Cache result
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
+
+  // Direct 2D weighted sum over the footprint of the output pixel
+  bool Resize::referencePixel(Image input, int x, int y,
+                              const Params& params, float result[4])
+  {
+    size_t size[2];
+    getOutputSize(params, input.width, input.height, size);
+    int tapsX = getTaps(params.resampling, input.width, size[0]);
+    int tapsY = getTaps(params.resampling, input.height, size[1]);
+    std::vector<float> weightsX(tapsX), weightsY(tapsY);
+    int firstX = getWeights(params.resampling, input.width, size[0], x,
+                            &weightsX[0]);
+    int firstY = getWeights(params.resampling, input.height, size[1], y,
+                            &weightsY[0]);
+
+    for (int c = 0; c < 4; c++)
+    {
+      result[c] = 0.f;
+      for (int j = 0; j < tapsY; j++)
+      {
+        for (int i = 0; i < tapsX; i++)
+        {
+          result[c] += weightsY[j]*weightsX[i]*
+                       getPixel(input, firstX+i, firstY+j, c);
+        }
+      }
+    }
+    return true;
+  }
+}
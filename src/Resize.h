@@ -0,0 +1,52 @@
+// Resize.h (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <vector>
+
+#include "Filter.h"
+
+namespace improsa
+{
+  // Weights of the input pixels contributing to each output pixel along
+  // one axis. Each output pixel takes the same number of taps, starting
+  // from an input coordinate which is clamped to the image when used.
+  typedef struct
+  {
+    int taps;
+    std::vector<int> first;
+    std::vector<float> weights;
+  } ResampleTable;
+
+  // Resamples images by params.scale, with a 2x box filter, bilinear
+  // interpolation or a Lanczos (a=3) filter, which is widened when
+  // downsampling so that it also removes frequencies above the new limit
+  class Resize : public Filter
+  {
+  public:
+    Resize();
+
+    virtual bool runCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideGPU(Image input, Image output, const Params& params);
+    virtual bool runOpenCL(Image input, Image output, const Params& params);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+    virtual void getOutputSize(const Params& params, size_t width,
+                               size_t height, size_t size[2]) const;
+    virtual bool prepare(int method, Image image, const Params& params);
+
+  protected:
+    virtual bool execute();
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
+    bool checkResampling(Image image, const Params& params) const;
+
+    ResampleTable m_tableX, m_tableY;
+  };
+}
@@ -13,6 +13,14 @@
 #if ENABLE_HALIDE
 #include "halide/sharpen_cpu.h"
 #include "halide/sharpen_gpu.h"
+#include "halide/sharpen_cpu_planar.h"
+#include "halide/sharpen_gpu_planar.h"
+#include "halide/sharpen_cpu_u16.h"
+#include "halide/sharpen_gpu_u16.h"
+#include "halide/sharpen_cpu_f32.h"
+#include "halide/sharpen_gpu_f32.h"
+#include "halide/sharpen_cpu_half.h"
+#include "halide/sharpen_gpu_half.h"
 #endif
 
 namespace improsa
@@ -20,6 +28,7 @@ namespace improsa
   Sharpen::Sharpen() : Filter()
   {
     m_name = "Sharpen";
+    m_radius = 1;
     m_reference.data = NULL;
   }
 
@@ -30,16 +39,32 @@ namespace improsa
     buffer_t inputBuffer = createHalideBuffer(input);
     buffer_t outputBuffer = createHalideBuffer(output);
 
+    // Each layout and pixel format has a separate pipeline, and planar
+    // pipelines skip the alpha plane
+    HalideFunction pipeline = params.halfPrecision ?
+      selectHalfPipeline(input, halide_sharpen_cpu_half) :
+      selectHalidePipeline(
+        input, halide_sharpen_cpu, halide_sharpen_cpu_planar,
+        halide_sharpen_cpu_u16, halide_sharpen_cpu_f32);
+    if (!pipeline)
+    {
+      return false;
+    }
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      copyAlphaPlane(input, output);
+    }
+
     reportStatus("Running Halide CPU filter");
 
     // Warm-up run
-    halide_sharpen_cpu(&inputBuffer, &outputBuffer);
+    pipeline(&inputBuffer, &outputBuffer);
 
     // Timed runs
     startTiming();
     for (int i = 0; i < params.iterations; i++)
     {
-      halide_sharpen_cpu(&inputBuffer, &outputBuffer);
+      pipeline(&inputBuffer, &outputBuffer);
     }
     stopTiming();
 
@@ -59,18 +84,34 @@ namespace improsa
     buffer_t inputBuffer = createHalideBuffer(input);
     buffer_t outputBuffer = createHalideBuffer(output);
 
+    // Each layout and pixel format has a separate pipeline, and planar
+    // pipelines skip the alpha plane
+    HalideFunction pipeline = params.halfPrecision ?
+      selectHalfPipeline(input, halide_sharpen_gpu_half) :
+      selectHalidePipeline(
+        input, halide_sharpen_gpu, halide_sharpen_gpu_planar,
+        halide_sharpen_gpu_u16, halide_sharpen_gpu_f32);
+    if (!pipeline)
+    {
+      return false;
+    }
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      copyAlphaPlane(input, output);
+    }
+
     reportStatus("Running Halide GPU filter");
 
     // Warm-up run
     inputBuffer.host_dirty = true;
-    halide_sharpen_gpu(&inputBuffer, &outputBuffer);
+    pipeline(&inputBuffer, &outputBuffer);
     halide_dev_sync(NULL);
 
     // Timed runs
     startTiming();
     for (int i = 0; i < params.iterations; i++)
     {
-      halide_sharpen_gpu(&inputBuffer, &outputBuffer);
+      pipeline(&inputBuffer, &outputBuffer);
     }
     halide_dev_sync(NULL);
     stopTiming();
@@ -85,123 +126,102 @@ namespace improsa
 #endif
   }
 
-  bool Sharpen::runOpenCL(Image input, Image output, const Params& params)
+  bool Sharpen::prepare(int method, Image image, const Params& params)
   {
-    if (!initCL(params, sharpen_kernel, "-cl-fast-relaxed-math"))
-    {
-      return false;
-    }
-
-    cl_int err;
-    cl_kernel kernel;
-    cl_mem d_input, d_output;
-    cl_image_format format = {CL_RGBA, CL_UNORM_INT8};
-
-    kernel = clCreateKernel(m_program, "sharpen", &err);
-    CHECK_ERROR_OCL(err, "creating kernel", return false);
-
-    d_input = clCreateImage2D(
-      m_context, CL_MEM_READ_ONLY, &format,
-      input.width, input.height, 0, NULL, &err);
-    CHECK_ERROR_OCL(err, "creating input image", return false);
+    beginSession(method, image, params);
 
-    d_output = clCreateImage2D(
-      m_context, CL_MEM_WRITE_ONLY, &format,
-      input.width, input.height, 0, NULL, &err);
-    CHECK_ERROR_OCL(err, "creating output image", return false);
-
-    size_t origin[3] = {0, 0, 0};
-    size_t region[3] = {input.width, input.height, 1};
-    err = clEnqueueWriteImage(
-      m_queue, d_input, CL_TRUE,
-      origin, region, 0, 0, input.data, 0, NULL, NULL);
-    CHECK_ERROR_OCL(err, "writing image data", return false);
-
-    err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_input);
-    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_output);
-    CHECK_ERROR_OCL(err, "setting kernel arguments", return false);
+    if (method == METHOD_OPENCL && image.layout == LAYOUT_INTERLEAVED)
+    {
+      if (params.halfPrecision && !checkHalfKernel(params))
+      {
+        release();
+        return false;
+      }
 
-    reportStatus("Running OpenCL kernel");
+      if (params.buffers)
+      {
+        if (!prepareBufferKernel(sharpen_kernel, "-cl-fast-relaxed-math",
+                                 "sharpen_buffer"))
+        {
+          return false;
+        }
 
-    const size_t global[2] = {output.width, output.height};
-    const size_t *local = NULL;
-    if (params.wgsize[0] && params.wgsize[1])
-    {
-      local = params.wgsize;
-    }
+        reportStatus("Running OpenCL sharpen_buffer kernel");
+        return true;
+      }
 
-    // Timed runs
-    for (int i = 0; i < params.iterations + 1; i++)
-    {
-      err = clEnqueueNDRangeKernel(
-        m_queue, kernel, 2, NULL, global, local, 0, NULL, NULL);
-      CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+      if (params.fixedPoint && !check8Bit(image, image))
+      {
+        release();
+        return false;
+      }
 
-      // Start timing after warm-up run
-      if (i == 0)
+      cl_image_format format = getImageFormat(image);
+      const char *name = "sharpen";
+      if (params.fixedPoint)
       {
-        err = clFinish(m_queue);
-        CHECK_ERROR_OCL(err, "running kernel", return false);
-        startTiming();
+        // Integer kernel operates directly on the 8-bit channel values
+        format.image_channel_data_type = CL_UNSIGNED_INT8;
+        name = "sharpen_fixed";
+      }
+      if (params.coarsening > 1)
+      {
+        if (params.fixedPoint)
+        {
+          reportStatus("Coarsening not supported for fixed-point kernels.");
+          release();
+          return false;
+        }
+        name = "sharpen_coarse";
+      }
+      const char *options = "-cl-fast-relaxed-math";
+      if (params.halfPrecision)
+      {
+        options = "-cl-fast-relaxed-math -DHALF";
+        name = "sharpen_half";
+      }
+      if (!prepareKernel(sharpen_kernel, options, name, format))
+      {
+        return false;
       }
-    }
-    err = clFinish(m_queue);
-    CHECK_ERROR_OCL(err, "running kernel", return false);
-    stopTiming();
 
-    reportStatus("Finished OpenCL kernel");
+      reportStatus("Running OpenCL %s kernel", name);
+      return true;
+    }
 
-    err = clEnqueueReadImage(
-      m_queue, d_output, CL_TRUE,
-      origin, region, 0, 0, output.data, 0, NULL, NULL);
-    CHECK_ERROR_OCL(err, "reading image data", return false);
+    return Filter::prepare(method, image, params);
+  }
 
-    clReleaseMemObject(d_input);
-    clReleaseMemObject(d_output);
-    clReleaseKernel(kernel);
-    releaseCL();
+  bool Sharpen::runOpenCL(Image input, Image output, const Params& params)
+  {
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      return runPlanarOpenCL(input, output, params, sharpen_kernel,
+                             "-cl-fast-relaxed-math", "sharpen_planar", false);
+    }
 
-    return outputResults(input, output, params);
+    return benchmark(METHOD_OPENCL, input, output, params);
   }
 
-  bool Sharpen::runReference(Image input, Image output)
+  bool Sharpen::runReference(Image input, Image output,
+                             const Params& params)
   {
     // Check for cached result
     if (m_reference.data)
     {
-      memcpy(output.data, m_reference.data, output.width*output.height*4);
+      copyImage(m_reference, output);
       reportStatus("Finished reference (cached)");
       return true;
     }
 
-    const float mask[3][4] =
-    {
-      {-1, -1, -1},
-      {-1,  8, -1},
-      {-1, -1, -1}
-    };
-
     reportStatus("Running reference");
     for (int y = 0; y < output.height; y++)
     {
       for (int x = 0; x < output.width; x++)
       {
-        float r = 0;
-        float g = 0;
-        float b = 0;
-        for (int j = -1; j <= 1; j++)
-        {
-          for (int i = -1; i <= 1; i++)
-          {
-            r += getPixel(input, x+i, y+j, 0) * mask[i+1][j+1];
-            g += getPixel(input, x+i, y+j, 1) * mask[i+1][j+1];
-            b += getPixel(input, x+i, y+j, 2) * mask[i+1][j+1];
-          }
-        }
-        setPixel(output, x, y, 0, r/8 + getPixel(input, x, y, 0));
-        setPixel(output, x, y, 1, g/8 + getPixel(input, x, y, 1));
-        setPixel(output, x, y, 2, b/8 + getPixel(input, x, y, 2));
-        setPixel(output, x, y, 3, getPixel(input, x, y, 3));
+        float pixel[4];
+        referencePixel(input, x, y, params, pixel);
+        setPixelRGBA(output, x, y, pixel);
       }
 #if SHOW_REFERENCE_PROGRESS == 1
       reportStatus("Completed %.1f%% of reference", (100.f*y)/(input.height-1));
@@ -210,11 +230,40 @@ namespace improsa
     reportStatus("Finished reference");
 
     // Cache result
-    m_reference.width = output.width;
-    m_reference.height = output.height;
-    m_reference.data = new unsigned char[output.width*output.height*4];
-    memcpy(m_reference.data, output.data, output.width*output.height*4);
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
 
+  bool Sharpen::referencePixel(Image input, int x, int y,
+                               const Params& params, float result[4])
+  {
+    const float mask[3][4] =
+    {
+      {-1, -1, -1},
+      {-1,  8, -1},
+      {-1, -1, -1}
+    };
+
+    float r = 0;
+    float g = 0;
+    float b = 0;
+    for (int j = -1; j <= 1; j++)
+    {
+      for (int i = -1; i <= 1; i++)
+      {
+        r += getPixel(input, x+i, y+j, 0) * mask[i+1][j+1];
+        g += getPixel(input, x+i, y+j, 1) * mask[i+1][j+1];
+        b += getPixel(input, x+i, y+j, 2) * mask[i+1][j+1];
+      }
+    }
+    result[0] = r/8 + getPixel(input, x, y, 0);
+    result[1] = g/8 + getPixel(input, x, y, 1);
+    result[2] = b/8 + getPixel(input, x, y, 2);
+    result[3] = getPixel(input, x, y, 3);
     return true;
   }
 }
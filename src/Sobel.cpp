@@ -6,6 +6,8 @@
 // license terms please see the LICENSE file distributed with this
 // source code.
 
+#include <algorithm>
+#include <math.h>
 #include <string.h>
 
 #include "Sobel.h"
@@ -13,14 +15,102 @@
 #if ENABLE_HALIDE
 #include "halide/sobel_cpu.h"
 #include "halide/sobel_gpu.h"
+#include "halide/sobel_cpu_planar.h"
+#include "halide/sobel_gpu_planar.h"
+#include "halide/sobel_cpu_u16.h"
+#include "halide/sobel_gpu_u16.h"
+#include "halide/sobel_cpu_f32.h"
+#include "halide/sobel_gpu_f32.h"
 #endif
 
+// Default work-group size of the gradient kernel, which sets the size of
+// its local memory tile
+#define GRADIENT_TILE 16
+
+// Largest difference in gradient direction (radians) accepted by
+// verification, where the gradient is large enough to define one
+#define ANGLE_TOLERANCE 0.01f
+
 namespace improsa
 {
+  struct GradientArgs
+  {
+    Image input;
+    float *magnitude, *angle;
+  };
+
+  static void luminanceRow(Image input, int y, float *lum)
+  {
+    const unsigned char *row = input.data + y*getRowPitch(input);
+    for (int x = 0; x < input.width; x++)
+    {
+      const unsigned char *p = row + x*4;
+      lum[x] = (p[0]*0.299f + p[1]*0.587f + p[2]*0.114f) * (1.f/255.f);
+    }
+  }
+
+  // Each row of luminance is computed once and kept for the three output
+  // rows which use it, so the cost of conversion is shared by nine taps
+  static void gradientRows(void *data, int begin, int end)
+  {
+    GradientArgs *args = (GradientArgs*)data;
+    Image input = args->input;
+    int w = input.width, h = input.height;
+
+    float *buffer = (float*)allocateBuffer(3*w*sizeof(float));
+    float *rows[3] = {buffer, buffer + w, buffer + 2*w};
+    luminanceRow(input, std::max(begin-1, 0), rows[0]);
+    luminanceRow(input, begin, rows[1]);
+
+    for (int y = begin; y < end; y++)
+    {
+      luminanceRow(input, std::min(y+1, h-1), rows[2]);
+
+      const float *above = rows[0], *row = rows[1], *below = rows[2];
+      float *magnitude = args->magnitude + y*w;
+      float *angle = args->angle + y*w;
+      for (int x = 0; x < w; x++)
+      {
+        int l = std::max(x-1, 0), r = std::min(x+1, w-1);
+        float g_x = (above[r] - above[l]) + 2*(row[r] - row[l]) +
+                    (below[r] - below[l]);
+        float g_y = (below[l] + 2*below[x] + below[r]) -
+                    (above[l] + 2*above[x] + above[r]);
+        magnitude[x] = sqrtf(g_x*g_x + g_y*g_y);
+        angle[x] = atan2f(g_y, g_x);
+      }
+
+      float *top = rows[0];
+      rows[0] = rows[1];
+      rows[1] = rows[2];
+      rows[2] = top;
+    }
+
+    releaseBuffer(buffer);
+  }
+
   Sobel::Sobel() : Filter()
   {
     m_name = "Sobel";
+    m_radius = 1;
     m_reference.data = NULL;
+    m_magnitude = m_angle = NULL;
+    m_deviceMagnitude = m_deviceAngle = 0;
+    m_directions = NULL;
+  }
+
+  Sobel::~Sobel()
+  {
+    release();
+  }
+
+  bool Sobel::runCPU(Image input, Image output, const Params& params)
+  {
+    if (!params.sobelGradient)
+    {
+      return Filter::runCPU(input, output, params);
+    }
+    return runGradient(METHOD_CPU, input, output, params);
   }
 
   bool Sobel::runHalideCPU(Image input, Image output, const Params& params)
@@ -30,16 +120,31 @@ namespace improsa
     buffer_t inputBuffer = createHalideBuffer(input);
     buffer_t outputBuffer = createHalideBuffer(output);
 
+    // Each layout and pixel format has a separate pipeline, and planar
+    // pipelines skip the alpha plane
+    HalideFunction pipeline = selectHalidePipeline(
+      input, halide_sobel_cpu, halide_sobel_cpu_planar,
+      halide_sobel_cpu_u16, halide_sobel_cpu_f32);
+    if (!pipeline)
+    {
+      return false;
+    }
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      memset(output.data + getPixelOffset(output, 0, 0, 3), 255,
+             getRowPitch(output)*output.height);
+    }
+
     reportStatus("Running Halide CPU filter");
 
     // Warm-up run
-    halide_sobel_cpu(&inputBuffer, &outputBuffer);
+    pipeline(&inputBuffer, &outputBuffer);
 
     // Timed runs
     startTiming();
     for (int i = 0; i < params.iterations; i++)
     {
-      halide_sobel_cpu(&inputBuffer, &outputBuffer);
+      pipeline(&inputBuffer, &outputBuffer);
     }
     stopTiming();
 
@@ -59,18 +164,33 @@ namespace improsa
     buffer_t inputBuffer = createHalideBuffer(input);
     buffer_t outputBuffer = createHalideBuffer(output);
 
+    // Each layout and pixel format has a separate pipeline, and planar
+    // pipelines skip the alpha plane
+    HalideFunction pipeline = selectHalidePipeline(
+      input, halide_sobel_gpu, halide_sobel_gpu_planar,
+      halide_sobel_gpu_u16, halide_sobel_gpu_f32);
+    if (!pipeline)
+    {
+      return false;
+    }
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      memset(output.data + getPixelOffset(output, 0, 0, 3), 255,
+             getRowPitch(output)*output.height);
+    }
+
     reportStatus("Running Halide GPU filter");
 
     // Warm-up run
     inputBuffer.host_dirty = true;
-    halide_sobel_gpu(&inputBuffer, &outputBuffer);
+    pipeline(&inputBuffer, &outputBuffer);
     halide_dev_sync(NULL);
 
     // Timed runs
     startTiming();
     for (int i = 0; i < params.iterations; i++)
     {
-      halide_sobel_gpu(&inputBuffer, &outputBuffer);
+      pipeline(&inputBuffer, &outputBuffer);
     }
     halide_dev_sync(NULL);
     stopTiming();
@@ -85,119 +205,181 @@ namespace improsa
 #endif
   }
 
-  bool Sobel::runOpenCL(Image input, Image output, const Params& params)
+  bool Sobel::prepare(int method, Image image, const Params& params)
   {
-    if (!initCL(params, sobel_kernel, "-cl-fast-relaxed-math"))
+    beginSession(method, image, params);
+    if (params.sobelGradient)
     {
-      return false;
+      return prepareGradient();
     }
 
-    cl_int err;
-    cl_kernel kernel;
-    cl_mem d_input, d_output;
-    cl_image_format format = {CL_RGBA, CL_UNORM_INT8};
+    if (method == METHOD_OPENCL && image.layout == LAYOUT_INTERLEAVED)
+    {
+      if (params.buffers)
+      {
+        if (!prepareBufferKernel(sobel_kernel, "-cl-fast-relaxed-math",
+                                 "sobel_buffer"))
+        {
+          return false;
+        }
 
-    kernel = clCreateKernel(m_program, "sobel", &err);
-    CHECK_ERROR_OCL(err, "creating kernel", return false);
+        reportStatus("Running OpenCL sobel_buffer kernel");
+        return true;
+      }
 
-    d_input = clCreateImage2D(
-      m_context, CL_MEM_READ_ONLY, &format,
-      input.width, input.height, 0, NULL, &err);
-    CHECK_ERROR_OCL(err, "creating input image", return false);
+      if (params.fixedPoint && !check8Bit(image, image))
+      {
+        release();
+        return false;
+      }
 
-    d_output = clCreateImage2D(
-      m_context, CL_MEM_WRITE_ONLY, &format,
-      input.width, input.height, 0, NULL, &err);
-    CHECK_ERROR_OCL(err, "creating output image", return false);
+      cl_image_format format = getImageFormat(image);
+      const char *name = "sobel";
+      if (params.fixedPoint)
+      {
+        // Integer kernel operates directly on the 8-bit channel values
+        format.image_channel_data_type = CL_UNSIGNED_INT8;
+        name = "sobel_fixed";
+      }
+      if (params.coarsening > 1)
+      {
+        if (params.fixedPoint)
+        {
+          reportStatus("Coarsening not supported for fixed-point kernels.");
+          release();
+          return false;
+        }
+        name = "sobel_coarse";
+      }
+      if (!prepareKernel(sobel_kernel, "-cl-fast-relaxed-math",
+                         name, format))
+      {
+        return false;
+      }
 
-    size_t origin[3] = {0, 0, 0};
-    size_t region[3] = {input.width, input.height, 1};
-    err = clEnqueueWriteImage(
-      m_queue, d_input, CL_TRUE,
-      origin, region, 0, 0, input.data, 0, NULL, NULL);
-    CHECK_ERROR_OCL(err, "writing image data", return false);
+      reportStatus("Running OpenCL %s kernel", name);
+      return true;
+    }
+
+    return Filter::prepare(method, image, params);
+  }
 
-    err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_input);
-    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_output);
-    CHECK_ERROR_OCL(err, "setting kernel arguments", return false);
+  void Sobel::release()
+  {
+    releaseBuffer(m_magnitude);
+    releaseBuffer(m_angle);
+    m_magnitude = m_angle = NULL;
+    if (m_deviceMagnitude)
+    {
+      clReleaseMemObject(m_deviceMagnitude);
+      m_deviceMagnitude = 0;
+    }
+    if (m_deviceAngle)
+    {
+      clReleaseMemObject(m_deviceAngle);
+      m_deviceAngle = 0;
+    }
+    Filter::release();
+  }
 
-    reportStatus("Running OpenCL kernel");
+  bool Sobel::execute()
+  {
+    if (!m_sessionParams.sobelGradient)
+    {
+      return Filter::execute();
+    }
 
-    const size_t global[2] = {output.width, output.height};
-    const size_t *local = NULL;
-    if (params.wgsize[0] && params.wgsize[1])
+    if (m_sessionMethod == METHOD_CPU)
     {
-      local = params.wgsize;
+      computeGradient(m_sessionInput, m_magnitude, m_angle,
+                      getNumThreads(m_sessionParams.threads));
+      return true;
     }
 
-    // Timed runs
-    for (int i = 0; i < params.iterations + 1; i++)
+    // Every work-group loads a whole tile, so the global size is rounded up
+    const size_t global[2] =
+    {
+      (m_sessionImage.width + m_tile[0] - 1)/m_tile[0]*m_tile[0],
+      (m_sessionImage.height + m_tile[1] - 1)/m_tile[1]*m_tile[1]
+    };
+    cl_int err = clEnqueueNDRangeKernel(
+      m_queue, m_kernel, 2, NULL, global, m_tile, 0, NULL, NULL);
+    CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+    return true;
+  }
+
+  // The gradient is always retrieved with a blocking read, as the
+  // magnitudes are then expanded into the output image on the host
+  bool Sobel::retrieve(bool blocking, cl_event *event)
+  {
+    if (!m_sessionParams.sobelGradient)
     {
-      err = clEnqueueNDRangeKernel(
-        m_queue, kernel, 2, NULL, global, local, 0, NULL, NULL);
-      CHECK_ERROR_OCL(err, "enqueuing kernel", return false);
+      return Filter::retrieve(blocking, event);
+    }
+
+    Image output = m_sessionOutput;
+    size_t size = output.width*output.height*sizeof(float);
+    if (m_sessionMethod == METHOD_OPENCL)
+    {
+      cl_int err = clEnqueueReadBuffer(
+        m_queue, m_deviceMagnitude, CL_FALSE, 0, size, m_magnitude,
+        0, NULL, NULL);
+      err |= clEnqueueReadBuffer(
+        m_queue, m_deviceAngle, CL_TRUE, 0, size, m_angle, 0, NULL, NULL);
+      CHECK_ERROR_OCL(err, "reading buffer data", return false);
+    }
 
-      // Start timing after warm-up run
-      if (i == 0)
+    for (int y = 0; y < output.height; y++)
+    {
+      for (int x = 0; x < output.width; x++)
       {
-        err = clFinish(m_queue);
-        CHECK_ERROR_OCL(err, "running kernel", return false);
-        startTiming();
+        float m = m_magnitude[x + y*output.width];
+        float pixel[4] = {m, m, m, 1.f};
+        setPixelRGBA(output, x, y, pixel);
       }
     }
-    err = clFinish(m_queue);
-    CHECK_ERROR_OCL(err, "running kernel", return false);
-    stopTiming();
-
-    reportStatus("Finished OpenCL kernel");
+    if (m_directions)
+    {
+      memcpy(m_directions, m_angle, size);
+    }
+    return true;
+  }
 
-    err = clEnqueueReadImage(
-      m_queue, d_output, CL_TRUE,
-      origin, region, 0, 0, output.data, 0, NULL, NULL);
-    CHECK_ERROR_OCL(err, "reading image data", return false);
+  bool Sobel::runOpenCL(Image input, Image output, const Params& params)
+  {
+    if (params.sobelGradient)
+    {
+      return runGradient(METHOD_OPENCL, input, output, params);
+    }
 
-    clReleaseMemObject(d_input);
-    clReleaseMemObject(d_output);
-    clReleaseKernel(kernel);
-    releaseCL();
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      return runPlanarOpenCL(input, output, params, sobel_kernel,
+                             "-cl-fast-relaxed-math", "sobel_planar", true);
+    }
 
-    return outputResults(input, output, params);
+    return benchmark(METHOD_OPENCL, input, output, params);
   }
 
-  bool Sobel::runReference(Image input, Image output)
+  bool Sobel::runReference(Image input, Image output,
+                           const Params& params)
   {
     // Check for cached result
     if (m_reference.data)
     {
-      memcpy(output.data, m_reference.data, output.width*output.height*4);
+      copyImage(m_reference, output);
       reportStatus("Finished reference (cached)");
       return true;
     }
 
-    const float mask[3][4] =
-    {
-      {-1, -2, -1},
-      {0, 0, 0},
-      {1, 2, 1}
-    };
-
     reportStatus("Running reference");
     for (int y = 0; y < output.height; y++)
     {
       for (int x = 0; x < output.width; x++)
       {
-        float g_x = 0;
-        float g_y = 0;
-        for (int j = -1; j <= 1; j++)
-        {
-          for (int i = -1; i <= 1; i++)
-          {
-            g_x += getPixelGrayscale(input, x+i, y+j) * mask[i+1][j+1];
-            g_y += getPixelGrayscale(input, x+i, y+j) * mask[j+1][i+1];
-          }
-        }
-        float g_mag = sqrt(g_x*g_x + g_y*g_y);
-        setPixelGrayscale(output, x, y, g_mag);
+        float pixel[4];
+        referencePixel(input, x, y, params, pixel);
+        setPixelRGBA(output, x, y, pixel);
       }
 #if SHOW_REFERENCE_PROGRESS == 1
       reportStatus("Completed %.1f%% of reference", (100.f*y)/(input.height-1));
@@ -206,11 +388,231 @@ namespace improsa
     reportStatus("Finished reference");
 
     // Cache result
-    m_reference.width = output.width;
-    m_reference.height = output.height;
-    m_reference.data = new unsigned char[output.width*output.height*4];
-    memcpy(m_reference.data, output.data, output.width*output.height*4);
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
+
+  bool Sobel::referencePixel(Image input, int x, int y,
+                             const Params& params, float result[4])
+  {
+    float g_x, g_y;
+    referenceGradient(input, x, y, g_x, g_y);
+    float g_mag = sqrt(g_x*g_x + g_y*g_y);
+    result[0] = result[1] = result[2] = g_mag;
+    result[3] = 1.f;
+    return true;
+  }
+
+  void Sobel::referenceGradient(Image input, int x, int y,
+                                float& g_x, float& g_y)
+  {
+    const float mask[3][4] =
+    {
+      {-1, -2, -1},
+      {0, 0, 0},
+      {1, 2, 1}
+    };
+
+    g_x = 0;
+    g_y = 0;
+    for (int j = -1; j <= 1; j++)
+    {
+      for (int i = -1; i <= 1; i++)
+      {
+        float lum = getPixelGrayscale(input, x+i, y+j);
+        g_x += lum * mask[i+1][j+1];
+        g_y += lum * mask[j+1][i+1];
+      }
+    }
+  }
+
+  bool Sobel::runGradient(int method, Image input, Image output,
+                          const Params& params)
+  {
+    // The directions are checked once the session has been released
+    float *angle =
+      (float*)allocateBuffer(input.width*input.height*sizeof(float));
+    m_directions = angle;
+    bool success = timeSession(method, input, output, params);
+    m_directions = NULL;
+
+    if (success)
+    {
+      if (params.verify && !verifyAngles(input, angle))
+      {
+        reportStatus("Gradient directions failed verification");
+        success = false;
+      }
+      success = outputResults(input, output, params) && success;
+    }
+
+    releaseBuffer(angle);
+    return success;
+  }
+
+  // The gradient outputs hold a single image, so batches are not supported
+  bool Sobel::prepareGradient()
+  {
+    Image image = m_sessionImage;
+    if (m_sessionMethod != METHOD_CPU && m_sessionMethod != METHOD_OPENCL)
+    {
+      return Filter::prepare(m_sessionMethod, image, m_sessionParams);
+    }
+    if (!checkInterleaved(image, image))
+    {
+      release();
+      return false;
+    }
+    if (m_sessionParams.batch > 1)
+    {
+      reportStatus("Batches are not supported for gradient outputs.");
+      release();
+      return false;
+    }
+
+    size_t size = image.width*image.height*sizeof(float);
+    m_magnitude = (float*)allocateBuffer(size);
+    m_angle = (float*)allocateBuffer(size);
+
+    if (m_sessionMethod == METHOD_CPU)
+    {
+      if (!check8Bit(image, image))
+      {
+        release();
+        return false;
+      }
 
+      reportStatus("Running CPU gradient with %d threads",
+                   getNumThreads(m_sessionParams.threads));
+      return true;
+    }
+
+    if (m_sessionParams.buffers || m_sessionParams.coarsening > 1)
+    {
+      reportStatus("Only the image kernel is implemented for gradients.");
+      release();
+      return false;
+    }
+
+    if (!prepareGradientOpenCL())
+    {
+      return false;
+    }
+
+    reportStatus("Running OpenCL sobel_gradient kernel");
+    return true;
+  }
+
+  bool Sobel::prepareGradientOpenCL()
+  {
+    getGradientTile(m_sessionParams, m_tile);
+    char options[128];
+    sprintf(options, "-cl-fast-relaxed-math -DTILE_X=%zu -DTILE_Y=%zu",
+            m_tile[0], m_tile[1]);
+    if (!initCL(m_sessionParams, sobel_kernel, options))
+    {
+      release();
+      return false;
+    }
+
+    cl_int err;
+    m_kernel = clCreateKernel(m_program, "sobel_gradient", &err);
+    CHECK_ERROR_OCL(err, "creating kernel", release(); return false);
+
+    Image image = m_sessionImage;
+    cl_image_format format = getImageFormat(image);
+    m_deviceInput = clCreateImage2D(
+      m_context, CL_MEM_READ_ONLY, &format,
+      image.width, image.height, 0, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating input image", release(); return false);
+
+    size_t size = image.width*image.height*sizeof(float);
+    m_deviceMagnitude = clCreateBuffer(
+      m_context, CL_MEM_WRITE_ONLY, size, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating magnitude buffer",
+                    release(); return false);
+
+    m_deviceAngle = clCreateBuffer(
+      m_context, CL_MEM_WRITE_ONLY, size, NULL, &err);
+    CHECK_ERROR_OCL(err, "creating angle buffer", release(); return false);
+
+    err  = clSetKernelArg(m_kernel, 0, sizeof(cl_mem), &m_deviceInput);
+    err |= clSetKernelArg(m_kernel, 1, sizeof(cl_mem), &m_deviceMagnitude);
+    err |= clSetKernelArg(m_kernel, 2, sizeof(cl_mem), &m_deviceAngle);
+    CHECK_ERROR_OCL(err, "setting kernel arguments",
+                    release(); return false);
     return true;
   }
+
+  void Sobel::computeGradient(Image input, float *magnitude, float *angle,
+                              unsigned int threads)
+  {
+    GradientArgs args = {input, magnitude, angle};
+    parallelFor(input.height, threads, gradientRows, &args);
+  }
+
+  // Program source containing the sobel_gradient kernel, for filters
+  // which build on it
+  const char* Sobel::getGradientSource() const
+  {
+    return sobel_kernel;
+  }
+
+  // The work-group size of the gradient kernel is fixed at compile time, as
+  // it sets the size of the tile in local memory
+  void Sobel::getGradientTile(const Params& params, size_t tile[2]) const
+  {
+    tile[0] = tile[1] = GRADIENT_TILE;
+    if (params.wgsize[0] && params.wgsize[1])
+    {
+      tile[0] = params.wgsize[0];
+      tile[1] = params.wgsize[1];
+    }
+  }
+
+  // Directions are only compared where the gradient is at least one 8-bit
+  // step, as they are unstable where it vanishes
+  bool Sobel::verifyAngles(Image input, const float *angle)
+  {
+    int errors = 0;
+    const int maxErrors = 16;
+    for (int y = 0; y < input.height; y++)
+    {
+      for (int x = 0; x < input.width; x++)
+      {
+        float g_x, g_y;
+        referenceGradient(input, x, y, g_x, g_y);
+        if (sqrt(g_x*g_x + g_y*g_y) < 1/255.f)
+        {
+          continue;
+        }
+
+        float ref = atan2(g_y, g_x);
+        float out = angle[x + y*input.width];
+        float diff = fabs(ref - out);
+        if (diff > M_PI)
+        {
+          diff = 2*M_PI - diff;
+        }
+        if (diff > ANGLE_TOLERANCE)
+        {
+          // Only report first few errors
+          if (errors < maxErrors)
+          {
+            reportStatus("Direction mismatch at (%d,%d): %.3f vs %.3f",
+                         x, y, ref, out);
+          }
+          if (++errors == maxErrors)
+          {
+            reportStatus("Supressing further errors");
+          }
+        }
+      }
+    }
+    return errors == 0;
+  }
 }
@@ -6,6 +6,8 @@
 // license terms please see the LICENSE file distributed with this
 // source code.
 
+#pragma once
+
 #include "Filter.h"
 
 namespace improsa
@@ -14,10 +16,48 @@ namespace improsa
   {
   public:
     Sobel();
+    virtual ~Sobel();
 
+    virtual bool runCPU(Image input, Image output, const Params& params);
     virtual bool runHalideCPU(Image input, Image output, const Params& params);
     virtual bool runHalideGPU(Image input, Image output, const Params& params);
     virtual bool runOpenCL(Image input, Image output, const Params& params);
-    virtual bool runReference(Image input, Image output);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+    virtual bool prepare(int method, Image image, const Params& params);
+    virtual void release();
+
+  protected:
+    virtual bool execute();
+    virtual bool retrieve(bool blocking, cl_event *event);
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
+
+    // Gradients of the luminance as separate single-channel outputs, each
+    // holding width*height floats. Directions are in radians, as returned
+    // by atan2(g_y, g_x) with y increasing down the image. The session
+    // writes the magnitudes to the output image.
+    bool runGradient(int method, Image input, Image output,
+                     const Params& params);
+    bool prepareGradient();
+    bool prepareGradientOpenCL();
+    const char* getGradientSource() const;
+    void getGradientTile(const Params& params, size_t tile[2]) const;
+    void computeGradient(Image input, float *magnitude, float *angle,
+                         unsigned int threads);
+    void referenceGradient(Image input, int x, int y,
+                           float& g_x, float& g_y);
+    bool verifyAngles(Image input, const float *angle);
+
+    // Gradient of one image, on the host and the device, with the tile of
+    // the gradient kernel
+    float *m_magnitude, *m_angle;
+    cl_mem m_deviceMagnitude, m_deviceAngle;
+    size_t m_tile[2];
+
+    // Host array receiving a copy of the directions, if any, which
+    // outlives the session
+    float *m_directions;
   };
 }
@@ -0,0 +1,436 @@
+// UnsharpMask.cpp (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <math.h>
+#include <stdio.h>
+
+#include "UnsharpMask.h"
+#include "opencl/unsharp.h"
+#if ENABLE_HALIDE
+#include "halide/unsharp_cpu.h"
+#include "halide/unsharp_gpu.h"
+#include "halide/unsharp_cpu_planar.h"
+#include "halide/unsharp_gpu_planar.h"
+#include "halide/unsharp_cpu_u16.h"
+#include "halide/unsharp_gpu_u16.h"
+#include "halide/unsharp_cpu_f32.h"
+#include "halide/unsharp_gpu_f32.h"
+#endif
+
+// Parameters compiled into the Halide pipelines
+#define HALIDE_RADIUS 3
+#define HALIDE_AMOUNT 1.f
+#define HALIDE_THRESHOLD 0.f
+
+namespace improsa
+{
+  // Normalised 1D Gaussian weights, with the window covering three
+  // standard deviations either side of the centre
+  static void computeWeights(int radius, float *weights)
+  {
+    float sigma = radius/3.f;
+    float sum = 0.f;
+    for (int i = -radius; i <= radius; i++)
+    {
+      float norm = i / sigma;
+      weights[i+radius] = exp(-0.5f * (norm*norm));
+      sum += weights[i+radius];
+    }
+    for (int i = 0; i <= 2*radius; i++)
+    {
+      weights[i] /= sum;
+    }
+  }
+
+  static inline int clampIndex(int i, int n)
+  {
+    return i < 0 ? 0 : i >= n ? n-1 : i;
+  }
+
+  struct UnsharpArgs
+  {
+    Image input, output;
+    int radius;
+    const float *weights;
+    float amount, threshold;
+  };
+
+  // Horizontal pass over one row, producing three float channels per pixel
+  static void blurRow(const unsigned char *row, int w, int r,
+                      const float *weights, float *out)
+  {
+    for (int x = 0; x < w; x++)
+    {
+      float sum[3] = {0.f, 0.f, 0.f};
+      for (int i = -r; i <= r; i++)
+      {
+        const unsigned char *pixel = row + clampIndex(x+i, w)*4;
+        sum[0] += weights[i+r]*pixel[0];
+        sum[1] += weights[i+r]*pixel[1];
+        sum[2] += weights[i+r]*pixel[2];
+      }
+      out[x*3 + 0] = sum[0];
+      out[x*3 + 1] = sum[1];
+      out[x*3 + 2] = sum[2];
+    }
+  }
+
+  // Each thread keeps a ring of the 2r+1 most recent horizontally blurred
+  // rows of its strip. Each output row adds one row to the ring, then the
+  // vertical pass and the combine step are applied together, so the
+  // blurred image only ever exists one row at a time.
+  static void unsharpRows(void *data, int begin, int end)
+  {
+    UnsharpArgs *args = (UnsharpArgs*)data;
+    Image input = args->input;
+    size_t inPitch = getRowPitch(input), outPitch = getRowPitch(args->output);
+    int w = input.width, h = input.height, r = args->radius;
+    int size = 2*r + 1;
+    const float *weights = args->weights;
+    float threshold = args->threshold*255.f;
+
+    // Row j of the image (before clamping) is held in slot (j-begin+r)%size
+    float *ring = (float*)allocateBuffer(size*w*3*sizeof(float));
+    std::vector<const float*> rows(size);
+    for (int j = begin-r; j < begin+r; j++)
+    {
+      blurRow(input.data + clampIndex(j, h)*inPitch, w, r, weights,
+              ring + ((j-begin+r)%size)*w*3);
+    }
+
+    for (int y = begin; y < end; y++)
+    {
+      int j = y+r;
+      blurRow(input.data + clampIndex(j, h)*inPitch, w, r, weights,
+              ring + ((j-begin+r)%size)*w*3);
+      for (int k = 0; k < size; k++)
+      {
+        rows[k] = ring + ((y-begin+k)%size)*w*3;
+      }
+
+      const unsigned char *in = input.data + y*inPitch;
+      unsigned char *out = args->output.data + y*outPitch;
+      for (int x = 0; x < w; x++)
+      {
+        for (int c = 0; c < 3; c++)
+        {
+          float blurred = 0.f;
+          for (int k = 0; k < size; k++)
+          {
+            blurred += weights[k]*rows[k][x*3 + c];
+          }
+
+          float orig = in[x*4 + c];
+          float diff = orig - blurred;
+          float value = fabs(diff) >= threshold ? orig + args->amount*diff
+                                                : orig;
+          out[x*4 + c] = value < 0.f ? 0 : value > 255.f ? 255 : value;
+        }
+        out[x*4 + 3] = in[x*4 + 3];
+      }
+    }
+
+    releaseBuffer(ring);
+  }
+
+  UnsharpMask::UnsharpMask() : Filter()
+  {
+    m_name = "UnsharpMask";
+    m_radius = 3;
+    m_weightsBuffer = 0;
+  }
+
+  UnsharpMask::~UnsharpMask()
+  {
+    release();
+  }
+
+  int UnsharpMask::getRadius(const Params& params) const
+  {
+    return params.radius ? params.radius : m_radius;
+  }
+
+  bool UnsharpMask::prepare(int method, Image image, const Params& params)
+  {
+    beginSession(method, image, params);
+    int radius = getRadius(params);
+    m_weights.resize(2*radius+1);
+    computeWeights(radius, &m_weights[0]);
+
+    if (method == METHOD_CPU)
+    {
+      if (!checkInterleaved(image, image) || !check8Bit(image, image))
+      {
+        release();
+        return false;
+      }
+
+      reportStatus("Running CPU unsharp mask (radius %d) with %d threads",
+                   radius, getNumThreads(params.threads));
+      return true;
+    }
+    else if (method == METHOD_OPENCL && image.layout == LAYOUT_INTERLEAVED)
+    {
+      if (params.buffers || params.fixedPoint || params.halfPrecision)
+      {
+        reportStatus("Only the image kernel is implemented for this filter.");
+        release();
+        return false;
+      }
+
+      char options[64];
+      sprintf(options, "-cl-fast-relaxed-math -DRADIUS=%d", radius);
+      const char *name = params.coarsening > 1 ? "unsharp_coarse" : "unsharp";
+      if (!prepareKernel(unsharp_kernel, options, name, getImageFormat(image)))
+      {
+        return false;
+      }
+
+      cl_int err;
+      m_weightsBuffer = clCreateBuffer(
+        m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        m_weights.size()*sizeof(float), &m_weights[0], &err);
+      CHECK_ERROR_OCL(err, "creating weights buffer",
+                      release(); return false);
+
+      cl_float amount = params.sharpenAmount;
+      cl_float threshold = params.sharpenThreshold;
+      err  = clSetKernelArg(m_kernel, 2, sizeof(cl_mem), &m_weightsBuffer);
+      err |= clSetKernelArg(m_kernel, 3, sizeof(cl_float), &amount);
+      err |= clSetKernelArg(m_kernel, 4, sizeof(cl_float), &threshold);
+      CHECK_ERROR_OCL(err, "setting kernel arguments",
+                      release(); return false);
+
+      reportStatus("Running OpenCL %s kernel", name);
+      return true;
+    }
+
+    return Filter::prepare(method, image, params);
+  }
+
+  void UnsharpMask::release()
+  {
+    if (m_weightsBuffer)
+    {
+      clReleaseMemObject(m_weightsBuffer);
+      m_weightsBuffer = 0;
+    }
+    Filter::release();
+  }
+
+  bool UnsharpMask::execute()
+  {
+    if (m_sessionMethod != METHOD_CPU)
+    {
+      return Filter::execute();
+    }
+
+    unsigned int threads = getNumThreads(m_sessionParams.threads);
+    for (unsigned int b = 0; b < m_sessionParams.batch; b++)
+    {
+      UnsharpArgs args =
+      {
+        getBatchImage(m_sessionInput, b), getBatchImage(m_sessionOutput, b),
+        getRadius(m_sessionParams), &m_weights[0],
+        m_sessionParams.sharpenAmount, m_sessionParams.sharpenThreshold
+      };
+      parallelFor(args.input.height, threads, unsharpRows, &args);
+    }
+    return true;
+  }
+
+  bool UnsharpMask::runCPU(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_CPU, input, output, params);
+  }
+
+  bool UnsharpMask::checkHalideParams(const Params& params) const
+  {
+    if (getRadius(params) != HALIDE_RADIUS ||
+        params.sharpenAmount != HALIDE_AMOUNT ||
+        params.sharpenThreshold != HALIDE_THRESHOLD)
+    {
+      reportStatus("Halide filter only supports radius %d, amount %g "
+                   "and threshold %g", HALIDE_RADIUS, HALIDE_AMOUNT,
+                   HALIDE_THRESHOLD);
+      return false;
+    }
+    return true;
+  }
+
+  bool UnsharpMask::runHalideCPU(Image input, Image output,
+                                 const Params& params)
+  {
+#if ENABLE_HALIDE
+    if (!checkHalideParams(params))
+    {
+      return false;
+    }
+
+    // Create halide buffers
+    buffer_t inputBuffer = createHalideBuffer(input);
+    buffer_t outputBuffer = createHalideBuffer(output);
+
+    // Each layout and pixel format has a separate pipeline, and planar
+    // pipelines skip the alpha plane
+    HalideFunction pipeline = selectHalidePipeline(
+      input, halide_unsharp_cpu, halide_unsharp_cpu_planar,
+      halide_unsharp_cpu_u16, halide_unsharp_cpu_f32);
+    if (!pipeline)
+    {
+      return false;
+    }
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      copyAlphaPlane(input, output);
+    }
+
+    reportStatus("Running Halide CPU filter");
+
+    // Warm-up run
+    pipeline(&inputBuffer, &outputBuffer);
+
+    // Timed runs
+    startTiming();
+    for (int i = 0; i < params.iterations; i++)
+    {
+      pipeline(&inputBuffer, &outputBuffer);
+    }
+    stopTiming();
+
+    halide_release(NULL);
+
+    return outputResults(input, output, params);
+#else
+    reportStatus("Halide not enabled during build.");
+    return false;
+#endif
+  }
+
+  bool UnsharpMask::runHalideGPU(Image input, Image output,
+                                 const Params& params)
+  {
+#if ENABLE_HALIDE
+    if (!checkHalideParams(params))
+    {
+      return false;
+    }
+
+    // Create halide buffers
+    buffer_t inputBuffer = createHalideBuffer(input);
+    buffer_t outputBuffer = createHalideBuffer(output);
+
+    // Each layout and pixel format has a separate pipeline, and planar
+    // pipelines skip the alpha plane
+    HalideFunction pipeline = selectHalidePipeline(
+      input, halide_unsharp_gpu, halide_unsharp_gpu_planar,
+      halide_unsharp_gpu_u16, halide_unsharp_gpu_f32);
+    if (!pipeline)
+    {
+      return false;
+    }
+    if (input.layout == LAYOUT_PLANAR)
+    {
+      copyAlphaPlane(input, output);
+    }
+
+    reportStatus("Running Halide GPU filter");
+
+    // Warm-up run
+    inputBuffer.host_dirty = true;
+    pipeline(&inputBuffer, &outputBuffer);
+    halide_dev_sync(NULL);
+
+    // Timed runs
+    startTiming();
+    for (int i = 0; i < params.iterations; i++)
+    {
+      pipeline(&inputBuffer, &outputBuffer);
+    }
+    halide_dev_sync(NULL);
+    stopTiming();
+
+    halide_copy_to_host(NULL, &outputBuffer);
+    halide_release(NULL);
+
+    return outputResults(input, output, params);
+#else
+    reportStatus("Halide not enabled during build.");
+    return false;
+#endif
+  }
+
+  bool UnsharpMask::runOpenCL(Image input, Image output, const Params& params)
+  {
+    return benchmark(METHOD_OPENCL, input, output, params);
+  }
+
+  bool UnsharpMask::runReference(Image input, Image output,
+                                 const Params& params)
+  {
+    // Check for cached result
+    if (m_reference.data)
+    {
+      copyImage(m_reference, output);
+      reportStatus("Finished reference (cached)");
+      return true;
+    }
+
+    reportStatus("Running reference");
+    for (int y = 0; y < output.height; y++)
+    {
+      for (int x = 0; x < output.width; x++)
+      {
+        float pixel[4];
+        referencePixel(input, x, y, params, pixel);
+        setPixelRGBA(output, x, y, pixel);
+      }
+#if SHOW_REFERENCE_PROGRESS == 1
+      reportStatus("Completed %.1f%% of reference", (100.f*y)/(input.height-1));
+#endif
+    }
+    reportStatus("Finished reference");
+
+    // Cache result
+    m_reference = output;
+    m_reference.stride = 0;
+    m_reference.data = (unsigned char*)allocateBuffer(getImageSize(output));
+    copyImage(output, m_reference);
+
+    return true;
+  }
+
+  // Direct 2D Gaussian blur of the window, followed by the combine step
+  bool UnsharpMask::referencePixel(Image input, int x, int y,
+                                   const Params& params, float result[4])
+  {
+    int radius = getRadius(params);
+    std::vector<float> weights(2*radius+1);
+    computeWeights(radius, &weights[0]);
+
+    for (int c = 0; c < 3; c++)
+    {
+      float blurred = 0.f;
+      for (int j = -radius; j <= radius; j++)
+      {
+        for (int i = -radius; i <= radius; i++)
+        {
+          blurred += weights[j+radius]*weights[i+radius]*
+                     getPixel(input, x+i, y+j, c);
+        }
+      }
+
+      float orig = getPixel(input, x, y, c);
+      float diff = orig - blurred;
+      result[c] = fabs(diff) >= params.sharpenThreshold ?
+        orig + params.sharpenAmount*diff : orig;
+    }
+    result[3] = getPixel(input, x, y, 3);
+    return true;
+  }
+}
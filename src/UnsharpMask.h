@@ -0,0 +1,44 @@
+// UnsharpMask.h (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <vector>
+
+#include "Filter.h"
+
+namespace improsa
+{
+  // Adds a multiple of the difference between each pixel and a Gaussian
+  // blur of its neighbourhood. The blur is computed in the same pass as the
+  // combine step, so the blurred image is never stored.
+  class UnsharpMask : public Filter
+  {
+  public:
+    UnsharpMask();
+    virtual ~UnsharpMask();
+
+    virtual bool runCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideCPU(Image input, Image output, const Params& params);
+    virtual bool runHalideGPU(Image input, Image output, const Params& params);
+    virtual bool runOpenCL(Image input, Image output, const Params& params);
+    virtual bool runReference(Image input, Image output,
+                              const Params& params);
+
+    virtual bool prepare(int method, Image image, const Params& params);
+    virtual void release();
+
+  protected:
+    virtual bool execute();
+    virtual int getRadius(const Params& params) const;
+    virtual bool referencePixel(Image input, int x, int y,
+                                const Params& params, float result[4]);
+    bool checkHalideParams(const Params& params) const;
+
+    std::vector<float> m_weights;
+    cl_mem m_weightsBuffer;
+  };
+}
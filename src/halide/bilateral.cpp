@@ -11,13 +11,14 @@
 
 int main(int argc, char *argv[])
 {
-  if (argc != 4)
+  bool planar;
+  Type type;
+  if (!parseOptions(argc, argv, planar, type))
   {
-    cout << "Usage: " << argv[0] << " cpu|gpu out_func out_prefix" << endl;
     return 1;
   }
 
-  ImageParam input(UInt(8), 3, "input");
+  ImageParam input(type, 3, "input");
   Func clamped("clamped");
   Func coeff("coeff"), sum("sum");
   Func weight("weight");
@@ -25,21 +26,23 @@ int main(int argc, char *argv[])
   Var c("c"), x("x"), y("y"), i("i"), j("j");
 
   // Algorithm
-  clamped(x, y, c) = input(
+  clamped(x, y, c) = toFloat(input(
     clamp(x, 0, input.width()-1),
     clamp(y, 0, input.height()-1),
-    c) / 255.f;
+    c), type);
 
   Expr imgDist = (sqrt(f32(i*i) + f32(j*j))) * (1.f/3.f);
   Expr colDist = sqrt(
     pow(clamped(x+i, y+j, 0)-clamped(x, y, 0), 2) +
     pow(clamped(x+i, y+j, 1)-clamped(x, y, 1), 2) +
     pow(clamped(x+i, y+j, 2)-clamped(x, y, 2), 2)
-  ) * (1.f/0.2f);
+  ) * cast(arith, 1.f/0.2f);
 
+  // The spatial term is computed in single precision as it only depends on
+  // the tap, while the range term uses the channel arithmetic type
   weight(x, y, i, j) =
-    exp(-0.5f * (imgDist*imgDist)) *
-    exp(-0.5f * (colDist*colDist));
+    cast(arith, exp(-0.5f * (imgDist*imgDist))) *
+    exp(cast(arith, -0.5f) * (colDist*colDist));
 
   RDom r(-2, 5, -2, 5, "r");
   coeff(x, y) += weight(x, y, r.x, r.y);
@@ -48,21 +51,25 @@ int main(int argc, char *argv[])
   bilateral(x, y, c) =
     select(
       c==3,
-      255,
-      u8(clamp(sum(x, y, c)/coeff(x, y), 0, 1) * 255)
+      fromFloat(1.f, type),
+      fromFloat(sum(x, y, c)/coeff(x, y), type)
     );
 
   // Channel order
-  input.set_stride(0, 4);
-  input.set_extent(2, 4);
-  bilateral.reorder_storage(c, x, y);
-  bilateral.output_buffer().set_stride(0, 4);
-  bilateral.output_buffer().set_extent(2, 4);
+  setLayout(bilateral, input, x, y, c, planar);
 
   // Schedules
   if (!strcmp(argv[1], "cpu"))
   {
-    bilateral.parallel(y).vectorize(c, 4);
+    if (planar)
+    {
+      // Vectorize along rows of each plane
+      bilateral.parallel(y).vectorize(x, 8);
+    }
+    else
+    {
+      bilateral.parallel(y).vectorize(c, 4);
+    }
   }
   else if (!strcmp(argv[1], "gpu"))
   {
@@ -11,48 +11,53 @@
 
 int main(int argc, char *argv[])
 {
-  if (argc != 4)
+  bool planar;
+  Type type;
+  if (!parseOptions(argc, argv, planar, type))
   {
-    cout << "Usage: " << argv[0] << " cpu|gpu out_func out_prefix" << endl;
     return 1;
   }
 
-  ImageParam input(UInt(8), 3, "input");
+  ImageParam input(type, 3, "input");
   Func clamped("clamped");
   Func blur_x("blur_x"), blur_y("blur_y");
   Var c("c"), x("x"), y("y");
 
   // Algorithm
-  clamped(x, y, c) = input(
+  clamped(x, y, c) = toFloat(input(
     clamp(x, 0, input.width()-1),
     clamp(y, 0, input.height()-1),
-    c) / 255.f;
+    c), type);
   blur_x(x, y, c) = (
     clamped(x-2, y, c) +
     clamped(x-1, y, c) +
     clamped(x,   y, c) +
     clamped(x+1, y, c) +
     clamped(x+2, y, c)
-    )/ 5.f;
-  blur_y(x, y, c) = u8((
+    ) / 5;
+  blur_y(x, y, c) = fromFloat((
     blur_x(x, y-2, c) +
     blur_x(x, y-1, c) +
     blur_x(x, y,   c) +
     blur_x(x, y+1, c) +
     blur_x(x, y+2, c)
-    ) / 5.f * 255);
+    ) / 5, type);
 
   // Channel order
-  input.set_stride(0, 4);
-  input.set_extent(2, 4);
-  blur_y.reorder_storage(c, x, y);
-  blur_y.output_buffer().set_stride(0, 4);
-  blur_y.output_buffer().set_extent(2, 4);
+  setLayout(blur_y, input, x, y, c, planar);
 
   // Schedules
   if (!strcmp(argv[1], "cpu"))
   {
-    blur_y.parallel(y).vectorize(c, 4);
+    if (planar)
+    {
+      // Vectorize along rows of each plane
+      blur_y.parallel(y).vectorize(x, 8);
+    }
+    else
+    {
+      blur_y.parallel(y).vectorize(c, 4);
+    }
   }
   else if (!strcmp(argv[1], "gpu"))
   {
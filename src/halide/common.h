@@ -43,6 +43,101 @@ Expr f32(Expr x)
   return cast(Float(32), x);
 }
 
+// Type used for arithmetic on channel values, which is single precision
+// unless the half option is given
+Type arith = Float(32);
+
+// Optional arguments after the output prefix select the planar layout and
+// the pixel format (u8, u16 or f32). The half option selects half-precision
+// arithmetic, which is only supported for interleaved 8-bit pixels.
+bool parseOptions(int argc, char *argv[], bool& planar, Type& type)
+{
+  planar = false;
+  type = UInt(8);
+  if (argc < 4)
+  {
+    cout << "Usage: " << argv[0]
+         << " cpu|gpu out_func out_prefix [planar] [u8|u16|f32] [half]"
+         << endl;
+    return false;
+  }
+  for (int i = 4; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "planar"))
+    {
+      planar = true;
+    }
+    else if (!strcmp(argv[i], "u8"))
+    {
+      type = UInt(8);
+    }
+    else if (!strcmp(argv[i], "u16"))
+    {
+      type = UInt(16);
+    }
+    else if (!strcmp(argv[i], "f32"))
+    {
+      type = Float(32);
+    }
+    else if (!strcmp(argv[i], "half"))
+    {
+      arith = Float(16);
+    }
+    else
+    {
+      cout << "Invalid option '" << argv[i] << "'" << endl;
+      return false;
+    }
+  }
+  if (arith.bits == 16 && (planar || type != UInt(8)))
+  {
+    cout << "Half precision requires interleaved u8 pixels" << endl;
+    return false;
+  }
+  return true;
+}
+
+// Integer channels are normalised to [0,1], while float channels are used
+// as they are
+Expr toFloat(Expr x, Type type)
+{
+  if (type.is_float())
+  {
+    return x;
+  }
+  return cast(arith, x) / cast(arith, type.max());
+}
+
+// Integer channels are clamped and scaled to the full range of the type,
+// while float channels are left unclamped for high dynamic range images
+Expr fromFloat(Expr x, Type type)
+{
+  if (type.is_float())
+  {
+    return f32(x);
+  }
+  return cast(type, clamp(x, 0, 1) * cast(arith, type.max()));
+}
+
+// Interleaved RGBA images, or separate planes where only the three colour
+// planes are passed to the pipeline (alpha is handled by the caller)
+void setLayout(Func func, ImageParam input, Var x, Var y, Var c, bool planar)
+{
+  if (planar)
+  {
+    input.set_extent(2, 3);
+    func.output_buffer().set_extent(2, 3);
+  }
+  else
+  {
+    input.set_stride(0, 4);
+    input.set_extent(2, 4);
+    func.reorder_storage(c, x, y);
+    func.output_buffer().set_stride(0, 4);
+    func.output_buffer().set_extent(2, 4);
+  }
+}
+
 void compile(Func func, ImageParam input, string fnName, string prefix)
 {
   vector<Argument> args;
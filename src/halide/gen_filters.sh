@@ -8,7 +8,10 @@
 # license terms please see the LICENSE file distributed with this
 # source code.
 
-functions="bilateral blur sharpen sobel"
+functions="bilateral blur sharpen sobel unsharp"
+
+# Filters which also have pipelines using half-precision arithmetic
+half_functions="bilateral blur sharpen"
 
 OUTDIR=${1:-.}
 mkdir -p $OUTDIR
@@ -36,6 +39,33 @@ do
     then
       exit 1
     fi
+
+    ./$name $schedule halide_$name\_$schedule\_planar \
+      $OUTDIR/$name\_$schedule\_planar planar
+    if [ $? -ne 0 ]
+    then
+      exit 1
+    fi
+
+    for format in u16 f32
+    do
+      ./$name $schedule halide_$name\_$schedule\_$format \
+        $OUTDIR/$name\_$schedule\_$format $format
+      if [ $? -ne 0 ]
+      then
+        exit 1
+      fi
+    done
+
+    if [[ " $half_functions " == *" $name "* ]]
+    then
+      ./$name $schedule halide_$name\_$schedule\_half \
+        $OUTDIR/$name\_$schedule\_half half
+      if [ $? -ne 0 ]
+      then
+        exit 1
+      fi
+    fi
   done
 
 done
@@ -11,23 +11,24 @@
 
 int main(int argc, char *argv[])
 {
-  if (argc != 4)
+  bool planar;
+  Type type;
+  if (!parseOptions(argc, argv, planar, type))
   {
-    cout << "Usage: " << argv[0] << " cpu|gpu out_func out_prefix" << endl;
     return 1;
   }
 
-  ImageParam input(UInt(8), 3, "input");
+  ImageParam input(type, 3, "input");
   Func clamped("clamped");
   Func convolved("convolved");
   Func sharpen("sharpen");
   Var c("c"), x("x"), y("y");
 
   // Algorithm
-  clamped(x, y, c) = input(
+  clamped(x, y, c) = toFloat(input(
     clamp(x, 0, input.width()-1),
     clamp(y, 0, input.height()-1),
-    c) / 255.f;
+    c), type);
 
   Image<int16_t> kernel(3, 3);
   kernel(0, 0) = -1;
@@ -42,21 +43,25 @@ int main(int argc, char *argv[])
 
   RDom r(kernel);
   convolved(x, y, c) += kernel(r.x, r.y) * clamped(x + r.x - 1, y + r.y - 1, c);
-  sharpen(x, y, c) = u8(
-    clamp(convolved(x, y, c)/8 + clamped(x, y, c), 0, 1) * 255
+  sharpen(x, y, c) = fromFloat(
+    convolved(x, y, c)/8 + clamped(x, y, c), type
   );
 
   // Channel order
-  input.set_stride(0, 4);
-  input.set_extent(2, 4);
-  sharpen.reorder_storage(c, x, y);
-  sharpen.output_buffer().set_stride(0, 4);
-  sharpen.output_buffer().set_extent(2, 4);
+  setLayout(sharpen, input, x, y, c, planar);
 
   // Schedules
   if (!strcmp(argv[1], "cpu"))
   {
-    sharpen.parallel(y).vectorize(c, 4);
+    if (planar)
+    {
+      // Vectorize along rows of each plane
+      sharpen.parallel(y).vectorize(x, 8);
+    }
+    else
+    {
+      sharpen.parallel(y).vectorize(c, 4);
+    }
   }
   else if (!strcmp(argv[1], "gpu"))
   {
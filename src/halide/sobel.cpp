@@ -11,23 +11,24 @@
 
 int main(int argc, char *argv[])
 {
-  if (argc != 4)
+  bool planar;
+  Type type;
+  if (!parseOptions(argc, argv, planar, type))
   {
-    cout << "Usage: " << argv[0] << " cpu|gpu out_func out_prefix" << endl;
     return 1;
   }
 
-  ImageParam input(UInt(8), 3, "input");
+  ImageParam input(type, 3, "input");
   Func clamped("clamped"), grayscale("grayscale");
   Func g_x("g_x"), g_y("g_y"), g_mag("g_mag");
   Func sobel("sobel");
   Var c("c"), x("x"), y("y");
 
   // Algorithm
-  clamped(x, y, c) = input(
+  clamped(x, y, c) = toFloat(input(
     clamp(x, 0, input.width()-1),
     clamp(y, 0, input.height()-1),
-    c) / 255.f;
+    c), type);
   grayscale(x, y) =
     clamped(x, y, 0)*0.299f +
     clamped(x, y, 1)*0.587f +
@@ -48,19 +49,24 @@ int main(int argc, char *argv[])
   g_x(x, y) += kernel(r.x, r.y) * grayscale(x + r.x - 1, y + r.y - 1);
   g_y(x, y) += kernel(r.y, r.x) * grayscale(x + r.x - 1, y + r.y - 1);
   g_mag(x, y) = sqrt(g_x(x, y)*g_x(x, y) + g_y(x, y)*g_y(x, y));
-  sobel(x, y, c) = select(c==3, 255, u8(clamp(g_mag(x, y), 0, 1)*255));
+  sobel(x, y, c) =
+    select(c==3, fromFloat(1.f, type), fromFloat(g_mag(x, y), type));
 
   // Channel order
-  input.set_stride(0, 4);
-  input.set_extent(2, 4);
-  sobel.reorder_storage(c, x, y);
-  sobel.output_buffer().set_stride(0, 4);
-  sobel.output_buffer().set_extent(2, 4);
+  setLayout(sobel, input, x, y, c, planar);
 
   // Schedules
   if (!strcmp(argv[1], "cpu"))
   {
-    sobel.parallel(y).vectorize(c, 4);
+    if (planar)
+    {
+      // Vectorize along rows of each plane
+      sobel.parallel(y).vectorize(x, 8);
+    }
+    else
+    {
+      sobel.parallel(y).vectorize(c, 4);
+    }
   }
   else if (!strcmp(argv[1], "gpu"))
   {
@@ -0,0 +1,99 @@
+// unsharp.cpp (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "common.h"
+#include <iostream>
+
+// Fixed parameters, matching the defaults of the UnsharpMask filter
+#define RADIUS 3
+#define AMOUNT 1.f
+#define THRESHOLD 0.f
+
+int main(int argc, char *argv[])
+{
+  bool planar;
+  Type type;
+  if (!parseOptions(argc, argv, planar, type))
+  {
+    return 1;
+  }
+
+  ImageParam input(type, 3, "input");
+  Func clamped("clamped");
+  Func blur_x("blur_x"), blur_y("blur_y");
+  Func unsharp("unsharp");
+  Var c("c"), x("x"), y("y");
+
+  // Normalised Gaussian weights, covering three standard deviations
+  float weights[2*RADIUS+1];
+  float sum = 0.f;
+  for (int i = -RADIUS; i <= RADIUS; i++)
+  {
+    float norm = i / (RADIUS/3.f);
+    weights[i+RADIUS] = exp(-0.5f * (norm*norm));
+    sum += weights[i+RADIUS];
+  }
+
+  // Algorithm
+  clamped(x, y, c) = toFloat(input(
+    clamp(x, 0, input.width()-1),
+    clamp(y, 0, input.height()-1),
+    c), type);
+  Expr row = 0.f, column = 0.f;
+  for (int i = -RADIUS; i <= RADIUS; i++)
+  {
+    row = row + (weights[i+RADIUS]/sum) * clamped(x+i, y, c);
+    column = column + (weights[i+RADIUS]/sum) * blur_x(x, y+i, c);
+  }
+  blur_x(x, y, c) = row;
+  blur_y(x, y, c) = column;
+
+  Expr orig = clamped(x, y, c);
+  Expr diff = orig - blur_y(x, y, c);
+  Expr sharpened = select(abs(diff) >= THRESHOLD, orig + AMOUNT*diff, orig);
+  unsharp(x, y, c) = fromFloat(select(c < 3, sharpened, orig), type);
+
+  // Channel order
+  setLayout(unsharp, input, x, y, c, planar);
+
+  // Schedules. The vertical pass is always inlined into the combine step.
+  if (!strcmp(argv[1], "cpu"))
+  {
+    // Strips of rows are processed in parallel, and the row sums are
+    // computed as they are needed and kept only while the vertical window
+    // covers them, so no full-frame intermediate is stored
+    Var yo("yo"), yi("yi");
+    unsharp.split(y, yo, yi, 32).parallel(yo);
+    blur_x.store_at(unsharp, yo).compute_at(unsharp, yi);
+    if (planar)
+    {
+      // Vectorize along rows of each plane
+      unsharp.vectorize(x, 8);
+      blur_x.vectorize(x, 8);
+    }
+    else
+    {
+      unsharp.vectorize(c, 4);
+      blur_x.vectorize(c, 4);
+    }
+  }
+  else if (!strcmp(argv[1], "gpu"))
+  {
+    // Row sums are recomputed by each thread rather than stored
+    unsharp.cuda_tile(x, y, 16, 4);
+  }
+  else
+  {
+    cout << "Invalid schedule type '" << argv[1] << "'" << endl;
+    return 1;
+  }
+
+  compile(unsharp, input, argv[2], argv[3]);
+
+  return 0;
+}
@@ -11,36 +11,332 @@ const sampler_t sampler =
   CLK_ADDRESS_CLAMP_TO_EDGE   |
   CLK_FILTER_NEAREST;
 
+// Batches of images are stacked vertically in one image, so reads are
+// clamped to the rows of the image containing the work-item
+#ifdef BATCH_HEIGHT
+#define FIRST_ROW ((int)get_global_id(1)/BATCH_HEIGHT*BATCH_HEIGHT)
+#define COORD(x, y) \
+  (int2)(x, clamp(y, FIRST_ROW, FIRST_ROW+BATCH_HEIGHT-1))
+#else
+#define COORD(x, y) (int2)(x, y)
+#endif
+
+// Spatial weights are indexed by tap, range weights by the difference in
+// a single 8-bit channel (see Bilateral.cpp)
 kernel void bilateral(read_only image2d_t input,
-                      write_only image2d_t output)
+                      write_only image2d_t output,
+                      constant float *spatial,
+                      constant float *range)
 {
   int x = get_global_id(0);
   int y = get_global_id(1);
 
   float coeff = 0.f;
   float4 sum = 0.f;
-  float4 center = read_imagef(input, sampler, (int2)(x, y));
+  uint4 center = read_imageui(input, sampler, COORD(x, y));
 
-  for (int j = -2; j <= 2; j++)
+  for (int j = -RADIUS; j <= RADIUS; j++)
   {
-    for (int i = -2; i <= 2; i++)
+    for (int i = -RADIUS; i <= RADIUS; i++)
     {
-      float norm, weight;
-      float4 pixel = read_imagef(input, sampler, (int2)(x+i, y+j));
-
-      norm = sqrt((float)(i*i) + (float)(j*j)) * (1.f/3.f);
-      weight = native_exp(-0.5f * (norm*norm));
+      uint4 pixel = read_imageui(input, sampler, COORD(x+i, y+j));
+      uint4 diff = abs_diff(pixel, center);
 
-      norm = fast_distance(pixel.xyz, center.xyz) * (1.f/0.2f);
-      weight *= native_exp(-0.5f * (norm*norm));
+      float weight = spatial[(j+RADIUS)*(2*RADIUS+1) + (i+RADIUS)] *
+        range[diff.x] * range[diff.y] * range[diff.z];
 
       coeff += weight;
-      sum += weight*pixel;
+      sum += weight*convert_float4(pixel);
+    }
+  }
+
+  uint4 result = convert_uint4(sum/coeff);
+  result.w = center.w;
+
+  write_imageui(output, (int2)(x, y), result);
+}
+
+#ifdef HALF
+#pragma OPENCL EXTENSION cl_khr_fp16 : enable
+
+// Half-precision weights and products double the throughput of the inner
+// loop on devices with native fp16 support. Weights which underflow are
+// negligible next to that of the centre pixel, and each row of the window
+// is summed in half precision before the rows are accumulated in single
+// precision, so that rounding errors do not grow with the radius.
+kernel void bilateral_half(read_only image2d_t input,
+                           write_only image2d_t output,
+                           constant float *spatial,
+                           constant float *range)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  float coeff = 0.f;
+  float4 sum = 0.f;
+  uint4 center = read_imageui(input, sampler, COORD(x, y));
+
+  for (int j = -RADIUS; j <= RADIUS; j++)
+  {
+    half rowCoeff = 0;
+    half4 rowSum = 0;
+    for (int i = -RADIUS; i <= RADIUS; i++)
+    {
+      uint4 pixel = read_imageui(input, sampler, COORD(x+i, y+j));
+      uint4 diff = abs_diff(pixel, center);
+
+      half weight = (half)spatial[(j+RADIUS)*(2*RADIUS+1) + (i+RADIUS)] *
+        (half)range[diff.x] * (half)range[diff.y] * (half)range[diff.z];
+
+      rowCoeff += weight;
+      rowSum += weight*convert_half4(pixel);
     }
+    coeff += rowCoeff;
+    sum += convert_float4(rowSum);
   }
 
-  sum /= coeff;
-  sum.w = center.w;
+  uint4 result = convert_uint4(sum/coeff);
+  result.w = center.w;
+
+  write_imageui(output, (int2)(x, y), result);
+}
+
+#endif
+
+#ifdef STRIP
+
+// Coarsened kernels produce a vertical strip of STRIP pixels per
+// work-item, so that each row loaded is shared by all of the outputs whose
+// windows cover it. Strips are aligned to the images of a batch, each of
+// which is IMAGE_HEIGHT rows high, and reads are clamped to that image.
+#define STRIPS ((IMAGE_HEIGHT+STRIP-1)/STRIP)
+#define STRIP_FIRST ((int)get_global_id(1)/STRIPS*IMAGE_HEIGHT)
+#define STRIP_Y (STRIP_FIRST + (int)get_global_id(1)%STRIPS*STRIP)
+
+kernel void bilateral_coarse(read_only image2d_t input,
+                             write_only image2d_t output,
+                             constant float *spatial,
+                             constant float *range)
+{
+  int x = get_global_id(0);
+  int y = STRIP_Y;
+  int last = STRIP_FIRST+IMAGE_HEIGHT-1;
+  if (x >= get_image_width(output) || y >= get_image_height(output))
+  {
+    return;
+  }
+
+  uint4 center[STRIP];
+  float coeff[STRIP];
+  float4 sum[STRIP];
+  for (int p = 0; p < STRIP; p++)
+  {
+    center[p] = read_imageui(input, sampler, (int2)(x, min(y+p, last)));
+    coeff[p] = 0.f;
+    sum[p] = 0.f;
+  }
+
+  for (int j = -RADIUS; j < STRIP+RADIUS; j++)
+  {
+    int _y = clamp(y+j, STRIP_FIRST, last);
+    for (int i = -RADIUS; i <= RADIUS; i++)
+    {
+      uint4 pixel = read_imageui(input, sampler, (int2)(x+i, _y));
+      for (int p = max(j-RADIUS, 0); p <= min(j+RADIUS, STRIP-1); p++)
+      {
+        uint4 diff = abs_diff(pixel, center[p]);
+        float weight = spatial[(j-p+RADIUS)*(2*RADIUS+1) + (i+RADIUS)] *
+          range[diff.x] * range[diff.y] * range[diff.z];
+
+        coeff[p] += weight;
+        sum[p] += weight*convert_float4(pixel);
+      }
+    }
+  }
+
+  for (int p = 0; p < STRIP && y+p <= last; p++)
+  {
+    uint4 result = convert_uint4(sum[p]/coeff[p]);
+    result.w = center[p].w;
+    write_imageui(output, (int2)(x, y+p), result);
+  }
+}
+
+#endif
+
+#ifdef PIXELS
+
+// Buffer kernels produce PIXELS horizontally adjacent pixels per work-item,
+// so that neighbouring work-items read contiguous runs of pixels and the
+// overlapping parts of their windows are loaded once. Reads are clamped to
+// the edges of the image, or of the image containing the work-item's row
+// when a batch of images is stacked vertically.
+inline global const uchar4* clamp_row(global const uchar4 *input, int y)
+{
+  int first = (int)get_global_id(1)/HEIGHT*HEIGHT;
+  return input + clamp(y, first, first+HEIGHT-1)*WIDTH;
+}
+
+kernel void bilateral_buffer(global const uchar4 *input,
+                             global uchar4 *output,
+                             constant float *spatial,
+                             constant float *range)
+{
+  int x = get_global_id(0)*PIXELS;
+  int y = get_global_id(1);
+  if (x >= WIDTH || y >= ROWS)
+  {
+    return;
+  }
+
+  uint4 center[PIXELS];
+  float coeff[PIXELS];
+  float4 sum[PIXELS];
+  for (int p = 0; p < PIXELS; p++)
+  {
+    center[p] = convert_uint4(input[min(x+p, WIDTH-1) + y*WIDTH]);
+    coeff[p] = 0.f;
+    sum[p] = 0.f;
+  }
+
+  for (int j = -RADIUS; j <= RADIUS; j++)
+  {
+    global const uchar4 *row = clamp_row(input, y+j);
+
+    // Each load contributes to every output whose window covers it
+    for (int i = -RADIUS; i < PIXELS+RADIUS; i++)
+    {
+      uint4 pixel = convert_uint4(row[clamp(x+i, 0, WIDTH-1)]);
+      for (int p = max(i-RADIUS, 0); p <= min(i+RADIUS, PIXELS-1); p++)
+      {
+        uint4 diff = abs_diff(pixel, center[p]);
+        float weight = spatial[(j+RADIUS)*(2*RADIUS+1) + (i-p+RADIUS)] *
+          range[diff.x] * range[diff.y] * range[diff.z];
+
+        coeff[p] += weight;
+        sum[p] += weight*convert_float4(pixel);
+      }
+    }
+  }
+
+  for (int p = 0; p < PIXELS && x+p < WIDTH; p++)
+  {
+    uchar4 result = convert_uchar4_sat(sum[p]/coeff[p]);
+    result.w = center[p].w;
+    output[x+p + y*WIDTH] = result;
+  }
+}
+
+#endif
+
+// Bilateral grid kernels (see Bilateral.cpp)
+#define GRID_PAD 2
+
+inline float luminance(float4 pixel)
+{
+  return dot(pixel.xyz, (float3)(0.299f, 0.587f, 0.114f)) / 255.f;
+}
+
+// Each work-item gathers the pixels that fall into one grid column, so
+// no atomics are needed
+kernel void grid_splat(read_only image2d_t input,
+                       global float4 *grid,
+                       float spatialStep,
+                       float rangeStep)
+{
+  int gx = get_global_id(0);
+  int gy = get_global_id(1);
+  int gridWidth = get_global_size(0);
+  int gridHeight = get_global_size(1);
+  int width = get_image_width(input);
+  int height = get_image_height(input);
+
+  float4 cells[GRID_DEPTH];
+  for (int z = 0; z < GRID_DEPTH; z++)
+  {
+    cells[z] = 0.f;
+  }
+
+  int x0 = max((int)((gx-GRID_PAD-0.5f)*spatialStep), 0);
+  int x1 = min((int)((gx-GRID_PAD+0.5f)*spatialStep) + 2, width);
+  int y0 = max((int)((gy-GRID_PAD-0.5f)*spatialStep), 0);
+  int y1 = min((int)((gy-GRID_PAD+0.5f)*spatialStep) + 2, height);
+  for (int y = y0; y < y1; y++)
+  {
+    if ((int)(y/spatialStep + 0.5f) + GRID_PAD != gy)
+    {
+      continue;
+    }
+    for (int x = x0; x < x1; x++)
+    {
+      if ((int)(x/spatialStep + 0.5f) + GRID_PAD != gx)
+      {
+        continue;
+      }
+      float4 pixel = convert_float4(read_imageui(input, sampler, (int2)(x, y)));
+      int gz = (int)(luminance(pixel)/rangeStep + 0.5f) + GRID_PAD;
+      pixel.w = 1.f;
+      cells[gz] += pixel;
+    }
+  }
+
+  for (int z = 0; z < GRID_DEPTH; z++)
+  {
+    grid[(z*gridHeight + gy)*gridWidth + gx] = cells[z];
+  }
+}
+
+kernel void grid_blur(global const float4 *input,
+                      global float4 *output,
+                      int axis)
+{
+  int3 pos = (int3)(get_global_id(0), get_global_id(1), get_global_id(2));
+  int3 size = (int3)(get_global_size(0), get_global_size(1), get_global_size(2));
+  int index = (pos.z*size.y + pos.y)*size.x + pos.x;
+
+  int p = axis == 0 ? pos.x : axis == 1 ? pos.y : pos.z;
+  int n = axis == 0 ? size.x : axis == 1 ? size.y : size.z;
+  int stride = axis == 0 ? 1 : axis == 1 ? size.x : size.x*size.y;
+
+  float4 sum = 6*input[index];
+  if (p >= 1)  sum += 4*input[index - stride];
+  if (p >= 2)  sum +=   input[index - 2*stride];
+  if (p+1 < n) sum += 4*input[index + stride];
+  if (p+2 < n) sum +=   input[index + 2*stride];
+
+  output[index] = sum * (1.f/16.f);
+}
+
+kernel void grid_slice(read_only image2d_t input,
+                       write_only image2d_t output,
+                       global const float4 *grid,
+                       int gridWidth,
+                       int gridHeight,
+                       float spatialStep,
+                       float rangeStep)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  uint4 pixel = read_imageui(input, sampler, (int2)(x, y));
+  float3 f = (float3)(x/spatialStep, y/spatialStep,
+                      luminance(convert_float4(pixel))/rangeStep) + GRID_PAD;
+  int3 i = convert_int3(f);
+  float3 t = f - convert_float3(i);
+
+  int plane = gridWidth*gridHeight;
+  int index = (i.z*gridHeight + i.y)*gridWidth + i.x;
+  float4 v0 = mix(mix(grid[index], grid[index+1], t.x),
+                  mix(grid[index+gridWidth], grid[index+gridWidth+1], t.x),
+                  t.y);
+  index += plane;
+  float4 v1 = mix(mix(grid[index], grid[index+1], t.x),
+                  mix(grid[index+gridWidth], grid[index+gridWidth+1], t.x),
+                  t.y);
+  float4 value = mix(v0, v1, t.z);
+
+  uint4 result = convert_uint4_sat(value/value.w);
+  result.w = pixel.w;
 
-  write_imagef(output, (int2)(x, y), sum);
+  write_imageui(output, (int2)(x, y), result);
 }
@@ -11,6 +11,21 @@ const sampler_t sampler =
   CLK_ADDRESS_CLAMP_TO_EDGE   |
   CLK_FILTER_NEAREST;
 
+// Batches of images are stacked vertically in one image, so reads are
+// clamped to the rows of the image containing the work-item
+#ifdef BATCH_HEIGHT
+#define FIRST_ROW ((int)get_global_id(1)/BATCH_HEIGHT*BATCH_HEIGHT)
+#define COORD(x, y) \
+  (int2)(x, clamp(y, FIRST_ROW, FIRST_ROW+BATCH_HEIGHT-1))
+#else
+#define COORD(x, y) (int2)(x, y)
+#endif
+
+#ifndef RADIUS
+#define RADIUS 2
+#endif
+#define AREA ((2*RADIUS+1)*(2*RADIUS+1))
+
 kernel void blur(read_only image2d_t input,
                  write_only image2d_t output)
 {
@@ -18,12 +33,187 @@ kernel void blur(read_only image2d_t input,
   int y = get_global_id(1);
 
   float4 sum = 0.f;
+  for (int j = -RADIUS; j <= RADIUS; j++)
+  {
+    for (int i = -RADIUS; i <= RADIUS; i++)
+    {
+      sum += read_imagef(input, sampler, COORD(x+i, y+j));
+    }
+  }
+  write_imagef(output, (int2)(x, y), sum/(float)AREA);
+}
+
+// Only valid for the default radius
+kernel void blur_fixed(read_only image2d_t input,
+                       write_only image2d_t output)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  // 25*255 fits in 16 bits
+  ushort4 sum = 0;
   for (int j = -2; j <= 2; j++)
   {
     for (int i = -2; i <= 2; i++)
     {
-      sum += read_imagef(input, sampler, (int2)(x+i, y+j));
+      sum += convert_ushort4(read_imageui(input, sampler, COORD(x+i, y+j)));
+    }
+  }
+
+  // Divide by 25 with a multiply and shift (5243/2^17 ~= 1/25)
+  write_imageui(output, (int2)(x, y), (convert_uint4(sum) * 5243) >> 17);
+}
+
+#ifdef HALF
+#pragma OPENCL EXTENSION cl_khr_fp16 : enable
+
+// Half-precision arithmetic doubles the throughput of the inner loop on
+// devices with native fp16 support. Each row of the window is summed in
+// half precision, but the rows are accumulated in single precision so
+// that rounding errors do not grow with the area of the window.
+kernel void blur_half(read_only image2d_t input,
+                      write_only image2d_t output)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  float4 sum = 0.f;
+  for (int j = -RADIUS; j <= RADIUS; j++)
+  {
+    half4 row = 0;
+    for (int i = -RADIUS; i <= RADIUS; i++)
+    {
+      row += read_imageh(input, sampler, COORD(x+i, y+j));
+    }
+    sum += convert_float4(row);
+  }
+  write_imagef(output, (int2)(x, y), sum/(float)AREA);
+}
+
+#endif
+
+#ifdef STRIP
+
+// Coarsened kernels produce a vertical strip of STRIP pixels per
+// work-item, so that each row loaded is shared by all of the outputs whose
+// windows cover it. Strips are aligned to the images of a batch, each of
+// which is IMAGE_HEIGHT rows high, and reads are clamped to that image.
+#define STRIPS ((IMAGE_HEIGHT+STRIP-1)/STRIP)
+#define STRIP_FIRST ((int)get_global_id(1)/STRIPS*IMAGE_HEIGHT)
+#define STRIP_Y (STRIP_FIRST + (int)get_global_id(1)%STRIPS*STRIP)
+
+kernel void blur_coarse(read_only image2d_t input,
+                        write_only image2d_t output)
+{
+  int x = get_global_id(0);
+  int y = STRIP_Y;
+  int last = STRIP_FIRST+IMAGE_HEIGHT-1;
+  if (x >= get_image_width(output) || y >= get_image_height(output))
+  {
+    return;
+  }
+
+  float4 sum[STRIP];
+  for (int p = 0; p < STRIP; p++)
+  {
+    sum[p] = 0.f;
+  }
+
+  for (int j = -RADIUS; j < STRIP+RADIUS; j++)
+  {
+    int _y = clamp(y+j, STRIP_FIRST, last);
+    float4 row = 0.f;
+    for (int i = -RADIUS; i <= RADIUS; i++)
+    {
+      row += read_imagef(input, sampler, (int2)(x+i, _y));
+    }
+    for (int p = max(j-RADIUS, 0); p <= min(j+RADIUS, STRIP-1); p++)
+    {
+      sum[p] += row;
+    }
+  }
+
+  for (int p = 0; p < STRIP && y+p <= last; p++)
+  {
+    write_imagef(output, (int2)(x, y+p), sum[p]/(float)AREA);
+  }
+}
+
+#endif
+
+#ifdef PIXELS
+
+// Buffer kernels produce PIXELS horizontally adjacent pixels per work-item,
+// so that neighbouring work-items read contiguous runs of pixels and the
+// overlapping parts of their windows are loaded once. Reads are clamped to
+// the edges of the image, or of the image containing the work-item's row
+// when a batch of images is stacked vertically.
+inline global const uchar4* clamp_row(global const uchar4 *input, int y)
+{
+  int first = (int)get_global_id(1)/HEIGHT*HEIGHT;
+  return input + clamp(y, first, first+HEIGHT-1)*WIDTH;
+}
+
+kernel void blur_buffer(global const uchar4 *input,
+                        global uchar4 *output)
+{
+  int x = get_global_id(0)*PIXELS;
+  int y = get_global_id(1);
+  if (x >= WIDTH || y >= ROWS)
+  {
+    return;
+  }
+
+  float4 sum[PIXELS];
+  for (int p = 0; p < PIXELS; p++)
+  {
+    sum[p] = 0.f;
+  }
+
+  for (int j = -RADIUS; j <= RADIUS; j++)
+  {
+    global const uchar4 *row = clamp_row(input, y+j);
+
+    // Each load contributes to every output whose window covers it
+    for (int i = -RADIUS; i < PIXELS+RADIUS; i++)
+    {
+      float4 value = convert_float4(row[clamp(x+i, 0, WIDTH-1)]);
+      for (int p = max(i-RADIUS, 0); p <= min(i+RADIUS, PIXELS-1); p++)
+      {
+        sum[p] += value;
+      }
+    }
+  }
+
+  for (int p = 0; p < PIXELS && x+p < WIDTH; p++)
+  {
+    output[x+p + y*WIDTH] = convert_uchar4_sat_rte(sum[p]/(float)AREA);
+  }
+}
+
+#endif
+
+// Planar buffers, one work-item per pixel for all three colour planes
+kernel void blur_planar(global const uchar *input,
+                        global uchar *output,
+                        int width, int height)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  int plane = width*height;
+
+  for (int c = 0; c < 3; c++)
+  {
+    global const uchar *in = input + c*plane;
+    uint sum = 0;
+    for (int j = -RADIUS; j <= RADIUS; j++)
+    {
+      int _y = clamp(y+j, 0, height-1);
+      for (int i = -RADIUS; i <= RADIUS; i++)
+      {
+        sum += in[clamp(x+i, 0, width-1) + _y*width];
+      }
     }
+    output[c*plane + x + y*width] = sum / AREA;
   }
-  write_imagef(output, (int2)(x, y), sum/25.f);
 }
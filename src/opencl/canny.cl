@@ -0,0 +1,144 @@
+// canny.cl (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+// These kernels are built together with sobel.cl, whose sobel_gradient
+// kernel computes the gradient magnitude and direction, so that the whole
+// detector runs on the device. The labels are one byte per pixel.
+#define NONE 0
+#define WEAK 1
+#define EDGE 2
+
+inline float gradient_at(global const float *magnitude,
+                         int x, int y, int width, int height)
+{
+  if (x < 0 || x >= width || y < 0 || y >= height)
+  {
+    return 0.f;
+  }
+  return magnitude[x + y*width];
+}
+
+// Non-maximum suppression along the gradient direction, quantised to one
+// of four neighbour pairs, followed by classification with the thresholds
+kernel void canny_suppress(global const float *magnitude,
+                           global const float *angle,
+                           global uchar *labels,
+                           int width, int height,
+                           float low, float high)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  if (x >= width || y >= height)
+  {
+    return;
+  }
+
+  float a = angle[x + y*width];
+  a = a < 0.f ? a + M_PI_F : a;
+  int dx = 1, dy = 0;
+  if (a >= M_PI_F/8 && a < 3*M_PI_F/8)
+  {
+    dy = 1;
+  }
+  else if (a >= 3*M_PI_F/8 && a < 5*M_PI_F/8)
+  {
+    dx = 0;
+    dy = 1;
+  }
+  else if (a >= 5*M_PI_F/8 && a < 7*M_PI_F/8)
+  {
+    dx = -1;
+    dy = 1;
+  }
+
+  float m = magnitude[x + y*width];
+  float m1 = gradient_at(magnitude, x+dx, y+dy, width, height);
+  float m2 = gradient_at(magnitude, x-dx, y-dy, width, height);
+
+  uchar label = NONE;
+  if (m > m1 && m >= m2 && m >= low)
+  {
+    label = m >= high ? EDGE : WEAK;
+  }
+  labels[x + y*width] = label;
+}
+
+// Hysteresis by iterative propagation. Each work-group loads a tile of
+// labels with a one pixel border into local memory, and promotes weak
+// pixels next to edges until the tile stops changing, so that edges can
+// travel across a whole tile in one launch. The host relaunches the kernel
+// until no work-group reports a change. Labels only ever change from weak
+// to edge, so reading a neighbour's label while it changes is harmless.
+kernel void canny_hysteresis(global uchar *labels,
+                             global int *changed,
+                             int width, int height)
+{
+  local uchar tile[TILE_Y+2][TILE_X+2];
+  local int tileChanged;
+
+  int lx = get_local_id(0);
+  int ly = get_local_id(1);
+  int x0 = get_group_id(0)*TILE_X - 1;
+  int y0 = get_group_id(1)*TILE_Y - 1;
+  for (int j = ly; j < TILE_Y+2; j += TILE_Y)
+  {
+    for (int i = lx; i < TILE_X+2; i += TILE_X)
+    {
+      int _x = x0+i, _y = y0+j;
+      bool inside = _x >= 0 && _x < width && _y >= 0 && _y < height;
+      tile[j][i] = inside ? labels[_x + _y*width] : NONE;
+    }
+  }
+
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  bool updated = false;
+  do
+  {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lx == 0 && ly == 0)
+    {
+      tileChanged = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (tile[ly+1][lx+1] == WEAK)
+    {
+      bool connected = false;
+      for (int j = 0; j < 3; j++)
+      {
+        for (int i = 0; i < 3; i++)
+        {
+          connected |= tile[ly+j][lx+i] == EDGE;
+        }
+      }
+      if (connected)
+      {
+        tile[ly+1][lx+1] = EDGE;
+        tileChanged = 1;
+        updated = true;
+      }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  } while (tileChanged);
+
+  if (updated)
+  {
+    labels[x + y*width] = EDGE;
+    *changed = 1;
+  }
+}
+
+kernel void canny_output(global const uchar *labels,
+                         write_only image2d_t output)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  float value = labels[x + y*get_image_width(output)] == EDGE ? 1.f : 0.f;
+  write_imagef(output, (int2)(x, y), (float4)(value, value, value, 1.f));
+}
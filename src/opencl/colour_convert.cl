@@ -0,0 +1,119 @@
+// colour_convert.cl (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+const sampler_t sampler =
+  CLK_NORMALIZED_COORDS_FALSE |
+  CLK_ADDRESS_CLAMP_TO_EDGE   |
+  CLK_FILTER_NEAREST;
+
+// YUV frames are tightly packed, with the chroma plane(s) following the Y
+// plane. NV12 interleaves U and V (uvStep = 2), while I420 stores the V
+// plane after the U plane (uvStep = 1). The chroma planes round odd
+// dimensions up.
+void chroma_planes(int width, int height, int x, int y, int uvStep,
+                   int *u, int *v)
+{
+  int cw = (width+1)/2, ch = (height+1)/2;
+  *u = width*height + y*cw*uvStep + x*uvStep;
+  *v = *u + (uvStep == 2 ? 1 : cw*ch);
+}
+
+// One work-item per 2x2 block of pixels, which share a chroma sample.
+// Blocks on the right and bottom edges of odd images are partial.
+kernel void yuv_to_rgba(global const uchar *input,
+                        write_only image2d_t output,
+                        int uvStep)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  int width = get_image_width(output);
+  int height = get_image_height(output);
+
+  int u, v;
+  chroma_planes(width, height, x, y, uvStep, &u, &v);
+  int d = input[u] - 128;
+  int e = input[v] - 128;
+
+  for (int j = 0; j < 2; j++)
+  {
+    for (int i = 0; i < 2; i++)
+    {
+      int2 pos = (int2)(2*x + i, 2*y + j);
+      if (pos.x >= width || pos.y >= height)
+      {
+        continue;
+      }
+      int c = 298*(input[pos.y*width + pos.x] - 16) + 128;
+      int4 rgba = (int4)(c + 409*e, c - 100*d - 208*e, c + 516*d, 255<<8);
+      write_imageui(output, pos, convert_uint4(clamp(rgba >> 8, 0, 255)));
+    }
+  }
+}
+
+kernel void rgba_to_yuv(read_only image2d_t input,
+                        global uchar *output,
+                        int uvStep)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  int width = get_image_width(input);
+  int height = get_image_height(input);
+
+  // Partial blocks repeat the edge pixels in the chroma sum, through the
+  // clamped reads
+  int4 sum = 0;
+  for (int j = 0; j < 2; j++)
+  {
+    for (int i = 0; i < 2; i++)
+    {
+      int2 pos = (int2)(2*x + i, 2*y + j);
+      int4 p = convert_int4(read_imageui(input, sampler, pos));
+      if (pos.x < width && pos.y < height)
+      {
+        output[pos.y*width + pos.x] =
+          ((66*p.x + 129*p.y + 25*p.z + 128) >> 8) + 16;
+      }
+      sum += p;
+    }
+  }
+
+  int u, v;
+  chroma_planes(width, height, x, y, uvStep, &u, &v);
+  output[u] = ((-38*sum.x - 74*sum.y + 112*sum.z + 512) >> 10) + 128;
+  output[v] = ((112*sum.x - 94*sum.y - 18*sum.z + 512) >> 10) + 128;
+}
+
+float lab_function(float t)
+{
+  return t > 0.008856f ? cbrt(t) : 7.787f*t + 16.f/116.f;
+}
+
+// sRGB to CIE L*a*b* (D65), with L, a and b scaled to the channel range
+kernel void rgba_to_lab(read_only image2d_t input,
+                        write_only image2d_t output)
+{
+  int2 pos = (int2)(get_global_id(0), get_global_id(1));
+  float4 p = read_imagef(input, sampler, pos);
+
+  float3 rgb = p.xyz;
+  rgb = select(pow((rgb + 0.055f)/1.055f, (float3)(2.4f)), rgb/12.92f,
+               rgb <= 0.04045f);
+
+  float fx = lab_function(dot(rgb, (float3)(0.412453f, 0.357580f,
+                                            0.180423f))/0.950456f);
+  float fy = lab_function(dot(rgb, (float3)(0.212671f, 0.715160f,
+                                            0.072169f)));
+  float fz = lab_function(dot(rgb, (float3)(0.019334f, 0.119193f,
+                                            0.950227f))/1.088754f);
+
+  float4 lab = (float4)((116.f*fy - 16.f)/100.f,
+                        (500.f*(fx - fy) + 128.f)/255.f,
+                        (200.f*(fy - fz) + 128.f)/255.f,
+                        p.w);
+  write_imagef(output, pos, lab);
+}
@@ -0,0 +1,80 @@
+// convolution.cl (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+// KERNEL_WIDTH and KERNEL_HEIGHT are defined when building the program
+
+const sampler_t sampler =
+  CLK_NORMALIZED_COORDS_FALSE |
+  CLK_ADDRESS_CLAMP_TO_EDGE   |
+  CLK_FILTER_NEAREST;
+
+// Batches of images are stacked vertically in one image, so reads are
+// clamped to the rows of the image containing the work-item
+#ifdef BATCH_HEIGHT
+#define FIRST_ROW ((int)get_global_id(1)/BATCH_HEIGHT*BATCH_HEIGHT)
+#define LAST_ROW (FIRST_ROW+BATCH_HEIGHT-1)
+#else
+#define FIRST_ROW 0
+#define LAST_ROW ((int)get_global_size(1)-1)
+#endif
+
+kernel void convolve(read_only image2d_t input,
+                     write_only image2d_t output,
+                     constant float *weights)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  float4 sum = 0.f;
+  for (int j = 0; j < KERNEL_HEIGHT; j++)
+  {
+    for (int i = 0; i < KERNEL_WIDTH; i++)
+    {
+      int2 pos = (int2)(x + i - KERNEL_WIDTH/2,
+                        clamp(y + j - KERNEL_HEIGHT/2, FIRST_ROW, LAST_ROW));
+      sum += read_imagef(input, sampler, pos) * weights[j*KERNEL_WIDTH + i];
+    }
+  }
+  sum.w = read_imagef(input, sampler, (int2)(x, y)).w;
+  write_imagef(output, (int2)(x, y), sum);
+}
+
+kernel void convolve_rows(read_only image2d_t input,
+                          global float4 *temp,
+                          constant float *weights)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  float4 sum = 0.f;
+  for (int i = 0; i < KERNEL_WIDTH; i++)
+  {
+    int2 pos = (int2)(x + i - KERNEL_WIDTH/2, y);
+    sum += read_imagef(input, sampler, pos) * weights[i];
+  }
+  sum.w = read_imagef(input, sampler, (int2)(x, y)).w;
+  temp[x + y*get_global_size(0)] = sum;
+}
+
+kernel void convolve_columns(global const float4 *temp,
+                             write_only image2d_t output,
+                             constant float *weights)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  int width = get_global_size(0);
+
+  float4 sum = 0.f;
+  for (int j = 0; j < KERNEL_HEIGHT; j++)
+  {
+    int _y = clamp(y + j - KERNEL_HEIGHT/2, FIRST_ROW, LAST_ROW);
+    sum += temp[x + _y*width] * weights[j];
+  }
+  sum.w = temp[x + y*width].w;
+  write_imagef(output, (int2)(x, y), sum);
+}
@@ -11,11 +11,11 @@ const sampler_t sampler =
   CLK_ADDRESS_CLAMP_TO_EDGE   |
   CLK_FILTER_NEAREST;
 
-kernel void buffer(global uchar4 *input,
-                   global uchar4 *output)
+kernel void buffer(global PIXEL *input,
+                   global PIXEL *output)
 {
   size_t pixel = get_global_id(0) + get_global_id(1)*WIDTH;
-  uchar4 value = input[pixel + get_global_id(2)*WIDTH*HEIGHT];
+  PIXEL value = input[pixel + get_global_id(2)*WIDTH*HEIGHT];
   output[pixel] = value;
 }
 
@@ -0,0 +1,107 @@
+// equalize.cl (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+const sampler_t sampler =
+  CLK_NORMALIZED_COORDS_FALSE |
+  CLK_ADDRESS_CLAMP_TO_EDGE   |
+  CLK_FILTER_NEAREST;
+
+#define BINS 256
+
+// Each work-group counts a share of the pixels of rows [y0, y0+height)
+// into a histogram in local memory, using local atomics, and writes it to
+// its own slot of the histograms buffer
+kernel void histogram(read_only image2d_t input,
+                      global uint *histograms,
+                      int y0, int height)
+{
+  local uint bins[3*BINS];
+  int lid = get_local_id(0);
+  int size = get_local_size(0);
+  for (int i = lid; i < 3*BINS; i += size)
+  {
+    bins[i] = 0;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  int width = get_image_width(input);
+  int pixels = width*height;
+  for (int i = get_global_id(0); i < pixels; i += get_global_size(0))
+  {
+    uint4 v = read_imageui(input, sampler, (int2)(i%width, y0 + i/width));
+    atomic_inc(bins + v.x);
+    atomic_inc(bins + v.y + BINS);
+    atomic_inc(bins + v.z + 2*BINS);
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  global uint *result = histograms + get_group_id(0)*3*BINS;
+  for (int i = lid; i < 3*BINS; i += size)
+  {
+    result[i] = bins[i];
+  }
+}
+
+// One level of the tree reduction, with one work-item per bin of each
+// pair of histograms stride slots apart
+kernel void histogram_reduce(global uint *histograms, int stride, int groups)
+{
+  int bin = get_global_id(0) % (3*BINS);
+  int a = get_global_id(0) / (3*BINS) * 2*stride;
+  int b = a + stride;
+  if (b < groups)
+  {
+    histograms[a*3*BINS + bin] += histograms[b*3*BINS + bin];
+  }
+}
+
+// One work-item per entry of the lookup table of each channel, mapping
+// the lowest occupied value to zero and the highest to 255
+kernel void histogram_lut(global const uint *histogram, global uchar *lut)
+{
+  int c = get_global_id(0) / BINS;
+  int v = get_global_id(0) % BINS;
+  global const uint *hist = histogram + c*BINS;
+
+  ulong total = 0, lowest = 0, cdf = 0;
+  for (int i = 0; i < BINS; i++)
+  {
+    if (!total)
+    {
+      lowest = hist[i];
+    }
+    total += hist[i];
+    if (i == v)
+    {
+      cdf = total;
+    }
+  }
+
+  ulong range = total - lowest;
+  if (!range)
+  {
+    lut[c*BINS + v] = v;
+  }
+  else
+  {
+    ulong above = cdf > lowest ? cdf - lowest : 0;
+    lut[c*BINS + v] = (above*(BINS-1) + range/2) / range;
+  }
+}
+
+kernel void equalize(read_only image2d_t input,
+                     write_only image2d_t output,
+                     global const uchar *lut)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  uint4 v = read_imageui(input, sampler, (int2)(x, y));
+  uint4 result = (uint4)(lut[v.x], lut[v.y + BINS], lut[v.z + 2*BINS], v.w);
+  write_imageui(output, (int2)(x, y), result);
+}
@@ -0,0 +1,100 @@
+// integral.cl (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+// Summed-area table with the same layout as IntegralImage: (W+1)x(H+1)
+// entries with a leading row and column of zeros. Sums wrap around modulo
+// 2^32, which keeps rectangle sums exact (see IntegralImage.h).
+
+const sampler_t sampler =
+  CLK_NORMALIZED_COORDS_FALSE |
+  CLK_ADDRESS_CLAMP_TO_EDGE   |
+  CLK_FILTER_NEAREST;
+
+// One work-item per image row
+kernel void integral_rows(read_only image2d_t input,
+                          global uint4 *table)
+{
+  int y = get_global_id(0);
+  int width = get_image_width(input);
+  global uint4 *row = table + (y+1)*(width+1);
+
+  uint4 sum = 0;
+  row[0] = sum;
+  for (int x = 0; x < width; x++)
+  {
+    sum += read_imageui(input, sampler, (int2)(x, y));
+    row[x+1] = sum;
+  }
+}
+
+// One work-item per table column, so neighbouring work-items access
+// neighbouring addresses
+kernel void integral_columns(global uint4 *table, int height)
+{
+  int x = get_global_id(0);
+  int stride = get_global_size(0);
+
+  table[x] = 0;
+  uint4 sum = 0;
+  for (int y = 1; y <= height; y++)
+  {
+    sum += table[x + y*stride];
+    table[x + y*stride] = sum;
+  }
+}
+
+uint4 rect_sum(global const uint4 *table, int stride,
+               int x0, int y0, int x1, int y1)
+{
+  return table[(x1+1) + (y1+1)*stride] - table[(x1+1) + y0*stride]
+       - table[x0 + (y1+1)*stride]     + table[x0 + y0*stride];
+}
+
+// Sum over a (2*radius+1)^2 window with clamp-to-edge addressing
+uint4 box_sum(global const uint4 *table, int width, int height,
+              int x, int y, int radius)
+{
+  int stride = width+1;
+  int x0 = max(x-radius, 0), x1 = min(x+radius, width-1);
+  int y0 = max(y-radius, 0), y1 = min(y+radius, height-1);
+  uint4 sum = rect_sum(table, stride, x0, y0, x1, y1);
+
+  // Taps beyond the edges repeat the edge rows, columns and corners
+  uint left   = x0 - (x-radius);
+  uint right  = (x+radius) - x1;
+  uint top    = y0 - (y-radius);
+  uint bottom = (y+radius) - y1;
+  if (left | right | top | bottom)
+  {
+    sum += left   * rect_sum(table, stride, 0, y0, 0, y1);
+    sum += right  * rect_sum(table, stride, width-1, y0, width-1, y1);
+    sum += top    * rect_sum(table, stride, x0, 0, x1, 0);
+    sum += bottom * rect_sum(table, stride, x0, height-1, x1, height-1);
+    sum += left*top      * rect_sum(table, stride, 0, 0, 0, 0);
+    sum += right*top     * rect_sum(table, stride, width-1, 0, width-1, 0);
+    sum += left*bottom   * rect_sum(table, stride, 0, height-1, 0, height-1);
+    sum += right*bottom  * rect_sum(table, stride, width-1, height-1,
+                                    width-1, height-1);
+  }
+  return sum;
+}
+
+// Local mean over a (2*radius+1)^2 window
+kernel void box_mean(global const uint4 *table,
+                     write_only image2d_t output,
+                     int radius)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  int width = get_global_size(0);
+  int height = get_global_size(1);
+
+  uint area = (2*radius+1)*(2*radius+1);
+  uint4 sum = box_sum(table, width, height, x, y, radius);
+  write_imageui(output, (int2)(x, y), sum / area);
+}
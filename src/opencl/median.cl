@@ -0,0 +1,66 @@
+// median.cl (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+const sampler_t sampler =
+  CLK_NORMALIZED_COORDS_FALSE |
+  CLK_ADDRESS_CLAMP_TO_EDGE   |
+  CLK_FILTER_NEAREST;
+
+// Batches of images are stacked vertically in one image, so reads are
+// clamped to the rows of the image containing the work-item
+#ifdef BATCH_HEIGHT
+#define FIRST_ROW ((int)get_global_id(1)/BATCH_HEIGHT*BATCH_HEIGHT)
+#define COORD(x, y) \
+  (int2)(x, clamp(y, FIRST_ROW, FIRST_ROW+BATCH_HEIGHT-1))
+#else
+#define COORD(x, y) (int2)(x, y)
+#endif
+
+#define SIZE ((2*RADIUS+1)*(2*RADIUS+1))
+
+// Compare-and-swap for all four channels at once
+#define SORT2(a, b)         \
+  {                         \
+    uint4 lo = min(a, b);   \
+    b = max(a, b);          \
+    a = lo;                 \
+  }
+
+kernel void median(read_only image2d_t input,
+                   write_only image2d_t output)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  uint4 values[SIZE];
+  int n = 0;
+  for (int j = -RADIUS; j <= RADIUS; j++)
+  {
+    for (int i = -RADIUS; i <= RADIUS; i++)
+    {
+      values[n++] = read_imageui(input, sampler, COORD(x+i, y+j));
+    }
+  }
+
+  // Fixed bubble sort network, stopping once the upper half (including
+  // the median) is in place. Loop bounds are constant, so the network is
+  // fully unrolled and values stay in registers.
+  #pragma unroll
+  for (int pass = 0; pass <= SIZE/2; pass++)
+  {
+    #pragma unroll
+    for (int i = 0; i < SIZE-1-pass; i++)
+    {
+      SORT2(values[i], values[i+1]);
+    }
+  }
+
+  uint4 result = values[SIZE/2];
+  result.w = read_imageui(input, sampler, COORD(x, y)).w;
+  write_imageui(output, (int2)(x, y), result);
+}
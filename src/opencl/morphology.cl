@@ -0,0 +1,93 @@
+// morphology.cl (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+const sampler_t sampler =
+  CLK_NORMALIZED_COORDS_FALSE |
+  CLK_ADDRESS_CLAMP_TO_EDGE   |
+  CLK_FILTER_NEAREST;
+
+#define OP(a, b) (dilate ? max(a, b) : min(a, b))
+
+// Reads down a column are clamped to the rows of one image in a batch
+inline uint4 load(read_only image2d_t input, int2 pos,
+                  int columns, int begin, int end)
+{
+  if (columns)
+  {
+    pos.y = clamp(pos.y, begin, end-1);
+  }
+  return read_imageui(input, sampler, pos);
+}
+
+// van Herk/Gil-Werman erosion or dilation along rows or columns, with
+// one work-item per segment of size pixels. The windows of the segment
+// span its pixels (whose suffix results are kept) and the following
+// size-1 pixels (whose prefix results are accumulated), so each output
+// takes three operations whatever the size. Alpha is copied.
+kernel void morph(read_only image2d_t input,
+                  write_only image2d_t output,
+                  int size, int columns, int dilate)
+{
+  int width = get_image_width(input);
+  int height = get_image_height(input);
+
+  int2 pos, step;
+  int begin, end;
+  if (columns)
+  {
+    int segments = (IMAGE_HEIGHT + size-1)/size;
+    begin = get_global_id(1)/segments*IMAGE_HEIGHT;
+    end = begin + IMAGE_HEIGHT;
+    pos = (int2)(get_global_id(0), begin + get_global_id(1)%segments*size);
+    step = (int2)(0, 1);
+    if (pos.x >= width || begin >= height)
+    {
+      return;
+    }
+  }
+  else
+  {
+    begin = 0;
+    end = width;
+    pos = (int2)(get_global_id(0)*size, get_global_id(1));
+    step = (int2)(1, 0);
+    if (pos.x >= width || pos.y >= height)
+    {
+      return;
+    }
+  }
+
+  // Window of the first pixel starts at origin
+  int2 origin = pos - step*(size/2);
+  int count = min(size, end - (columns ? pos.y : pos.x));
+
+  uint4 suffix[MAX_SIZE];
+  suffix[size-1] = load(input, origin + step*(size-1), columns, begin, end);
+  for (int t = size-2; t >= 0; t--)
+  {
+    suffix[t] = OP(suffix[t+1],
+                   load(input, origin + step*t, columns, begin, end));
+  }
+
+  uint4 prefix = 0;
+  for (int t = 0; t < count; t++)
+  {
+    uint4 result = suffix[t];
+    if (t > 0)
+    {
+      uint4 value = load(input, origin + step*(size+t-1),
+                         columns, begin, end);
+      prefix = t > 1 ? OP(prefix, value) : value;
+      result = OP(result, prefix);
+    }
+
+    int2 p = pos + step*t;
+    result.w = read_imageui(input, sampler, p).w;
+    write_imageui(output, p, result);
+  }
+}
@@ -0,0 +1,93 @@
+// pyramid.cl (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+const sampler_t sampler =
+  CLK_NORMALIZED_COORDS_FALSE |
+  CLK_ADDRESS_CLAMP_TO_EDGE   |
+  CLK_FILTER_NEAREST;
+
+constant float binomial[5] = {1.f, 4.f, 6.f, 4.f, 1.f};
+
+// One work-item per pixel of the coarse level, which is written both to
+// its own image (read when building the next level) and to its place in
+// the output at (x0, y0)
+kernel void pyramid_reduce(read_only image2d_t fine,
+                           write_only image2d_t coarse,
+                           write_only image2d_t output,
+                           int x0, int y0)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  float4 sum = 0.f;
+  for (int j = 0; j < 5; j++)
+  {
+    float4 row = 0.f;
+    for (int i = 0; i < 5; i++)
+    {
+      row += binomial[i]*read_imagef(fine, sampler, (int2)(2*x+i-2, 2*y+j-2));
+    }
+    sum += binomial[j]*row;
+  }
+  sum /= 256.f;
+
+  write_imagef(coarse, (int2)(x, y), sum);
+  write_imagef(output, (int2)(x0+x, y0+y), sum);
+}
+
+// Taps of the expand kernel for coordinate i of the fine level. Even
+// coordinates take weights 1,6,1 from the coarse sample they lie on and
+// its neighbours, odd coordinates 4,4 from the samples either side.
+inline int expand_taps(int i, int index[3], float weight[3])
+{
+  int m = i >> 1;
+  if (i & 1)
+  {
+    index[0] = m;
+    index[1] = m+1;
+    weight[0] = weight[1] = 4.f;
+    return 2;
+  }
+  index[0] = m-1;
+  index[1] = m;
+  index[2] = m+1;
+  weight[0] = weight[2] = 1.f;
+  weight[1] = 6.f;
+  return 3;
+}
+
+// One work-item per pixel of the fine level, storing the difference from
+// the expanded coarse level offset by half the range
+kernel void pyramid_laplacian(read_only image2d_t fine,
+                              read_only image2d_t coarse,
+                              write_only image2d_t output,
+                              int x0, int y0)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  int indexX[3], indexY[3];
+  float weightX[3], weightY[3];
+  int tapsX = expand_taps(x, indexX, weightX);
+  int tapsY = expand_taps(y, indexY, weightY);
+
+  float4 expanded = 0.f;
+  for (int j = 0; j < tapsY; j++)
+  {
+    for (int i = 0; i < tapsX; i++)
+    {
+      expanded += weightX[i]*weightY[j]*
+        read_imagef(coarse, sampler, (int2)(indexX[i], indexY[j]));
+    }
+  }
+
+  float4 value = read_imagef(fine, sampler, (int2)(x, y));
+  float4 result = value - expanded/64.f + 128.f/255.f;
+  result.w = value.w;
+  write_imagef(output, (int2)(x0+x, y0+y), result);
+}
@@ -0,0 +1,138 @@
+// recursive_gaussian.cl (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+// Young-van Vliet recursive Gaussian. The coefficients are
+// (B, b1/b0, b2/b0, b3/b0) followed by the 3x3 boundary matrix,
+// see RecursiveGaussian.cpp.
+
+const sampler_t sampler =
+  CLK_NORMALIZED_COORDS_FALSE |
+  CLK_ADDRESS_CLAMP_TO_EDGE   |
+  CLK_FILTER_NEAREST;
+
+// Initial anti-causal state for a signal extended with the edge value
+#define BOUNDARY(coeffs, edge, w1, w2, w3)                  \
+  {                                                         \
+    float4 u1 = w1 - edge, u2 = w2 - edge, u3 = w3 - edge;  \
+    w1 = edge + coeffs.s4*u1 + coeffs.s5*u2 + coeffs.s6*u3; \
+    w2 = edge + coeffs.s7*u1 + coeffs.s8*u2 + coeffs.s9*u3; \
+    w3 = edge + coeffs.sa*u1 + coeffs.sb*u2 + coeffs.sc*u3; \
+  }
+
+// One work-item per row, filtering into the temporary buffer
+kernel void iir_rows(read_only image2d_t input,
+                     global float4 *temp,
+                     float16 coeffs)
+{
+  int y = get_global_id(0);
+  int width = get_image_width(input);
+  global float4 *row = temp + y*width;
+
+  // Causal pass, starting from the steady state for the edge value
+  float4 w1, w2, w3;
+  w1 = w2 = w3 = read_imagef(input, sampler, (int2)(0, y));
+  for (int x = 0; x < width; x++)
+  {
+    float4 w = coeffs.x*read_imagef(input, sampler, (int2)(x, y)) +
+               coeffs.y*w1 + coeffs.z*w2 + coeffs.w*w3;
+    row[x] = w;
+    w3 = w2;
+    w2 = w1;
+    w1 = w;
+  }
+
+  // Anti-causal pass
+  float4 edge = read_imagef(input, sampler, (int2)(width-1, y));
+  BOUNDARY(coeffs, edge, w1, w2, w3);
+  for (int x = width-1; x >= 0; x--)
+  {
+    float4 w = coeffs.x*row[x] + coeffs.y*w1 + coeffs.z*w2 + coeffs.w*w3;
+    row[x] = w;
+    w3 = w2;
+    w2 = w1;
+    w1 = w;
+  }
+}
+
+// One work-item per column, so neighbouring work-items access
+// neighbouring addresses
+kernel void iir_columns(global float4 *temp,
+                        read_only image2d_t input,
+                        write_only image2d_t output,
+                        float16 coeffs)
+{
+  int x = get_global_id(0);
+  int width = get_global_size(0);
+  int height = get_image_height(input);
+
+  float4 w1, w2, w3;
+  float4 edge = temp[x + (height-1)*width];
+  w1 = w2 = w3 = temp[x];
+  for (int y = 0; y < height; y++)
+  {
+    float4 w = coeffs.x*temp[x + y*width] +
+               coeffs.y*w1 + coeffs.z*w2 + coeffs.w*w3;
+    temp[x + y*width] = w;
+    w3 = w2;
+    w2 = w1;
+    w1 = w;
+  }
+
+  BOUNDARY(coeffs, edge, w1, w2, w3);
+  for (int y = height-1; y >= 0; y--)
+  {
+    float4 w = coeffs.x*temp[x + y*width] +
+               coeffs.y*w1 + coeffs.z*w2 + coeffs.w*w3;
+    w3 = w2;
+    w2 = w1;
+    w1 = w;
+
+    w.w = read_imagef(input, sampler, (int2)(x, y)).w;
+    write_imagef(output, (int2)(x, y), w);
+  }
+}
+
+// Direct convolution for small sigma, where the recursion is inaccurate.
+// One work-item per pixel for each pass, with 2*radius+1 weights.
+kernel void fir_rows(read_only image2d_t input,
+                     global float4 *temp,
+                     constant float *weights,
+                     int radius)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  int width = get_global_size(0);
+
+  float4 sum = 0.f;
+  for (int i = -radius; i <= radius; i++)
+  {
+    sum += read_imagef(input, sampler, (int2)(x+i, y)) * weights[i+radius];
+  }
+  temp[x + y*width] = sum;
+}
+
+kernel void fir_columns(global const float4 *temp,
+                        read_only image2d_t input,
+                        write_only image2d_t output,
+                        constant float *weights,
+                        int radius)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  int width = get_global_size(0);
+  int height = get_global_size(1);
+
+  float4 sum = 0.f;
+  for (int j = -radius; j <= radius; j++)
+  {
+    int _y = clamp(y+j, 0, height-1);
+    sum += temp[x + _y*width] * weights[j+radius];
+  }
+  sum.w = read_imagef(input, sampler, (int2)(x, y)).w;
+  write_imagef(output, (int2)(x, y), sum);
+}
@@ -0,0 +1,109 @@
+// resize.cl (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+const sampler_t sampler =
+  CLK_NORMALIZED_COORDS_FALSE |
+  CLK_ADDRESS_CLAMP_TO_EDGE   |
+  CLK_FILTER_NEAREST;
+
+#define LANCZOS_A 3
+
+// One work-item per output pixel. Pixel centres are at half-integer
+// coordinates in both images, and reads outside the input are clamped.
+
+kernel void resize_box(read_only image2d_t input,
+                       write_only image2d_t output)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  float4 sum = read_imagef(input, sampler, (int2)(2*x,   2*y))   +
+               read_imagef(input, sampler, (int2)(2*x+1, 2*y))   +
+               read_imagef(input, sampler, (int2)(2*x,   2*y+1)) +
+               read_imagef(input, sampler, (int2)(2*x+1, 2*y+1));
+  write_imagef(output, (int2)(x, y), sum*0.25f);
+}
+
+// Interpolation is done explicitly rather than with a linear sampler,
+// which has very few bits of fractional precision on some devices
+kernel void resize_bilinear(read_only image2d_t input,
+                            write_only image2d_t output)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  float2 scale = (float2)(get_image_width(input), get_image_height(input)) /
+                 (float2)(get_image_width(output), get_image_height(output));
+  float2 src = ((float2)(x, y) + 0.5f)*scale - 0.5f;
+  float2 first = floor(src);
+  float2 f = src - first;
+  int2 p = convert_int2(first);
+
+  float4 top = mix(read_imagef(input, sampler, p),
+                   read_imagef(input, sampler, p + (int2)(1, 0)), f.x);
+  float4 bottom = mix(read_imagef(input, sampler, p + (int2)(0, 1)),
+                      read_imagef(input, sampler, p + (int2)(1, 1)), f.x);
+  write_imagef(output, (int2)(x, y), mix(top, bottom, f.y));
+}
+
+inline float lanczos(float x)
+{
+  if (x == 0.f)
+  {
+    return 1.f;
+  }
+  if (fabs(x) >= LANCZOS_A)
+  {
+    return 0.f;
+  }
+  return LANCZOS_A*sinpi(x)*sinpi(x/LANCZOS_A)/(M_PI_F*M_PI_F*x*x);
+}
+
+// The kernel is widened by the scale factor when downsampling, so the
+// number of taps in each direction (TAPS_X and TAPS_Y) is computed by the
+// host for the sizes of the images
+kernel void resize_lanczos(read_only image2d_t input,
+                           write_only image2d_t output)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  float2 scale = (float2)(get_image_width(input), get_image_height(input)) /
+                 (float2)(get_image_width(output), get_image_height(output));
+  float2 filterScale = max(scale, 1.f);
+  float2 center = ((float2)(x, y) + 0.5f)*scale;
+  int2 first = convert_int2(floor(center - LANCZOS_A*filterScale));
+
+  float weightsX[TAPS_X];
+  float sumX = 0.f;
+  for (int i = 0; i < TAPS_X; i++)
+  {
+    weightsX[i] = lanczos((first.x+i+0.5f-center.x)/filterScale.x);
+    sumX += weightsX[i];
+  }
+
+  float4 sum = 0.f;
+  float sumY = 0.f;
+  for (int j = 0; j < TAPS_Y; j++)
+  {
+    float weightY = lanczos((first.y+j+0.5f-center.y)/filterScale.y);
+    sumY += weightY;
+    if (weightY == 0.f)
+    {
+      continue;
+    }
+
+    float4 row = 0.f;
+    for (int i = 0; i < TAPS_X; i++)
+    {
+      row += weightsX[i]*read_imagef(input, sampler, first + (int2)(i, j));
+    }
+    sum += weightY*row;
+  }
+  write_imagef(output, (int2)(x, y), sum/(sumX*sumY));
+}
@@ -11,6 +11,16 @@ const sampler_t sampler =
   CLK_ADDRESS_CLAMP_TO_EDGE   |
   CLK_FILTER_NEAREST;
 
+// Batches of images are stacked vertically in one image, so reads are
+// clamped to the rows of the image containing the work-item
+#ifdef BATCH_HEIGHT
+#define FIRST_ROW ((int)get_global_id(1)/BATCH_HEIGHT*BATCH_HEIGHT)
+#define COORD(x, y) \
+  (int2)(x, clamp(y, FIRST_ROW, FIRST_ROW+BATCH_HEIGHT-1))
+#else
+#define COORD(x, y) (int2)(x, y)
+#endif
+
 constant float mask[3][3] =
 {
   {-1, -2, -1},
@@ -18,6 +28,13 @@ constant float mask[3][3] =
   {1, 2, 1}
 };
 
+constant int mask_fixed[3][3] =
+{
+  {-1, -2, -1},
+  {0, 0, 0},
+  {1, 2, 1}
+};
+
 kernel void sobel(read_only image2d_t input,
                   write_only image2d_t output)
 {
@@ -30,7 +47,7 @@ kernel void sobel(read_only image2d_t input,
   {
     for (int i = -1; i <= 1; i++)
     {
-      float4 p = read_imagef(input, sampler, (int2)(x+i, y+j));
+      float4 p = read_imagef(input, sampler, COORD(x+i, y+j));
       g_x += (p.x*0.299f + p.y*0.587f + p.z*0.114f) * mask[i+1][j+1];
       g_y += (p.x*0.299f + p.y*0.587f + p.z*0.114f) * mask[j+1][i+1];
     }
@@ -38,3 +55,217 @@ kernel void sobel(read_only image2d_t input,
   float g_mag = sqrt(g_x*g_x + g_y*g_y);
   write_imagef(output, (int2)(x, y), (float4)(g_mag,g_mag,g_mag,1));
 }
+
+kernel void sobel_fixed(read_only image2d_t input,
+                        write_only image2d_t output)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  // Luminance weights are scaled by 2^16, so gradients fit in 32 bits
+  int g_x = 0;
+  int g_y = 0;
+  for (int j = -1; j <= 1; j++)
+  {
+    for (int i = -1; i <= 1; i++)
+    {
+      uint4 p = read_imageui(input, sampler, COORD(x+i, y+j));
+      int lum = p.x*19595 + p.y*38470 + p.z*7471;
+      g_x += lum * mask_fixed[i+1][j+1];
+      g_y += lum * mask_fixed[j+1][i+1];
+    }
+  }
+  float g = sqrt((float)g_x*g_x + (float)g_y*g_y) * (1.f/65536.f);
+  uint g_mag = min(convert_uint_sat(g), 255u);
+  write_imageui(output, (int2)(x, y), (uint4)(g_mag,g_mag,g_mag,255));
+}
+
+#ifdef TILE_X
+
+// Gradient magnitude and direction as separate single-channel outputs.
+// Each work-group converts a TILE_X*TILE_Y tile and its one pixel border to
+// luminance once, in local memory, and each work-item then computes its
+// gradient from the shared tile. The global size may be rounded up to a
+// whole number of tiles.
+kernel void sobel_gradient(read_only image2d_t input,
+                           global float *magnitude,
+                           global float *angle)
+{
+  local float tile[TILE_Y+2][TILE_X+2];
+
+  int lx = get_local_id(0);
+  int ly = get_local_id(1);
+  int x0 = get_group_id(0)*TILE_X - 1;
+  int y0 = get_group_id(1)*TILE_Y - 1;
+  for (int j = ly; j < TILE_Y+2; j += TILE_Y)
+  {
+    for (int i = lx; i < TILE_X+2; i += TILE_X)
+    {
+      float4 p = read_imagef(input, sampler, (int2)(x0+i, y0+j));
+      tile[j][i] = p.x*0.299f + p.y*0.587f + p.z*0.114f;
+    }
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  int width = get_image_width(input);
+  if (x >= width || y >= get_image_height(input))
+  {
+    return;
+  }
+
+  float g_x = 0.f;
+  float g_y = 0.f;
+  for (int j = -1; j <= 1; j++)
+  {
+    for (int i = -1; i <= 1; i++)
+    {
+      float lum = tile[ly+j+1][lx+i+1];
+      g_x += lum * mask[i+1][j+1];
+      g_y += lum * mask[j+1][i+1];
+    }
+  }
+  magnitude[x + y*width] = sqrt(g_x*g_x + g_y*g_y);
+  angle[x + y*width] = atan2(g_y, g_x);
+}
+
+#endif
+
+#ifdef STRIP
+
+// Coarsened kernels produce a vertical strip of STRIP pixels per
+// work-item, so that each row loaded is shared by all of the outputs whose
+// windows cover it. Strips are aligned to the images of a batch, each of
+// which is IMAGE_HEIGHT rows high, and reads are clamped to that image.
+#define STRIPS ((IMAGE_HEIGHT+STRIP-1)/STRIP)
+#define STRIP_FIRST ((int)get_global_id(1)/STRIPS*IMAGE_HEIGHT)
+#define STRIP_Y (STRIP_FIRST + (int)get_global_id(1)%STRIPS*STRIP)
+
+kernel void sobel_coarse(read_only image2d_t input,
+                         write_only image2d_t output)
+{
+  int x = get_global_id(0);
+  int y = STRIP_Y;
+  int last = STRIP_FIRST+IMAGE_HEIGHT-1;
+  if (x >= get_image_width(output) || y >= get_image_height(output))
+  {
+    return;
+  }
+
+  float g_x[STRIP], g_y[STRIP];
+  for (int p = 0; p < STRIP; p++)
+  {
+    g_x[p] = 0.f;
+    g_y[p] = 0.f;
+  }
+
+  for (int j = -1; j <= STRIP; j++)
+  {
+    int _y = clamp(y+j, STRIP_FIRST, last);
+    float lum[3];
+    for (int i = 0; i < 3; i++)
+    {
+      float4 p = read_imagef(input, sampler, (int2)(x+i-1, _y));
+      lum[i] = p.x*0.299f + p.y*0.587f + p.z*0.114f;
+    }
+    for (int p = max(j-1, 0); p <= min(j+1, STRIP-1); p++)
+    {
+      for (int i = 0; i < 3; i++)
+      {
+        g_x[p] += lum[i] * mask[i][j-p+1];
+        g_y[p] += lum[i] * mask[j-p+1][i];
+      }
+    }
+  }
+
+  for (int p = 0; p < STRIP && y+p <= last; p++)
+  {
+    float g_mag = sqrt(g_x[p]*g_x[p] + g_y[p]*g_y[p]);
+    write_imagef(output, (int2)(x, y+p), (float4)(g_mag,g_mag,g_mag,1));
+  }
+}
+
+#endif
+
+#ifdef PIXELS
+
+// Buffer kernels produce PIXELS horizontally adjacent pixels per work-item,
+// so that neighbouring work-items read contiguous runs of pixels and the
+// overlapping parts of their windows are loaded once. Reads are clamped to
+// the edges of the image, or of the image containing the work-item's row
+// when a batch of images is stacked vertically.
+inline global const uchar4* clamp_row(global const uchar4 *input, int y)
+{
+  int first = (int)get_global_id(1)/HEIGHT*HEIGHT;
+  return input + clamp(y, first, first+HEIGHT-1)*WIDTH;
+}
+
+kernel void sobel_buffer(global const uchar4 *input,
+                         global uchar4 *output)
+{
+  int x = get_global_id(0)*PIXELS;
+  int y = get_global_id(1);
+  if (x >= WIDTH || y >= ROWS)
+  {
+    return;
+  }
+
+  float lum[3][PIXELS+2];
+  for (int j = 0; j < 3; j++)
+  {
+    global const uchar4 *row = clamp_row(input, y+j-1);
+    for (int i = 0; i < PIXELS+2; i++)
+    {
+      float4 p = convert_float4(row[clamp(x+i-1, 0, WIDTH-1)]);
+      lum[j][i] = p.x*0.299f + p.y*0.587f + p.z*0.114f;
+    }
+  }
+
+  for (int p = 0; p < PIXELS && x+p < WIDTH; p++)
+  {
+    float g_x = 0.f;
+    float g_y = 0.f;
+    for (int j = 0; j < 3; j++)
+    {
+      for (int i = 0; i < 3; i++)
+      {
+        g_x += lum[j][p+i] * mask[i][j];
+        g_y += lum[j][p+i] * mask[j][i];
+      }
+    }
+    uchar g_mag = convert_uchar_sat_rte(sqrt(g_x*g_x + g_y*g_y));
+    output[x+p + y*WIDTH] = (uchar4)(g_mag, g_mag, g_mag, 255);
+  }
+}
+
+#endif
+
+// Planar buffers, writing the magnitude to all three colour planes
+kernel void sobel_planar(global const uchar *input,
+                         global uchar *output,
+                         int width, int height)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  int plane = width*height;
+
+  int g_x = 0;
+  int g_y = 0;
+  for (int j = -1; j <= 1; j++)
+  {
+    int _y = clamp(y+j, 0, height-1);
+    for (int i = -1; i <= 1; i++)
+    {
+      int p = clamp(x+i, 0, width-1) + _y*width;
+      int lum = input[p]*19595 + input[p+plane]*38470 + input[p+2*plane]*7471;
+      g_x += lum * mask_fixed[i+1][j+1];
+      g_y += lum * mask_fixed[j+1][i+1];
+    }
+  }
+  float g = sqrt((float)g_x*g_x + (float)g_y*g_y) * (1.f/65536.f);
+  uchar g_mag = min(convert_uint_sat(g), 255u);
+  output[x + y*width] = g_mag;
+  output[x + y*width + plane] = g_mag;
+  output[x + y*width + 2*plane] = g_mag;
+}
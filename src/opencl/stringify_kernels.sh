@@ -8,7 +8,9 @@
 # license terms please see the LICENSE file distributed with this
 # source code.
 
-kernels="bilateral blur copy sharpen sobel"
+kernels="bilateral blur canny colour_convert convolution copy equalize \
+         integral median morphology pyramid recursive_gaussian resize \
+         sharpen sobel unsharp"
 
 for name in $kernels
 do
@@ -0,0 +1,117 @@
+// unsharp.cl (ImProSA)
+// Copyright (c) 2014, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+const sampler_t sampler =
+  CLK_NORMALIZED_COORDS_FALSE |
+  CLK_ADDRESS_CLAMP_TO_EDGE   |
+  CLK_FILTER_NEAREST;
+
+// Batches of images are stacked vertically in one image, so reads are
+// clamped to the rows of the image containing the work-item
+#ifdef BATCH_HEIGHT
+#define FIRST_ROW ((int)get_global_id(1)/BATCH_HEIGHT*BATCH_HEIGHT)
+#define COORD(x, y) \
+  (int2)(x, clamp(y, FIRST_ROW, FIRST_ROW+BATCH_HEIGHT-1))
+#else
+#define COORD(x, y) (int2)(x, y)
+#endif
+
+#ifndef RADIUS
+#define RADIUS 3
+#endif
+
+// Differences from the blurred value smaller than the threshold are left
+// alone, so that noise in flat regions is not amplified. Alpha is copied.
+inline float4 sharpen(float4 orig, float4 blurred,
+                      float amount, float threshold)
+{
+  float4 diff = orig - blurred;
+  float4 result = select(orig, orig + amount*diff,
+                         isgreaterequal(fabs(diff), (float4)threshold));
+  result.w = orig.w;
+  return result;
+}
+
+// The separable Gaussian is applied as weighted row sums, and combined
+// with the centre pixel before anything is written
+kernel void unsharp(read_only image2d_t input,
+                    write_only image2d_t output,
+                    constant float *weights,
+                    float amount, float threshold)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  float4 blurred = 0.f;
+  for (int j = -RADIUS; j <= RADIUS; j++)
+  {
+    float4 row = 0.f;
+    for (int i = -RADIUS; i <= RADIUS; i++)
+    {
+      row += weights[i+RADIUS]*read_imagef(input, sampler, COORD(x+i, y+j));
+    }
+    blurred += weights[j+RADIUS]*row;
+  }
+
+  float4 orig = read_imagef(input, sampler, (int2)(x, y));
+  write_imagef(output, (int2)(x, y),
+               sharpen(orig, blurred, amount, threshold));
+}
+
+#ifdef STRIP
+
+// Coarsened kernels produce a vertical strip of STRIP pixels per
+// work-item, so that each row sum is shared by all of the outputs whose
+// windows cover it. Strips are aligned to the images of a batch, each of
+// which is IMAGE_HEIGHT rows high, and reads are clamped to that image.
+#define STRIPS ((IMAGE_HEIGHT+STRIP-1)/STRIP)
+#define STRIP_FIRST ((int)get_global_id(1)/STRIPS*IMAGE_HEIGHT)
+#define STRIP_Y (STRIP_FIRST + (int)get_global_id(1)%STRIPS*STRIP)
+
+kernel void unsharp_coarse(read_only image2d_t input,
+                           write_only image2d_t output,
+                           constant float *weights,
+                           float amount, float threshold)
+{
+  int x = get_global_id(0);
+  int y = STRIP_Y;
+  int last = STRIP_FIRST+IMAGE_HEIGHT-1;
+  if (x >= get_image_width(output) || y >= get_image_height(output))
+  {
+    return;
+  }
+
+  float4 blurred[STRIP];
+  for (int p = 0; p < STRIP; p++)
+  {
+    blurred[p] = 0.f;
+  }
+
+  for (int j = -RADIUS; j < STRIP+RADIUS; j++)
+  {
+    int _y = clamp(y+j, STRIP_FIRST, last);
+    float4 row = 0.f;
+    for (int i = -RADIUS; i <= RADIUS; i++)
+    {
+      row += weights[i+RADIUS]*read_imagef(input, sampler, (int2)(x+i, _y));
+    }
+    for (int p = max(j-RADIUS, 0); p <= min(j+RADIUS, STRIP-1); p++)
+    {
+      blurred[p] += weights[j-p+RADIUS]*row;
+    }
+  }
+
+  for (int p = 0; p < STRIP && y+p <= last; p++)
+  {
+    float4 orig = read_imagef(input, sampler, (int2)(x, y+p));
+    write_imagef(output, (int2)(x, y+p),
+                 sharpen(orig, blurred[p], amount, threshold));
+  }
+}
+
+#endif